@@ -0,0 +1 @@
+char psmi_infinipath_revision[] ="$""Date: 2026-10-17 19:28 InfiniPath $";
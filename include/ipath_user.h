@@ -144,6 +144,12 @@ struct _ipath_ctrl {
 struct _ipath_ctrl *ipath_userinit(int32_t, struct ipath_user_info *,
 				   struct ipath_base_info *b);
 
+// Same as ipath_userinit(), but the cpu affinity recommended by the driver is
+// only applied if setaffinity is non-zero, $IPATH_NO_CPUAFFINITY is ignored.
+struct _ipath_ctrl *ipath_userinit_affinity(int32_t, struct ipath_user_info *,
+					    struct ipath_base_info *b,
+					    int setaffinity);
+
 // don't inline these; it's all init code, and not inlining makes the
 // overall code shorter and easier to debug
 void ipath_touch_mmap(void *, size_t) __attribute__ ((noinline));
@@ -0,0 +1 @@
+static __attribute__ ((unused)) char __psc_infinipath_revision[] ="$""Date: 2026-10-17 19:28 InfiniPath $";
@@ -86,11 +86,6 @@ static void ipath_setaffinity(int fd)
     struct ipath_cmd cmd;
     cpu_set_t cpuset;
 
-    if(getenv("IPATH_NO_CPUAFFINITY")) {
-        _IPATH_PRDBG("Skipping processor affinity, $IPATH_NO_CPUAFFINITY set\n");
-        return;
-    }
-
     memset(&cmd, 0, sizeof(struct ipath_cmd));
     memset(&info, 0, sizeof(struct ipath_ctxt_info));
     cmd.type = IPATH_CMD_CTXT_INFO;
@@ -131,6 +126,17 @@ static void ipath_setaffinity(int fd)
 // else is returned as part of ipath_base_info.
 struct _ipath_ctrl *ipath_userinit(int fd, struct ipath_user_info *u,
                                    struct ipath_base_info *b)
+{
+    int setaffinity = (getenv("IPATH_NO_CPUAFFINITY") == NULL);
+
+    if(!setaffinity)
+        _IPATH_PRDBG("Skipping processor affinity, $IPATH_NO_CPUAFFINITY set\n");
+    return ipath_userinit_affinity(fd, u, b, setaffinity);
+}
+
+struct _ipath_ctrl *ipath_userinit_affinity(int fd, struct ipath_user_info *u,
+                                            struct ipath_base_info *b,
+                                            int setaffinity)
 {
     struct _ipath_ctrl *spctrl = NULL;
     void *tmp;
@@ -159,7 +165,8 @@ struct _ipath_ctrl *ipath_userinit(int fd, struct ipath_user_info *u,
         goto err;
     }
 
-    ipath_setaffinity(fd); // prior to memory allocation in driver, etc.
+    if(setaffinity)
+        ipath_setaffinity(fd); // prior to memory allocation in driver, etc.
 
     c.type = IPATH_CMD_USER_INIT;
     memcpy(&c.cmd.user_info, u, sizeof(*u));
@@ -110,11 +110,6 @@ static void ipath_setaffinity(int fd)
     cpu_set_t cpuset;
     char *env;
 
-    if(getenv("IPATH_NO_CPUAFFINITY")) {
-        _IPATH_PRDBG("Skipping processor affinity, $IPATH_NO_CPUAFFINITY set\n");
-        return;
-    }
-
     env = getenv("IPATH_SET_CPUAFFINITY");
     if (!env) return;
 
@@ -137,6 +132,17 @@ static void ipath_setaffinity(int fd)
 // else is returned as part of ipath_base_info.
 struct _ipath_ctrl *ipath_userinit(int fd, struct ipath_user_info *u,
                                    struct ipath_base_info *b)
+{
+    int setaffinity = (getenv("IPATH_NO_CPUAFFINITY") == NULL);
+
+    if(!setaffinity)
+        _IPATH_PRDBG("Skipping processor affinity, $IPATH_NO_CPUAFFINITY set\n");
+    return ipath_userinit_affinity(fd, u, b, setaffinity);
+}
+
+struct _ipath_ctrl *ipath_userinit_affinity(int fd, struct ipath_user_info *u,
+                                            struct ipath_base_info *b,
+                                            int setaffinity)
 {
     struct _ipath_ctrl *spctrl = NULL;
     void *tmp;
@@ -165,7 +171,8 @@ struct _ipath_ctrl *ipath_userinit(int fd, struct ipath_user_info *u,
         goto err;
     }
 
-    ipath_setaffinity(fd); // prior to memory allocation in driver, etc.
+    if(setaffinity)
+        ipath_setaffinity(fd); // prior to memory allocation in driver, etc.
 
     /*
      * Allocate b->spi_sendbuf_status, one page size.
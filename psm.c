@@ -84,6 +84,11 @@ psmi_verno_isinteroperable(uint16_t verno)
     int iscompat = -1;
 
     switch (psmi_verno) {
+       case 0x0111:
+	 /* Adds psm_ep_connect_start/test, psm_mq_open, PSM_EP_CLOSE_JOBEXIT
+	  * and PSM_MQ_OPT_EAGER_CREDITS.  Eager credits are negotiated through
+	  * the connect protocol version, so the wire stays compatible.
+	  */
        case 0x0110:
        case 0x010f:
 	 /* Multi-rail is supported in this version, since the packet header
@@ -443,7 +448,13 @@ __psm_poll(psm_ep_t ep)
 
     PSMI_ASSERT_INITIALIZED();
 
-    PSMI_PLOCK();
+    /* In thread-multiple mode, whoever holds the lock is already polling */
+    if (ep->thread_multiple) {
+	if (PSMI_PLOCK_TRY())
+	    return PSM_OK_NO_PROGRESS;
+    }
+    else
+	PSMI_PLOCK();
 
     tmp = ep;
     do {
@@ -467,6 +478,14 @@ __psm_poll(psm_ep_t ep)
      * PSM_OK_NO_PROGRESS & PSM_OK => PSM_OK
      * PSM_OK_NO_PROGRESS & PSM_OK_NO_PROGRESS => PSM_OK_NO_PROGRESS */
     PSMI_PUNLOCK();
+
+    /* Signal-requested capture dumps are written outside the lock */
+    if_pf (PSMI_CAPTURE_ENABLED()) {
+	do {
+	    psmi_capture_poll(ep);
+	    ep = ep->mctxt_next;
+	} while (ep != tmp);
+    }
     return (err1 & err2);
 }
 PSMI_API_DECL(psm_poll)
@@ -67,9 +67,9 @@ typedef struct psm_ep *psm_ep_t;
  * psm_mq_init).  */
 typedef struct psm_mq *psm_mq_t;
 
-#define PSM_VERNO       0x0110
+#define PSM_VERNO       0x0111
 #define PSM_VERNO_MAJOR 0x01
-#define PSM_VERNO_MINOR 0x10
+#define PSM_VERNO_MINOR 0x11
 
 enum psm_error {
     
@@ -633,10 +633,15 @@ psm_ep_epid_share_memory(psm_ep_t ep, psm_epid_t epid, int *result);
 
 /* Close endpoint
  * [in] ep PSM endpoint handle
- * [in] mode One of PSM_EP_CLOSE_GRACEFUL or PSM_EP_CLOSE_FORCE
+ * [in] mode One of PSM_EP_CLOSE_GRACEFUL, PSM_EP_CLOSE_FORCE or
+ *			PSM_EP_CLOSE_JOBEXIT
  * [in] timeout How long to wait in nanoseconds if mode is
- *			PSM_EP_CLOSE_GRACEFUL, 0 waits forever.  If mode is
- *			PSM_EP_CLOSE_FORCE, this parameter is ignored.
+ *			PSM_EP_CLOSE_GRACEFUL, 0 waits forever.  Otherwise,
+ *			this parameter is ignored.
+ *
+ * PSM_EP_CLOSE_JOBEXIT is for callers that know every peer is closing its
+ * endpoint as well (e.g. at the end of a job).  No disconnect messages are
+ * exchanged and the close does not wait for peers at all.
  *
  * The following errors are returned, others are handled by the per-endpoint
  * error handler:
@@ -651,6 +656,9 @@ psm_ep_close(psm_ep_t ep, int mode, int64_t timeout);
 
 #define PSM_EP_CLOSE_GRACEFUL	0   /* Graceful close mode in psm_ep_close */
 #define PSM_EP_CLOSE_FORCE	1   /* Forceful close mode in psm_ep_close */
+#if PSM_VERNO >= 0x0111
+#define PSM_EP_CLOSE_JOBEXIT	2   /* All peers are closing, no handshake */
+#endif
 
 /* Provide mappings for network id to hostname
  *
@@ -791,6 +799,45 @@ psm_ep_connect(psm_ep_t ep, int num_of_epid, const psm_epid_t *array_of_epid,
 	       const int *array_of_epid_mask, psm_error_t *array_of_errors, 
 	       psm_epaddr_t *array_of_epaddr, int64_t timeout);
 
+#if PSM_VERNO >= 0x0111
+/* Connect endpoints without blocking
+ *
+ * Function to overlap connection establishment with other work.  
+ * psm_ep_connect_start takes the same arguments as psm_ep_connect and
+ * returns a request, without connecting anything yet.  Each subsequent call
+ * to psm_ep_connect_test makes progress on the connect and returns
+ * PSM_OK_NO_PROGRESS until it is over.  Shared memory endpoints are
+ * connected without blocking, each call only polls for their replies.  A
+ * device with a blocking connect (InfiniPath) connects up to
+ * PSM_CONNECT_BATCH endpoints per call.  The last call returns PSM_OK or
+ * the error psm_ep_connect would have returned, and frees the request.
+ *
+ * [in] timeout As for psm_ep_connect, for the whole set of endpoints and
+ *              starting from the call to psm_ep_connect_start.
+ * [out] req Connect request, passed to psm_ep_connect_test.
+ *
+ * [pre] Unlike psm_ep_connect, the arrays must remain valid until the last
+ *       call to psm_ep_connect_test returns.
+ * [pre] No other connect and no psm_ep_close on the endpoint until then.
+ *
+ * [post] If the last call returns PSM_OK, the output arrays are as
+ *        psm_ep_connect would have left them.  On error, endpoints in
+ *        batches that were never attempted are left as PSM_EPID_UNKNOWN.
+ */
+typedef struct psm_ep_connect_req *psm_ep_connect_req_t;
+
+psm_error_t
+psm_ep_connect_start(psm_ep_t ep, int num_of_epid, 
+		     const psm_epid_t *array_of_epid,
+		     const int *array_of_epid_mask, 
+		     psm_error_t *array_of_errors, 
+		     psm_epaddr_t *array_of_epaddr, int64_t timeout,
+		     psm_ep_connect_req_t *req);
+
+psm_error_t
+psm_ep_connect_test(psm_ep_connect_req_t *req);
+#endif
+
 /* Ensure endpoint communication progress 
  *
  * Function to ensure progress for all PSM components instantiated on an
@@ -923,6 +970,21 @@ psm_epaddr_getctxt(psm_epaddr_t epaddr);
    * dropped.
    */
 
+#if PSM_VERNO >= 0x0111
+#define PSM_MQ_OPT_EAGER_CREDITS    0x304
+#define PSM_MQ_EAGER_CREDITS	    PSM_MQ_OPT_EAGER_CREDITS
+  /* [uint32_t ] Bytes of eager (non-rendezvous) data, plus a fixed per
+   * message charge, that each remote peer may have outstanding in this
+   * endpoint's unexpected queue.  Once a peer runs out it switches to
+   * rendezvous until matched receives give the credits back.  Advertised to
+   * peers when connecting, so only affects later connections (if unset,
+   * defaults to 0 which disables eager flow control).
+   *
+   * component object: PSM Matched Queue (psm_mq_t).
+   * option value: Eager credit window in bytes, 0 for unlimited.
+   */
+#endif
+
 
 /* PSM_COMPONENT_AM options */
 #define PSM_AM_OPT_FRAG_SZ          0x401
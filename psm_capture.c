@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2013. Intel Corporation. All rights reserved.
+ * Copyright (c) 2006-2012. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/time.h>
+#include <signal.h>
+#include "psm_user.h"
+
+/*
+ * Per-endpoint capture ring.  Writers claim a slot with a cmpxchg on the ring
+ * position and publish it by storing position+1 in the slot's seq once the
+ * copy is done, so the sender and receive threads never take a lock and a
+ * dump only keeps slots whose seq is stable across its copy.
+ */
+struct psmi_capture_rec {
+    volatile uint32_t	seq;	/* ring position+1, 0 while being written */
+    uint8_t		dir;
+    uint8_t		path;
+    uint16_t		hdrlen;
+    uint32_t		paylen;
+    uint32_t		caplen;	/* payload bytes kept after the header */
+    uint64_t		t_cyc;
+    uint8_t		data[0];
+};
+
+struct psmi_capture {
+    volatile uint32_t	pos;
+    uint32_t		mask;
+    uint32_t		recsz;
+    uint32_t		snaplen;
+    volatile uint32_t	dump_gen;
+    uint32_t		num_dumps;
+    uint64_t		t_cyc0;	/* cycles and time of day at init */
+    struct timeval	tv0;
+    char		*prefix;
+    uint8_t		*ring;
+};
+
+int psmi_capture_enabled = 0;
+static volatile uint32_t psmi_capture_dump_gen = 0;
+
+static
+void
+psmi_capture_sighandler(int sig)
+{
+    psmi_capture_dump_gen++;
+}
+
+psm_error_t
+psmi_capture_init(psm_ep_t ep)
+{
+    union psmi_envvar_val env_cap, env_snap, env_sig, env_file;
+    struct psmi_capture *cap;
+    uint32_t nrecs;
+
+    ep->capture = NULL;
+    psmi_getenv("PSM_CAPTURE", 
+		"Number of packets kept in the capture ring (0 disables)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 0, &env_cap);
+    if (env_cap.e_uint == 0)
+	return PSM_OK;
+
+    psmi_getenv("PSM_CAPTURE_SNAPLEN", 
+		"Payload bytes captured per packet",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 64, &env_snap);
+    psmi_getenv("PSM_CAPTURE_FILE", 
+		"Capture file prefix, .<host>.<pid>.<context>.<n>.pcap is added",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) "psm_capture", &env_file);
+    psmi_getenv("PSM_CAPTURE_SIGNAL", 
+		"Signal that writes out the capture rings (0 for none)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 0, &env_sig);
+
+    cap = (struct psmi_capture *) 
+	    psmi_calloc(ep, UNDEFINED, 1, sizeof(struct psmi_capture));
+    if (cap == NULL)
+	return PSM_NO_MEMORY;
+
+    nrecs = 1;
+    while (nrecs < env_cap.e_uint && nrecs < (1U << 24))
+	nrecs <<= 1;
+    cap->mask = nrecs - 1;
+    cap->snaplen = env_snap.e_uint;
+    cap->recsz = PSMI_ALIGNUP(sizeof(struct psmi_capture_rec) + 
+			      PSMI_CAPTURE_HDR_MAX + cap->snaplen, 8);
+    cap->dump_gen = psmi_capture_dump_gen;
+    cap->prefix = psmi_strdup(ep, env_file.e_str);
+    cap->ring = psmi_calloc(ep, UNDEFINED, nrecs, cap->recsz);
+    if (cap->prefix == NULL || cap->ring == NULL) {
+	if (cap->prefix) psmi_free(cap->prefix);
+	if (cap->ring) psmi_free(cap->ring);
+	psmi_free(cap);
+	return PSM_NO_MEMORY;
+    }
+    gettimeofday(&cap->tv0, NULL);
+    cap->t_cyc0 = get_cycles();
+
+    if (env_sig.e_uint > 0)
+	signal((int) env_sig.e_uint, psmi_capture_sighandler);
+
+    ep->capture = cap;
+    psmi_capture_enabled = 1;
+    _IPATH_PRDBG("Capturing %u packets of up to %u payload bytes\n",
+		 nrecs, cap->snaplen);
+    return PSM_OK;
+}
+
+void
+psmi_capture_fini(psm_ep_t ep)
+{
+    struct psmi_capture *cap = ep->capture;
+
+    if (cap == NULL)
+	return;
+
+    psmi_capture_write(ep);
+    ep->capture = NULL;
+    psmi_free(cap->ring);
+    psmi_free(cap->prefix);
+    psmi_free(cap);
+}
+
+psm_error_t
+psmi_capture_write(psm_ep_t ep)
+{
+    struct psmi_capture *cap = ep->capture;
+    struct psmi_capture_pcaphdr phdr;
+    struct psmi_capture_rec *rec, *copy;
+    uint32_t pos, end, rec_hdr[4], file_hdr[6];
+    uint64_t ns;
+    char path[PATH_MAX];
+    FILE *fp;
+
+    if (cap == NULL)
+	return PSM_OK;
+
+    snprintf(path, sizeof path, "%s.%s.%d.%d.%u.pcap", cap->prefix,
+	     psmi_gethostname(), (int) getpid(), 
+	     (int) psm_epid_context(ep->epid), cap->num_dumps++);
+    if ((fp = fopen(path, "w")) == NULL)
+	return psmi_handle_error(ep, PSM_INTERNAL_ERR,
+		    "Couldn't open capture file %s: %s", path, strerror(errno));
+    copy = psmi_malloc(ep, UNDEFINED, cap->recsz);
+    if (copy == NULL) {
+	fclose(fp);
+	return PSM_NO_MEMORY;
+    }
+
+    /* Nanosecond resolution pcap */
+    file_hdr[0] = 0xa1b23c4d;
+    file_hdr[1] = 2 | (4 << 16);
+    file_hdr[2] = 0;
+    file_hdr[3] = 0;
+    file_hdr[4] = sizeof(phdr) + PSMI_CAPTURE_HDR_MAX + cap->snaplen;
+    file_hdr[5] = PSMI_CAPTURE_LINKTYPE;
+    fwrite(file_hdr, sizeof(file_hdr), 1, fp);
+
+    end = cap->pos;
+    pos = end - min(end, cap->mask + 1);
+    for (; pos != end; pos++) {
+	rec = (struct psmi_capture_rec *) 
+		(cap->ring + (size_t) (pos & cap->mask) * cap->recsz);
+	if (rec->seq != pos + 1)
+	    continue;
+	memcpy(copy, rec, cap->recsz);
+	ips_rmb();
+	if (rec->seq != pos + 1) /* overwritten while we copied */
+	    continue;
+
+	ns = cycles_to_nanosecs(copy->t_cyc - cap->t_cyc0) + 
+	     cap->tv0.tv_usec * 1000ULL;
+	rec_hdr[0] = (uint32_t) (cap->tv0.tv_sec + ns / 1000000000ULL);
+	rec_hdr[1] = (uint32_t) (ns % 1000000000ULL);
+	rec_hdr[2] = sizeof(phdr) + copy->hdrlen + copy->caplen;
+	rec_hdr[3] = sizeof(phdr) + copy->hdrlen + copy->paylen;
+
+	phdr.version = PSMI_CAPTURE_VERSION;
+	phdr.dir = copy->dir;
+	phdr.path = copy->path;
+	phdr.hdrlen = (uint8_t) copy->hdrlen;
+	phdr.paylen = __cpu_to_be32(copy->paylen);
+
+	fwrite(rec_hdr, sizeof(rec_hdr), 1, fp);
+	fwrite(&phdr, sizeof(phdr), 1, fp);
+	fwrite(copy->data, copy->hdrlen + copy->caplen, 1, fp);
+    }
+
+    psmi_free(copy);
+    if (fclose(fp))
+	return psmi_handle_error(ep, PSM_INTERNAL_ERR,
+		    "Couldn't write capture file %s: %s", path, strerror(errno));
+    _IPATH_PRDBG("Wrote capture file %s\n", path);
+    return PSM_OK;
+}
+
+/*
+ * Write the rings out if a dump was requested by signal since the last call.
+ * Called from psm_poll once the progress lock is released, never from the
+ * send/receive paths; one thread writes each requested dump.
+ */
+void
+psmi_capture_poll(psm_ep_t ep)
+{
+    struct psmi_capture *cap = ep->capture;
+    uint32_t gen, old;
+
+    if (cap == NULL)
+	return;
+
+    if ((gen = psmi_capture_dump_gen) != (old = cap->dump_gen) &&
+	ips_cmpxchg(&cap->dump_gen, old, gen) == old)
+	psmi_capture_write(ep);
+}
+
+void
+psmi_capture_packet(psm_ep_t ep, int dir, int path,
+		    const void *hdr, uint32_t hdrlen,
+		    const void *payload, uint32_t paylen)
+{
+    struct psmi_capture *cap = ep->capture;
+    struct psmi_capture_rec *rec;
+    uint32_t pos;
+
+    if (cap == NULL)
+	return;
+
+    do {
+	pos = cap->pos;
+    } while (ips_cmpxchg(&cap->pos, pos, pos + 1) != pos);
+
+    rec = (struct psmi_capture_rec *) 
+	    (cap->ring + (size_t) (pos & cap->mask) * cap->recsz);
+    rec->seq = 0;
+    ips_wmb();
+
+    rec->t_cyc = get_cycles();
+    rec->dir = dir;
+    rec->path = path;
+    rec->hdrlen = min(hdrlen, PSMI_CAPTURE_HDR_MAX);
+    rec->paylen = paylen;
+    rec->caplen = payload != NULL ? min(paylen, cap->snaplen) : 0;
+    memcpy(rec->data, hdr, rec->hdrlen);
+    if (rec->caplen)
+	memcpy(rec->data + rec->hdrlen, payload, rec->caplen);
+
+    ips_wmb();
+    rec->seq = pos + 1;
+}
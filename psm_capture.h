@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2013. Intel Corporation. All rights reserved.
+ * Copyright (c) 2006-2012. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PSMI_IN_USER_H
+#error psm_capture.h not meant to be included directly, include psm_user.h instead
+#endif
+
+#ifndef _PSM_CAPTURE_H
+#define _PSM_CAPTURE_H
+
+/*
+ * Packet capture.  When PSM_CAPTURE is set, each endpoint keeps a ring of the
+ * last packets it sent and received: a timestamp, the packet header and up to
+ * PSM_CAPTURE_SNAPLEN bytes of payload.  The ring is written out as a pcap file
+ * when the endpoint closes, and on demand when PSM_CAPTURE_SIGNAL is raised
+ * (from the next psm_poll, outside the progress lock).
+ *
+ * Each pcap record (link type LINKTYPE_USER0) is a psmi_capture_pcaphdr in
+ * network byte order followed by the packet header and the captured payload.
+ */
+#define PSMI_CAPTURE_VERSION	1
+#define PSMI_CAPTURE_LINKTYPE	147	/* LINKTYPE_USER0 */
+#define PSMI_CAPTURE_HDR_MAX	128	/* header bytes kept per packet */
+
+#define PSMI_CAPTURE_TX		0
+#define PSMI_CAPTURE_RX		1
+
+#define PSMI_CAPTURE_PIO	1
+#define PSMI_CAPTURE_DMA	2
+#define PSMI_CAPTURE_RECV	3
+#define PSMI_CAPTURE_SHM	4
+
+struct psmi_capture_pcaphdr {
+    uint8_t	version;
+    uint8_t	dir;		/* PSMI_CAPTURE_TX or RX */
+    uint8_t	path;		/* pio, dma, recv or shm */
+    uint8_t	hdrlen;		/* packet header bytes that follow */
+    uint32_t	paylen;		/* payload length of the packet */
+} __attribute__ ((packed));
+
+struct psmi_capture;
+
+extern int psmi_capture_enabled; /* use macro to test */
+#define PSMI_CAPTURE_ENABLED()	(!!psmi_capture_enabled)
+
+psm_error_t psmi_capture_init(psm_ep_t ep);
+void	    psmi_capture_fini(psm_ep_t ep);
+psm_error_t psmi_capture_write(psm_ep_t ep);
+void	    psmi_capture_poll(psm_ep_t ep);
+void	    psmi_capture_packet(psm_ep_t ep, int dir, int path,
+				const void *hdr, uint32_t hdrlen,
+				const void *payload, uint32_t paylen);
+
+#endif /* _PSM_CAPTURE_H */
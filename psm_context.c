@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdarg.h>
 
 #include "psm_user.h"
 
@@ -46,7 +47,7 @@
 static int      psmi_get_hca_selection_algorithm(void);
 static psm_error_t psmi_init_userinfo_params(psm_ep_t ep, 
 		int unit_id, int port,
-		psm_uuid_t const unique_job_key,
+		psm_uuid_t const unique_job_key, int retryable,
 		struct ipath_user_info *user_info);
 
 psm_error_t
@@ -149,10 +150,29 @@ runtime_flags_string(char *buf, size_t len, uint32_t runtime_flags)
     return buf;
 }
 
+/* Errors of a retryable open are only logged, the caller tries elsewhere */
+static
+psm_error_t
+psmi_context_error(int retryable, psm_error_t err, const char *fmt, ...)
+{
+    char buf[PSM_ERRSTRING_MAXLEN];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+
+    if (!retryable)
+	return psmi_handle_error(NULL, err, "%s", buf);
+    _IPATH_PRDBG("%s\n", buf);
+    return err;
+}
+
 psm_error_t
 psmi_context_open(const psm_ep_t ep, long unit_id, long port,
 	      psm_uuid_t const job_key, 
-	      int64_t timeout_ns, psmi_context_t *context)
+	      int64_t timeout_ns, int cpu_affinity, int retryable,
+	      psmi_context_t *context)
 {
     long open_timeout = 0;
     int lid;
@@ -176,19 +196,19 @@ psmi_context_open(const psm_ep_t ep, long unit_id, long port,
 
     context->fd = ipath_context_open(unit_id, port, open_timeout);
     if (context->fd == -1) {
-	err = psmi_handle_error(NULL, PSM_EP_DEVICE_FAILURE,
+	err = psmi_context_error(retryable, PSM_EP_DEVICE_FAILURE,
 		    "PSM can't open %s for reading and writing",
 		    dev_name);
 	goto bail;
     }
 
     if ((err = psmi_init_userinfo_params(ep, (int) unit_id, (int)port, job_key,
-				&context->user_info))) 
+				retryable, &context->user_info))) 
 	goto bail;
 
 retry_open:
-    context->ctrl = ipath_userinit(context->fd, &context->user_info,
-		                &context->base_info);
+    context->ctrl = ipath_userinit_affinity(context->fd, &context->user_info,
+		                &context->base_info, cpu_affinity);
 
     if (!context->ctrl) {
 
@@ -207,23 +227,24 @@ retry_open:
 		retry_delay <<= 1;
 	    
 	    /* If device is still busy after 3 attempts give up. No contexts
-	     * available.
+	     * available.  Don't wait at all if another unit can be tried.
 	     */
-	    if (((errno == EBUSY) || (errno == ENODEV)) && retry_delay > 4)
+	    if (((errno == EBUSY) || (errno == ENODEV)) && 
+		(retry_delay > 4 || retryable))
 	      goto fail;
 	    
 	    sleep(retry_delay);
 	    goto retry_open;
 	}
       
-	err = psmi_handle_error(NULL, PSM_EP_NO_NETWORK,
+	err = psmi_context_error(retryable, PSM_EP_NO_NETWORK,
 		"can't open %s, network down", dev_name);
 	goto bail;
     }
 
     if ((lid = ipath_get_port_lid(context->base_info.spi_unit,
 				  context->base_info.spi_port)) == -1) {
-	err = psmi_handle_error(NULL, 
+	err = psmi_context_error(retryable, 
 	        PSM_EP_DEVICE_FAILURE, 
 		"Can't get InfiniBand LID in psm_ep_open: is SMA running?");
 	goto fail;
@@ -231,7 +252,7 @@ retry_open:
     if (ipath_get_port_gid(context->base_info.spi_unit,
 			   context->base_info.spi_port,
 			   &gid_hi, &gid_lo) == -1) {
-	err = psmi_handle_error(NULL, 
+	err = psmi_context_error(retryable, 
 	        PSM_EP_DEVICE_FAILURE, 
 		"Can't get InfiniBand GID in psm_ep_open: is SMA running?");
 	goto fail;
@@ -291,19 +312,19 @@ fail:
     switch (errno) {
     case ENOENT:
     case ENODEV:
-	err = psmi_handle_error(NULL, PSM_EP_NO_DEVICE,
+	err = psmi_context_error(retryable, PSM_EP_NO_DEVICE,
 		"%s not found", dev_name);
 	break;
     case ENXIO:
-	err = psmi_handle_error(NULL, PSM_EP_DEVICE_FAILURE,
+	err = psmi_context_error(retryable, PSM_EP_DEVICE_FAILURE,
 		"%s failure", dev_name);
 	break;
     case EBUSY:
-	err = psmi_handle_error(NULL, PSM_EP_NO_PORTS_AVAIL,
+	err = psmi_context_error(retryable, PSM_EP_NO_PORTS_AVAIL,
 		"No free InfiniPath contexts available on %s", dev_name);
 	break;
     default:
-	err = psmi_handle_error(NULL, PSM_EP_DEVICE_FAILURE, 
+	err = psmi_context_error(retryable, PSM_EP_DEVICE_FAILURE, 
 		"Driver initialization failure on %s", dev_name);
 	break;
     }
@@ -423,7 +444,7 @@ ret:
 static
 psm_error_t
 psmi_init_userinfo_params(psm_ep_t ep, int unit_id, int port,
-		psm_uuid_t const unique_job_key,
+		psm_uuid_t const unique_job_key, int retryable,
 		struct ipath_user_info *user_info)
 {
     /* static variables, shared among rails */
@@ -463,7 +484,7 @@ psmi_init_userinfo_params(psm_ep_t ep, int unit_id, int port,
     //job_key &= ~0xff; /* just to make more readable */
 
     if (avail_contexts == 0) {
-	err = psmi_handle_error(NULL, PSM_EP_NO_DEVICE,
+	err = psmi_context_error(retryable, PSM_EP_NO_DEVICE,
 		"PSM found 0 available contexts on InfiniPath device(s).");
 	goto fail;
     }
@@ -522,7 +543,7 @@ psmi_init_userinfo_params(psm_ep_t ep, int unit_id, int port,
     if (ranks_per_context) {
         int contexts = (nranks + ranks_per_context - 1) / ranks_per_context;
 	if (contexts > ask_contexts) {
-	    err = psmi_handle_error(NULL, PSM_EP_NO_DEVICE,
+	    err = psmi_context_error(retryable, PSM_EP_NO_DEVICE,
 		    "Context required %d (nranks %d, ranks_per_context %d) "
 		    "is less than allowed context %d which is either the "
 		    "total avail_context %d or set by PSM_SHAREDCONTEXTS_MAX\n",
@@ -53,10 +53,14 @@ struct psmi_context {
 }
 psmi_context_t;
 
+/* cpu_affinity: let the driver bind us to the cpu it recommends
+ * retryable: don't wait for a context and only log errors instead of
+ *            raising them, the caller has another unit to try */
 psm_error_t
 psmi_context_open(const psm_ep_t ep, long unit_id, long port,
 		  psm_uuid_t const job_key, 
-		  int64_t timeout_ns, psmi_context_t *context);
+		  int64_t timeout_ns, int cpu_affinity, int retryable,
+		  psmi_context_t *context);
 
 psm_error_t
 psmi_context_close(psmi_context_t *context);
@@ -32,12 +32,34 @@
  * SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <ftw.h>
+
 #include "psm_user.h"
 #include "psm_mq_internal.h"
+#include "ptl_am/psm_am_internal.h"
 
 typedef void (*memcpy_fn_t)(void *dst, const void *src, size_t n);
 static int psmi_test_memcpy(memcpy_fn_t, const char *name);
 static int psmi_test_epid_table(int numelems);
+static int psmi_test_mq_threads(int nthreads, int iters, int by_head);
+static int psmi_test_mq_msgrate(int nthreads, int thread_multiple);
+static int psmi_test_shm_wireup(int nranks, int mode);
+static int psmi_test_shm_robust(int mode);
+static int psmi_test_topo(void);
+
+#define WIREUP_HANDSHAKE	0
+#define WIREUP_LAZY		1
+#define WIREUP_NONBLOCKING	2
+
+#define ROBUST_TAIL_LOCK	0
+#define ROBUST_HALF_WRITTEN	1
 
 int psmi_diags(void);
 
@@ -60,7 +82,25 @@ int
 psmi_diags(void)
 {
     int ret = 0;
+    int nranks, nthreads;
     ret |= psmi_test_epid_table(2048);
+    ret |= psmi_test_topo();
+    ret |= psmi_test_mq_threads(1, 100000, 0);
+    ret |= psmi_test_mq_threads(4, 100000, 0);
+    ret |= psmi_test_mq_threads(8, 100000, 0);
+    ret |= psmi_test_mq_threads(4, 100000, 1);
+    ret |= psmi_test_mq_threads(8, 100000, 1);
+    for (nthreads = 1; nthreads <= 32; nthreads <<= 1) {
+	ret |= psmi_test_mq_msgrate(nthreads, 0);
+	ret |= psmi_test_mq_msgrate(nthreads, 1);
+    }
+    for (nranks = 8; nranks <= PTL_AMSH_MAX_LOCAL_PROCS; nranks <<= 1) {
+	ret |= psmi_test_shm_wireup(nranks, WIREUP_LAZY);
+	ret |= psmi_test_shm_wireup(nranks, WIREUP_HANDSHAKE);
+	ret |= psmi_test_shm_wireup(nranks, WIREUP_NONBLOCKING);
+    }
+    ret |= psmi_test_shm_robust(ROBUST_TAIL_LOCK);
+    ret |= psmi_test_shm_robust(ROBUST_HALF_WRITTEN);
     ret |= psmi_test_memcpy((memcpy_fn_t) psmi_memcpyo, "psmi_memcpyo");
     //ret |= psmi_test_memcpy((memcpy_fn_t) psmi_mq_mtucpy, "psmi_mq_mtucpy");
 
@@ -175,6 +215,704 @@ fail:
     DIAGS_RETURN_FAIL("");
 }
 
+/*
+ * Thread-multiple MQ lock test
+ *
+ * Only the completed queue and the request pools are covered by the MQ lock
+ * (PSM_THREAD_MULTIPLE=1), sends, receives and progress still serialize on
+ * the progress lock.  Each thread allocates requests and completes them
+ * onto the shared completed queue.  It then reaps either its own request,
+ * the way psm_mq_test does, or whatever is at the head of the queue, the way
+ * psm_mq_ipeek does, so that requests completed by one thread are freed by
+ * another.
+ */
+struct mq_threads_arg {
+    psm_mq_t	mq;
+    int		iters;
+    int		by_head;
+    uint64_t	nreaped;
+};
+
+static void *
+mq_threads_run(void *varg)
+{
+    struct mq_threads_arg *arg = (struct mq_threads_arg *) varg;
+    psm_mq_t mq = arg->mq;
+    psm_mq_req_t req;
+    int i;
+
+    for (i = 0; i < arg->iters; i++) {
+	req = psmi_mq_req_alloc(mq, (i & 1) ? MQE_TYPE_SEND : MQE_TYPE_RECV);
+	if (req == NULL)
+	    break;
+	req->state = MQ_STATE_COMPLETE;
+	mq_qq_append(&mq->completed_q, req);
+
+	PSMI_MQ_LOCK(mq);
+	if (arg->by_head)
+	    req = mq->completed_q.first;
+	if (req != NULL)
+	    mq_qq_remove(&mq->completed_q, req);
+	PSMI_MQ_UNLOCK(mq);
+
+	if (req != NULL) {
+	    psmi_mq_req_free(req);
+	    arg->nreaped++;
+	}
+    }
+    return NULL;
+}
+
+static int
+psmi_test_mq_threads(int nthreads, int iters, int by_head)
+{
+    struct mq_threads_arg *args = NULL;
+    pthread_t *tids = NULL;
+    psm_mq_t mq;
+    psm_mq_req_t req;
+    uint64_t nreaped = 0;
+    char buf[64];
+    int i, nreqs;
+
+    snprintf(buf, sizeof buf, "%d threads, %s", nthreads,
+	     by_head ? "ipeek" : "test");
+
+    mq = (psm_mq_t) psmi_calloc(PSMI_EP_NONE, UNDEFINED, 1, sizeof(struct psm_mq));
+    args = (struct mq_threads_arg *)
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nthreads, sizeof(*args));
+    tids = (pthread_t *)
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nthreads, sizeof(pthread_t));
+    diags_assert(mq != NULL);
+    diags_assert(args != NULL);
+    diags_assert(tids != NULL);
+
+    mq->memmode = PSMI_MEMMODE_NORMAL;
+    mq->completed_q.first = NULL;
+    mq->completed_q.lastp = &mq->completed_q.first;
+    psmi_spin_init(&mq->lock_store);
+    mq->lock = &mq->lock_store;
+    diags_assert(psmi_mq_req_init(mq) == PSM_OK);
+    nreqs = mq->nreqs;
+
+    for (i = 0; i < nthreads; i++) {
+	args[i].mq = mq;
+	args[i].iters = iters;
+	args[i].by_head = by_head;
+	diags_assert(pthread_create(&tids[i], NULL, mq_threads_run, &args[i]) == 0);
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(tids[i], NULL);
+	nreaped += args[i].nreaped;
+    }
+
+    /* Reaping from the head may leave requests behind on the queue */
+    while ((req = mq->completed_q.first) != NULL) {
+	mq_qq_remove(&mq->completed_q, req);
+	psmi_mq_req_free(req);
+	nreaped++;
+    }
+    diags_assert(nreaped == (uint64_t) nthreads * iters);
+    diags_assert(mq->nreqs == nreqs);
+    diags_assert(mq->completed_q.lastp == &mq->completed_q.first);
+
+    psmi_mq_req_fini(mq);
+    psmi_free(tids);
+    psmi_free(args);
+    psmi_free(mq);
+    DIAGS_RETURN_PASS(buf);
+
+fail:
+    /* Threads that did start may still be using the MQ, leak it */
+    DIAGS_RETURN_FAIL(buf);
+}
+
+/*
+ * Multi-threaded MQ message rate
+ *
+ * Forks a process with a self-only endpoint in which each of nthreads
+ * threads posts a receive, sends itself an 8 byte message under its own tag
+ * and waits for both, serialized on the progress lock or with
+ * PSM_THREAD_MULTIPLE=1.  Reports the aggregate message rate.
+ */
+#define MSGRATE_MSGS		100000
+#define MSGRATE_TIMEOUT_SECS	300
+
+struct mq_msgrate_arg {
+    psm_mq_t		mq;
+    psm_epaddr_t	epaddr;
+    uint64_t		tag;
+    int			iters;
+    int			nerrs;
+};
+
+static void *
+mq_msgrate_run(void *varg)
+{
+    struct mq_msgrate_arg *arg = (struct mq_msgrate_arg *) varg;
+    psm_mq_req_t sreq, rreq;
+    uint64_t sbuf, rbuf;
+    int i;
+
+    for (i = 0; i < arg->iters; i++) {
+	sbuf = (arg->tag << 32) | i;
+	rbuf = 0;
+	if (psm_mq_irecv(arg->mq, arg->tag, ~0ULL, 0, &rbuf, sizeof rbuf,
+			 NULL, &rreq) != PSM_OK ||
+	    psm_mq_isend(arg->mq, arg->epaddr, 0, arg->tag, &sbuf,
+			 sizeof sbuf, NULL, &sreq) != PSM_OK ||
+	    psm_mq_wait(&sreq, NULL) != PSM_OK ||
+	    psm_mq_wait(&rreq, NULL) != PSM_OK || rbuf != sbuf) {
+	    arg->nerrs++;
+	    break;
+	}
+    }
+    return NULL;
+}
+
+static void
+mq_msgrate_child(double *rate, int nthreads, int thread_multiple)
+{
+    struct mq_msgrate_arg *args;
+    pthread_t *tids;
+    psm_uuid_t key;
+    psm_ep_t ep;
+    psm_epid_t epid;
+    psm_epaddr_t epaddr;
+    psm_error_t err;
+    psm_mq_t mq;
+    uint64_t t_start;
+    int i, nerrs = 0;
+
+    alarm(MSGRATE_TIMEOUT_SECS);
+    setenv("PSM_DEVICES", "self", 1);
+    setenv("PSM_THREAD_MULTIPLE", thread_multiple ? "1" : "0", 1);
+
+    args = (struct mq_msgrate_arg *)
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nthreads, sizeof(*args));
+    tids = (pthread_t *)
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nthreads, sizeof(pthread_t));
+    if (args == NULL || tids == NULL)
+	_exit(1);
+
+    psm_uuid_generate(key);
+    psmi_epid_init();
+    if (psm_ep_open(key, NULL, &ep, &epid) != PSM_OK ||
+	psm_mq_init(ep, PSM_MQ_ORDERMASK_NONE, NULL, 0, &mq) != PSM_OK ||
+	psm_ep_connect(ep, 1, &epid, NULL, &err, &epaddr, 0) != PSM_OK)
+	_exit(2);
+
+    t_start = get_cycles();
+    for (i = 0; i < nthreads; i++) {
+	args[i].mq = mq;
+	args[i].epaddr = epaddr;
+	args[i].tag = i;
+	args[i].iters = MSGRATE_MSGS / nthreads;
+	if (pthread_create(&tids[i], NULL, mq_msgrate_run, &args[i]) != 0)
+	    _exit(3);
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(tids[i], NULL);
+	nerrs += args[i].nerrs;
+    }
+    *rate = (double) nthreads * (MSGRATE_MSGS / nthreads) * 1e9 /
+	    cycles_to_nanosecs(get_cycles() - t_start);
+    if (nerrs)
+	_exit(4);
+
+    if (psm_mq_finalize(mq) != PSM_OK ||
+	psm_ep_close(ep, PSM_EP_CLOSE_GRACEFUL, 0) != PSM_OK)
+	_exit(5);
+    _exit(0);
+}
+
+static int
+psmi_test_mq_msgrate(int nthreads, int thread_multiple)
+{
+    double *rate;
+    pid_t pid;
+    char buf[64];
+    int status;
+
+    snprintf(buf, sizeof buf, "%d threads, %s", nthreads,
+	     thread_multiple ? "thread multiple" : "serialized");
+
+    rate = (double *) mmap(NULL, sizeof(*rate), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    diags_assert(rate != MAP_FAILED);
+    *rate = 0;
+
+    pid = fork();
+    if (pid == 0)
+	mq_msgrate_child(rate, nthreads, thread_multiple);
+    diags_assert(pid > 0);
+    diags_assert(waitpid(pid, &status, 0) == pid);
+    diags_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    snprintf(buf, sizeof buf, "%d threads, %s, %.0f msgs/s", nthreads,
+	     thread_multiple ? "thread multiple" : "serialized", *rate);
+    munmap(rate, sizeof(*rate));
+    DIAGS_RETURN_PASS(buf);
+
+fail:
+    DIAGS_RETURN_FAIL(buf);
+}
+
+/*
+ * Shared memory wire-up benchmark
+ *
+ * Forks nranks local processes that open shm-only endpoints, connect all to
+ * all and close again without sending anything.  Connects are lazy, with a
+ * handshake, or with a handshake through psm_ep_connect_start/test given
+ * every epid twice.  Reports the slowest rank's connect and close times.
+ * Every close must complete: a peer that connected lazily but never sent
+ * still has to be waited for, else it is left without anyone to answer its
+ * disconnect.
+ */
+#define WIREUP_TIMEOUT_SECS	300
+
+struct wireup_shared {
+    volatile int	nready;
+    volatile int	nconnected;
+    volatile int	stage[PTL_AMSH_MAX_LOCAL_PROCS]; /* 1 open ... 4 closed */
+    uint64_t		t_connect[PTL_AMSH_MAX_LOCAL_PROCS]; /* ns */
+    int			n_tests[PTL_AMSH_MAX_LOCAL_PROCS];
+    uint64_t		t_close[PTL_AMSH_MAX_LOCAL_PROCS];
+    psm_epid_t		epids[PTL_AMSH_MAX_LOCAL_PROCS];
+};
+
+static void
+wireup_rank(struct wireup_shared *sh, psm_uuid_t key, int rank, int nranks,
+	    int mode)
+{
+    psm_ep_connect_req_t req;
+    psm_error_t *errs, err;
+    psm_epaddr_t *epaddrs;
+    psm_epid_t *epids;
+    psm_ep_t ep;
+    psm_epid_t epid;
+    char buf[16];
+    uint64_t t_start;
+    int i, nepids = mode == WIREUP_NONBLOCKING ? 2 * nranks : nranks;
+
+    alarm(WIREUP_TIMEOUT_SECS);
+    setenv("PSM_DEVICES", "self,shm", 1);
+    setenv("PSM_SHM_LAZY_CONNECT", mode == WIREUP_LAZY ? "1" : "0", 1);
+    snprintf(buf, sizeof buf, "%d", rank);
+    setenv("MPI_LOCALRANKID", buf, 1);
+    snprintf(buf, sizeof buf, "%d", nranks);
+    setenv("MPI_LOCALNRANKS", buf, 1);
+
+    errs = (psm_error_t *) 
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nepids, sizeof(psm_error_t));
+    epaddrs = (psm_epaddr_t *) 
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nepids, sizeof(psm_epaddr_t));
+    epids = (psm_epid_t *) 
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, nepids, sizeof(psm_epid_t));
+    if (errs == NULL || epaddrs == NULL || epids == NULL)
+	_exit(1);
+
+    psmi_epid_init();
+    if (psm_ep_open(key, NULL, &ep, &epid) != PSM_OK)
+	_exit(2);
+    sh->epids[rank] = epid;
+    sh->stage[rank] = 1;
+    __sync_fetch_and_add(&sh->nready, 1);
+    while (sh->nready < nranks)
+	sched_yield();
+    for (i = 0; i < nepids; i++)
+	epids[i] = sh->epids[i % nranks];
+
+    t_start = get_cycles();
+    if (mode == WIREUP_NONBLOCKING) {
+	if (psm_ep_connect_start(ep, nepids, epids, NULL, errs, epaddrs, 0,
+				 &req) != PSM_OK)
+	    _exit(3);
+	do {
+	    err = psm_ep_connect_test(&req);
+	    sh->n_tests[rank]++;
+	} while (err == PSM_OK_NO_PROGRESS);
+    }
+    else
+	err = psm_ep_connect(ep, nepids, epids, NULL, errs, epaddrs, 0);
+    if (err != PSM_OK || ep->connections != nranks)
+	_exit(3);
+    sh->t_connect[rank] = cycles_to_nanosecs(get_cycles() - t_start);
+    sh->stage[rank] = 2;
+
+    /* Nobody sends, so lazily connected peers know nothing of each other.
+     * Keep polling, peers still connecting wait for our replies. */
+    __sync_fetch_and_add(&sh->nconnected, 1);
+    while (sh->nconnected < nranks)
+	psm_poll(ep);
+
+    t_start = get_cycles();
+    sh->stage[rank] = 3;
+    if (psm_ep_close(ep, PSM_EP_CLOSE_GRACEFUL, 0) != PSM_OK)
+	_exit(4);
+    sh->t_close[rank] = cycles_to_nanosecs(get_cycles() - t_start);
+    sh->stage[rank] = 4;
+    for (i = 0; i < nepids; i++)
+	if (errs[i] != PSM_OK)
+	    _exit(5);
+    _exit(0);
+}
+
+static int
+psmi_test_shm_wireup(int nranks, int mode)
+{
+    static const char *modes[] = { "handshake", "lazy", "non-blocking" };
+    struct wireup_shared *sh;
+    psm_uuid_t key;
+    uint64_t t_connect = 0, t_close = 0;
+    pid_t pid;
+    char buf[128];
+    int i, status, nfailed = 0, n_tests = 0;
+
+    snprintf(buf, sizeof buf, "%d ranks, %s connect", nranks, modes[mode]);
+
+    sh = (struct wireup_shared *) mmap(NULL, sizeof(*sh), 
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    diags_assert(sh != MAP_FAILED);
+    memset(sh, 0, sizeof(*sh));
+    psm_uuid_generate(key);
+
+    for (i = 0; i < nranks; i++) {
+	pid = fork();
+	if (pid == 0)
+	    wireup_rank(sh, key, i, nranks, mode);
+	if (pid < 0)
+	    nfailed++;
+    }
+    while ((pid = wait(&status)) > 0)
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    _IPATH_ERROR("wireup rank exited with status 0x%x\n", status);
+	    nfailed++;
+	}
+
+    for (i = 0; i < nranks; i++) {
+	if (sh->stage[i] != 4)
+	    _IPATH_ERROR("wireup rank %d stopped in stage %d\n", i, sh->stage[i]);
+	t_connect = max(t_connect, sh->t_connect[i]);
+	t_close = max(t_close, sh->t_close[i]);
+	n_tests = max(n_tests, sh->n_tests[i]);
+    }
+    munmap(sh, sizeof(*sh));
+    diags_assert(nfailed == 0);
+
+    snprintf(buf, sizeof buf, "%d ranks, %s connect %.3f ms, close %.3f ms",
+	     nranks, modes[mode], (double) t_connect / 1e6,
+	     (double) t_close / 1e6);
+    if (mode == WIREUP_NONBLOCKING)
+	snprintf(buf + strlen(buf), sizeof buf - strlen(buf), 
+		 ", at most %d tests", n_tests);
+    DIAGS_RETURN_PASS(buf);
+
+fail:
+    DIAGS_RETURN_FAIL(buf);
+}
+
+/*
+ * Shared memory robustness test
+ *
+ * A receiver and a sender connect over shm, the sender then takes the
+ * receiver's short request fifo tail lock, or leaves a slot half-written,
+ * and is killed.  A second sender must still get its messages through, the
+ * receiver must report the dead peer, and both must close gracefully.
+ */
+#define ROBUST_MSGS		1000
+#define ROBUST_TIMEOUT_SECS	60
+
+struct robust_shared {
+    volatile int	stage[3];	/* receiver, killed and second sender */
+    volatile int	nunreachable;
+    psm_epid_t		epid;
+};
+
+static struct robust_shared *robust_sh;
+
+static psm_error_t
+robust_errhandler(psm_ep_t ep, const psm_error_t error, 
+		  const char *error_string, psm_error_token_t token)
+{
+    if (error == PSM_EPID_UNREACHABLE && ep->epid == robust_sh->epid)
+	__sync_fetch_and_add(&robust_sh->nunreachable, 1);
+    return error;
+}
+
+static void
+robust_open(psm_uuid_t key, int rank, psm_ep_t *ep, psm_mq_t *mq, 
+	    psm_epaddr_t *epaddr)
+{
+    psm_epid_t epid;
+    psm_error_t err;
+    char buf[16];
+
+    alarm(ROBUST_TIMEOUT_SECS);
+    setenv("PSM_DEVICES", "self,shm", 1);
+    setenv("PSM_SHM_LAZY_CONNECT", "0", 1);
+    setenv("PSM_SHM_ROBUST", "10", 1);
+    snprintf(buf, sizeof buf, "%d", rank);
+    setenv("MPI_LOCALRANKID", buf, 1);
+    setenv("MPI_LOCALNRANKS", "3", 1);
+
+    psmi_epid_init();
+    if (psm_ep_open(key, NULL, ep, &epid) != PSM_OK ||
+	psm_error_register_handler(*ep, robust_errhandler) != PSM_OK ||
+	psm_mq_init(*ep, PSM_MQ_ORDERMASK_NONE, NULL, 0, mq) != PSM_OK)
+	_exit(2);
+    if (epaddr == NULL)
+	robust_sh->epid = epid;
+    else if (psm_ep_connect(*ep, 1, &robust_sh->epid, NULL, &err, 
+			    epaddr, 0) != PSM_OK)
+	_exit(3);
+}
+
+static void
+robust_recv(psm_uuid_t key)
+{
+    psm_ep_t ep;
+    psm_mq_t mq;
+    psm_mq_req_t req;
+    uint64_t buf;
+    int i;
+
+    robust_open(key, 0, &ep, &mq, NULL);
+    robust_sh->stage[0] = 1;
+
+    for (i = 0; i <= ROBUST_MSGS; i++) {
+	if (psm_mq_irecv(mq, i == 0 ? 1 : 2, ~0ULL, 0, &buf, sizeof buf,
+			 NULL, &req) != PSM_OK ||
+	    psm_mq_wait(&req, NULL) != PSM_OK)
+	    _exit(4);
+	if (buf != (i == 0 ? 1 : i - 1))
+	    _exit(5);
+    }
+    /* The second sender may have taken the lock over before we looked */
+    while (robust_sh->nunreachable == 0)
+	psm_poll(ep);
+    robust_sh->stage[0] = 2;
+
+    if (psm_mq_finalize(mq) != PSM_OK ||
+	psm_ep_close(ep, PSM_EP_CLOSE_GRACEFUL, 0) != PSM_OK)
+	_exit(6);
+    _exit(0);
+}
+
+/* Dies in the middle of a send, as seen from am_ctl_getslot_pkt_inner */
+static void
+robust_send_and_die(psm_uuid_t key, int mode)
+{
+    struct amsh_qtail_info *tailinfo;
+    am_pkt_short_t *pkt;
+    psm_ep_t ep;
+    psm_mq_t mq;
+    psm_epaddr_t epaddr;
+    uint64_t buf = 1;
+    uint32_t me;
+    int shmidx;
+
+    robust_open(key, 1, &ep, &mq, &epaddr);
+    if (psm_mq_send(mq, epaddr, 0, 1, &buf, sizeof buf) != PSM_OK)
+	_exit(4);
+
+    me = ep->amsh_shmidx + 1;
+    shmidx = epaddr->_shmidx;
+    tailinfo = &ep->amsh_dirpage->qtails[shmidx].reqFifoShort;
+    while (ips_cmpxchg(&tailinfo->lock, 0, me) != 0)
+	;
+    if (mode == ROBUST_HALF_WRITTEN) {
+	pkt = (am_pkt_short_t *) ((uintptr_t) ep->amsh_qdir[shmidx].qreqFifoShort +
+		tailinfo->tail * ep->amsh_qdir[shmidx].qreqH->shortq.elem_sz);
+	if (pkt->flag != QFREE)
+	    _exit(5);
+	pkt->flag = QUSED_BY(me - 1);
+	if (++tailinfo->tail == ep->amsh_qdir[shmidx].qreqH->shortq.elem_cnt)
+	    tailinfo->tail = 0;
+	ips_wmb();
+	tailinfo->lock = 0;
+    }
+    robust_sh->stage[1] = 1;
+    for (;;)
+	pause();
+}
+
+static void
+robust_send(psm_uuid_t key)
+{
+    psm_ep_t ep;
+    psm_mq_t mq;
+    psm_epaddr_t epaddr;
+    uint64_t buf;
+
+    robust_open(key, 2, &ep, &mq, &epaddr);
+    for (buf = 0; buf < ROBUST_MSGS; buf++)
+	if (psm_mq_send(mq, epaddr, 0, 2, &buf, sizeof buf) != PSM_OK)
+	    _exit(4);
+    robust_sh->stage[2] = 1;
+
+    if (psm_mq_finalize(mq) != PSM_OK ||
+	psm_ep_close(ep, PSM_EP_CLOSE_GRACEFUL, 0) != PSM_OK)
+	_exit(6);
+    _exit(0);
+}
+
+static int
+psmi_test_shm_robust(int mode)
+{
+    static const char *modes[] = { "holding a tail lock", 
+				   "with a half-written slot" };
+    psm_uuid_t key;
+    pid_t pid[3];
+    char buf[128];
+    int i, status = 0, nfailed = 0, stage[3];
+
+    snprintf(buf, sizeof buf, "sender killed %s", modes[mode]);
+
+    robust_sh = (struct robust_shared *) mmap(NULL, sizeof(*robust_sh), 
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    diags_assert(robust_sh != MAP_FAILED);
+    memset(robust_sh, 0, sizeof(*robust_sh));
+    psm_uuid_generate(key);
+
+    if ((pid[0] = fork()) == 0)
+	robust_recv(key);
+    while (pid[0] > 0 && robust_sh->stage[0] == 0 &&
+	   waitpid(pid[0], &status, WNOHANG) == 0)
+	usleep(1000);
+
+    /* Reap it once it's stuck, its pid must be gone */
+    if ((pid[1] = fork()) == 0)
+	robust_send_and_die(key, mode);
+    while (pid[1] > 0 && robust_sh->stage[1] == 0 &&
+	   waitpid(pid[1], &status, WNOHANG) == 0)
+	usleep(1000);
+    if (pid[1] > 0) {
+	kill(pid[1], SIGKILL);
+	waitpid(pid[1], &status, 0);
+    }
+
+    if ((pid[2] = fork()) == 0)
+	robust_send(key);
+
+    for (i = 0; i < 3; i += 2) {
+	if (pid[i] < 0 || waitpid(pid[i], &status, 0) != pid[i] ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    _IPATH_ERROR("robust process %d exited with status 0x%x\n", 
+			 i, status);
+	    nfailed++;
+	}
+    }
+    for (i = 0; i < 3; i++)
+	stage[i] = robust_sh->stage[i];
+    munmap(robust_sh, sizeof(*robust_sh));
+    diags_assert(stage[0] == 2 && stage[1] == 1 && stage[2] == 1);
+    diags_assert(nfailed == 0);
+    DIAGS_RETURN_PASS(buf);
+
+fail:
+    DIAGS_RETURN_FAIL(buf);
+}
+
+/*
+ * Topology placement test
+ *
+ * Builds a fake sysfs tree under /tmp: two packages of two cores with two
+ * hardware threads each, package n being NUMA node n, and two units, qib0
+ * on node 1 and qib1 on node 0.  Checks where psmi_topo_place puts ranks,
+ * and that PSM_SYSFS_ROOT points psmi_topo_placement at the tree.
+ */
+static int
+topo_write(const char *root, const char *str, const char *fmt, ...)
+{
+    char path[PATH_MAX], *c;
+    size_t n;
+    va_list ap;
+    FILE *fp;
+
+    n = snprintf(path, sizeof path, "%s/", root);
+    va_start(ap, fmt);
+    vsnprintf(path + n, sizeof path - n, fmt, ap);
+    va_end(ap);
+
+    for (c = path + n; (c = strchr(c, '/')) != NULL; c++) {
+	*c = '\0';
+	if (mkdir(path, 0700) && errno != EEXIST)
+	    return -1;
+	*c = '/';
+    }
+    if ((fp = fopen(path, "w")) == NULL)
+	return -1;
+    fprintf(fp, "%s\n", str);
+    return fclose(fp);
+}
+
+static int
+topo_remove(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int
+psmi_test_topo(void)
+{
+    /* Where ranks go with both units, qib0 only and no units */
+    static const int cpus_2units[8] = { 2, 3, 6, 7, 0, 1, 4, 5 };
+    static const int cpus_unit0[12] = { 2, 3, 6, 7, 0, 1, 4, 5, 0, 1, 4, 5 };
+    struct psmi_topo topo;
+    char root[] = "/tmp/psm_topo.XXXXXX", buf[8];
+    int i, cpu, unit;
+
+    topo.cpus = NULL;
+    diags_assert(mkdtemp(root) != NULL);
+    diags_assert(!topo_write(root, "0-7", "devices/system/cpu/online"));
+    for (i = 0; i < 8; i++) {
+	snprintf(buf, sizeof buf, "%d", i & 1);
+	diags_assert(!topo_write(root, buf,
+		     "devices/system/cpu/cpu%d/topology/core_id", i));
+	snprintf(buf, sizeof buf, "%d", (i >> 1) & 1);
+	diags_assert(!topo_write(root, buf,
+		     "devices/system/cpu/cpu%d/topology/physical_package_id", i));
+    }
+    diags_assert(!topo_write(root, "0-1,4-5", "devices/system/node/node0/cpulist"));
+    diags_assert(!topo_write(root, "2-3,6-7", "devices/system/node/node1/cpulist"));
+    diags_assert(!topo_write(root, "1", "class/infiniband/qib0/device/numa_node"));
+    diags_assert(!topo_write(root, "0", "class/infiniband/qib1/device/numa_node"));
+
+    diags_assert(psmi_topo_load(&topo, root) == PSM_OK);
+    diags_assert(topo.ncpus == 8 && topo.nunits == 2);
+    diags_assert(topo.unit_node[0] == 1 && topo.unit_node[1] == 0);
+
+    /* Half the ranks on each unit, first hw threads of their node first */
+    for (i = 0; i < 8; i++) {
+	psmi_topo_place(&topo, i, 8, 0x3, &cpu, &unit);
+	diags_assert(cpu == cpus_2units[i] && unit == i / 4);
+    }
+    /* Ranks past node 1's cpus spill over to node 0's */
+    for (i = 0; i < 12; i++) {
+	psmi_topo_place(&topo, i, 12, 0x1, &cpu, &unit);
+	diags_assert(cpu == cpus_unit0[i] && unit == 0);
+    }
+    /* No units, any cores before any hyperthreads */
+    for (i = 0; i < 8; i++) {
+	psmi_topo_place(&topo, i, 8, 0, &cpu, &unit);
+	diags_assert(cpu == i && unit == -1);
+    }
+    psmi_topo_fini(&topo);
+
+    setenv("PSM_SYSFS_ROOT", root, 1);
+    i = psmi_topo_placement(5, 8, 0x3, &cpu, &unit);
+    unsetenv("PSM_SYSFS_ROOT");
+    diags_assert(i == PSM_OK && cpu == 1 && unit == 1);
+
+    nftw(root, topo_remove, 16, FTW_DEPTH | FTW_PHYS);
+    DIAGS_RETURN_PASS("");
+
+fail:
+    psmi_topo_fini(&topo);
+    nftw(root, topo_remove, 16, FTW_DEPTH | FTW_PHYS);
+    DIAGS_RETURN_FAIL("");
+}
+
 /*
  * Memcpy correctness test
  */
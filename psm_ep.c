@@ -594,7 +594,7 @@ __psm_ep_open_internal(psm_uuid_t const unique_job_key, int *devid_enabled,
     psm_epaddr_t epaddr = NULL;
     char buf[128], *p, *e;
     char *old_cpuaff = NULL, *old_unit = NULL;
-    union psmi_envvar_val yield_cnt, no_cpuaff, env_unit_id,
+    union psmi_envvar_val yield_cnt, thread_multiple, no_cpuaff, env_unit_id,
 	  env_port_id, env_sl;
     size_t ptl_sizes;
     int default_cpuaff;
@@ -783,17 +783,19 @@ __psm_ep_open_internal(psm_uuid_t const unique_job_key, int *devid_enabled,
 	    (unsigned long long) opts.outvl);
 #endif
 
+    /* Each ptl starts on a cache line, the ptl types are declared with
+     * cache aligned members */
     ptl_sizes =
 	(psmi_device_is_enabled(devid_enabled, PTL_DEVID_SELF) ?
-	    psmi_ptl_self.sizeof_ptl() : 0) +
+	    PSMI_ALIGNUP(psmi_ptl_self.sizeof_ptl(), 64) : 0) +
 	(psmi_device_is_enabled(devid_enabled, PTL_DEVID_IPS) ?
-	    psmi_ptl_ips.sizeof_ptl() : 0) +
+	    PSMI_ALIGNUP(psmi_ptl_ips.sizeof_ptl(), 64) : 0) +
 	(psmi_device_is_enabled(devid_enabled, PTL_DEVID_AMSH) ?
-	    psmi_ptl_amsh.sizeof_ptl() : 0);
+	    PSMI_ALIGNUP(psmi_ptl_amsh.sizeof_ptl(), 64) : 0);
     if (ptl_sizes == 0) return PSM_EP_NO_DEVICE;
 
     ep = (psm_ep_t) psmi_calloc(PSMI_EP_NONE, UNDEFINED, 1, 
-				sizeof(struct psm_ep) + ptl_sizes);
+				sizeof(struct psm_ep) + ptl_sizes + 64);
     epaddr = (psm_epaddr_t) psmi_calloc(PSMI_EP_NONE, PER_PEER_ENDPOINT, 
 					1, sizeof(struct psm_epaddr));
     if (ep == NULL || epaddr == NULL) {
@@ -860,19 +862,30 @@ __psm_ep_open_internal(psm_uuid_t const unique_job_key, int *devid_enabled,
 		&yield_cnt);
     ep->yield_spin_cnt = yield_cnt.e_uint;
 
-    ptl_sizes = 0;
+    /* Many threads making calls on the endpoint at once?  Only waits, tests
+     * and probes change, sends and receives still take the progress lock. */
+    psmi_getenv("PSM_THREAD_MULTIPLE",
+		"Threads take turns driving progress, tests and probes skip the progress lock, sends and receives do not (default is disabled i.e. 0)",
+		PSMI_ENVVAR_LEVEL_USER,
+		PSMI_ENVVAR_TYPE_YESNO,
+		(union psmi_envvar_val) 0,
+		&thread_multiple);
+    ep->thread_multiple = thread_multiple.e_uint;
+
+    ptl_sizes = PSMI_ALIGNUP(ep->ptl_base_data, 64) - 
+		(uintptr_t) ep->ptl_base_data;
     amsh_ptl = ips_ptl = self_ptl = NULL;
     if (psmi_ep_device_is_enabled(ep, PTL_DEVID_AMSH)) {
 	amsh_ptl = (ptl_t *) (ep->ptl_base_data + ptl_sizes);
-	ptl_sizes += psmi_ptl_amsh.sizeof_ptl();
+	ptl_sizes += PSMI_ALIGNUP(psmi_ptl_amsh.sizeof_ptl(), 64);
     }
     if (psmi_ep_device_is_enabled(ep, PTL_DEVID_IPS)) {
 	ips_ptl = (ptl_t *) (ep->ptl_base_data + ptl_sizes);
-	ptl_sizes += psmi_ptl_ips.sizeof_ptl();
+	ptl_sizes += PSMI_ALIGNUP(psmi_ptl_ips.sizeof_ptl(), 64);
     }
     if (psmi_ep_device_is_enabled(ep, PTL_DEVID_SELF)) {
 	self_ptl = (ptl_t *) (ep->ptl_base_data + ptl_sizes);
-	ptl_sizes += psmi_ptl_self.sizeof_ptl();
+	ptl_sizes += PSMI_ALIGNUP(psmi_ptl_self.sizeof_ptl(), 64);
     }
 
     if ((err = psmi_ep_open_device(ep, &opts, unique_job_key, 
@@ -915,6 +928,9 @@ __psm_ep_open_internal(psm_uuid_t const unique_job_key, int *devid_enabled,
     if ((err = psmi_epid_set_hostname(psm_epid_nid(ep->epid), buf, 0)))
 	goto fail;
 
+    if ((err = psmi_capture_init(ep)))
+	goto fail;
+
     /* 
      * Active Message initialization
      */
@@ -1031,6 +1047,10 @@ __psm_ep_open(psm_uuid_t const unique_job_key, struct psm_ep_open_opts const *op
     ep->mctxt_prev = ep->mctxt_next = ep;
     ep->mctxt_master = ep;
     mq->ep = ep;
+    if (ep->thread_multiple) {
+	psmi_spin_init(&mq->lock_store);
+	mq->lock = &mq->lock_store;
+    }
 
     *epo = ep;
     *epido = epid;
@@ -1118,7 +1138,8 @@ __psm_ep_close(psm_ep_t ep, int mode, int64_t timeout_in)
 	timeout_in = PSMI_MAX_EP_CLOSE_TIMEOUT;
     _IPATH_PRDBG("Closing endpoint %p with force=%s and to=%.2f seconds and "
                  "%d connections\n",
-		 ep, mode == PSM_EP_CLOSE_FORCE ? "YES" : "NO", 
+		 ep, mode == PSM_EP_CLOSE_FORCE ? "YES" : 
+		     mode == PSM_EP_CLOSE_JOBEXIT ? "JOBEXIT" : "NO", 
 		 (double) timeout_in / 1e9, (int) ep->connections);
 
     /* XXX We currently cheat in the sense that we leave each PTL the allowed
@@ -1144,6 +1165,7 @@ __psm_ep_close(psm_ep_t ep, int mode, int64_t timeout_in)
 	if (psmi_ep_device_is_enabled(ep, PTL_DEVID_IPS))
 	    psmi_context_close(&ep->context);
 
+	psmi_capture_fini(ep);
 	psmi_free(ep->epaddr);
 	psmi_free(ep->context_mylabel);
 	/*
@@ -1176,6 +1198,81 @@ __psm_ep_close(psm_ep_t ep, int mode, int64_t timeout_in)
 }
 PSMI_API_DECL(psm_ep_close)
 
+/* Has the process already been bound to a subset of the processors? */
+static
+int
+psmi_ep_affinity_is_set(long nproc)
+{
+    cpu_set_t cpuset;
+    int i, num_set = 0;
+
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof cpuset, &cpuset)) {
+	_IPATH_PRDBG("Couldn't get processory affinity, assuming "
+		     "not set: %s\n", strerror(errno));
+	return 0;
+    }
+    for (i = 0; i < CPU_SETSIZE; i++) {
+	if (CPU_ISSET(i, &cpuset))
+	    num_set++;
+    }
+    return (num_set > 0 && num_set < nproc);
+}
+
+/* Units with the port we want (any port if port <= 0) up */
+static
+uint32_t
+psmi_ep_active_units(long port)
+{
+    uint32_t mask = 0;
+    int unit, p, nunits = ipath_get_num_units();
+
+    for (unit = 0; unit < nunits && unit < IPATH_MAX_UNIT; unit++)
+	for (p = 1; p <= IPATH_MAX_PORT; p++)
+	    if ((port <= 0 || port == p) && ipath_get_port_lid(unit, p) != -1) {
+		mask |= 1U << unit;
+		break;
+	    }
+    return mask;
+}
+
+/*
+ * Default placement from the node topology (see psm_topo.h) for whatever
+ * the user left unset: the unit when none was asked for and the cpu when
+ * affinity is neither disabled nor already set.  Only units with an active
+ * port are placed on.  Either is left at -1 when the topology or our local
+ * rank can't be found.
+ */
+static
+void
+psmi_ep_default_placement(long unit_req, long port, long *unit_o, int *cpu_o)
+{
+    char *e = getenv("IPATH_NO_CPUAFFINITY");
+    int rank, nranks, cpu, unit;
+    uint32_t unit_mask = 0;
+    int do_cpu;
+
+    *unit_o = -1;
+    *cpu_o = -1;
+
+    if (psmi_topo_local_rank(&rank, &nranks))
+	return;
+
+    if (unit_req == IPATH_UNIT_ID_ANY && 
+	getenv("IPATH_HCA_SELECTION_ALG") == NULL)
+	unit_mask = psmi_ep_active_units(port);
+    do_cpu = ((e == NULL || *e == '\0') &&
+	      !psmi_ep_affinity_is_set(sysconf(_SC_NPROCESSORS_ONLN)));
+    if (!unit_mask && !do_cpu)
+	return;
+
+    if (psmi_topo_placement(rank, nranks, unit_mask, &cpu, &unit) != PSM_OK)
+	return;
+    *unit_o = unit;
+    if (do_cpu)
+	*cpu_o = cpu;
+}
+
 static
 psm_error_t 
 psmi_ep_open_device(const psm_ep_t ep, 
@@ -1185,6 +1282,13 @@ psmi_ep_open_device(const psm_ep_t ep,
 		    psm_epid_t *epid)
 {
     psm_error_t err = PSM_OK;
+    union psmi_envvar_val env_place;
+
+    psmi_getenv("PSM_PLACEMENT",
+		"Place local ranks on cores and units by node topology (default is enabled i.e. 1)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+		(union psmi_envvar_val) 1,
+		&env_place);
 
     /* Skip affinity.  No affinity if:
      * 1. User explicitly sets no-affinity=YES in environment.
@@ -1193,11 +1297,53 @@ psmi_ep_open_device(const psm_ep_t ep,
      */
     if (psmi_ep_device_is_enabled(ep, PTL_DEVID_IPS)) {
 	uint32_t lid;
+	long unit = opts->unit, place_unit = -1;
+	int place_cpu = -1, placed = 0;
+	/* Whether the driver may bind us, as ipath_userinit() decides */
+	int driver_cpuaff = (getenv("IPATH_NO_CPUAFFINITY") == NULL);
+	cpu_set_t old_cpuset;
 	
 	ep->out_sl = opts->outsl;
+
+	if (env_place.e_uint)
+	    psmi_ep_default_placement(opts->unit, opts->port,
+				      &place_unit, &place_cpu);
+	if (place_unit != -1)
+	    unit = place_unit;
+	if (place_cpu != -1) {
+	    cpu_set_t cpuset;
+	    CPU_ZERO(&cpuset);
+	    CPU_SET(place_cpu, &cpuset);
+	    /* Bind before the context is opened so its memory is allocated
+	     * near us, and keep the driver from picking another cpu */
+	    if (sched_getaffinity(0, sizeof old_cpuset, &old_cpuset) ||
+		sched_setaffinity(0, sizeof cpuset, &cpuset)) 
+		_IPATH_PRDBG("Couldn't set affinity to processor %d: %s\n",
+		    place_cpu, strerror(errno));
+	    else
+		placed = 1;
+	}
 	
-	if ((err = psmi_context_open(ep, opts->unit, opts->port, unique_job_key,
-				     opts->timeout, context)) != PSM_OK)
+	err = psmi_context_open(ep, unit, opts->port, unique_job_key,
+				opts->timeout, driver_cpuaff && !placed,
+				unit != opts->unit, context);
+	/* The placed unit is only a preference, it may be out of contexts.
+	 * The cpu was placed next to it, so unbind and let the driver place
+	 * us near the unit we do get. */
+	if (err != PSM_OK && unit != opts->unit) {
+	    _IPATH_PRDBG("Couldn't open a context on placed unit %ld, "
+			 "trying unit %d\n", unit, opts->unit);
+	    if (placed) {
+		if (sched_setaffinity(0, sizeof old_cpuset, &old_cpuset))
+		    _IPATH_PRDBG("Couldn't restore cpu affinity: %s\n",
+				 strerror(errno));
+		placed = 0;
+	    }
+	    err = psmi_context_open(ep, opts->unit, opts->port, 
+				    unique_job_key, opts->timeout,
+				    driver_cpuaff, 0, context);
+	}
+	if (err != PSM_OK)
 	    goto fail;
 
 	_IPATH_DBG("[%d]use unit %d port %d\n", getpid(), 
@@ -1282,34 +1428,26 @@ psmi_ep_open_device(const psm_ep_t ep,
 	if (e == NULL || *e == '\0') 
 	{
 	    cpu_set_t cpuset;
-	    CPU_ZERO(&cpuset);
+	    int cpu = rank, unit;
+
 	    /* First see if affinity is already set */
-	    if (sched_getaffinity(0, sizeof cpuset, &cpuset)) {
-		_IPATH_PRDBG("Couldn't get processory affinity, assuming "
-			     "not set: %s\n", strerror(errno));
-	    }
+	    if (psmi_ep_affinity_is_set(nproc))
+		_IPATH_PRDBG("CPU affinity already set, leaving as is\n");
+	    else if (rank >= nranks || rank < 0) 
+		_IPATH_PRDBG("Skipping affinity, rank is %d and there are "
+			    "only %d processors.\n", rank, nranks);
 	    else {
-		int i, num_set = 0;
-		for (i = 0; i < CPU_SETSIZE; i++) {
-		    if (CPU_ISSET(i, &cpuset))
-			num_set++;
-		}
-
-		if (num_set > 0 && num_set < nproc)
-		    _IPATH_PRDBG("CPU affinity already set, leaving as is\n");
-		else if (rank >= nranks || rank < 0) 
-		    _IPATH_PRDBG("Skipping affinity, rank is %d and there are "
-				"only %d processors.\n", rank, nranks);
-		else {
-		    CPU_ZERO(&cpuset);
-		    CPU_SET(rank, &cpuset);
-		    if (sched_setaffinity(0,sizeof cpuset, &cpuset)) 
-			_IPATH_PRDBG("Couldn't set affinity to processor %d: %s\n",
-			    rank, strerror(errno));
-		    else
-			_IPATH_PRDBG("Set CPU affinity to %d out of %d processors\n",
-			    rank, nranks);
-		}
+		/* Spread over cores before hyperthreads, else core=rank */
+		if (env_place.e_uint)
+		    psmi_topo_placement(rank, nranks, 0, &cpu, &unit);
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		if (sched_setaffinity(0,sizeof cpuset, &cpuset)) 
+		    _IPATH_PRDBG("Couldn't set affinity to processor %d: %s\n",
+			cpu, strerror(errno));
+		else
+		    _IPATH_PRDBG("Set CPU affinity to %d out of %d processors\n",
+			cpu, nranks);
 	    }
 	}
 
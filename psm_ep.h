@@ -85,10 +85,14 @@
 #define PSMI_MIN_EP_CLOSE_GRACE_INTERVAL (1 * SEC_ULL)
 #define PSMI_MAX_EP_CLOSE_GRACE_INTERVAL (10 * SEC_ULL)
 
+/* MQ ids are carried in 6 bits of the message envelope */
+#define PSMI_MQ_MAX	64
+
 struct psm_ep {
     psm_epid_t		epid;	    /**> This endpoint's Endpoint ID */
     psm_epaddr_t	epaddr;	    /**> This ep's ep address */
-    psm_mq_t		mq;	    /**> only 1 MQ */
+    psm_mq_t		mq;	    /**> first MQ, owns the request pools */
+    psm_mq_t		mqs[PSMI_MQ_MAX]; /**> MQs opened on this ep, by id */
     int			unit_id;
     uint16_t		portnum;
     uint8_t		out_sl;
@@ -120,6 +124,8 @@ struct psm_ep {
     psmi_context_t	context;
     char	*context_mylabel;
     uint32_t	yield_spin_cnt;
+    uint32_t	thread_multiple;    /**> Waiters elect one progress thread,
+				      MQs lock their own queues */
 
     /* EP link-lists */
     struct psm_ep	*user_ep_next;
@@ -147,6 +153,8 @@ struct psm_ep {
     uint64_t    gid_hi;
     uint64_t    gid_lo;
 
+    struct psmi_capture *capture; /* packet capture ring, if enabled */
+
     ptl_ctl_t	ptl_amsh;
     ptl_ctl_t	ptl_ips;
     ptl_ctl_t	ptl_self;
@@ -192,6 +200,12 @@ union psmi_seqnum {
   uint32_t val;
 } psmi_seqnum_t;
 
+/* Subnet and epid of each of a peer's contexts, for multi-context */
+struct psm_epaddr_mctxt {
+    uint64_t		gidhi[IPATH_MAX_UNIT];
+    psm_epid_t		epid[IPATH_MAX_UNIT];
+};
+
 struct psm_epaddr {
     struct ptl	    *ptl;	   /* Which ptl owns this epaddress */
     ptl_ctl_t	    *ptlctl;	   /* The control structure for the ptl */
@@ -212,9 +226,9 @@ struct psm_epaddr {
 	uint8_t		 _ptladdr_data[0];
     };
 
-    /* it makes sense only in master */
-    uint64_t		mctxt_gidhi[IPATH_MAX_UNIT];
-    psm_epid_t		mctxt_epid[IPATH_MAX_UNIT];
+    /* it makes sense only in master, and only allocated when the peer
+     * advertised more than one context (mctxt_epcount > 0) */
+    struct psm_epaddr_mctxt *mctxt_peer;
     int			mctxt_epcount;
     int			mctxt_nsconn;	/* # slave connection */
     uint16_t		mctxt_send_seqnum;
@@ -223,6 +237,16 @@ struct psm_epaddr {
     struct mqsq		outoforder_q; /**> OutofOrder queue */
     int			outoforder_c; /* OOO queue count */
 
+    /* Eager credits, see mq_egrcredit_take().  The sender side counts bytes
+     * charged and given back as free-running 32-bit counters, the receiver
+     * side counts bytes it has given back to this peer against the window it
+     * advertised when the peer was added. */
+    uint32_t		egrcredit_window; /* 0: peer doesn't flow control */
+    uint32_t		egrcredit_sent;
+    uint32_t		egrcredit_acked;
+    uint32_t		egrcredit_granted; /* 0: we don't flow control peer */
+    uint32_t		egrcredit_freed;
+
     /* epaddr linklist for multi-context. */
     struct psm_epaddr	*mctxt_master;
     struct psm_epaddr	*mctxt_prev;
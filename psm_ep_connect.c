@@ -35,63 +35,155 @@
 
 int psmi_ep_device_is_enabled(const psm_ep_t ep, int devid);
 
+/* Connect state, shared by psm_ep_connect and psm_ep_connect_start() */
+struct psm_ep_connect_req {
+    psm_ep_t		ep;
+    int			num_of_epid;
+    psm_epid_t const	*array_of_epid;
+    int const		*array_of_epid_mask;
+    psm_error_t		*array_of_errors;
+    psm_epaddr_t	*array_of_epaddr;
+    int64_t		timeout;	/* for the whole set */
+    uint64_t		t_start;
+    int			batch;	/* epids per call into a blocking ptl */
+
+    int			num_pending;	/* unique epids still to connect */
+    int			dev;	/* index in ep->devid_enabled being tried */
+    int			num_sub;	/* epids packed for dev, -1 if not yet */
+    int			next;	/* first packed epid dev wasn't given yet */
+    struct ptl_connection_req *ptl_req; /* in flight on dev */
+
+    /* Scratch, allocated along with the request */
+    int			*pending;
+    int			*epid_mask_isdupof;
+    psm_epid_t		*sub_epid;
+    psm_epaddr_t	*sub_epaddr;
+    psm_error_t		*sub_errors;
+    int			*sub_mask;
+    int			*sub_idx;
+};
+
+PSMI_ALWAYS_INLINE(
+uint32_t
+psmi_connect_epid_hash(psm_epid_t epid, int bits))
+{
+    return (uint32_t) ((epid * 0x9e3779b97f4a7c13ULL) >> (64 - bits));
+}
+
+/* The same test each ptl makes before attempting an epid */
+static
+int
+psmi_connect_epid_reachable(psm_ep_t ep, int devid, psm_epid_t epid)
+{
+    int result;
+
+    switch (devid) {
+	case PTL_DEVID_SELF:
+	    return epid == ep->epid;
+	case PTL_DEVID_AMSH:
+	    if (psm_ep_epid_share_memory(ep, epid, &result) != PSM_OK)
+		return 1; /* let shm decide */
+	    return result;
+	default:
+	    return 1;
+    }
+}
+
+static
+const char *
+psmi_connect_ptl(psm_ep_t ep, int devid, ptl_ctl_t **ptlctl_o)
+{
+    switch (devid) {
+	case PTL_DEVID_IPS:
+	    *ptlctl_o = &ep->ptl_ips;
+	    return "ips";
+	case PTL_DEVID_AMSH:
+	    *ptlctl_o = &ep->ptl_amsh;
+	    return "amsh";
+	case PTL_DEVID_SELF:
+	    *ptlctl_o = &ep->ptl_self;
+	    return "self";
+	default:
+	    *ptlctl_o = &ep->ptl_ips; /*no-unused*/
+	    psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
+		    "Unknown/unhandled PTL id %d\n", devid);
+	    return "unknown";
+    }
+}
+
+/*
+ * Sets up a connect.  Duplicate epids are found with an open-addressed hash
+ * set in one pass, only their first occurrence is connected.  The timeout
+ * is scaled to the number of epids here, once for the whole set.
+ */
+static
 psm_error_t
-__psm_ep_connect(psm_ep_t ep, int num_of_epid,
-	        psm_epid_t const *array_of_epid,
-	        int const *array_of_epid_mask, /* can be NULL */
-	        psm_error_t  *array_of_errors,
-	        psm_epaddr_t *array_of_epaddr,
-	        int64_t timeout)
+psmi_ep_connect_init(psm_ep_t ep, int num_of_epid,
+		     psm_epid_t const *array_of_epid,
+		     int const *array_of_epid_mask,
+		     psm_error_t *array_of_errors,
+		     psm_epaddr_t *array_of_epaddr,
+		     int64_t timeout, int batch,
+		     struct psm_ep_connect_req **req_o)
 {
-    psm_error_t err = PSM_OK;
-    ptl_ctl_t *ptlctl;
-    ptl_t     *ptl;
-    int i, j, dup_idx;
-    int num_toconnect = 0;
-    int *epid_mask = NULL;
-    int *epid_mask_isdupof = NULL;
-    char *device;
-    uint64_t t_start = get_cycles();
-    uint64_t t_left;
+    struct psm_ep_connect_req *req;
     union psmi_envvar_val timeout_intval;
+    int j, k, num_toconnect = 0;
+    int dedup_bits, dedup_size, *dedup;
 
-    PSMI_ERR_UNLESS_INITIALIZED(ep);
+    /* Hash set at most half full */
+    for (dedup_bits = 2; (1 << dedup_bits) < 2 * num_of_epid; dedup_bits++)
+	;
+    dedup_size = 1 << dedup_bits;
 
-    PSMI_PLOCK();
+    req = (struct psm_ep_connect_req *) psmi_malloc(ep, UNDEFINED, 
+		sizeof(struct psm_ep_connect_req) +
+		num_of_epid * (sizeof(psm_epid_t) + sizeof(psm_epaddr_t) +
+			       sizeof(psm_error_t) + 4 * sizeof(int)) +
+		dedup_size * sizeof(int));
+    if (req == NULL)
+	return PSM_NO_MEMORY;
+    req->sub_epid   = (psm_epid_t *) (req + 1);
+    req->sub_epaddr = (psm_epaddr_t *) (req->sub_epid + num_of_epid);
+    req->sub_errors = (psm_error_t *) (req->sub_epaddr + num_of_epid);
+    req->sub_mask   = (int *) (req->sub_errors + num_of_epid);
+    req->sub_idx    = req->sub_mask + num_of_epid;
+    req->pending    = req->sub_idx + num_of_epid;
+    req->epid_mask_isdupof = req->pending + num_of_epid;
+    dedup	    = req->epid_mask_isdupof + num_of_epid;
+    memset(dedup, 0, dedup_size * sizeof(int));
 
-    /*
-     * Normally we would lock here, but instead each implemented ptl component
-     * does its own locking.  This is mostly because the ptl components are
-     * ahead of the PSM interface in that they can disconnect their peers.
-     */
-    if (ep == NULL || array_of_epaddr == NULL || array_of_epid == NULL ||
-	num_of_epid < 1) {
-	err = psmi_handle_error(ep, PSM_PARAM_ERR, 
-				 "Invalid psm_ep_connect parameters");
-	goto fail;
-    } 
-    
-    /* We need two of these masks to detect duplicates */
-    err = PSM_NO_MEMORY;
-    epid_mask = (int *) psmi_malloc(ep, UNDEFINED, sizeof(int) * num_of_epid);
-    if (epid_mask == NULL) 
-	goto fail;
-    epid_mask_isdupof = (int *) psmi_malloc(ep, UNDEFINED, sizeof(int) * num_of_epid);
-    if (epid_mask_isdupof == NULL) 
-	goto fail;
-    err = PSM_OK;
+    req->ep = ep;
+    req->num_of_epid = num_of_epid;
+    req->array_of_epid = array_of_epid;
+    req->array_of_epid_mask = array_of_epid_mask;
+    req->array_of_errors = array_of_errors;
+    req->array_of_epaddr = array_of_epaddr;
+    req->batch = batch;
+    req->num_pending = 0;
+    req->dev = 0;
+    req->num_sub = -1;
+    req->next = 0;
+    req->ptl_req = NULL;
 
-    /* Eventually handle timeouts across all connects. */
     for (j = 0; j < num_of_epid; j++) {
+	req->epid_mask_isdupof[j] = -1;
 	if (array_of_epid_mask != NULL && !array_of_epid_mask[j])
-	    epid_mask[j] = 0;
+	    continue;
+	array_of_errors[j] = PSM_EPID_UNKNOWN;
+	array_of_epaddr[j] = NULL;
+	num_toconnect++;
+
+	/* Look for duplicates in input array */
+	k = psmi_connect_epid_hash(array_of_epid[j], dedup_bits);
+	while (dedup[k] && array_of_epid[dedup[k]-1] != array_of_epid[j])
+	    k = (k + 1) & (dedup_size - 1);
+	if (dedup[k]) /* don't connect more than once */
+	    req->epid_mask_isdupof[j] = dedup[k] - 1;
 	else {
-	    epid_mask[j] = 1;
-	    array_of_errors[j] = PSM_EPID_UNKNOWN;
-	    array_of_epaddr[j] = NULL;
-	    num_toconnect++;
+	    dedup[k] = j + 1;
+	    req->pending[req->num_pending++] = j;
 	}
-	epid_mask_isdupof[j] = -1;
     }
 
     psmi_getenv("PSM_CONNECT_TIMEOUT",
@@ -115,76 +207,27 @@ __psm_ep_connect(psm_ep_t ep, int num_of_epid,
     _IPATH_PRDBG("Connect to %d endpoints with time-out of %.2f secs\n",
                  num_toconnect, (double) timeout/ 1e9);
 
-    /* Look for duplicates in input array */
-    for (i = 0; i < num_of_epid; i++) {
-	for (j = i + 1; j < num_of_epid; j++) {
-	    if (array_of_epid[i] == array_of_epid[j] &&
-		epid_mask[i] && epid_mask[j]) {
-		epid_mask[j] = 0; /* don't connect more than once */
-		epid_mask_isdupof[j] = i;
-	    }
-	}
-    }
-
-    for (i = 0; i < PTL_MAX_INIT; i++) {
-	if (ep->devid_enabled[i] == -1)
-	    continue;
-	/* Set up the right connect ptrs */
-	switch (ep->devid_enabled[i]) {
-	    case PTL_DEVID_IPS:
-		ptlctl = &ep->ptl_ips;
-		ptl = ep->ptl_ips.ptl;
-		device = "ips";
-		break;
-	    case PTL_DEVID_AMSH:
-		ptlctl = &ep->ptl_amsh;
-		ptl = ep->ptl_amsh.ptl;
-		device = "amsh";
-		break;
-	    case PTL_DEVID_SELF:
-		ptlctl = &ep->ptl_self;
-		ptl = ep->ptl_self.ptl;
-		device = "self";
-		break;
-	    default:
-		device = "unknown";
-		ptlctl = &ep->ptl_ips; /*no-unused*/
-		ptl = ep->ptl_ips.ptl; /*no-unused*/
-		device = "ips"; /*no-unused*/
-		psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
-			"Unknown/unhandled PTL id %d\n", ep->devid_enabled[i]);
-		break;
-	}
-	t_left = psmi_cycles_left(t_start, timeout);
-
-	_IPATH_VDBG("Trying to connect with device %s\n", device);
-	if ((err = ptlctl->ep_connect(ptl, num_of_epid, array_of_epid, 
-		    epid_mask, array_of_errors, array_of_epaddr, 
-		    cycles_to_nanosecs(t_left)))) 
-	{
-		_IPATH_PRDBG("Connect failure in device %s err=%d\n", 
-			    device, err);
-		goto connect_fail;
-	}
-
-	/* Now process what's been connected */
-	for (j = 0; j < num_of_epid; j++) {
-	    dup_idx = epid_mask_isdupof[j];
-	    if (!epid_mask[j] && dup_idx == -1)
-		continue;
+    req->timeout = timeout;
+    req->t_start = get_cycles();
+    *req_o = req;
+    return PSM_OK;
+}
 
-	    if (dup_idx != -1) { /* dup */
-		array_of_epaddr[j] = array_of_epaddr[dup_idx];
-		array_of_errors[j] = array_of_errors[dup_idx];
-		epid_mask_isdupof[j] = -1;
-	    }
+/* Final checks and error report, the request stays allocated */
+static
+psm_error_t
+psmi_ep_connect_report(struct psm_ep_connect_req *req, psm_error_t err)
+{
+    psm_ep_t ep = req->ep;
+    int num_of_epid = req->num_of_epid;
+    psm_epid_t const *array_of_epid = req->array_of_epid;
+    int const *array_of_epid_mask = req->array_of_epid_mask;
+    psm_error_t *array_of_errors = req->array_of_errors;
+    psm_epaddr_t *array_of_epaddr = req->array_of_epaddr;
+    int i;
 
-	    if (array_of_errors[j] == PSM_OK) {
-		epid_mask[j] = 0; /* don't try on next ptl */
-		ep->connections++;
-	    }
-	}
-    }
+    if (err != PSM_OK)
+	goto connect_fail;
 
     for (i = 0; i < num_of_epid; i++) {
 	ptl_ctl_t *c = NULL;
@@ -278,15 +321,229 @@ connect_fail:
 	err = psmi_handle_error(ep, err, errbuf, "%s");
     }
 
-fail:
-    PSMI_PUNLOCK();
+    return err;
+}
 
-    if (epid_mask != NULL)
-	psmi_free(epid_mask);
-    if (epid_mask_isdupof != NULL)
-	psmi_free(epid_mask_isdupof);
+/*
+ * Moves a connect along, called with the progress lock held.
+ *
+ * Each ptl in turn is handed the still unconnected epids it can reach,
+ * packed into the scratch arrays: self gets our own epid, shm the epids
+ * sharing memory with us and ips everything left over, including whatever
+ * an earlier ptl failed on.  Unless told to block, a ptl with a
+ * non-blocking connect is polled once per call and any other ptl is given
+ * at most req->batch epids per call.  Returns PSM_OK_NO_PROGRESS until the
+ * connect is over, then its outcome.
+ */
+static
+psm_error_t
+psmi_ep_connect_progress(struct psm_ep_connect_req *req, int block)
+{
+    psm_ep_t ep = req->ep;
+    psm_error_t err = PSM_OK, err_fini;
+    ptl_ctl_t *ptlctl;
+    const char *device;
+    int j, k, num, dup_idx;
 
+    while (req->dev < PTL_MAX_INIT && req->num_pending > 0) {
+	if (ep->devid_enabled[req->dev] == -1) {
+	    req->dev++;
+	    continue;
+	}
+	device = psmi_connect_ptl(ep, ep->devid_enabled[req->dev], &ptlctl);
+
+	if (req->num_sub == -1) {
+	    /* Pack the pending epids this device can reach */
+	    req->num_sub = req->next = 0;
+	    for (k = 0; k < req->num_pending; k++) {
+		j = req->pending[k];
+		if (!psmi_connect_epid_reachable(ep, ep->devid_enabled[req->dev],
+						 req->array_of_epid[j])) {
+		    req->array_of_errors[j] = PSM_EPID_UNREACHABLE;
+		    continue;
+		}
+		req->sub_idx[req->num_sub] = j;
+		req->sub_epid[req->num_sub] = req->array_of_epid[j];
+		req->sub_mask[req->num_sub] = 1;
+		req->sub_errors[req->num_sub] = PSM_EPID_UNKNOWN;
+		req->sub_epaddr[req->num_sub] = NULL;
+		req->num_sub++;
+	    }
+	    if (req->num_sub == 0) {
+		req->num_sub = -1;
+		req->dev++;
+		continue;
+	    }
+
+	    _IPATH_VDBG("Trying to connect %d epids with device %s\n",
+			req->num_sub, device);
+	    if (!block && ptlctl->ep_connect_start != NULL) {
+		err = ptlctl->ep_connect_start(ptlctl->ptl, req->num_sub,
+			req->sub_epid, req->sub_mask, req->sub_errors,
+			req->sub_epaddr, &req->ptl_req);
+		req->next = req->num_sub;
+		if (err == PSM_OK_NO_PROGRESS)
+		    err = PSM_OK;
+	    }
+	}
+
+	if (req->ptl_req != NULL) {
+	    psmi_poll_internal(ep, 1);
+	    err = ptlctl->ep_connect_poll(ptlctl->ptl, req->ptl_req);
+	    if (err == PSM_OK_NO_PROGRESS &&
+		psmi_cycles_left(req->t_start, req->timeout))
+		return PSM_OK_NO_PROGRESS;
+	    err_fini = ptlctl->ep_connect_fini(ptlctl->ptl, req->ptl_req);
+	    req->ptl_req = NULL;
+	    if (err == PSM_OK || err == PSM_OK_NO_PROGRESS)
+		err = err_fini;
+	}
+	else if (err == PSM_OK && req->next < req->num_sub) {
+	    num = req->num_sub - req->next;
+	    if (!block)
+		num = min(num, req->batch);
+	    err = ptlctl->ep_connect(ptlctl->ptl, num, 
+		    req->sub_epid + req->next, req->sub_mask + req->next,
+		    req->sub_errors + req->next, req->sub_epaddr + req->next,
+		    cycles_to_nanosecs(psmi_cycles_left(req->t_start,
+							req->timeout)));
+	    req->next += num;
+	    if (err == PSM_OK && req->next < req->num_sub)
+		return PSM_OK_NO_PROGRESS;
+	}
+
+	for (k = 0; k < req->num_sub; k++) {
+	    j = req->sub_idx[k];
+	    req->array_of_errors[j] = req->sub_errors[k];
+	    req->array_of_epaddr[j] = req->sub_epaddr[k];
+	}
+	req->num_sub = -1;
+	req->dev++;
+	if (err) {
+		_IPATH_PRDBG("Connect failure in device %s err=%d\n", 
+			    device, err);
+		return psmi_ep_connect_report(req, err);
+	}
+
+	/* Now process what's been connected */
+	for (j = k = 0; k < req->num_pending; k++) {
+	    if (req->array_of_errors[req->pending[k]] == PSM_OK)
+		ep->connections++;
+	    else /* try on next ptl */
+		req->pending[j++] = req->pending[k];
+	}
+	req->num_pending = j;
+    }
+
+    /* Duplicates share the outcome of their first occurrence, they aren't
+     * connections of their own */
+    for (j = 0; j < req->num_of_epid; j++) {
+	dup_idx = req->epid_mask_isdupof[j];
+	if (dup_idx == -1)
+	    continue;
+	req->array_of_epaddr[j] = req->array_of_epaddr[dup_idx];
+	req->array_of_errors[j] = req->array_of_errors[dup_idx];
+    }
+
+    return psmi_ep_connect_report(req, PSM_OK);
+}
+
+psm_error_t
+__psm_ep_connect(psm_ep_t ep, int num_of_epid,
+	        psm_epid_t const *array_of_epid,
+	        int const *array_of_epid_mask, /* can be NULL */
+	        psm_error_t  *array_of_errors,
+	        psm_epaddr_t *array_of_epaddr,
+	        int64_t timeout)
+{
+    struct psm_ep_connect_req *req;
+    psm_error_t err;
+
+    PSMI_ERR_UNLESS_INITIALIZED(ep);
+
+    PSMI_PLOCK();
+
+    /*
+     * Normally we would lock here, but instead each implemented ptl component
+     * does its own locking.  This is mostly because the ptl components are
+     * ahead of the PSM interface in that they can disconnect their peers.
+     */
+    if (ep == NULL || array_of_epaddr == NULL || array_of_epid == NULL ||
+	num_of_epid < 1) {
+	err = psmi_handle_error(ep, PSM_PARAM_ERR, 
+				 "Invalid psm_ep_connect parameters");
+	goto fail;
+    } 
+
+    err = psmi_ep_connect_init(ep, num_of_epid, array_of_epid,
+			       array_of_epid_mask, array_of_errors,
+			       array_of_epaddr, timeout, num_of_epid, &req);
+    if (err == PSM_OK) {
+	err = psmi_ep_connect_progress(req, 1);
+	psmi_free(req);
+    }
+
+fail:
+    PSMI_PUNLOCK();
     return err;
 }
 PSMI_API_DECL(psm_ep_connect)
 
+psm_error_t
+__psm_ep_connect_start(psm_ep_t ep, int num_of_epid,
+		      psm_epid_t const *array_of_epid,
+		      int const *array_of_epid_mask, /* can be NULL */
+		      psm_error_t  *array_of_errors,
+		      psm_epaddr_t *array_of_epaddr,
+		      int64_t timeout, psm_ep_connect_req_t *req_o)
+{
+    union psmi_envvar_val env_batch;
+    psm_error_t err;
+
+    PSMI_ERR_UNLESS_INITIALIZED(ep);
+
+    if (ep == NULL || array_of_epaddr == NULL || array_of_epid == NULL ||
+	num_of_epid < 1 || req_o == NULL)
+	return psmi_handle_error(ep, PSM_PARAM_ERR, 
+				 "Invalid psm_ep_connect_start parameters");
+
+    psmi_getenv("PSM_CONNECT_BATCH",
+		"Endpoints a blocking device connects per psm_ep_connect_test",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 1024,
+		&env_batch);
+
+    PSMI_PLOCK();
+    err = psmi_ep_connect_init(ep, num_of_epid, array_of_epid,
+			       array_of_epid_mask, array_of_errors,
+			       array_of_epaddr, timeout,
+			       max(env_batch.e_uint, 1), req_o);
+    PSMI_PUNLOCK();
+    if (err != PSM_OK)
+	return psmi_handle_error(ep, err, "Couldn't allocate connect request");
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_ep_connect_start)
+
+psm_error_t
+__psm_ep_connect_test(psm_ep_connect_req_t *ireq)
+{
+    struct psm_ep_connect_req *req = *ireq;
+    psm_error_t err;
+
+    PSMI_ERR_UNLESS_INITIALIZED(NULL);
+
+    if (req == NULL)
+	return PSM_OK;
+
+    PSMI_PLOCK();
+    err = psmi_ep_connect_progress(req, 0);
+    PSMI_PUNLOCK();
+    if (err == PSM_OK_NO_PROGRESS)
+	return err;
+
+    psmi_free(req);
+    *ireq = NULL;
+    return err;
+}
+PSMI_API_DECL(psm_ep_connect_test)
@@ -81,6 +81,18 @@ struct mpool {
 
 static int	psmi_mpool_allocate_chunk(mpool_t);
 
+/* Chunks are stored as returned by the allocator so they can be freed as-is;
+ * aligned pools over-allocate each chunk and start their first element on
+ * the next PSMI_MPOOL_ALIGNMENT boundary. */
+PSMI_ALWAYS_INLINE(
+uintptr_t psmi_mpool_chunk_base(mpool_t mp, void *chunk))
+{
+    if (mp->mp_flags & PSMI_MPOOL_ALIGN)
+	return PSMI_ALIGNUP(chunk, PSMI_MPOOL_ALIGNMENT);
+    else
+	return (uintptr_t) chunk;
+}
+
 /**
  * psmi_mpool_create()
  *
@@ -329,7 +341,8 @@ psmi_mpool_find_obj_by_index(mpool_t mp, int index)
 	return NULL;
 
     me = (struct mpool_element *)
-	  ((uintptr_t) mp->mp_elm_vector[index >> mp->mp_vector_shift] +
+	  (psmi_mpool_chunk_base(mp, 
+			mp->mp_elm_vector[index >> mp->mp_vector_shift]) +
 	  (index & (mp->mp_num_obj_per_chunk - 1)) * mp->mp_elm_size + 
 	  mp->mp_elm_offset);
 
@@ -404,7 +417,9 @@ psmi_mpool_allocate_chunk(mpool_t mp)
 	return PSM_NO_MEMORY;
 
     chunk = psmi_malloc(PSMI_EP_NONE, mp->mp_memtype, 
-			num_to_allocate * mp->mp_elm_size);
+			num_to_allocate * mp->mp_elm_size +
+			(mp->mp_flags & PSMI_MPOOL_ALIGN ? 
+			 PSMI_MPOOL_ALIGNMENT - 1 : 0));
     if (chunk == NULL) {
 	fprintf(stderr,
 	    "Failed to allocate memory for memory pool chunk: %s\n",
@@ -413,7 +428,7 @@ psmi_mpool_allocate_chunk(mpool_t mp)
     }
 
     for (i = 0; i < num_to_allocate; i++) {
-	elm = (struct mpool_element *)((uintptr_t)chunk +
+	elm = (struct mpool_element *)(psmi_mpool_chunk_base(mp, chunk) +
 	    i * mp->mp_elm_size + mp->mp_elm_offset);
 	elm->me_gen_count = 0;
 	elm->me_index = mp->mp_num_obj + i;
@@ -173,8 +173,21 @@ __psm_mq_iprobe(psm_mq_t mq, uint64_t tag, uint64_t tagsel, psm_mq_status_t *sta
 
     PSMI_ASSERT_INITIALIZED();
 
+    /* In thread-multiple mode, look before queueing up behind a poller */
+    if (mq->lock != NULL) {
+	PSMI_MQ_LOCK(mq);
+	req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 0);
+	if (req != NULL && status != NULL)
+	    mq_status_copy(req, status);
+	PSMI_MQ_UNLOCK(mq);
+	if (req != NULL)
+	    return PSM_OK;
+    }
+
     PSMI_PLOCK();
+    PSMI_MQ_LOCK(mq);
     req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 0);
+    PSMI_MQ_UNLOCK(mq);
 
     if (req != NULL) {
 	PSMI_PUNLOCK();
@@ -185,7 +198,9 @@ __psm_mq_iprobe(psm_mq_t mq, uint64_t tag, uint64_t tagsel, psm_mq_status_t *sta
 
     psmi_poll_internal(mq->ep, 1);
     /* try again */
+    PSMI_MQ_LOCK(mq);
     req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 0);
+    PSMI_MQ_UNLOCK(mq);
 
     if (req != NULL) {
 	PSMI_PUNLOCK();
@@ -241,6 +256,44 @@ __psm_mq_cancel(psm_mq_req_t *ireq)
 }
 PSMI_API_DECL(psm_mq_cancel)
 
+/* 
+ * Thread-multiple wait, entered and left with the progress lock held.
+ *
+ * Rather than each waiter holding the lock across its whole wait and the
+ * others queueing up behind it, waiters drop the lock after every progress
+ * pass.  Whichever thread wins the next trylock runs the next pass, the
+ * others only watch their own request, and sends from other threads get
+ * the lock in between passes.
+ */
+static
+psm_error_t
+psmi_mq_wait_elected(psm_ep_t ep, psm_mq_req_t req)
+{
+    volatile uint32_t *state = &req->state;
+    psm_error_t err = PSM_OK;
+    int spin_cnt = 0;
+
+    PSMI_PLOCK_ASSERT();
+    while (*state != MQ_STATE_COMPLETE) {
+	err = psmi_poll_internal(ep, 1);
+	if (err > PSM_OK_NO_PROGRESS)
+	    break;
+	PSMI_PUNLOCK();
+	while (PSMI_PLOCK_TRY()) {
+	    /* Another thread is polling, maybe on our behalf */
+	    if (*state == MQ_STATE_COMPLETE) {
+		PSMI_PLOCK();
+		break;
+	    }
+	    if (++spin_cnt == ep->yield_spin_cnt) {
+		spin_cnt = 0;
+		sched_yield();
+	    }
+	}
+    }
+    return err;
+}
+
 /* This is the only PSM function that blocks.
  * We handle it in a special manner since we don't know what the user's
  * execution environment is (threads, oversubscribing processes, etc).
@@ -257,6 +310,22 @@ psmi_mq_wait_inner(psm_mq_req_t *ireq, psm_mq_status_t *status, int do_lock))
 	return PSM_OK;
     }
 
+    /* Thread-multiple, already queued as complete: only the MQ lock */
+    if (do_lock && req->mq->lock != NULL && req->state == MQ_STATE_COMPLETE) {
+	psm_mq_t mq = req->mq;
+	PSMI_MQ_LOCK(mq);
+	if (req->pprev != NULL) {
+	    mq_qq_remove(&mq->completed_q, req);
+	    PSMI_MQ_UNLOCK(mq);
+	    if (status != NULL)
+		mq_status_copy(req, status);
+	    psmi_mq_req_free(req);
+	    *ireq = PSM_MQ_REQINVALID;
+	    return PSM_OK;
+	}
+	PSMI_MQ_UNLOCK(mq);
+    }
+
     if (do_lock)
 	PSMI_PLOCK();
 
@@ -276,7 +345,10 @@ psmi_mq_wait_inner(psm_mq_req_t *ireq, psm_mq_status_t *status, int do_lock))
 	    return err;
 	}
 
-	PSMI_BLOCKUNTIL(mq->ep, err, req->state == MQ_STATE_COMPLETE);
+	if (do_lock && mq->ep->thread_multiple)
+	    err = psmi_mq_wait_elected(mq->ep, req);
+	else
+	    PSMI_BLOCKUNTIL(mq->ep, err, req->state == MQ_STATE_COMPLETE);
 
 	if (err > PSM_OK_NO_PROGRESS)
 	    goto fail_with_lock;
@@ -284,7 +356,9 @@ psmi_mq_wait_inner(psm_mq_req_t *ireq, psm_mq_status_t *status, int do_lock))
 	    err = PSM_OK;
     }
 
+    PSMI_MQ_LOCK(req->mq);
     mq_qq_remove(&req->mq->completed_q, req);
+    PSMI_MQ_UNLOCK(req->mq);
 
     if (status != NULL)
 	mq_status_copy(req, status);
@@ -318,6 +392,7 @@ psm_error_t __sendpath
 __psm_mq_test(psm_mq_req_t *ireq, psm_mq_status_t *status)
 {
     psm_mq_req_t req = *ireq;
+    psm_mq_t mq;
     psm_error_t err = PSM_OK;
 
     PSMI_ASSERT_INITIALIZED();
@@ -337,13 +412,28 @@ __psm_mq_test(psm_mq_req_t *ireq, psm_mq_status_t *status)
 	    return PSM_MQ_NO_COMPLETIONS;
     }
 
+    mq = req->mq;
+    if (mq->lock != NULL) {
+	/* Thread-multiple, the completed queue has its own lock.  The poller
+	 * marks a request complete just before queueing it, leave it to the
+	 * next test if we got in between. */
+	PSMI_MQ_LOCK(mq);
+	if (req->pprev == NULL) {
+	    PSMI_MQ_UNLOCK(mq);
+	    return PSM_MQ_NO_COMPLETIONS;
+	}
+	mq_qq_remove(&mq->completed_q, req);
+	PSMI_MQ_UNLOCK(mq);
+    }
+    else {
+	PSMI_PLOCK();
+	mq_qq_remove(&mq->completed_q, req);
+	PSMI_PUNLOCK();
+    }
+
     if (status != NULL)
 	mq_status_copy(req, status);
-
-    PSMI_PLOCK();
-    mq_qq_remove(&req->mq->completed_q, req);
     psmi_mq_req_free(req);
-    PSMI_PUNLOCK();
 
     *ireq = PSM_MQ_REQINVALID;
     _IPATH_VDBG("req=%p complete, tag=%llx buf=%p, len=%d, err=%d\n", 
@@ -408,7 +498,9 @@ __psm_mq_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags,
     PSMI_PLOCK();
 
     /* First check unexpected Queue and remove req if found */
+    PSMI_MQ_LOCK(mq);
     req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 1);
+    PSMI_MQ_UNLOCK(mq);
 
     if (req == NULL) 
     {
@@ -439,6 +531,7 @@ __psm_mq_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags,
     else {
 	uint32_t copysz;
 	req->context = context;
+	mq_egrcredit_release_req(req);
 
 	psmi_assert(MQE_TYPE_IS_RECV(req->type));
 	_IPATH_VDBG("unexpected buf=%p,len=%d,tag=%"PRIx64 
@@ -449,7 +542,7 @@ __psm_mq_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags,
 	    if (req->buf != NULL) { /* 0-byte messages don't alloc a sysbuf */
 		copysz = mq_set_msglen(req, len, req->send_msglen);
 		psmi_mq_mtucpy(buf, (const void *) req->buf, copysz);
-		psmi_mq_sysbuf_free(mq, req->buf);
+		mq_unexp_buf_free(mq, req);
 	    }
 	    req->buf = buf;
 	    req->buf_len = len;
@@ -505,7 +598,13 @@ __psm_mq_ipeek(psm_mq_t mq, psm_mq_req_t *oreq, psm_mq_status_t *status)
     PSMI_ASSERT_INITIALIZED();
 
     if ((req = mq->completed_q.first) == NULL) {
-	PSMI_PLOCK();
+	/* In thread-multiple mode, don't queue up behind a poller */
+	if (mq->ep->thread_multiple) {
+	    if (PSMI_PLOCK_TRY())
+		return PSM_MQ_NO_COMPLETIONS;
+	}
+	else
+	    PSMI_PLOCK();
 	psmi_poll_internal(mq->ep, 1);
 	if ((req = mq->completed_q.first) == NULL) {
 	    PSMI_PUNLOCK();
@@ -552,6 +651,22 @@ psmi_mqopt_ctl(psm_mq_t mq, uint32_t key, void *value, int get)
 			mq->shm_thresh_rv, get ? "GET" : "SET");
 	    break;
 
+	case PSM_MQ_EAGER_CREDITS:
+	    if (get)
+		*((uint32_t *)value) = mq->egrcredit_window;
+	    else {
+		/* Granted per connection, so it's the same for all MQs */
+		int i;
+		val32 = *((uint32_t *) value);
+		mq->egrcredit_window = val32;
+		for (i = 0; i < PSMI_MQ_MAX; i++)
+		    if (mq->ep->mqs[i] != NULL)
+			mq->ep->mqs[i]->egrcredit_window = val32;
+	    }
+	    _IPATH_VDBG("EAGER_CREDITS = %d (%s)\n",
+			mq->egrcredit_window, get ? "GET" : "SET");
+	    break;
+
 	case PSM_MQ_MAX_SYSBUF_MBYTES:
 	    if (get)
 		*((uint32_t *)value) = (uint32_t)(mq->max_sysbuf_bytes / 1048576);
@@ -604,6 +719,10 @@ __psm_mq_init(psm_ep_t ep, uint64_t tag_order_mask,
     psmi_assert(mq != NULL);
     psmi_assert(mq->ep != NULL);
 
+    PSMI_PLOCK();
+    if (ep->mqs[0] == NULL)
+	ep->mqs[0] = mq;
+
     /* Process options */
     for (i = 0; err == PSM_OK && i < numopts; i++) 
 	err = psmi_mqopt_ctl(mq, opts[i].key, opts[i].value, 0);
@@ -613,17 +732,100 @@ __psm_mq_init(psm_ep_t ep, uint64_t tag_order_mask,
     *mqo = mq;
 
 fail:
+    PSMI_PUNLOCK();
     return err;
 }
 PSMI_API_DECL(psm_mq_init)
 
+/*
+ * Each call opens another MQ with its own tag space.  Progress parks peers'
+ * envelopes on MQs we haven't opened, so take the lowest id that is free or
+ * parked and keep what was already received on it.
+ */
+psm_error_t
+__psm_mq_open(psm_ep_t ep, uint64_t tag_order_mask, 
+	    const struct psm_optkey *opts, 
+	    int numopts, psm_mq_t *mqo)
+{
+    psm_error_t err = PSM_OK;
+    psm_mq_t mq;
+    uint32_t id;
+    int i;
+
+    PSMI_ERR_UNLESS_INITIALIZED(ep);
+
+    psmi_assert(ep->mq != NULL);
+
+    PSMI_PLOCK();
+    for (id = 1; id < PSMI_MQ_MAX; id++)
+	if (ep->mqs[id] == NULL || ep->mqs[id]->parked)
+	    break;
+    if (id == PSMI_MQ_MAX) {
+	err = psmi_handle_error(ep, PSM_EP_NO_RESOURCES,
+		"Endpoint already has %d matched queues", PSMI_MQ_MAX);
+	goto fail;
+    }
+    if (ep->mqs[id] != NULL) {
+	mq = ep->mqs[id];
+	mq->parked = 0;
+    }
+    else if ((err = psmi_mq_malloc_secondary(ep, id, &mq)))
+	goto fail;
+
+    /* Process options */
+    for (i = 0; err == PSM_OK && i < numopts; i++) 
+	err = psmi_mqopt_ctl(mq, opts[i].key, opts[i].value, 0);
+    if (err != PSM_OK) { /* error already handled */
+	if (mq->unexpected_q.first != NULL)
+	    mq->parked = 1;
+	else {
+	    ep->mqs[mq->id] = NULL;
+	    psmi_mq_free(mq);
+	}
+	goto fail;
+    }
+    
+    *mqo = mq;
+
+fail:
+    PSMI_PUNLOCK();
+    return err;
+}
+PSMI_API_DECL(psm_mq_open)
+
 psm_error_t
 __psm_mq_finalize(psm_mq_t mq)
 {
     psm_ep_t	ep;
+    int		i;
     PSMI_ERR_UNLESS_INITIALIZED(mq->ep);
 
     ep = mq->ep;
+    if (mq->id != 0) {
+	/* Requests, unexpected messages and rendezvous in flight all still
+	 * point at this MQ */
+	PSMI_PLOCK();
+	if (mq->nreqs != 0) {
+	    psm_error_t err = psmi_handle_error(ep, PSM_PARAM_ERR,
+		"Matched queue %u still has %u requests outstanding",
+		mq->id, mq->nreqs);
+	    PSMI_PUNLOCK();
+	    return err;
+	}
+	ep->mqs[mq->id] = NULL;
+	PSMI_PUNLOCK();
+	return psmi_mq_free(mq);
+    }
+
+    /* The other MQs take their requests from this one's pools */
+    for (i = 1; i < PSMI_MQ_MAX; i++) {
+	if (ep->mqs[i] != NULL) {
+	    psmi_mq_free(ep->mqs[i]);
+	    ep->mqs[i] = NULL;
+	}
+    }
+    ep->mqs[0] = NULL;
+
     do {
 	ep->mq = NULL;
 	ep = ep->mctxt_next;
@@ -689,10 +891,72 @@ fail:
     return err;
 }
 
+/*
+ * MQs after the first have their own queues, stats and thresholds (starting
+ * out as the first MQ's) but take requests from the first MQ's pools since
+ * the ptls find rendezvous requests by pool index, not knowing their MQ.
+ */
+psm_error_t
+psmi_mq_malloc_secondary(psm_ep_t ep, uint32_t id, psm_mq_t *mqo)
+{
+    psm_mq_t mq0 = ep->mq;
+    psm_mq_t mq;
+
+    psmi_assert(id > 0 && id < PSMI_MQ_MAX && ep->mqs[id] == NULL);
+
+    mq = (psm_mq_t) psmi_calloc(ep, UNDEFINED, 1, sizeof(struct psm_mq));
+    if (mq == NULL)
+	return psmi_handle_error(ep, PSM_NO_MEMORY,
+		"Couldn't allocate memory for mq endpoint");
+
+    mq->ep = ep;
+    mq->id = id;
+    mq->memmode = mq0->memmode;
+    mq->expected_q.first = NULL;
+    mq->expected_q.lastp = &mq->expected_q.first;
+    mq->unexpected_q.first = NULL;
+    mq->unexpected_q.lastp = &mq->unexpected_q.first;
+    mq->completed_q.first = NULL;
+    mq->completed_q.lastp = &mq->completed_q.first;
+
+    mq->cur_sysbuf_bytes = 0ULL;
+    mq->max_sysbuf_bytes = mq0->max_sysbuf_bytes;
+    mq->ipath_thresh_rv = mq0->ipath_thresh_rv;
+    mq->ipath_window_rv = mq0->ipath_window_rv;
+    mq->shm_thresh_rv = mq0->shm_thresh_rv;
+    /* Eager credits are granted per connection, not per MQ */
+    mq->egrcredit_window = mq0->egrcredit_window;
+
+    mq->sreq_pool = mq0->sreq_pool;
+    mq->rreq_pool = mq0->rreq_pool;
+    mq->lock = mq0->lock;
+    psmi_mq_sysbuf_init(mq);
+
+    ep->mqs[id] = mq;
+    *mqo = mq;
+    return PSM_OK;
+}
+
+/*
+ * A peer sent on an MQ we haven't opened yet.  Open it on its behalf so its
+ * envelopes queue up as unexpected messages, psm_mq_open hands it out later.
+ */
+psm_mq_t
+psmi_mq_park(psm_ep_t ep, uint32_t id)
+{
+    psm_mq_t mq;
+
+    if (psmi_mq_malloc_secondary(ep, id, &mq) != PSM_OK)
+	psmi_handle_error(PSMI_EP_NORETURN, PSM_NO_MEMORY,
+	    "Couldn't park messages for matched queue %u", id);
+    mq->parked = 1;
+    return mq;
+}
+
 psm_error_t
 psmi_mq_initialize_defaults(psm_mq_t mq)
 {
-    union psmi_envvar_val env_rvwin, env_ipathrv, env_shmrv;
+    union psmi_envvar_val env_rvwin, env_ipathrv, env_shmrv, env_egrcredit;
 
     psmi_getenv("PSM_MQ_RNDV_IPATH_THRESH", 
 		"ipath eager-to-rendezvous switchover",
@@ -715,6 +979,12 @@ psmi_mq_initialize_defaults(psm_mq_t mq)
 		(union psmi_envvar_val) mq->ipath_window_rv, &env_rvwin);
     mq->ipath_window_rv = env_rvwin.e_uint;
 
+    psmi_getenv("PSM_MQ_EAGER_CREDITS",
+		"eager bytes each peer may leave unexpected (0 unlimited)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) mq->egrcredit_window, &env_egrcredit);
+    mq->egrcredit_window = env_egrcredit.e_uint;
+
     return PSM_OK;
 }
     
@@ -722,7 +992,15 @@ psmi_mq_initialize_defaults(psm_mq_t mq)
 psm_error_t
 psmi_mq_free(psm_mq_t mq)
 {
-    psmi_mq_req_fini(mq);
+    psm_mq_req_t req;
+
+    /* Give lent receive buffers back before the requests go away */
+    for (req = mq->unexpected_q.first; req != NULL; req = req->next)
+	if (req->type & MQE_TYPE_EGRLENT)
+	    mq_unexp_buf_free(mq, req);
+
+    if (mq->id == 0) /* owns the request pools */
+	psmi_mq_req_fini(mq);
     psmi_mq_sysbuf_fini(mq);
     psmi_free(mq);
     return PSM_OK;
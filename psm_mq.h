@@ -65,7 +65,8 @@ extern "C" {
  *
  * @remark This function can be called many times to retrieve the MQ handle
  *         associated to an endpoint, but options are only considered the first
- *         time the function is called.
+ *         time the function is called.  Use psm_mq_open for further Matched
+ *         Queues with their own tag space.
  *
  * [post] The user obtains a handle to an instantiated Match Queue.  
  *
@@ -107,6 +108,32 @@ psm_error_t
 psm_mq_init(psm_ep_t ep, uint64_t tag_order_mask, 
 	    const struct psm_optkey *opts, int numopts, psm_mq_t *mq);
 
+#if PSM_VERNO >= 0x0111
+/* Open another Matched Queue on an endpoint
+ *
+ * Function to open a Matched Queue besides the one psm_mq_init returns, with
+ * its own tag space, queues, statistics and options.  The arguments are the
+ * same as for psm_mq_init.
+ *
+ * @remark Up to 63 Matched Queues can be opened per endpoint.  A message is
+ *         matched on the peer's Matched Queue opened in the same position,
+ *         so all endpoints must open their Matched Queues in the same order
+ *         before communicating over them.  Messages that arrive for a
+ *         Matched Queue before it is opened are kept as unexpected messages.
+ *         Finalizing the endpoint's first Matched Queue finalizes the others.
+ *
+ * The following error code is returned.  Other errors are handled by the PSM
+ * error handler (psm_error_register_handler).
+ *
+ * [retval] PSM_OK A new Matched Queue has been opened.
+ * [retval] PSM_EP_NO_RESOURCES The endpoint already has all the Matched
+ *         Queues it can have.
+ */
+psm_error_t
+psm_mq_open(psm_ep_t ep, uint64_t tag_order_mask, 
+	    const struct psm_optkey *opts, int numopts, psm_mq_t *mq);
+#endif
+
 #define PSM_MQ_ORDERMASK_NONE	0ULL
 	/* Used to initialize MQ and disable all MQ message ordering
 	 * guarantees (this mask may prevent the use of MQ to maintain matched
@@ -123,6 +150,8 @@ psm_mq_init(psm_ep_t ep, uint64_t tag_order_mask,
  *
  * [retval] PSM_OK A given Matched Queue has been freed and use of the future
  * use of the handle produces undefined results.
+ * [retval] PSM_PARAM_ERR The MQ is not the endpoint's first one and still has
+ * requests or unexpected messages that haven't been completed and received.
  */
 psm_error_t
 psm_mq_finalize(psm_mq_t mq);
@@ -68,6 +68,9 @@ typedef psm_error_t (*psm_mq_unexpected_callback_fn_t)
 		    
 struct psm_mq {
     psm_ep_t	  ep;		/**> ep back pointer */
+    uint32_t	  id;		/**> index in ep->mqs, sent with envelopes */
+    int		  parked;	/**> created by psmi_mq_demux, not opened yet */
+    uint32_t	  nreqs;	/**> requests allocated on this MQ, not freed */
     mpool_t	  sreq_pool;
     mpool_t	  rreq_pool;
 
@@ -76,11 +79,22 @@ struct psm_mq {
     struct mqsq   unexpected_q;	/**> Unexpected queue */
     struct mqq    completed_q;	/**> Completed queue */
 
+    /* Thread-multiple mode only, NULL otherwise, see PSMI_MQ_LOCK.  Secondary
+     * MQs use the first MQ's lock, they share its request pools. */
+    psmi_spinlock_t *lock;
+    psmi_spinlock_t  lock_store;
+
     uint64_t	  cur_sysbuf_bytes;
     uint64_t	  max_sysbuf_bytes;
     uint32_t	  ipath_thresh_rv;
     uint32_t	  shm_thresh_rv;
     uint32_t	  ipath_window_rv;
+    uint32_t	  egrcredit_window; /* eager bytes granted to each peer */
+
+    /* Unexpected short payloads a ptl can leave in its own receive buffers
+     * instead of a sysbuf.  The ptl sets egrlent only while it dispatches a
+     * payload it is able to lend. */
+    struct psmi_mq_lender *egrlent;
     int		  memmode;
 
     psm_mq_stats_t	stats;	/**> MQ stats, accumulated by each PTL */
@@ -103,6 +117,8 @@ struct psm_mq {
 #define MQE_TYPE_WAITING	0x0001
 #define MQE_TYPE_WAITING_PEER	0x0004
 #define MQE_TYPE_EGRLONG	0x0008
+#define MQE_TYPE_EGRCREDIT	0x0010	/* gives eager credits back when consumed */
+#define MQE_TYPE_EGRLENT	0x0020	/* buf is lent by the ptl, not a sysbuf */
 
 #define MQ_STATE_COMPLETE	0
 #define MQ_STATE_POSTED		1
@@ -117,6 +133,7 @@ struct psm_mq {
 #define MQ_MSG_RTS		4
 #define MQ_MSG_RTS_EGR		5
 #define MQ_MSG_RTS_WAIT		6
+#define MQ_MSG_PACKED		8	/* several coalesced tiny/short envelopes */
 #define MQ_MSG_DATA		9
 #define MQ_MSG_DATA_BLK		10
 #define MQ_MSG_DATA_REQ		11
@@ -125,6 +142,22 @@ struct psm_mq {
 
 #define MQ_MSG_USER_FIRST 64
 
+/*
+ * Eager credits.
+ *
+ * A receiver grants each peer egrcredit_window bytes at connect time and
+ * remembers the grant in the peer's egrcredit_granted, changing the option
+ * later only affects peers added after the change.  The
+ * sender charges every eager message against it and switches to rendezvous
+ * when it runs out, the receiver gives the charge back once the message no
+ * longer holds a system buffer (i.e. it was matched) and the ptl carries the
+ * running total back to the sender.  Both sides must charge the same amount
+ * for a message.
+ */
+#define MQ_EGRCREDIT_MSG_BYTES	64
+
+#define mq_egrcredit_cost(len)	((uint32_t)(len) + MQ_EGRCREDIT_MSG_BYTES)
+
 /*
  * Descriptor allocation limits.
  * The 'LIMITS' predefines fill in a psmi_rlimits_mpool structure
@@ -155,35 +188,45 @@ typedef psm_error_t (*mq_rts_callback_fn_t)(psm_mq_req_t req, int was_posted);
 typedef psm_error_t (*mq_testwait_callback_fn_t)(psm_mq_req_t *req, int istest,
 						 psm_mq_status_t *status);
 
-/* receive mq_req, the default */
+/* receive mq_req, the default
+ *
+ * Everything the matching loops and the ooo queue walk over is kept in the
+ * first cache line (requests are allocated PSMI_MPOOL_ALIGN'd).  Anything
+ * that is only needed once a request has matched, or only for rendezvous,
+ * goes after it.  Per-protocol rendezvous state that isn't needed for
+ * eager messages is allocated by the PTL and hung off ptl_req_ptr.
+ */
 struct psm_mq_req {
     struct {
 	psm_mq_req_t    next;
 	psm_mq_req_t    *pprev; /* used in completion queue */
     };
-    uint32_t	    state;
-    uint32_t	    type;
-    psm_mq_t	    mq;
 
     /* Tag matching vars */
     uint64_t	tag;
     uint64_t    tagsel;	    /* used for receives */
 
-    /* Some PTLs want to get notified when there's a test/wait event */
-    mq_testwait_callback_fn_t	testwait_callback;
+    uint32_t	    state;
+    uint32_t	    type;
+    psm_mq_t	    mq;
 
     /* Buffer attached to request.  May be a system buffer for unexpected
      * messages or a user buffer when an expected message */
     uint8_t *buf;
     uint32_t buf_len;
+    uint16_t msg_seqnum;	/* msg seq num for mctxt */
+
+    /* -- end of matching cache line -- */
+
     uint32_t error_code;
 
-    /* Used only for eager LONGs */
-    STAILQ_ENTRY(psm_mq_req)    nextq; /* used for egr-long only */
-    psmi_egrid_t egrid;
+    /* Some PTLs want to get notified when there's a test/wait event */
+    mq_testwait_callback_fn_t	testwait_callback;
+
+    /* Used for eager LONGs and for receives holding a lent ptl buffer */
+    STAILQ_ENTRY(psm_mq_req)    nextq; /* egr-long queue or lender's list */
+    psmi_egrid_t egrid;		       /* egr-long id or lent buffer slot */
     psm_epaddr_t epaddr;
-    uint16_t msg_seqnum;	/* msg seq num for mctxt */
-    uint8_t tid_grant[128];	/* don't change the size unless... */
 
     uint32_t recv_msglen; /* Message length we are ready to receive */
     uint32_t send_msglen; /* Message length from sender */
@@ -283,23 +326,43 @@ uint32_t mq_set_msglen(psm_mq_req_t req, uint32_t recvlen, uint32_t sendlen))
     }
 }
 
+/*
+ * In thread-multiple mode the completed and unexpected queues and the request
+ * pools also have a lock of their own, so that psm_mq_test and psm_mq_iprobe
+ * don't wait for the thread driving progress.  Everything else still runs
+ * under the progress lock: matching a receive drives ptl state (CTS, eager
+ * data, expected tids) that the receive path owns.  Always taken after the
+ * progress lock, never the other way around.
+ */
+#define PSMI_MQ_LOCK(mq)	do {				\
+	if_pf ((mq)->lock != NULL) psmi_spin_lock((mq)->lock);	\
+    } while (0)
+#define PSMI_MQ_UNLOCK(mq)	do {				\
+	if_pf ((mq)->lock != NULL) psmi_spin_unlock((mq)->lock);	\
+    } while (0)
+
+/* Takes the MQ lock, requests are marked complete before they're queued */
 #ifndef PSM_DEBUG
 
 PSMI_ALWAYS_INLINE(
 void
 mq_qq_append(struct mqq *q, psm_mq_req_t req))
 {
+    PSMI_MQ_LOCK(req->mq);
     req->next = NULL;
     req->pprev = q->lastp;
     *(q->lastp) = req;
     q->lastp = &req->next;
+    PSMI_MQ_UNLOCK(req->mq);
 }
 #else
 #define mq_qq_append(q,req) do { \
+    PSMI_MQ_LOCK((req)->mq);\
     (req)->next = NULL;\
     (req)->pprev = (q)->lastp;\
     *((q)->lastp) = (req); \
     (q)->lastp = &(req)->next; \
+    PSMI_MQ_UNLOCK((req)->mq);\
     if (q == &(req)->mq->completed_q) \
 	_IPATH_VDBG("Moving (req)=%p to completed queue on %s, %d\n", (req), __FILE__, __LINE__); \
 } while (0)
@@ -314,6 +377,7 @@ mq_sq_append(struct mqsq *q, psm_mq_req_t req))
     q->lastp = &req->next;
 }
 
+/* Called with the MQ lock held */
 PSMI_ALWAYS_INLINE(
 void
 mq_qq_remove(struct mqq *q, psm_mq_req_t req))
@@ -328,7 +392,17 @@ mq_qq_remove(struct mqq *q, psm_mq_req_t req))
 psm_error_t  psmi_mq_req_init(psm_mq_t mq);
 psm_error_t  psmi_mq_req_fini(psm_mq_t mq);
 psm_mq_req_t psmi_mq_req_alloc(psm_mq_t mq, uint32_t type);
-#define      psmi_mq_req_free(req)  psmi_mpool_put(req)
+
+PSMI_ALWAYS_INLINE(
+void
+psmi_mq_req_free(psm_mq_req_t req))
+{
+    psm_mq_t mq = req->mq;
+    PSMI_MQ_LOCK(mq);
+    psmi_mpool_put(req);
+    mq->nreqs--;
+    PSMI_MQ_UNLOCK(mq);
+}
 
 /*
  * MQ unexpected buffer management
@@ -343,6 +417,8 @@ void	  psmi_mq_sysbuf_getinfo(psm_mq_t mq, char *buf, size_t len);
  * Main receive progress engine, for shmops and ipath, in mq.c
  */
 psm_error_t psmi_mq_malloc(psm_mq_t *mqo);
+psm_error_t psmi_mq_malloc_secondary(psm_ep_t ep, uint32_t id, psm_mq_t *mqo);
+psm_mq_t    psmi_mq_park(psm_ep_t ep, uint32_t id);
 psm_error_t psmi_mq_initialize_defaults(psm_mq_t mq);
 psm_error_t psmi_mq_free(psm_mq_t mq);
 
@@ -418,6 +494,116 @@ mq_ooo_match(struct mqsq *q, uint16_t msg_seqnum)
     return NULL; /* no match */
 }
 
+/*
+ * Pick the MQ an incoming envelope is for.  The ptls receive on the
+ * endpoint's first MQ, envelopes name the MQ they were sent on by id and
+ * the peer is expected to have opened its MQs in the same order.  An
+ * envelope for an MQ we haven't opened yet is parked on that MQ's unexpected
+ * queue until psm_mq_open hands it out.
+ */
+PSMI_ALWAYS_INLINE(
+psm_mq_t
+psmi_mq_demux(psm_mq_t mq, uint32_t mqid))
+{
+    if_pt (mqid == 0)
+	return mq;
+    if_pf (mqid >= PSMI_MQ_MAX)
+	psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
+	    "Message for matched queue %u, past the last of %d", 
+	    mqid, PSMI_MQ_MAX);
+    if_pf (mq->ep->mqs[mqid] == NULL)
+	return psmi_mq_park(mq->ep, mqid);
+    return mq->ep->mqs[mqid];
+}
+
+/* Sender: charge an eager message to the peer, 0 if it must go rendezvous */
+PSMI_ALWAYS_INLINE(
+int
+mq_egrcredit_take(psm_epaddr_t epaddr, uint32_t len))
+{
+    psm_epaddr_t mepaddr = epaddr->mctxt_master;
+    uint32_t cost = mq_egrcredit_cost(len);
+
+    if_pt (mepaddr->egrcredit_window == 0)
+	return 1;
+    if ((mepaddr->egrcredit_sent - mepaddr->egrcredit_acked) + cost >
+	mepaddr->egrcredit_window)
+	return 0;
+    mepaddr->egrcredit_sent += cost;
+    return 1;
+}
+
+/* Sender: peer reports the running total of bytes it has given back */
+PSMI_ALWAYS_INLINE(
+void
+mq_egrcredit_update(psm_epaddr_t epaddr, uint32_t freed))
+{
+    psm_epaddr_t mepaddr = epaddr->mctxt_master;
+
+    /* Counters wrap, and acks can arrive out of order across rails */
+    if ((int32_t)(freed - mepaddr->egrcredit_acked) > 0 &&
+	(int32_t)(mepaddr->egrcredit_sent - freed) >= 0)
+	mepaddr->egrcredit_acked = freed;
+}
+
+/* Receiver: an eager message was matched on arrival */
+PSMI_ALWAYS_INLINE(
+void
+mq_egrcredit_release(psm_epaddr_t epaddr, uint32_t len))
+{
+    if (epaddr->mctxt_master->egrcredit_granted)
+	epaddr->mctxt_master->egrcredit_freed += mq_egrcredit_cost(len);
+}
+
+/* Receiver: an eager message is parked in a system buffer */
+PSMI_ALWAYS_INLINE(
+void
+mq_egrcredit_hold(psm_mq_req_t req, psm_epaddr_t epaddr))
+{
+    if (epaddr->mctxt_master->egrcredit_granted) {
+	req->type |= MQE_TYPE_EGRCREDIT;
+	req->epaddr = epaddr;
+    }
+}
+
+/* Receiver: an unexpected eager message gave up its system buffer */
+PSMI_ALWAYS_INLINE(
+void
+mq_egrcredit_release_req(psm_mq_req_t req))
+{
+    if (req->type & MQE_TYPE_EGRCREDIT) {
+	req->type &= ~MQE_TYPE_EGRCREDIT;
+	req->epaddr->mctxt_master->egrcredit_freed +=
+	    mq_egrcredit_cost(req->send_msglen);
+    }
+}
+
+/*
+ * A ptl receive queue lending its buffers to unexpected messages.  hold()
+ * either keeps the payload in place, tagging the request MQE_TYPE_EGRLENT with
+ * req->ptl_req_ptr pointing back at the lender, or returns 0 to have it copied
+ * to a sysbuf.  release() may be called outside the ptl's progress loop and
+ * must not touch the hardware.
+ */
+struct psmi_mq_lender {
+    int		(*hold)(struct psmi_mq_lender *lender, psm_mq_req_t req,
+			const void *payload);
+    void	(*release)(psm_mq_req_t req);
+};
+
+/* Give back the buffer of a consumed unexpected message */
+PSMI_ALWAYS_INLINE(
+void
+mq_unexp_buf_free(psm_mq_t mq, psm_mq_req_t req))
+{
+    if_pf (req->type & MQE_TYPE_EGRLENT) {
+	req->type &= ~MQE_TYPE_EGRLENT;
+	((struct psmi_mq_lender *) req->ptl_req_ptr)->release(req);
+    }
+    else
+	psmi_mq_sysbuf_free(mq, req->buf);
+}
+
 /* Default handler */
 int __fastpath
 psmi_mq_handle_envelope_unexpected(
@@ -450,6 +636,7 @@ psmi_mq_handle_tiny_envelope(psm_mq_t mq, psm_epaddr_t epaddr,
 	mq_copy_tiny((uint32_t *)req->buf, (uint32_t *)payload, msglen);
 	req->state = MQ_STATE_COMPLETE;
 	mq_qq_append(&mq->completed_q, req);
+	mq_egrcredit_release(epaddr, tinylen);
 	mq->stats.rx_user_bytes += msglen;
 	mq->stats.rx_user_num++;
 	_IPATH_VDBG("tiny from=%s match=YES (req=%p) mode=1 mqtag=%llu "
@@ -172,7 +172,9 @@ psmi_mq_handle_rts(psm_mq_t mq, uint64_t tag,
 	req->send_msgoff = 0;
 	req->rts_peer = peer;
 	req->rts_sbuf = send_buf;
+	PSMI_MQ_LOCK(mq);
 	mq_sq_append(&mq->unexpected_q, req);
+	PSMI_MQ_UNLOCK(mq);
 	*req_o = req; /* no match, will callback */
 	rc = MQ_RET_UNEXP_OK;
     }
@@ -263,8 +265,14 @@ psmi_mq_handle_envelope_unexpected(
 	    break;
 
 	case MQ_MSG_SHORT:
-	    req->buf = psmi_mq_sysbuf_alloc(mq, msglen);
-	    psmi_mq_mtucpy(req->buf, payload, msglen);
+	    /* Leave the payload where it is if the ptl can spare the buffer */
+	    if_pf (mq->egrlent != NULL &&
+		   mq->egrlent->hold(mq->egrlent, req, payload))
+		req->buf = (uint8_t *) payload;
+	    else {
+		req->buf = psmi_mq_sysbuf_alloc(mq, msglen);
+		psmi_mq_mtucpy(req->buf, payload, msglen);
+	    }
 	    req->state = MQ_STATE_COMPLETE;
 	    break;
 
@@ -287,7 +295,10 @@ psmi_mq_handle_envelope_unexpected(
 	    psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
 			    "Internal error, unknown packet 0x%x", mode);
     }
+    mq_egrcredit_hold(req, epaddr);
+    PSMI_MQ_LOCK(mq);
     mq_sq_append(&mq->unexpected_q, req);
+    PSMI_MQ_UNLOCK(mq);
     mq->stats.rx_sys_bytes += msglen;
     mq->stats.rx_sys_num++;
 
@@ -353,6 +364,7 @@ psmi_mq_handle_envelope(psm_mq_t mq, uint16_t mode, psm_epaddr_t epaddr,
 			    "Internal error, unknown packet 0x%x", mode);
 	}
 
+	mq_egrcredit_release(epaddr, send_msglen);
 	mq->stats.rx_user_bytes += msglen;
 	mq->stats.rx_user_num++;
 
@@ -373,24 +385,28 @@ psmi_mq_handle_envelope(psm_mq_t mq, uint16_t mode, psm_epaddr_t epaddr,
 int __recvpath
 psmi_mq_handle_outoforder_queue(psm_epaddr_t epaddr)
 {
-    psm_mq_t mq = epaddr->ep->mq;
+    psm_mq_t mq;
     psm_mq_req_t ureq, ereq;
     uint32_t msglen;
 
     next_ooo:
     ureq = mq_ooo_match(&epaddr->outoforder_q, epaddr->mctxt_recv_seqnum);
     if (ureq == NULL) return 0;
+    mq = ureq->mq; /* message order is per peer, across all MQs */
     epaddr->mctxt_recv_seqnum++;
     epaddr->outoforder_c--;
 
     ereq = mq_req_match(&(mq->expected_q), ureq->tag, 1);
     if (ereq == NULL) {
+	PSMI_MQ_LOCK(mq);
 	mq_sq_append(&mq->unexpected_q, ureq);
+	PSMI_MQ_UNLOCK(mq);
 	if (epaddr->outoforder_c) goto next_ooo;
 	return 0;
     }
 
     psmi_assert(MQE_TYPE_IS_RECV(ereq->type));
+    mq_egrcredit_release_req(ureq);
     ereq->tag = ureq->tag;
     msglen = mq_set_msglen(ereq, ereq->buf_len, ureq->send_msglen);
 
@@ -499,6 +515,7 @@ psmi_mq_handle_envelope_outoforder(psm_mq_t mq, uint16_t mode,
 			    "Internal error, unknown packet 0x%x", mode);
     }
 
+    mq_egrcredit_hold(req, epaddr);
     req->msg_seqnum = msg_seqnum;
     mq_sq_append(&epaddr->mctxt_master->outoforder_q, req);
     epaddr->mctxt_master->outoforder_c++;
@@ -48,10 +48,14 @@ psmi_mq_req_alloc(psm_mq_t mq, uint32_t type)
 
     psmi_assert(type == MQE_TYPE_RECV || type == MQE_TYPE_SEND);
 
+    PSMI_MQ_LOCK(mq);
     if (type == MQE_TYPE_SEND)
 	req = psmi_mpool_get(mq->sreq_pool);
     else
 	req = psmi_mpool_get(mq->rreq_pool);
+    if_pt (req != NULL)
+	mq->nreqs++;
+    PSMI_MQ_UNLOCK(mq);
 
     if_pt (req != NULL) {
 	/* A while ago there were issues about forgetting to zero-out parts of the
@@ -105,7 +109,7 @@ psmi_mq_req_init(psm_mq_t mq)
 	    goto fail;
 				    
 	if ((mq->sreq_pool = psmi_mpool_create(sizeof(struct psm_mq_req), 
-				chunksz, maxsz, 0, DESCRIPTORS,
+				chunksz, maxsz, PSMI_MPOOL_ALIGN, DESCRIPTORS,
 				NULL, NULL)) == NULL) 
 	{
 	    err = PSM_NO_MEMORY;
@@ -124,8 +128,8 @@ psmi_mq_req_init(psm_mq_t mq)
 	    goto fail;
 
 	if ((mq->rreq_pool = 
-	    psmi_mpool_create(sizeof(struct psm_mq_req), chunksz, maxsz, 0,
-			      DESCRIPTORS, NULL, NULL)) == NULL) {
+	    psmi_mpool_create(sizeof(struct psm_mq_req), chunksz, maxsz, 
+			      PSMI_MPOOL_ALIGN, DESCRIPTORS, NULL, NULL)) == NULL) {
 	    err = PSM_NO_MEMORY;
 	    goto fail;
 	}
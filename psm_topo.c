@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2013. Intel Corporation. All rights reserved.
+ * Copyright (c) 2006-2012. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sched.h>
+#include <stdarg.h>
+#include <limits.h>
+#include "psm_user.h"
+
+#define PSMI_TOPO_MAX_NODES	256
+
+static
+int
+psmi_topo_read(const char *root, char *buf, size_t len, const char *fmt, ...)
+{
+    char path[PATH_MAX];
+    size_t n;
+    va_list ap;
+    FILE *fp;
+
+    n = snprintf(path, sizeof path, "%s/", root);
+    va_start(ap, fmt);
+    vsnprintf(path + n, sizeof path - n, fmt, ap);
+    va_end(ap);
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return -1;
+    if (fgets(buf, len, fp) == NULL) {
+	fclose(fp);
+	return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Parse a sysfs cpulist such as "0-3,8-11" */
+static
+int
+psmi_topo_parse_cpulist(const char *str, cpu_set_t *set)
+{
+    char *e;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*str && *str != '\n') {
+	lo = hi = strtol(str, &e, 10);
+	if (e == str)
+	    return -1;
+	if (*e == '-') {
+	    str = e + 1;
+	    hi = strtol(str, &e, 10);
+	    if (e == str)
+		return -1;
+	}
+	for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+	    CPU_SET(lo, set);
+	str = (*e == ',') ? e + 1 : e;
+    }
+    return 0;
+}
+
+static
+int
+psmi_topo_cpu_cmp(const void *a, const void *b)
+{
+    const struct psmi_topo_cpu *x = a, *y = b;
+
+    if (x->thread != y->thread)
+	return x->thread - y->thread;
+    if (x->node != y->node)
+	return x->node - y->node;
+    if (x->package != y->package)
+	return x->package - y->package;
+    if (x->core != y->core)
+	return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+psm_error_t
+psmi_topo_load(struct psmi_topo *topo, const char *root)
+{
+    char buf[4096];
+    cpu_set_t online, nodeset;
+    struct psmi_topo_cpu *c;
+    int i, j, node, nnodes = 0;
+
+    memset(topo, 0, sizeof *topo);
+
+    if (psmi_topo_read(root, buf, sizeof buf,
+		       "devices/system/cpu/online") ||
+	psmi_topo_parse_cpulist(buf, &online) ||
+	CPU_COUNT(&online) == 0)
+	return PSM_INTERNAL_ERR;
+
+    topo->cpus = (struct psmi_topo_cpu *) 
+	psmi_calloc(PSMI_EP_NONE, UNDEFINED, CPU_COUNT(&online),
+		    sizeof(struct psmi_topo_cpu));
+    if (topo->cpus == NULL)
+	return PSM_NO_MEMORY;
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+	if (!CPU_ISSET(i, &online))
+	    continue;
+	c = &topo->cpus[topo->ncpus++];
+	c->cpu = i;
+	c->node = PSMI_TOPO_NODE_UNKNOWN;
+	c->core = c->package = -1;
+	if (!psmi_topo_read(root, buf, sizeof buf,
+		"devices/system/cpu/cpu%d/topology/core_id", i))
+	    c->core = atoi(buf);
+	if (!psmi_topo_read(root, buf, sizeof buf,
+		"devices/system/cpu/cpu%d/topology/physical_package_id", i))
+	    c->package = atoi(buf);
+	if (c->core == -1) /* nothing known, a core of its own */
+	    c->core = i;
+    }
+
+    for (node = 0; node < PSMI_TOPO_MAX_NODES; node++) {
+	if (psmi_topo_read(root, buf, sizeof buf,
+		"devices/system/node/node%d/cpulist", node) ||
+	    psmi_topo_parse_cpulist(buf, &nodeset))
+	    continue;
+	nnodes++;
+	for (i = 0; i < topo->ncpus; i++)
+	    if (CPU_ISSET(topo->cpus[i].cpu, &nodeset))
+		topo->cpus[i].node = node;
+    }
+
+    for (i = 0; i < topo->ncpus; i++) {
+	c = &topo->cpus[i];
+	/* Without NUMA information, sockets are the next best thing */
+	if (nnodes == 0 && c->package != -1)
+	    c->node = c->package;
+	for (j = 0; j < i; j++)
+	    if (topo->cpus[j].package == c->package &&
+		topo->cpus[j].core == c->core)
+		c->thread++;
+    }
+    qsort(topo->cpus, topo->ncpus, sizeof(struct psmi_topo_cpu),
+	  psmi_topo_cpu_cmp);
+
+    for (i = 0; i < IPATH_MAX_UNIT; i++) {
+	if (psmi_topo_read(root, buf, sizeof buf,
+		"class/infiniband/qib%d/device/numa_node", i))
+	    break;
+	topo->unit_node[topo->nunits++] = atoi(buf) < 0 ?
+	    (nnodes ? PSMI_TOPO_NODE_UNKNOWN : 0) : atoi(buf);
+    }
+
+    return PSM_OK;
+}
+
+void
+psmi_topo_fini(struct psmi_topo *topo)
+{
+    if (topo->cpus != NULL)
+	psmi_free(topo->cpus);
+    topo->cpus = NULL;
+    topo->ncpus = 0;
+}
+
+PSMI_ALWAYS_INLINE(
+int
+psmi_topo_nunits(const struct psmi_topo *topo, uint32_t unit_mask))
+{
+    int unit, n = 0;
+
+    for (unit = 0; unit < topo->nunits; unit++)
+	if (unit_mask & (1U << unit))
+	    n++;
+    return n;
+}
+
+PSMI_ALWAYS_INLINE(
+int
+psmi_topo_rank_unit(const struct psmi_topo *topo, int rank, int nranks,
+		    uint32_t unit_mask))
+{
+    int unit, n = psmi_topo_nunits(topo, unit_mask);
+
+    if (n == 0)
+	return -1;
+    n = (int) ((int64_t) rank * n / nranks);
+    for (unit = 0; unit < topo->nunits; unit++)
+	if ((unit_mask & (1U << unit)) && n-- == 0)
+	    break;
+    return unit;
+}
+
+PSMI_ALWAYS_INLINE(
+int
+psmi_topo_rank_node(const struct psmi_topo *topo, int unit))
+{
+    return unit == -1 ? PSMI_TOPO_NODE_UNKNOWN : topo->unit_node[unit];
+}
+
+void
+psmi_topo_place(const struct psmi_topo *topo, int rank, int nranks,
+		uint32_t unit_mask, int *cpu_o, int *unit_o)
+{
+    int unit = psmi_topo_rank_unit(topo, rank, nranks, unit_mask);
+    int node = psmi_topo_rank_node(topo, unit);
+    int i, r, slot = 0, nlocal = 0, spill = 0;
+
+    psmi_assert(rank >= 0 && rank < nranks && topo->ncpus > 0);
+
+    /* Our position among the ranks placed on the same node */
+    for (r = 0; r < rank; r++)
+	if (psmi_topo_rank_node(topo,
+		psmi_topo_rank_unit(topo, r, nranks, unit_mask)) == node)
+	    slot++;
+
+    for (i = 0; i < topo->ncpus; i++)
+	if (topo->cpus[i].node == node)
+	    nlocal++;
+    if (node == PSMI_TOPO_NODE_UNKNOWN || nlocal == 0) { /* any cpu will do */
+	node = PSMI_TOPO_NODE_UNKNOWN;
+	nlocal = topo->ncpus;
+    }
+
+    /* Cores on our node first, then spill over to the other nodes' */
+    if (slot >= nlocal) {
+	if (nlocal < topo->ncpus) {
+	    slot = (slot - nlocal) % (topo->ncpus - nlocal);
+	    spill = 1;
+	}
+	else
+	    slot %= topo->ncpus;
+    }
+
+    for (i = 0; i < topo->ncpus; i++) {
+	int local = node == PSMI_TOPO_NODE_UNKNOWN || 
+		    topo->cpus[i].node == node;
+	if (local != spill && slot-- == 0)
+	    break;
+    }
+    psmi_assert(i < topo->ncpus);
+
+    *cpu_o = topo->cpus[i].cpu;
+    *unit_o = unit;
+}
+
+int
+psmi_topo_local_rank(int *rank_o, int *nranks_o)
+{
+    union psmi_envvar_val env_rankid, env_nranks;
+    const char *lrank_env, *ppn_env;
+    char *c;
+
+    if ((c = getenv("MPI_LOCALRANKID")) && *c != '\0') { 
+	lrank_env = "MPI_LOCALRANKID";
+	ppn_env = "MPI_LOCALNRANKS";
+    }
+    else if ((c = getenv("PSC_MPI_PPN")) && *c != '\0') { 
+	ppn_env = "PSC_MPI_PPN";
+	lrank_env = "PSC_MPI_NODE_RANK";
+    }
+    else
+	return -1;
+
+    psmi_getenv(lrank_env, "Shared context rankid",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_INT,
+		(union psmi_envvar_val) -1,
+		&env_rankid); 
+    psmi_getenv(ppn_env, "Shared context numranks",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_INT,
+		(union psmi_envvar_val) -1,
+		&env_nranks); 
+
+    if (env_nranks.e_int < 1 || env_rankid.e_int < 0 ||
+	env_rankid.e_int >= env_nranks.e_int)
+	return -1;
+    *rank_o = env_rankid.e_int;
+    *nranks_o = env_nranks.e_int;
+    return 0;
+}
+
+psm_error_t
+psmi_topo_placement(int rank, int nranks, uint32_t unit_mask,
+		    int *cpu_o, int *unit_o)
+{
+    struct psmi_topo topo;
+    union psmi_envvar_val env_root, env_print;
+    psm_error_t err;
+    int r, cpu, unit;
+
+    psmi_getenv("PSM_SYSFS_ROOT",
+		"Where to read the node topology from",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) "/sys",
+		&env_root);
+    psmi_getenv("PSM_PLACEMENT_PRINT",
+		"Print the placement of every local rank (default is disabled i.e. 0)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+		(union psmi_envvar_val) 0,
+		&env_print);
+
+    if (rank < 0 || rank >= nranks)
+	return PSM_PARAM_ERR;
+    if ((err = psmi_topo_load(&topo, env_root.e_str))) {
+	_IPATH_PRDBG("No node topology under %s\n", env_root.e_str);
+	return err;
+    }
+
+    psmi_topo_place(&topo, rank, nranks, unit_mask, cpu_o, unit_o);
+    _IPATH_PRDBG("Placed local rank %d of %d on cpu %d unit %d\n",
+		 rank, nranks, *cpu_o, *unit_o);
+
+    /* The map is the same everywhere, one rank prints it */
+    if (env_print.e_uint && rank == 0) {
+	_IPATH_INFO("Placement of %d local ranks over %d cpus, %d units\n",
+		    nranks, topo.ncpus, psmi_topo_nunits(&topo, unit_mask));
+	for (r = 0; r < nranks; r++) {
+	    int i;
+	    psmi_topo_place(&topo, r, nranks, unit_mask, &cpu, &unit);
+	    for (i = 0; topo.cpus[i].cpu != cpu; i++)
+		;
+	    _IPATH_INFO("rank %d: cpu %d (node %d package %d core %d "
+			"thread %d) unit %d (node %d)\n", r, cpu,
+			topo.cpus[i].node, topo.cpus[i].package,
+			topo.cpus[i].core, topo.cpus[i].thread, unit,
+			unit == -1 ? PSMI_TOPO_NODE_UNKNOWN : 
+				     topo.unit_node[unit]);
+	}
+    }
+
+    psmi_topo_fini(&topo);
+    return PSM_OK;
+}
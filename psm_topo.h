@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2013. Intel Corporation. All rights reserved.
+ * Copyright (c) 2006-2012. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PSMI_IN_USER_H
+#error psm_topo.h not meant to be included directly, include psm_user.h instead
+#endif
+
+#ifndef _PSM_TOPO_H
+#define _PSM_TOPO_H
+
+/*
+ * Node topology for default rank placement.  Cpu package and core ids, NUMA
+ * node cpulists and each HCA's numa_node are read from sysfs, rooted at
+ * PSM_SYSFS_ROOT so that placement can be checked against a fake tree.
+ *
+ * Local ranks are spread over the units in unit_mask (the caller's pick of
+ * usable units, 0 leaves units alone) in contiguous blocks and each gets a
+ * core on its unit's NUMA node, taking one hardware thread of every core on
+ * the node before any hyperthread siblings.  Ranks that don't fit on their
+ * node spill over to the other nodes' cores.
+ */
+#define PSMI_TOPO_NODE_UNKNOWN	(-1)
+
+struct psmi_topo_cpu {
+    int	cpu;
+    int	core;
+    int	package;
+    int	node;
+    int	thread;		/* 0 for the first hw thread of its core */
+};
+
+struct psmi_topo {
+    int			  ncpus;
+    struct psmi_topo_cpu *cpus;	/* placement order */
+    int			  nunits;
+    int			  unit_node[IPATH_MAX_UNIT];
+};
+
+psm_error_t psmi_topo_load(struct psmi_topo *topo, const char *root);
+void	    psmi_topo_fini(struct psmi_topo *topo);
+void	    psmi_topo_place(const struct psmi_topo *topo, int rank, int nranks,
+			    uint32_t unit_mask, int *cpu_o, int *unit_o);
+
+/* Our rank and the number of ranks on this node, from the MPI launcher */
+int	    psmi_topo_local_rank(int *rank_o, int *nranks_o);
+
+/* Load, place and release in one go, printing the node's map when
+ * PSM_PLACEMENT_PRINT is set */
+psm_error_t psmi_topo_placement(int rank, int nranks, uint32_t unit_mask,
+				int *cpu_o, int *unit_o);
+
+#endif /* _PSM_TOPO_H */
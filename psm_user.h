@@ -57,6 +57,8 @@
 #include "psm_ep.h"
 #include "psm_lock.h"
 #include "psm_stats.h"
+#include "psm_capture.h"
+#include "psm_topo.h"
 #undef _PSMI_IN_USER_H
 
 #define PSMI_VERNO_MAKE(major,minor) ((((major)&0xff)<<8)|((minor)&0xff))
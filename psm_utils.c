@@ -821,6 +821,29 @@ uint32_t  psmi_get_hca_type(psmi_context_t *context)
 }
 
 #define PSMI_FAULTINJ_SPEC_NAMELEN  32
+
+/*
+ * Scripted faults.  Each rule applies to one injection point and counts the
+ * events there that match its peer and flow filters.  Events nth, nth+1, ...
+ * nth+count-1 are faulted, and again every 'every' events if non-zero.
+ */
+struct psmi_faultinj_rule {
+    STAILQ_ENTRY(psmi_faultinj_rule)	next;
+    char			spec_name[PSMI_FAULTINJ_SPEC_NAMELEN];
+    int				action;
+    uint32_t			peer;
+    uint32_t			flow;
+    unsigned long long		nth;
+    unsigned long long		count;
+    unsigned long long		every;
+    unsigned long long		usecs;
+
+    unsigned long long		num_events;
+    unsigned long long		num_faults;
+    uint64_t			t_stall_end; /* stall or delay held until */
+};
+STAILQ_HEAD(psmi_faultinj_ruleq, psmi_faultinj_rule);
+
 struct psmi_faultinj_spec {
     STAILQ_ENTRY(psmi_faultinj_spec)	next;
     char				spec_name[PSMI_FAULTINJ_SPEC_NAMELEN];
@@ -832,15 +855,106 @@ struct psmi_faultinj_spec {
     int num;
     int denom;
 
+    struct psmi_faultinj_ruleq rules;
 };
 
 int  psmi_faultinj_enabled = 0;
 int  psmi_faultinj_verbose = 0;
 char *psmi_faultinj_outfile = NULL;
+static int psmi_faultinj_scripted = 0;
+static unsigned int psmi_faultinj_seed = 0;
 
 static struct psmi_faultinj_spec		psmi_faultinj_dummy;
 static STAILQ_HEAD(, psmi_faultinj_spec)	psmi_faultinj_head =
 	STAILQ_HEAD_INITIALIZER(psmi_faultinj_head);
+/* Rules whose injection point hasn't been reached yet */
+static struct psmi_faultinj_ruleq		psmi_faultinj_rules =
+	STAILQ_HEAD_INITIALIZER(psmi_faultinj_rules);
+
+static const char *psmi_faultinj_actions[] = {
+    "none", "drop", "delay", "dup", "stall"
+};
+
+/* How the protocols recovered from the faults, reported at fini */
+static struct {
+    unsigned long long	num_recovered;
+    uint64_t		recover_cyc_total;
+    uint64_t		recover_cyc_max;
+    unsigned long long	retrans_pkts;
+    unsigned long long	retrans_bytes;
+} psmi_faultinj_recovery;
+
+/*
+ * Parse PSM_FI_SCRIPT, a ';'-separated list of rules of the form
+ *
+ *   <point> <action> [nth=N] [count=C] [every=E] [us=T] [peer=P] [flow=F]
+ *
+ * e.g. "recvlost drop nth=100 flow=1; piosend stall nth=10 us=500"
+ */
+static
+void
+psmi_faultinj_parse_script(const char *script)
+{
+    char *str, *rulestr, *tok, *save_rule, *save_tok;
+    struct psmi_faultinj_rule *rule;
+    int i;
+
+    str = psmi_strdup(NULL, script);
+    if (str == NULL)
+	return;
+
+    for (rulestr = strtok_r(str, ";", &save_rule); rulestr != NULL;
+	 rulestr = strtok_r(NULL, ";", &save_rule))
+    {
+	tok = strtok_r(rulestr, " \t", &save_tok);
+	if (tok == NULL)
+	    continue;
+
+	rule = psmi_calloc(PSMI_EP_NONE, UNDEFINED, 1, sizeof(*rule));
+	if (rule == NULL)
+	    break;
+	strncpy(rule->spec_name, tok, PSMI_FAULTINJ_SPEC_NAMELEN-1);
+	rule->peer = rule->flow = PSMI_FAULTINJ_ANY;
+	rule->nth = rule->count = 1;
+
+	tok = strtok_r(NULL, " \t", &save_tok);
+	for (i = 1; tok != NULL && i <= PSMI_FAULTINJ_STALL; i++)
+	    if (strcmp(tok, psmi_faultinj_actions[i]) == 0)
+		rule->action = i;
+	if (rule->action == PSMI_FAULTINJ_NONE) {
+	    _IPATH_ERROR("PSM_FI_SCRIPT: bad action in rule for %s\n",
+			 rule->spec_name);
+	    psmi_free(rule);
+	    continue;
+	}
+
+	while ((tok = strtok_r(NULL, " \t", &save_tok)) != NULL) {
+	    char *val = strchr(tok, '=');
+	    unsigned long long v;
+	    if (val == NULL) 
+		continue;
+	    *val++ = '\0';
+	    v = strtoull(val, NULL, 0);
+	    if (!strcmp(tok, "nth"))
+		rule->nth = max(v, 1);
+	    else if (!strcmp(tok, "count"))
+		rule->count = v;
+	    else if (!strcmp(tok, "every"))
+		rule->every = v;
+	    else if (!strcmp(tok, "us"))
+		rule->usecs = v;
+	    else if (!strcmp(tok, "peer"))
+		rule->peer = (uint32_t) v;
+	    else if (!strcmp(tok, "flow"))
+		rule->flow = (uint32_t) v;
+	    else
+		_IPATH_ERROR("PSM_FI_SCRIPT: unknown field %s\n", tok);
+	}
+	STAILQ_INSERT_TAIL(&psmi_faultinj_rules, rule, next);
+    }
+
+    psmi_free(str);
+}
 
 void
 psmi_faultinj_init()
@@ -852,6 +966,20 @@ psmi_faultinj_init()
 		PSMI_ENVVAR_VAL_NO, &env_fi);
 
     psmi_faultinj_enabled = !!env_fi.e_uint;
+
+    /* A script turns on fault injection by itself, and then only the
+     * scripted faults (and explicitly requested random ones) happen. */
+    {
+	char *def = NULL;
+	if (!psmi_getenv("PSM_FI_SCRIPT", "PSM Fault Injection script",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) def, &env_fi)) 
+	{
+	    psmi_faultinj_parse_script(env_fi.e_str);
+	    psmi_faultinj_scripted = 1;
+	    psmi_faultinj_enabled = 1;
+	}
+    }
     
     if (psmi_faultinj_enabled) {
 	char *def = NULL;
@@ -861,6 +989,12 @@ psmi_faultinj_init()
 	{
 	    psmi_faultinj_outfile = psmi_strdup(NULL, env_fi.e_str); 
 	}
+
+	/* Default seed for every random spec, pid if not set */
+	psmi_getenv("PSM_FI_SEED", "PSM Fault Injection random seed (0 is pid)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 0, &env_fi);
+	psmi_faultinj_seed = env_fi.e_uint ? env_fi.e_uint : (unsigned) getpid();
     }
 
     return;
@@ -870,6 +1004,7 @@ void
 psmi_faultinj_fini()
 {
     struct psmi_faultinj_spec	*fi;
+    struct psmi_faultinj_rule	*rule;
     FILE *fp;
     int do_fclose = 0;
 
@@ -902,6 +1037,27 @@ psmi_faultinj_fini()
 		    (double) fi->num * 100.0 / fi->denom, 
 		    (double) fi->num_faults * 100.0 / fi->num_calls,
 		    fi->num_faults, fi->num_calls);
+	    STAILQ_FOREACH(rule, &fi->rules, next) {
+		fprintf(fp, "%s:%s PSM_FI_%-12s %-5s nth=%lld count=%lld "
+			"every=%lld us=%lld => %10lld faults/%10lld events\n",
+			__progname, __ipath_mylabel, fi->spec_name, 
+			psmi_faultinj_actions[rule->action], rule->nth,
+			rule->count, rule->every, rule->usecs,
+			rule->num_faults, rule->num_events);
+	    }
+	}
+	if (psmi_faultinj_recovery.num_recovered ||
+	    psmi_faultinj_recovery.retrans_pkts) {
+	    unsigned long long nrec = psmi_faultinj_recovery.num_recovered;
+	    fprintf(fp, "%s:%s PSM_FI recovery %10lld losses, %.3f us avg, "
+		    "%.3f us max, %lld bytes in %lld packets retransmitted\n",
+		    __progname, __ipath_mylabel, nrec, nrec == 0 ? 0.0 :
+		    (double) cycles_to_nanosecs(
+			psmi_faultinj_recovery.recover_cyc_total / nrec) / 1e3,
+		    (double) cycles_to_nanosecs(
+			psmi_faultinj_recovery.recover_cyc_max) / 1e3,
+		    psmi_faultinj_recovery.retrans_bytes,
+		    psmi_faultinj_recovery.retrans_pkts);
 	}
 	fflush(fp);
 	if (do_fclose)
@@ -932,10 +1088,25 @@ psmi_faultinj_getspec(char *spec_name, int num, int denom)
     fi = psmi_malloc(PSMI_EP_NONE, UNDEFINED, sizeof(struct psmi_faultinj_spec));
     strncpy(fi->spec_name, spec_name, PSMI_FAULTINJ_SPEC_NAMELEN-1);
     fi->spec_name[PSMI_FAULTINJ_SPEC_NAMELEN-1] = '\0';
-    fi->num = num;
+    fi->num = psmi_faultinj_scripted ? 0 : num;
     fi->denom = denom;
     fi->num_faults = 0;
     fi->num_calls = 0;
+    fi->seedp = psmi_faultinj_seed;
+    STAILQ_INIT(&fi->rules);
+
+    /* Take over the scripted rules for this injection point */
+    {
+	struct psmi_faultinj_rule *rule, *rule_next;
+
+	for (rule = STAILQ_FIRST(&psmi_faultinj_rules); rule; rule = rule_next){
+	    rule_next = STAILQ_NEXT(rule, next);
+	    if (strcmp(rule->spec_name, fi->spec_name))
+		continue;
+	    STAILQ_REMOVE(&psmi_faultinj_rules, rule, psmi_faultinj_rule, next);
+	    STAILQ_INSERT_TAIL(&fi->rules, rule, next);
+	}
+    }
 
     /* 
      * See if we get a hint from the environment.
@@ -983,23 +1154,91 @@ psmi_faultinj_getspec(char *spec_name, int num, int denom)
     return fi;
 }
     
+/*
+ * Returns the fault to apply to this event at the injection point, if any.
+ * Nothing waits here: a stall reports busy for its duration over every
+ * matching event, a delay reports PSMI_FAULTINJ_DELAY the same way and then
+ * lets the held event through once.  Random faults configured with
+ * num:denom are drops.
+ */
 int
-psmi_faultinj_is_fault(struct psmi_faultinj_spec *fi)
+psmi_faultinj_event(struct psmi_faultinj_spec *fi, uint32_t peer, 
+		    uint32_t flow)
 {
+    struct psmi_faultinj_rule *rule;
+    unsigned long long n;
     int r;
+
     if (!psmi_faultinj_enabled) /* never fault if disabled */
-	return 0;
-    if (fi->num == 0)
-	return 0;
+	return PSMI_FAULTINJ_NONE;
 
     fi->num_calls++;
+
+    STAILQ_FOREACH(rule, &fi->rules, next) {
+	if ((rule->peer != PSMI_FAULTINJ_ANY && rule->peer != peer) ||
+	    (rule->flow != PSMI_FAULTINJ_ANY && rule->flow != flow))
+	    continue;
+
+	if (rule->t_stall_end) {
+	    if (get_cycles() < rule->t_stall_end)
+		return rule->action;
+	    rule->t_stall_end = 0;
+	    /* The event held back by a delay is retried, not a new one */
+	    if (rule->action == PSMI_FAULTINJ_DELAY)
+		return PSMI_FAULTINJ_NONE;
+	}
+
+	n = ++rule->num_events;
+	if (n < rule->nth)
+	    continue;
+	n -= rule->nth;
+	if (rule->every ? (n % rule->every) >= rule->count : n >= rule->count)
+	    continue;
+
+	fi->num_faults++;
+	rule->num_faults++;
+	if (rule->action == PSMI_FAULTINJ_DELAY ||
+	    rule->action == PSMI_FAULTINJ_STALL)
+	    rule->t_stall_end = get_cycles() + 
+				nanosecs_to_cycles(rule->usecs * 1000ULL);
+	return rule->action;
+    }
+
+    if (fi->num == 0)
+	return PSMI_FAULTINJ_NONE;
+
     r = rand_r(&fi->seedp);
     if (r % fi->denom <= fi->num) {
 	fi->num_faults++;
-	return 1;
+	return PSMI_FAULTINJ_DROP;
     }
     else
-	return 0;
+	return PSMI_FAULTINJ_NONE;
+}
+
+void
+psmi_faultinj_retransmit(uint32_t npkts, uint64_t nbytes)
+{
+    psmi_faultinj_recovery.retrans_pkts += npkts;
+    psmi_faultinj_recovery.retrans_bytes += nbytes;
+}
+
+void
+psmi_faultinj_recovered(uint64_t t_lost)
+{
+    uint64_t cyc = get_cycles() - t_lost;
+
+    psmi_faultinj_recovery.num_recovered++;
+    psmi_faultinj_recovery.recover_cyc_total += cyc;
+    psmi_faultinj_recovery.recover_cyc_max = 
+	max(psmi_faultinj_recovery.recover_cyc_max, cyc);
+}
+
+int
+psmi_faultinj_is_fault(struct psmi_faultinj_spec *fi)
+{
+    return psmi_faultinj_event(fi, PSMI_FAULTINJ_ANY, PSMI_FAULTINJ_ANY) ==
+	   PSMI_FAULTINJ_DROP;
 }
 
 /* For memory allocation, we kind of break the PSM error handling rules.
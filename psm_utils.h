@@ -271,6 +271,23 @@ struct psmi_faultinj_spec *psmi_faultinj_getspec(char *spec_name,
 	    (var) = psmi_faultinj_getspec((spec_name), (num), (denom)); 
 int    psmi_faultinj_is_fault(struct psmi_faultinj_spec *spec);
 
+/* Faults returned by psmi_faultinj_event, each injection point applies the
+ * ones that make sense there and ignores the others */
+#define PSMI_FAULTINJ_NONE	0
+#define PSMI_FAULTINJ_DROP	1   /* lose the packet */
+#define PSMI_FAULTINJ_DELAY	2   /* not yet, retry the same event later */
+#define PSMI_FAULTINJ_DUP	3   /* deliver the packet twice */
+#define PSMI_FAULTINJ_STALL	4   /* report busy / not ready for a while */
+#define PSMI_FAULTINJ_ANY	0xffffffffU
+int    psmi_faultinj_event(struct psmi_faultinj_spec *spec, uint32_t peer,
+			   uint32_t flow);
+
+/* Recovery accounting, reported with the fault counts at fini.  Protocols
+ * report what they retransmit and when a lost packet (noted at cycles
+ * t_lost) has been repaired. */
+void   psmi_faultinj_retransmit(uint32_t npkts, uint64_t nbytes);
+void   psmi_faultinj_recovered(uint64_t t_lost);
+
 /*
  * PSM core component set/get options
  */
@@ -111,6 +111,8 @@ ptl_arg_t;
 #include "ptl_ips/ptl_fwd.h"
 #include "ptl_am/ptl_fwd.h"
 
+struct ptl_connection_req;
+
 /* To be filled in as part of ptl_init */
 struct ptl_ctl
 {
@@ -142,6 +144,26 @@ struct ptl_ctl
 			      psm_epaddr_t output_array_of_epddr[],
 			      uint64_t timeout_ns);
 
+    /* Optional non-blocking ep_connect, with the same pre and post
+     * conditions once ep_connect_fini returns.  ep_connect_start returns
+     * PSM_OK_NO_PROGRESS and a request if there's anything to wait for.
+     * ep_connect_poll returns PSM_OK once the request is complete and
+     * PSM_OK_NO_PROGRESS until then, the caller polls the endpoint in
+     * between.  ep_connect_fini times out whatever isn't connected yet and
+     * frees the request.  At most one request is in flight per ptl, and no
+     * ep_connect or ep_disconnect runs meanwhile. */
+    psm_error_t (*ep_connect_start)(ptl_t *ptl,
+			      int num_ep,
+			      const psm_epid_t input_array_of_epid[], 
+			      const int	 array_of_epid_mask[],
+			      psm_error_t  output_array_of_errors[],
+			      psm_epaddr_t output_array_of_epddr[],
+			      struct ptl_connection_req **req_o);
+    psm_error_t (*ep_connect_poll)(ptl_t *ptl,
+				   struct ptl_connection_req *req);
+    psm_error_t (*ep_connect_fini)(ptl_t *ptl,
+				   struct ptl_connection_req *req);
+
     psm_error_t (*ep_disconnect)(ptl_t *ptl, int force,
 				 int num_ep,
 				 const psm_epaddr_t input_array_of_epaddr[],
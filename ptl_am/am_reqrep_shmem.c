@@ -138,6 +138,82 @@ int psmi_epaddr_kcopy_pid(psm_epaddr_t epaddr);
 static int psmi_kcopy_find_minor(int *minor);
 static int psmi_kcopy_open_minor(int minor);
 
+/*
+ * Robust shared memory.  The directory lock is a robust mutex, fifo tail
+ * locks and slots being filled are tagged with the local shmidx of their
+ * owner, and a peer is known dead when its pid is gone or now belongs to a
+ * process with a different start time.
+ */
+#define AMSH_ROBUST_INTERVAL_MS		100
+#define AMSH_LOCK_SPINS_BEFORE_CHECK	(1<<16)
+
+#define AMSH_PEER_DEAD(ptl, shmidx)				\
+	((shmidx) < PTL_AMSH_MAX_LOCAL_PROCS && (ptl)->peer_dead[shmidx])
+
+#define AMSH_LAZY_SET(dirpage, to, from)				\
+	((dirpage)->lazy_from[to][(from) >> 5] |= 1U << ((from) & 31))
+#define AMSH_LAZY_CLR(dirpage, to, from)				\
+	((dirpage)->lazy_from[to][(from) >> 5] &= ~(1U << ((from) & 31)))
+
+static
+void
+amsh_dirpage_lock(psm_ep_t ep)
+{
+    pthread_mutex_t *lock = (pthread_mutex_t *) &(ep->amsh_dirpage->lock);
+
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+	/* A process died holding the lock.  Directory updates are single
+	 * stores, there is nothing to roll back. */
+	_IPATH_INFO("Recovered shm directory lock from a dead process\n");
+	pthread_mutex_consistent(lock);
+    }
+}
+
+/* Start time of pid in clock ticks since boot, 0 if pid doesn't exist */
+static
+uint64_t
+amsh_pid_starttime(pid_t pid)
+{
+    char path[64], buf[512], *p;
+    int fd, n, i;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return 0;
+    n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (n <= 0)
+	return 0;
+    buf[n] = '\0';
+
+    /* Field 22, counted past the command name which may contain spaces */
+    if ((p = strrchr(buf, ')')) == NULL)
+	return 0;
+    for (i = 2; i < 22 && p != NULL; i++)
+	p = strchr(p+1, ' ');
+    return p != NULL ? (uint64_t) strtoull(p+1, NULL, 10) : 0;
+}
+
+static
+int
+amsh_peer_is_dead(ptl_t *ptl, int shmidx)
+{
+    pid_t pid = (pid_t) ptl->ep->amsh_dirpage->kassist_pids[shmidx];
+    uint64_t starttime = ptl->ep->amsh_dirpage->pid_starttime[shmidx];
+
+    if (ptl->peer_dead[shmidx])
+	return 1;
+    if (pid <= 0 || shmidx == ptl->shmidx)
+	return 0;
+    if (kill(pid, 0) == -1 && errno == ESRCH)
+	return 1;
+    if (starttime != 0 && amsh_pid_starttime(pid) != starttime)
+	return 1;
+    return 0;
+}
+
+static void amsh_robust_check(ptl_t *ptl);
+
 static inline void
 am_ctl_qhdr_init(volatile am_ctl_qhdr_t *q, int elem_cnt, int elem_sz)
 {
@@ -319,7 +395,7 @@ psm_error_t
 psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
 {
     int ismaster = 1;
-    int i;
+    int i, j;
     int use_kcopy, use_kassist;
     int shmidx;
     int kcopy_minor = -1;
@@ -486,6 +562,7 @@ psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
         pthread_mutexattr_t attr;
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
 	pthread_mutex_init(&(ep->amsh_dirpage->lock), &attr);
 	pthread_mutexattr_destroy(&attr);
 
@@ -495,6 +572,7 @@ psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
 	for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS; i++) {
 	    ep->amsh_dirpage->shmidx_map_epid[i] = 0;
 	    ep->amsh_dirpage->kassist_pids[i] = 0;
+	    ep->amsh_dirpage->pid_starttime[i] = 0;
 	}
 
         for(i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS*PTL_AMSH_MAX_LOCAL_NODES; i++) {
@@ -510,15 +588,15 @@ psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
             qtail->repFifoLong.tail = 0;
             qtail->repFifoHuge.tail = 0;
 
-            pthread_spin_init(&qtail->reqFifoShort.lock, PTHREAD_PROCESS_SHARED);
-            pthread_spin_init(&qtail->reqFifoMed.lock, PTHREAD_PROCESS_SHARED);
-            pthread_spin_init(&qtail->reqFifoLong.lock, PTHREAD_PROCESS_SHARED);
-            pthread_spin_init(&qtail->reqFifoHuge.lock, PTHREAD_PROCESS_SHARED);
+            qtail->reqFifoShort.lock = 0;
+            qtail->reqFifoMed.lock = 0;
+            qtail->reqFifoLong.lock = 0;
+            qtail->reqFifoHuge.lock = 0;
 
-            pthread_spin_init(&qtail->repFifoShort.lock, PTHREAD_PROCESS_SHARED);
-            pthread_spin_init(&qtail->repFifoMed.lock, PTHREAD_PROCESS_SHARED);
-            pthread_spin_init(&qtail->repFifoLong.lock, PTHREAD_PROCESS_SHARED);
-            pthread_spin_init(&qtail->repFifoHuge.lock, PTHREAD_PROCESS_SHARED);
+            qtail->repFifoShort.lock = 0;
+            qtail->repFifoMed.lock = 0;
+            qtail->repFifoLong.lock = 0;
+            qtail->repFifoHuge.lock = 0;
         }
 
 	if (use_kassist) {
@@ -538,6 +616,7 @@ psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
 	else
 	  ep->psmi_kassist_fd = -1;
 
+	ep->amsh_dirpage->layout_verno = AMSH_DIRPAGE_VERNO;
 	ips_mb();
 
 	ep->amsh_dirpage->is_init = 1;
@@ -550,6 +629,17 @@ psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
 	volatile int *is_init = &ep->amsh_dirpage->is_init;
 	while (*is_init == 0) 
 	    usleep(1);
+	ips_rmb();
+	if (ep->amsh_dirpage->layout_verno != AMSH_DIRPAGE_VERNO) {
+	    signal(SIGSEGV, old_handler_segv);
+	    signal(SIGBUS, old_handler_bus);
+	    err = psmi_handle_error(NULL, PSM_SHMEM_SEGMENT_ERR,
+		    "Shared memory segment %s was set up by an incompatible "
+		    "library (directory layout %d, expected %d)", 
+		    ep->amsh_keyname, ep->amsh_dirpage->layout_verno, 
+		    AMSH_DIRPAGE_VERNO);
+	    goto fail;
+	}
 	_IPATH_PRDBG("Slave synchronized object control page at "
 		     "%p, size=%d, kcopy minor is %d (mode=%s)\n", 
 		     mapptr, (int) segsz, kcopy_minor,
@@ -563,13 +653,24 @@ psmi_shm_attach(psm_ep_t ep, int *shmidx_o)
      * update our epid in the init phase once we actually know what our epid
      * is.
      */
-    pthread_mutex_lock((pthread_mutex_t *) &(ep->amsh_dirpage->lock));
+    amsh_dirpage_lock(ep);
     shmidx = -1;
     for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS; i++) {
 	if (ep->amsh_dirpage->shmidx_map_epid[i] == 0) {
 	    ep->amsh_dirpage->shmidx_map_epid[i] = 1;
             ep->amsh_dirpage->psm_verno[i] = PSMI_VERNO;
+	    ep->amsh_dirpage->amsh_features[i] = 
+		AMSH_HAVE_DIRPAGE_VERNO | AMSH_HAVE_LAZY_CONNECT;
+	    ep->amsh_dirpage->egrcredit_gen[i] = 0;
+	    /* Forget lazy connections of a previous owner that died */
+	    memset(ep->amsh_dirpage->lazy_from[i], 0, 
+		   sizeof(ep->amsh_dirpage->lazy_from[i]));
+	    for (j = 0; j < PTL_AMSH_MAX_LOCAL_PROCS; j++)
+		AMSH_LAZY_CLR(ep->amsh_dirpage, j, i);
+	    if (++ep->amsh_dirpage->attach_gen[i] == 0)
+		ep->amsh_dirpage->attach_gen[i] = 1;
 	    ep->amsh_dirpage->kassist_pids[i] = (int) getpid();
+	    ep->amsh_dirpage->pid_starttime[i] = amsh_pid_starttime(getpid());
 
 	    if (use_kassist) {
 	      if (!use_kcopy) {
@@ -688,7 +789,7 @@ amsh_init_segment(ptl_t *ptl)
     void (*old_handler_segv)(int) = signal (SIGSEGV, amsh_mmap_fault);
     void (*old_handler_bus)(int)  = signal (SIGBUS, amsh_mmap_fault);
 
-    pthread_mutex_lock((pthread_mutex_t *) &(ptl->ep->amsh_dirpage->lock));
+    amsh_dirpage_lock(ptl->ep);
 
     /*
      * Now that we know our epid, update it in the shmidx array
@@ -798,6 +899,7 @@ psm_error_t
 psmi_shm_detach(psm_ep_t ep)
 {
     psm_error_t err = PSM_OK;
+    int i;
 
     if (ep->amsh_shmidx == -1 || ep->amsh_keyname == NULL)
         return err;
@@ -822,9 +924,13 @@ psmi_shm_detach(psm_ep_t ep)
     }
 
     /* go mark my shmidx as free */
-    pthread_mutex_lock((pthread_mutex_t *) &(ep->amsh_dirpage->lock));
+    amsh_dirpage_lock(ep);
 
     ep->amsh_dirpage->num_attached--;
+    for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS; i++)
+        AMSH_LAZY_CLR(ep->amsh_dirpage, i, ep->amsh_shmidx);
+    ep->amsh_dirpage->amsh_features[ep->amsh_shmidx] = 0;
+    ep->amsh_dirpage->egrcredit_gen[ep->amsh_shmidx] = 0;
     ep->amsh_dirpage->shmidx_map_epid[ep->amsh_shmidx] = 0;
     ep->amsh_shmidx = -1;
 
@@ -1040,6 +1146,44 @@ amsh_epid_reachable(ptl_t *ptl, psm_epid_t epid)
     return result;
 }
 
+/*
+ * The eager credits we grant local peers.  Peers that connect without a
+ * handshake read them from the dirpage, so the window is latched the first
+ * time a peer is added or a connect is started and the same grant is
+ * published, advertised and released against for every peer from then on.
+ */
+static
+uint32_t
+amsh_egrcredit_grant(ptl_t *ptl)
+{
+    struct am_ctl_dirpage *dirpage = ptl->ep->amsh_dirpage;
+
+    if (!ptl->egrcredit_latched) {
+        ptl->egrcredit_grant = ptl->ep->mq->egrcredit_window;
+        dirpage->egrcredit_window[ptl->shmidx] = ptl->egrcredit_grant;
+        ips_wmb();
+        dirpage->egrcredit_gen[ptl->shmidx] = dirpage->attach_gen[ptl->shmidx];
+        ptl->egrcredit_latched = 1;
+    }
+    return ptl->egrcredit_grant;
+}
+
+/*
+ * The eager credits the local peer at shmidx published, or -1 if the
+ * endpoint now in that slot hasn't published any yet.
+ */
+static
+int64_t
+amsh_egrcredit_peer(ptl_t *ptl, int shmidx)
+{
+    struct am_ctl_dirpage *dirpage = ptl->ep->amsh_dirpage;
+
+    if (dirpage->egrcredit_gen[shmidx] != dirpage->attach_gen[shmidx])
+        return -1;
+    ips_rmb();
+    return dirpage->egrcredit_window[shmidx];
+}
+
 static
 psm_error_t
 amsh_epaddr_add(ptl_t *ptl, psm_epid_t epid, int shmidx, psm_epaddr_t *epaddr_o)
@@ -1069,6 +1213,7 @@ amsh_epaddr_add(ptl_t *ptl, psm_epid_t epid, int shmidx, psm_epaddr_t *epaddr_o)
     epaddr->epid = epid;
     epaddr->ep = ptl->ep;
     epaddr->_shmidx = shmidx;
+    epaddr->egrcredit_granted = amsh_egrcredit_grant(ptl);
     AMSH_CSTATE_TO_SET(epaddr, NONE);
     AMSH_CSTATE_FROM_SET(epaddr, NONE);
     if ((err = psmi_epid_set_hostname(psm_epid_nid(epid), 
@@ -1091,6 +1236,40 @@ fail:
     return err;
 }
 
+/*
+ * Local peers may connect to us without a handshake, the first packet from
+ * such a peer is what tells us about it.  Everything the handshake would have
+ * carried is in the dirpage, so add the peer here before running its handler.
+ */
+static
+psm_epaddr_t
+amsh_epaddr_lazy_add(ptl_t *ptl, int shmidx)
+{
+    struct am_ctl_dirpage *dirpage = ptl->ep->amsh_dirpage;
+    psm_epid_t epid = dirpage->shmidx_map_epid[shmidx];
+    psm_epaddr_t epaddr;
+    psm_error_t err;
+    int64_t window;
+
+    psmi_assert_always(shmidx < PTL_AMSH_MAX_LOCAL_PROCS && epid != 0);
+
+    epaddr = psmi_epid_lookup(ptl->ep, epid);
+    if (epaddr == NULL &&
+        (err = amsh_epaddr_add(ptl, epid, shmidx, &epaddr)))
+        psmi_handle_error(PSMI_EP_NORETURN, err, "Fatal error "
+                "in connecting to shm segment");
+
+    /* The peer published before connecting, 0 (no flow control) if not */
+    window = amsh_egrcredit_peer(ptl, shmidx);
+    epaddr->egrcredit_window = window < 0 ? 0 : (uint32_t) window;
+    AMSH_CSTATE_FROM_SET(epaddr, ESTABLISHED);
+    ptl->connect_from++;
+
+    _IPATH_VDBG("Lazy connect from %s at shmidx=%d\n",
+                psmi_epaddr_get_name(epid), shmidx);
+    return epaddr;
+}
+
 struct ptl_connection_req 
 {
     int         isdone;
@@ -1105,7 +1284,7 @@ struct ptl_connection_req
     psm_error_t       *errors;    /* inout errors */
 
     /* Used for connect/disconnect */
-    psm_amarg_t args[4];
+    psm_amarg_t args[8];
 };
 
 /*
@@ -1406,6 +1585,11 @@ amsh_ep_connreq_init(ptl_t *ptl,
     req->epids = array_of_epid;
     req->errors = array_of_errors;
 
+    /* Publish the eager credits we grant, a peer connecting without a
+     * handshake picks them up from the dirpage */
+    if (op == PTL_OP_CONNECT)
+        amsh_egrcredit_grant(ptl);
+
     /* First check if there's really something to connect/disconnect 
      * for this PTL */
     for (i = 0; i < numep; i++) {
@@ -1510,8 +1694,9 @@ amsh_ep_connreq_poll(ptl_t *ptl, struct ptl_connection_req *req)
                 if (shmidx < PTL_AMSH_MAX_LOCAL_PROCS) {  /* not remote nodes */
 #endif
                     /* Make sure the target of the disconnect is still there */
-                    pthread_mutex_lock((pthread_mutex_t *) &(ptl->ep->amsh_dirpage->lock));
-                    if (ptl->ep->amsh_dirpage->shmidx_map_epid[shmidx] != epaddr->epid) {
+                    amsh_dirpage_lock(ptl->ep);
+                    if (ptl->ep->amsh_dirpage->shmidx_map_epid[shmidx] != epaddr->epid ||
+                        AMSH_PEER_DEAD(ptl, shmidx)) {
                         req->numep_left--;
                         req->epid_mask[i] = AMSH_CMASK_DONE;
                         AMSH_CSTATE_TO_SET(epaddr, NONE);
@@ -1541,6 +1726,12 @@ amsh_ep_connreq_poll(ptl_t *ptl, struct ptl_connection_req *req)
                     req->epid_mask[i] = AMSH_CMASK_DONE;
                     AMSH_CSTATE_TO_SET(epaddr, NONE);
                 }
+                else if (AMSH_PEER_DEAD(ptl, epaddr->_shmidx)) {
+                    /* No one left to reply */
+                    req->numep_left--;
+                    req->epid_mask[i] = AMSH_CMASK_DONE;
+                    req->errors[i] = PSM_EPID_UNREACHABLE;
+                }
             }
         }
     }
@@ -1567,11 +1758,12 @@ amsh_ep_connreq_poll(ptl_t *ptl, struct ptl_connection_req *req)
         if (n_prereq > 0) { 
             char buf[32];
             uint16_t their_verno;
+            int64_t window;
 
             psmi_assert(req->numep_left > 0);
             /* Go through the list of peers we need to connect to and find out
              * if they each shared ep is mapped into shm */
-            pthread_mutex_lock((pthread_mutex_t *) &(ptl->ep->amsh_dirpage->lock));
+            amsh_dirpage_lock(ptl->ep);
             for (i = 0; i < req->numep; i++) {
                 if (req->epid_mask[i] != AMSH_CMASK_PREREQ)
                     continue;
@@ -1613,8 +1805,12 @@ amsh_ep_connreq_poll(ptl_t *ptl, struct ptl_connection_req *req)
 		}
 
                 /* Before we even send the request out, check to see if
-                 * versions are interoperable */
-                if (!psmi_verno_isinteroperable(their_verno)) {
+                 * versions are interoperable.  A local peer attached without
+                 * AMSH_HAVE_DIRPAGE_VERNO uses another dirpage layout. */
+                if (!psmi_verno_isinteroperable(their_verno) ||
+                    (shmidx < PTL_AMSH_MAX_LOCAL_PROCS &&
+                     !(ptl->ep->amsh_dirpage->amsh_features[shmidx] &
+                       AMSH_HAVE_DIRPAGE_VERNO))) {
                     snprintf(buf,sizeof buf, "%d.%d",
                             PSMI_VERNO_GET_MAJOR(their_verno),
                             PSMI_VERNO_GET_MINOR(their_verno));
@@ -1641,15 +1837,36 @@ amsh_ep_connreq_poll(ptl_t *ptl, struct ptl_connection_req *req)
                 } 
 
                 req->epaddr[i] = epaddr;
+
+                /* The peer's block is published and mapped, there's nothing
+                 * a request/reply would tell either side that it can't read
+                 * from the dirpage.  The peer learns about us from our first
+                 * packet, if it knows how to, and we need the credits it
+                 * grants published, else it's the handshake. */
+                if (ptl->connect_lazy && shmidx < PTL_AMSH_MAX_LOCAL_PROCS &&
+                    (ptl->ep->amsh_dirpage->amsh_features[shmidx] &
+                     AMSH_HAVE_LAZY_CONNECT) &&
+                    (window = amsh_egrcredit_peer(ptl, shmidx)) >= 0) {
+                    epaddr->egrcredit_window = (uint32_t) window;
+                    AMSH_CSTATE_TO_SET(epaddr, ESTABLISHED);
+                    AMSH_LAZY_SET(ptl->ep->amsh_dirpage, shmidx, ptl->shmidx);
+                    ptl->connect_to++;
+                    req->errors[i] = PSM_OK;
+                    req->numep_left--;
+                    req->epid_mask[i] = AMSH_CMASK_DONE;
+                    continue;
+                }
+
                 req->args[0].u32w0 = PSMI_AM_CONN_REQ;
                 req->args[0].u32w1 = ptl->connect_phase;
                 req->args[1].u64w0 = (uint64_t) ptl->epid;
                 req->args[2].u32w0 = PSMI_VERNO;
                 req->args[2].u32w1 = PSM_OK;
                 req->args[3].u64w0 = (uint64_t)(uintptr_t)&req->errors[i];
+                req->args[4].u64w0 = epaddr->egrcredit_granted;
                 req->epid_mask[i] = AMSH_CMASK_POSTREQ;
                 psmi_amsh_short_request(ptl, epaddr, amsh_conn_handler_hidx,
-                                    req->args, 4, NULL, 0, 0);
+                                    req->args, 5, NULL, 0, 0);
 	        _IPATH_PRDBG("epaddr=%p, epid=%" PRIx64 " at shmidx=%d\n", 
                     epaddr, epid, shmidx);
             }
@@ -1825,6 +2042,21 @@ amsh_ep_connect(ptl_t *ptl,
                                 array_of_epaddr, timeout_ns);
 }
 
+static
+psm_error_t 
+amsh_ep_connect_start(ptl_t *ptl,
+             int numep,
+	     const psm_epid_t *array_of_epid, 
+	     const int array_of_epid_mask[],
+             psm_error_t *array_of_errors,
+	     psm_epaddr_t *array_of_epaddr,
+             struct ptl_connection_req **req_o)
+{
+    return amsh_ep_connreq_init(ptl, PTL_OP_CONNECT, numep, array_of_epid,
+                                array_of_epid_mask, array_of_errors,
+                                array_of_epaddr, req_o);
+}
+
 static
 psm_error_t
 amsh_ep_disconnect(ptl_t *ptl, int force, int numep, 
@@ -1842,17 +2074,48 @@ amsh_ep_disconnect(ptl_t *ptl, int force, int numep,
    instead of using the tail/lock in the shq, use a separate per-domain
    tail/lock.  The queue is actually located on a remote node, but tailinfo
    is located on the local node (and shared by peers on the same node) */
+PSMI_ALWAYS_INLINE(
+void
+amsh_qtail_lock(ptl_t *ptl, struct amsh_qtail_info* tailinfo))
+{
+    uint32_t me = ptl->shmidx + 1;
+    uint32_t owner, spins = 0;
+
+    while ((owner = ips_cmpxchg(&tailinfo->lock, 0, me)) != 0) {
+        if_pf (ptl->robust && ++spins == AMSH_LOCK_SPINS_BEFORE_CHECK) {
+            spins = 0;
+            /* Holder died in its critical section, take the lock over */
+            if (amsh_peer_is_dead(ptl, owner - 1) &&
+                ips_cmpxchg(&tailinfo->lock, owner, me) == owner)
+                break;
+        }
+    }
+}
+
+PSMI_ALWAYS_INLINE(
+void
+amsh_qtail_unlock(struct amsh_qtail_info* tailinfo))
+{
+    ips_wmb();
+    tailinfo->lock = 0;
+}
+
 static
 am_pkt_short_t*
-am_ctl_getslot_pkt_inner(struct amsh_qtail_info* tailinfo,
+am_ctl_getslot_pkt_inner(ptl_t *ptl, int shmidx,
+                         struct amsh_qtail_info* tailinfo,
                          volatile am_ctl_qhdr_t *shq,
                          am_pkt_short_t *pkt0)
 {
     am_pkt_short_t* pkt;
     uint32_t idx;
 
+    /* Nobody drains a dead peer's queues, sends to it are discarded */
+    if_pf (AMSH_PEER_DEAD(ptl, shmidx))
+        return (am_pkt_short_t *) ptl->robust_sink;
+
     /* Acquire a slot/packet in the remote queue. */
-    pthread_spin_lock(&tailinfo->lock);
+    amsh_qtail_lock(ptl, tailinfo);
     idx = tailinfo->tail;
 
     /* Careful here -- pkt is pointing to memory on a remote node, so any
@@ -1860,7 +2123,9 @@ am_ctl_getslot_pkt_inner(struct amsh_qtail_info* tailinfo,
     pkt = (void*)((uintptr_t)pkt0 + idx * shq->elem_sz);
     if(pkt->flag == QFREE) {
         ips_sync_reads();
-        pkt->flag = QUSED;
+        /* Slots in other nodes can't be reclaimed by their owner's pid */
+        pkt->flag = shmidx < PTL_AMSH_MAX_LOCAL_PROCS ? 
+                        QUSED_BY(ptl->shmidx) : QUSED;
 
         tailinfo->tail += 1;
         if(tailinfo->tail == shq->elem_cnt) {
@@ -1869,7 +2134,7 @@ am_ctl_getslot_pkt_inner(struct amsh_qtail_info* tailinfo,
     } else {
         pkt = NULL;
     }
-    pthread_spin_unlock(&tailinfo->lock);
+    amsh_qtail_unlock(tailinfo);
 
     return pkt;
 }
@@ -1929,6 +2194,25 @@ am_ctl_getslot_pkt_inner(volatile am_ctl_qhdr_t *shq, am_pkt_short_t *pkt0)
 }
 #endif
 
+/*
+ * Fault injection on the shm fifos.  Shared memory has no retransmission so
+ * packets are never lost here, instead a scripted stall makes the fifo look
+ * full and a delay holds back one send the same way.  Rules match the peer
+ * shmidx and use flow 0 for requests, 1 for replies.
+ */
+PSMI_ALWAYS_INLINE(
+int
+am_ctl_getslot_fault(int shmidx, int is_reply))
+{
+    if_pf (PSMI_FAULTINJ_ENABLED()) {
+	PSMI_FAULTINJ_STATIC_DECL(fi, "shmsend", 0, 1);
+	int fault = psmi_faultinj_event(fi, shmidx, is_reply);
+	return fault == PSMI_FAULTINJ_STALL || fault == PSMI_FAULTINJ_DELAY;
+    }
+    else
+	return 0;
+}
+
 /* This is safe because 'flag' is at the same offset on both pkt and bulkpkt */
 #define am_ctl_getslot_bulkpkt_inner(shq,pkt0) ((am_pkt_bulk_t *) \
             am_ctl_getslot_pkt_inner(shq,(am_pkt_short_t *)(pkt0)))
@@ -1942,6 +2226,9 @@ am_ctl_getslot_pkt(ptl_t *ptl, int shmidx, int is_reply)
     volatile am_ctl_qhdr_t   *shq;
     am_pkt_short_t  *pkt0;
 
+        if_pf (am_ctl_getslot_fault(shmidx, is_reply))
+            return NULL;
+
         /* It's not obvious, but the packet acquisition code below is accessing
            memory mapped remotely from a peer on another SCIF node. Thus we
            have to make sure a SCIF connection to that peer is already
@@ -1967,7 +2254,7 @@ am_ctl_getslot_pkt(ptl_t *ptl, int shmidx, int is_reply)
             pkt0 = ptl->ep->amsh_qdir[shmidx].qrepFifoShort;
         }
 
-        return am_ctl_getslot_pkt_inner(tailinfo, shq, pkt0);
+        return am_ctl_getslot_pkt_inner(ptl, shmidx, tailinfo, shq, pkt0);
 }
 
 PSMI_ALWAYS_INLINE(
@@ -1979,6 +2266,9 @@ am_ctl_getslot_med(ptl_t *ptl, int shmidx, int is_reply)
     volatile am_ctl_qhdr_t   *shq;
     am_pkt_bulk_t  *pkt0;
 
+    if_pf (am_ctl_getslot_fault(shmidx, is_reply))
+        return NULL;
+
     if(!is_reply) {
         tailinfo = &ptl->ep->amsh_dirpage->qtails[shmidx].reqFifoMed;
         shq  = &(ptl->ep->amsh_qdir[shmidx].qreqH->medbulkq);
@@ -1989,7 +2279,7 @@ am_ctl_getslot_med(ptl_t *ptl, int shmidx, int is_reply)
         pkt0 = ptl->ep->amsh_qdir[shmidx].qrepFifoMed; 
     }
 
-    return (am_pkt_bulk_t*)am_ctl_getslot_pkt_inner(tailinfo,
+    return (am_pkt_bulk_t*)am_ctl_getslot_pkt_inner(ptl, shmidx, tailinfo,
             shq, (am_pkt_short_t*)pkt0);
 }
 
@@ -2002,6 +2292,9 @@ am_ctl_getslot_long(ptl_t *ptl, int shmidx, int is_reply)
     volatile am_ctl_qhdr_t   *shq;
     am_pkt_bulk_t  *pkt0;
 
+    if_pf (am_ctl_getslot_fault(shmidx, is_reply))
+        return NULL;
+
     if(!is_reply) {
         tailinfo = &ptl->ep->amsh_dirpage->qtails[shmidx].reqFifoLong;
         shq  = &(ptl->ep->amsh_qdir[shmidx].qreqH->longbulkq);
@@ -2012,7 +2305,7 @@ am_ctl_getslot_long(ptl_t *ptl, int shmidx, int is_reply)
         pkt0 = ptl->ep->amsh_qdir[shmidx].qrepFifoLong; 
     }
 
-    return (am_pkt_bulk_t*)am_ctl_getslot_pkt_inner(tailinfo,
+    return (am_pkt_bulk_t*)am_ctl_getslot_pkt_inner(ptl, shmidx, tailinfo,
             shq, (am_pkt_short_t*)pkt0);
 }
 
@@ -2025,6 +2318,9 @@ am_ctl_getslot_huge(ptl_t *ptl, int shmidx, int is_reply)
     volatile am_ctl_qhdr_t   *shq;
     am_pkt_bulk_t  *pkt0;
 
+    if_pf (am_ctl_getslot_fault(shmidx, is_reply))
+        return NULL;
+
     if(!is_reply) {
         tailinfo = &ptl->ep->amsh_dirpage->qtails[shmidx].reqFifoHuge;
         shq  = &(ptl->ep->amsh_qdir[shmidx].qreqH->hugebulkq);
@@ -2035,7 +2331,7 @@ am_ctl_getslot_huge(ptl_t *ptl, int shmidx, int is_reply)
         pkt0 = ptl->ep->amsh_qdir[shmidx].qrepFifoHuge; 
     }
 
-    return (am_pkt_bulk_t*)am_ctl_getslot_pkt_inner(tailinfo,
+    return (am_pkt_bulk_t*)am_ctl_getslot_pkt_inner(ptl, shmidx, tailinfo,
             shq, (am_pkt_short_t*)pkt0);
 }
 
@@ -2059,6 +2355,93 @@ advance_head(volatile am_ctl_qshort_cache_t *hdr))
         hdr->head = hdr->base;
 }
 
+/* Mark the slots of our own fifos that a dead peer left half-written.  A
+ * short slot is poisoned so the head skips over it in order, a bulk slot
+ * can't have been referenced yet and is simply freed. */
+#define AMSH_RECLAIM_SLOTS(_fifo, _flag) do {                               \
+        for (j = 0; j < amsh_qcounts.q ## _fifo; j++) {                    \
+            am_pkt_short_t *pkt =                                           \
+                QGETPTR(ptl, ptl->shmidx, _fifo, short, j);                 \
+            uint32_t flag = pkt->flag;                                      \
+            if (QSTATE(flag) == QUSED && QOWNER(flag) == shmidx) {          \
+                _QMARK_FLAG(pkt, _flag);                                    \
+                nreclaimed++;                                               \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+static
+void
+amsh_robust_peer_died(ptl_t *ptl, int shmidx)
+{
+    struct am_ctl_dirpage *dirpage = ptl->ep->amsh_dirpage;
+    psm_epaddr_t epaddr = ptl->ep->amsh_qdir[shmidx].amsh_epaddr;
+    uint32_t owner = shmidx + 1;
+    int i, j, nreclaimed = 0;
+
+    if (ptl->robust_sink == NULL) {
+        ptl->robust_sink = psmi_malloc(ptl->ep, UNDEFINED, AMHUGE_SZ);
+        if (ptl->robust_sink == NULL)
+            psmi_handle_error(PSMI_EP_NORETURN, PSM_NO_MEMORY,
+                    "Couldn't allocate shm discard buffer");
+    }
+    ptl->peer_dead[shmidx] = 1;
+
+    /* Tail locks it died holding, the qtail infos are laid out as an array */
+    for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS*PTL_AMSH_MAX_LOCAL_NODES; i++) {
+        amsh_qtail_info_t *qti = (amsh_qtail_info_t *) &dirpage->qtails[i];
+        for (j = 0; j < sizeof(struct amsh_qtail)/sizeof(*qti); j++)
+            if (ips_cmpxchg(&qti[j].lock, owner, 0) == owner)
+                nreclaimed++;
+    }
+
+    AMSH_RECLAIM_SLOTS(reqFifoShort, QPOISON);
+    AMSH_RECLAIM_SLOTS(reqFifoMed, QFREE);
+    AMSH_RECLAIM_SLOTS(reqFifoLong, QFREE);
+    AMSH_RECLAIM_SLOTS(reqFifoHuge, QFREE);
+    AMSH_RECLAIM_SLOTS(repFifoShort, QPOISON);
+    AMSH_RECLAIM_SLOTS(repFifoMed, QFREE);
+    AMSH_RECLAIM_SLOTS(repFifoLong, QFREE);
+    AMSH_RECLAIM_SLOTS(repFifoHuge, QFREE);
+
+    /* Don't wait on it for disconnects */
+    if (epaddr != NULL) {
+        int cstate = AMSH_CSTATE_TO_GET(epaddr);
+        if (cstate == AMSH_CSTATE_TO_REPLIED ||
+            cstate == AMSH_CSTATE_TO_ESTABLISHED) {
+            AMSH_CSTATE_TO_SET(epaddr, NONE);
+            ptl->connect_to--;
+        }
+        if (AMSH_CSTATE_FROM_GET(epaddr) == AMSH_CSTATE_FROM_ESTABLISHED) {
+            AMSH_CSTATE_FROM_SET(epaddr, NONE);
+            ptl->connect_from--;
+        }
+    }
+
+    psmi_handle_error(ptl->ep, PSM_EPID_UNREACHABLE,
+            "Local peer %s (shm index %d, pid %d) died, "
+            "%d shm locks and slots reclaimed",
+            epaddr ? psmi_epaddr_get_name(epaddr->epid) : "(unconnected)",
+            shmidx, dirpage->kassist_pids[shmidx], nreclaimed);
+}
+
+static
+void
+amsh_robust_check(ptl_t *ptl)
+{
+    struct am_ctl_dirpage *dirpage = ptl->ep->amsh_dirpage;
+    int i;
+
+    ptl->robust_next_check = get_cycles() + ptl->robust_interval;
+    for (i = 0; i <= dirpage->max_idx && i < PTL_AMSH_MAX_LOCAL_PROCS; i++) {
+        if (i == ptl->shmidx || ptl->peer_dead[i] ||
+            dirpage->shmidx_map_epid[i] == 0)
+            continue;
+        if (amsh_peer_is_dead(ptl, i))
+            amsh_robust_peer_died(ptl, i);
+    }
+}
+
 #define AMSH_ZERO_POLLS_BEFORE_YIELD    64
 #define AMSH_POLLS_BEFORE_PSM_POLL      16
 
@@ -2134,6 +2517,11 @@ amsh_poll_internal_inner(ptl_t *ptl, int replyonly, int is_internal))
 #endif
     }
 
+    /* No progress, peers may be gone */
+    if_pf (ptl->robust && err == PSM_OK_NO_PROGRESS &&
+           get_cycles() >= ptl->robust_next_check)
+        amsh_robust_check(ptl);
+
     if (is_internal) {
         if (err == PSM_OK) /* some progress, no yields */
             ptl->zero_polls = 0;
@@ -2561,6 +2949,18 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
     uintptr_t bulkptr;
     am_pkt_bulk_t *bulkpkt;
 
+    if_pf (pkt->flag == QPOISON)
+        return;
+
+    if_pf (tok.tok.epaddr_from == NULL && shmidx < PTL_AMSH_MAX_LOCAL_PROCS)
+        tok.tok.epaddr_from = amsh_epaddr_lazy_add(ptl, shmidx);
+
+    /* The short packet (with any inline payload) is the header, bulk
+     * payloads aren't kept */
+    if_pf (PSMI_CAPTURE_ENABLED())
+        psmi_capture_packet(ptl->ep, PSMI_CAPTURE_RX, PSMI_CAPTURE_SHM,
+                            pkt, sizeof(am_pkt_short_t), NULL, 0);
+
     /* It is possible for packets to arrive (the initial ones for connection
        establishment) before amsh_epid is set correctly.  However this can only
        happen for peers in the same node -- those connecting inter-node via
@@ -2682,7 +3082,7 @@ amsh_mq_rndv(ptl_t *ptl, psm_mq_t mq, psm_mq_req_t req,
     psm_amarg_t args[5] = {};
     psm_error_t err = PSM_OK;
 
-    args[0].u32w0 = MQ_MSG_RTS;
+    args[0].u32w0 = AMSH_MQ_MODE(mq, MQ_MSG_RTS);
     args[0].u32w1 = len;
     args[1].u64w0 = tag;
     args[2].u64w0 = (uint64_t)(uintptr_t) req;
@@ -2748,11 +3148,18 @@ amsh_mq_send_inner(psm_mq_t mq, psm_mq_req_t req, psm_epaddr_t epaddr,
     psm_error_t err = PSM_OK;
     int is_blocking = (req == NULL);
 
+    /* Out of eager credits at the receiver, don't grow its unexpected queue */
+    if_pf (epaddr->egrcredit_window && !(flags & PSM_MQ_FLAG_SENDSYNC) &&
+	   (len <= psmi_am_max_sizes.request_short ||
+	    len <= mq->shm_thresh_rv) &&
+	   !mq_egrcredit_take(epaddr, len))
+	goto do_rendezvous;
+
     if (!flags && len <= psmi_am_max_sizes.request_short) {
 	if (len <= 32) 
-	    args[0].u32w0 = MQ_MSG_TINY;
+	    args[0].u32w0 = AMSH_MQ_MODE(mq, MQ_MSG_TINY);
 	else 
-	    args[0].u32w0 = MQ_MSG_SHORT;
+	    args[0].u32w0 = AMSH_MQ_MODE(mq, MQ_MSG_SHORT);
 	args[1].u64 = tag;
 
 	psmi_amsh_short_request(epaddr->ptl, epaddr, mq_handler_hidx, args, 2, 
@@ -2764,7 +3171,7 @@ amsh_mq_send_inner(psm_mq_t mq, psm_mq_req_t req, psm_epaddr_t epaddr,
 	uint32_t bytes_left = len;
 	uint32_t bytes_this = min(bytes_left, psmi_am_max_sizes.request_short);
 	uint8_t *buf = (uint8_t *)ubuf;
-	args[0].u32w0 = MQ_MSG_LONG;
+	args[0].u32w0 = AMSH_MQ_MODE(mq, MQ_MSG_LONG);
         args[0].u32w1 = len;
 	args[1].u64 = tag;
 	psmi_amsh_short_request(epaddr->ptl, epaddr, mq_handler_hidx, args, 2, 
@@ -3103,12 +3510,19 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
                 psmi_assert(psmi_epid_lookup(ptl->ep, epid) != NULL);
             }
 
+            /* Eager credits granted to us by the requestor */
+            epaddr->egrcredit_window = narg > 4 ? args[4].u32w0 : 0;
+
             /* Do some version comparison, error checking if required. */
             /* Rewrite args */
-            ptl->connect_from++;
+            /* Already counted if the peer's first packet beat this one */
+            if (AMSH_CSTATE_FROM_GET(epaddr) != AMSH_CSTATE_FROM_ESTABLISHED)
+                ptl->connect_from++;
             args[0].u32w0 = PSMI_AM_CONN_REP;
             args[1].u64w0 = (psm_epid_t) ptl->epid;
             args[2].u32w1 = PSM_OK;
+            if (narg > 4)
+                args[4].u64w0 = epaddr->egrcredit_granted;
             AMSH_CSTATE_FROM_SET(epaddr, ESTABLISHED);
             tok->tok.epaddr_from = epaddr; /* adjust token */
             psmi_amsh_short_reply(tok, amsh_conn_handler_hidx, 
@@ -3123,6 +3537,7 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
             }
             epaddr = ptl->ep->amsh_qdir[shmidx].amsh_epaddr;
             *perr = err;
+            epaddr->egrcredit_window = narg > 4 ? args[4].u32w0 : 0;
             AMSH_CSTATE_TO_SET(epaddr, REPLIED);
             ptl->connect_to++;
             break;
@@ -3131,8 +3546,10 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
             epaddr = tok->tok.epaddr_from;
             args[0].u32w0 = PSMI_AM_DISC_REP;
             args[2].u32w1 = PSM_OK;
+            /* A peer that reconnected without a handshake was never counted */
+            if (AMSH_CSTATE_FROM_GET(epaddr) == AMSH_CSTATE_FROM_ESTABLISHED)
+                ptl->connect_from--;
             AMSH_CSTATE_FROM_SET(epaddr, DISC_REQ);
-            ptl->connect_from--;
             /* Before sending the reply, make sure the process
              * is still connected */
 
@@ -3140,7 +3557,7 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
 #ifdef PSM_HAVE_SCIF
             if (shmidx < PTL_AMSH_MAX_LOCAL_PROCS) {
 #endif
-                pthread_mutex_lock((pthread_mutex_t *) &(ptl->ep->amsh_dirpage->lock));
+                amsh_dirpage_lock(ptl->ep);
                 if (ptl->ep->amsh_dirpage->shmidx_map_epid[shmidx] != epaddr->epid)
                     is_valid = 0;
                 pthread_mutex_unlock((pthread_mutex_t *) &(ptl->ep->amsh_dirpage->lock));
@@ -3163,6 +3580,12 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
             epaddr = tok->tok.epaddr_from;
             AMSH_CSTATE_TO_SET(epaddr, DISC_REPLIED);
             ptl->connect_to--;
+            if (shmidx < PTL_AMSH_MAX_LOCAL_PROCS) {
+                amsh_dirpage_lock(ptl->ep);
+                AMSH_LAZY_CLR(ptl->ep->amsh_dirpage, shmidx, ptl->shmidx);
+                pthread_mutex_unlock(
+                    (pthread_mutex_t *) &(ptl->ep->amsh_dirpage->lock));
+            }
             break;
 
         default:
@@ -3223,10 +3646,37 @@ amsh_init(psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
     ptl->connect_phase = 0;
     ptl->connect_from = 0;
     ptl->connect_to = 0;
+    ptl->egrcredit_latched = 0;
+    ptl->egrcredit_grant = 0;
 
     memset(&ptl->amsh_empty_shortpkt, 0, sizeof ptl->amsh_empty_shortpkt);
     memset(&ptl->psmi_am_reqq_fifo, 0, sizeof ptl->psmi_am_reqq_fifo);
 
+    {
+        union psmi_envvar_val env_robust;
+
+        psmi_getenv("PSM_SHM_ROBUST",
+                "Interval in ms to check for dead local peers (0 disables)",
+                PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+                (union psmi_envvar_val) AMSH_ROBUST_INTERVAL_MS, &env_robust);
+        ptl->robust = !!env_robust.e_uint;
+        ptl->robust_interval = 
+            nanosecs_to_cycles(1000000ULL * env_robust.e_uint);
+        ptl->robust_next_check = 0;
+        ptl->robust_sink = NULL;
+        memset(ptl->peer_dead, 0, sizeof ptl->peer_dead);
+    }
+
+    {
+        union psmi_envvar_val env_lazy;
+
+        psmi_getenv("PSM_SHM_LAZY_CONNECT",
+                "Connect to local peers from the shm directory, no handshake",
+                PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+                (union psmi_envvar_val) 1, &env_lazy);
+        ptl->connect_lazy = env_lazy.e_uint;
+    }
+
     if ((err = amsh_init_segment(ptl)))
         goto fail;
 
@@ -3237,6 +3687,9 @@ amsh_init(psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
     ctl->ptl = ptl;
     ctl->ep_poll = amsh_poll;
     ctl->ep_connect = amsh_ep_connect;
+    ctl->ep_connect_start = amsh_ep_connect_start;
+    ctl->ep_connect_poll = amsh_ep_connreq_poll;
+    ctl->ep_connect_fini = amsh_ep_connreq_fini;
     ctl->ep_disconnect = amsh_ep_disconnect;
 
     ctl->mq_send  = amsh_mq_send;
@@ -3265,6 +3718,37 @@ fail:
     return err;
 }
 
+/*
+ * Number of local peers still connected to us without a handshake.  Such a
+ * peer may never have sent us anything, so it is in neither connect_from nor
+ * connect_to, but it will send us a disconnect request and wait for the
+ * reply.  Peers that died are dropped.
+ */
+static
+int
+amsh_lazy_pending(ptl_t *ptl)
+{
+    struct am_ctl_dirpage *dirpage = ptl->ep->amsh_dirpage;
+    volatile uint32_t *row = dirpage->lazy_from[ptl->shmidx];
+    uint32_t bits;
+    int i, b, n = 0;
+
+    /* Only peers that are gone need the lock, to be cleared */
+    for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS/32; i++) {
+        for (bits = row[i]; bits; bits &= bits - 1) {
+            b = i*32 + __builtin_ctz(bits);
+            if (dirpage->shmidx_map_epid[b] == 0 || AMSH_PEER_DEAD(ptl, b)) {
+                amsh_dirpage_lock(ptl->ep);
+                AMSH_LAZY_CLR(dirpage, ptl->shmidx, b);
+                pthread_mutex_unlock((pthread_mutex_t *) &dirpage->lock);
+            }
+            else
+                n++;
+        }
+    }
+    return n;
+}
+
 static
 psm_error_t 
 amsh_fini(ptl_t *ptl, int force, uint64_t timeout_ns)
@@ -3329,13 +3813,15 @@ amsh_fini(ptl_t *ptl, int force, uint64_t timeout_ns)
     //Are we somehow losing a message that arrives somewhere between where we
     //start to disconnect, and here?
 
-    if (ptl->connect_from > 0 || ptl->connect_to > 0) {
-        while (ptl->connect_from > 0 || ptl->connect_to > 0) {
+    if (ptl->connect_from > 0 || ptl->connect_to > 0 ||
+        amsh_lazy_pending(ptl)) {
+        while (ptl->connect_from > 0 || ptl->connect_to > 0 ||
+               amsh_lazy_pending(ptl)) {
             if (!psmi_cycles_left(t_start, timeout_ns)) {
                 err = PSM_TIMEOUT;
-                _IPATH_VDBG("CCC timed out with from=%d,to=%d\n",
+                _IPATH_VDBG("CCC timed out with from=%d,to=%d,lazy=%d\n",
                         ptl->connect_from,
-                        ptl->connect_to);
+                        ptl->connect_to, amsh_lazy_pending(ptl));
                 break;
             }
 	    psmi_poll_internal(ptl->ep, 1);
@@ -3347,6 +3833,13 @@ amsh_fini(ptl_t *ptl, int force, uint64_t timeout_ns)
                 ptl->connect_to);
     }
 
+    /* The directory goes away with the segment */
+    ptl->robust = 0;
+    if (ptl->robust_sink != NULL) {
+        psmi_free(ptl->robust_sink);
+        ptl->robust_sink = NULL;
+    }
+
     if ((err_seg = psmi_shm_detach(ptl->ep))) {
         err = err_seg;
         goto fail;
@@ -162,6 +162,11 @@ psmi_amsh_am_short_reply(psm_am_token_t tok,
 #define mq_handler_rtsdone_hidx  5
 #define am_handler_hidx          6
 
+/* mq_handler envelopes carry the sender's MQ id above the message mode */
+#define AMSH_MQ_MODE(mq, mode)   ((uint32_t)(mode) | ((mq)->id << 16))
+#define AMSH_MQ_MODE_GET(w)      ((w) & 0xffff)
+#define AMSH_MQ_ID_GET(w)        ((w) >> 16)
+
 #define AMREQUEST_SHORT 0
 #define AMREQUEST_LONG  1
 #define AMREPLY_SHORT   2
@@ -224,8 +229,15 @@ void psmi_am_reqq_add(int amtype, ptl_t *ptl, psm_epaddr_t epaddr,
 #define QREADY     2
 #define QREADYMED  3
 #define QREADYLONG 4
+#define QPOISON    5	/* left half-written by a dead peer, skipped */
+
+/* A slot being filled is tagged with the local shmidx of the filler so that
+ * it can be reclaimed if the filler dies before marking it ready. */
+#define QUSED_BY(shmidx) (QUSED | (((shmidx)+1) << 8))
+#define QSTATE(flag)	 ((flag) & 0xff)
+#define QOWNER(flag)	 ((int)((flag) >> 8) - 1)
 
-#define QISEMPTY(flag) (flag<QREADY)
+#define QISEMPTY(flag) (QSTATE(flag)<QREADY)
 #ifdef __powerpc__
 #  define _QMARK_FLAG_FENCE()  asm volatile("lwsync" : : : "memory")
 #elif defined(__x86_64__) || defined(__i386__)
@@ -419,8 +431,8 @@ struct amsh_qdirectory {
 typedef struct amsh_qtail_info
 {
     volatile uint32_t tail;
-    volatile pthread_spinlock_t  lock;
-    uint8_t  _pad0[64-1*4-sizeof(pthread_spinlock_t)];
+    volatile uint32_t lock;	/* local shmidx+1 of the holder, 0 if free */
+    uint8_t  _pad0[64-2*4];
 } amsh_qtail_info_t;
 PSMI_STRICT_SIZE_DECL(amsh_qtail_info_t,64);
 
@@ -437,13 +449,20 @@ struct amsh_qtail
     amsh_qtail_info_t repFifoHuge;
 } __attribute__ ((aligned(64)));
 
+/* Layout of struct am_ctl_dirpage and of the fifo tails it holds.  Bump it
+ * whenever either changes: endpoints only attach to a segment initialized
+ * with the same layout, and only connect to peers advertising
+ * AMSH_HAVE_DIRPAGE_VERNO (libraries before it left layout_verno zero). */
+#define AMSH_DIRPAGE_VERNO	3
+
 /* The first shared memory page is a control page to support each endpoint
  * independently adding themselves to the shared memory segment. */
 struct am_ctl_dirpage {
     pthread_mutex_t lock;
     char            _pad0[64-sizeof(pthread_mutex_t)];
     volatile int    is_init;
-    char            _pad1[64-sizeof(int)];
+    uint32_t	    layout_verno;   /* AMSH_DIRPAGE_VERNO of the creator */
+    char            _pad1[64-sizeof(int)-sizeof(uint32_t)];
 
     uint16_t        psm_verno[PTL_AMSH_MAX_LOCAL_PROCS];
     uint32_t        amsh_features[PTL_AMSH_MAX_LOCAL_PROCS];
@@ -453,6 +472,20 @@ struct am_ctl_dirpage {
     psm_epid_t      shmidx_map_epid[PTL_AMSH_MAX_LOCAL_PROCS];
     int		    kcopy_minor;
     int		    kassist_pids[PTL_AMSH_MAX_LOCAL_PROCS];
+    /* Process start times, tell a dead peer from a recycled pid */
+    uint64_t	    pid_starttime[PTL_AMSH_MAX_LOCAL_PROCS];
+    /* Bumped by each endpoint that takes the slot, never 0 once taken */
+    uint32_t	    attach_gen[PTL_AMSH_MAX_LOCAL_PROCS];
+    /* Eager credits each endpoint grants its peers, published at connect
+     * time so that peers can connect without a handshake.  The window is
+     * only valid while egrcredit_gen matches the slot's attach_gen. */
+    uint32_t	    egrcredit_window[PTL_AMSH_MAX_LOCAL_PROCS];
+    volatile uint32_t egrcredit_gen[PTL_AMSH_MAX_LOCAL_PROCS];
+    /* Bit b of lazy_from[a] is set while endpoint b is connected to a
+     * without a handshake, a doesn't leave before b has disconnected.
+     * Updated under the lock. */
+    uint32_t	    lazy_from[PTL_AMSH_MAX_LOCAL_PROCS]
+			     [PTL_AMSH_MAX_LOCAL_PROCS/32];
 
     /* A set of tail queue data for each remote domain.  Each domain has
        a reserved set of queues for each other domain.  The queues are located
@@ -468,6 +501,8 @@ struct am_ctl_dirpage {
 #define AMSH_HAVE_KNEM  0x02
 #define AMSH_HAVE_SCIF  0x04
 #define AMSH_HAVE_KASSIST 0x7
+#define AMSH_HAVE_DIRPAGE_VERNO 0x10	/* attached with AMSH_DIRPAGE_VERNO */
+#define AMSH_HAVE_LAZY_CONNECT	0x20	/* takes a first packet as a connect */
 
 /******************************************
  * Shared fifo element counts and sizes
@@ -513,12 +548,22 @@ struct ptl {
     int                    connect_phase;
     int                    connect_to;
     int                    connect_from;
+    int                    connect_lazy; /* connect local peers w/o handshake */
+    int                    egrcredit_latched;
+    uint32_t               egrcredit_grant; /* see amsh_egrcredit_grant() */
 
 /* List of context-specific shared variables */
     amsh_qinfo_t	   amsh_qsizes;
     am_pkt_short_t	   amsh_empty_shortpkt;
     struct am_reqq_fifo_t  psmi_am_reqq_fifo;
 
+/* Robust mode, detection and recovery of local peers that died */
+    int			   robust;
+    uint64_t		   robust_interval;
+    uint64_t		   robust_next_check;
+    void		  *robust_sink;	/* sends to dead peers land here */
+    uint8_t		   peer_dead[PTL_AMSH_MAX_LOCAL_PROCS];
+
 };
 
 #endif
@@ -39,11 +39,29 @@
 #include "knemrw.h"
 #include "scifrw.h"
 
+/*
+ * Fault injection on kernel assisted copies, a scripted delay holds up the
+ * copy to the peer pid (flow is PSMI_KASSIST_GET or PSMI_KASSIST_PUT).  The
+ * copy is synchronous and made from handler context, it can't be retried
+ * later so the delay is waited out here.
+ */
+PSMI_ALWAYS_INLINE(
+void
+ptl_kassist_fault(int pid, int dir))
+{
+    if_pf (PSMI_FAULTINJ_ENABLED()) {
+	PSMI_FAULTINJ_STATIC_DECL(fi, "kassist", 0, 1);
+	while (psmi_faultinj_event(fi, (uint32_t) pid, (uint32_t) dir) ==
+	       PSMI_FAULTINJ_DELAY)
+	    ;
+    }
+}
+
 static
 psm_error_t
 ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *tok)
 {
-    psm_amarg_t	args[5] = {};
+    psm_amarg_t	args[6] = {};
     psm_epaddr_t epaddr = req->rts_peer;
     ptl_t *ptl = epaddr->ptl;
     int pid = 0;
@@ -60,6 +78,8 @@ ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *t
     args[3].u32w0 = req->recv_msglen;
     args[3].u32w1 = tok != NULL ? 1 : 0;
     args[4].u64w0 = 0;
+    /* Give back the eager credits freed so far, the sender is likely out */
+    args[5].u32w0 = epaddr->mctxt_master->egrcredit_freed;
 
     /* First check: is the peer local? */
 #ifdef PSM_HAVE_SCIF
@@ -71,6 +91,8 @@ ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *t
                 req->recv_msglen > 0 &&
                 (pid = psmi_epaddr_kcopy_pid(epaddr)))
         {
+            ptl_kassist_fault(pid, PSMI_KASSIST_GET);
+
             if (ptl->ep->psmi_kassist_mode & PSMI_KASSIST_KCOPY) {
                 /* kcopy can be done in handler context or not. */
                 size_t nbytes = kcopy_get(ptl->ep->psmi_kassist_fd, pid,
@@ -135,11 +157,11 @@ ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *t
 
     if (tok != NULL) { 
 	psmi_am_reqq_add(AMREQUEST_SHORT, tok->ptl, tok->tok.epaddr_from, 
-	    mq_handler_rtsmatch_hidx, args, 5, NULL, 0, NULL, 0);
+	    mq_handler_rtsmatch_hidx, args, 6, NULL, 0, NULL, 0);
     }
     else
 	psmi_amsh_short_request(ptl, epaddr, mq_handler_rtsmatch_hidx, 
-				    args, 5, NULL, 0, 0);
+				    args, 6, NULL, 0, 0);
 
     /* 0-byte completion or we used kcopy */
     if (used_get == 1 || req->recv_msglen == 0)
@@ -164,22 +186,23 @@ psmi_am_mq_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t le
     ptl_t *ptl = tok->ptl;
     psm_mq_req_t    req;
     int rc;
-    int mode        = args[0].u32w0;
+    int mode        = AMSH_MQ_MODE_GET(args[0].u32w0);
+    psm_mq_t mq     = psmi_mq_demux(tok->mq, AMSH_MQ_ID_GET(args[0].u32w0));
     uint64_t tag    = args[1].u64;
     uint32_t msglen = mode <= MQ_MSG_SHORT ? len : args[0].u32w1;
 
     _IPATH_VDBG("mq=%p mode=%d, len=%d, msglen=%d\n", 
-	    tok->mq, mode, (int) len, msglen);
+	    mq, mode, (int) len, msglen);
 
     switch(mode) {
 	case MQ_MSG_TINY:
-	  rc = psmi_mq_handle_tiny_envelope(tok->mq, tok->tok.epaddr_from, tag,
+	  rc = psmi_mq_handle_tiny_envelope(mq, tok->tok.epaddr_from, tag,
 					    buf, (uint32_t) len);
 	  return;
 	  break;
 	case MQ_MSG_SHORT:
 	case MQ_MSG_LONG:
-	  rc = psmi_mq_handle_envelope(tok->mq, mode, tok->tok.epaddr_from,
+	  rc = psmi_mq_handle_envelope(mq, mode, tok->tok.epaddr_from,
 				       tag, (union psmi_egrid) 0U,
 				       msglen, buf, (uint32_t) len);
 	  return;
@@ -189,7 +212,7 @@ psmi_am_mq_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t le
 	    uintptr_t sbuf = (uintptr_t) args[3].u64w0;
 	    psmi_assert(narg == 5);
 	    psmi_assert_always(mode == MQ_MSG_RTS);
-	    rc = psmi_mq_handle_rts(tok->mq, tag, sbuf, msglen, 
+	    rc = psmi_mq_handle_rts(mq, tag, sbuf, msglen, 
 				    tok->tok.epaddr_from,
 				    ptl_handle_rtsmatch, &req);
 	    req->ptl_req_ptr = sreq;
@@ -237,6 +260,9 @@ psmi_am_mq_handler_rtsmatch(void *toki, psm_amarg_t *args, int narg, void *buf,
     _IPATH_VDBG("[rndv][send] req=%p dest_req=%p src=%p dest=%p len=%d\n",
 		    sreq, (void*)(uintptr_t)args[1].u64w0, sreq->buf, dest, msglen);
 
+    if (narg > 5)
+	mq_egrcredit_update(tok->tok.epaddr_from, args[5].u32w0);
+
     if (msglen > 0) {
 	rarg[0].u64w0 = args[1].u64w0; /* rreq */
 
@@ -255,6 +281,8 @@ psmi_am_mq_handler_rtsmatch(void *toki, psm_amarg_t *args, int narg, void *buf,
                         sreq->buf, msglen, dest, 0);
             else if (ptl->ep->psmi_kassist_mode & PSMI_KASSIST_PUT)
             {
+                ptl_kassist_fault(pid, PSMI_KASSIST_PUT);
+
                 if (ptl->ep->psmi_kassist_mode & PSMI_KASSIST_KCOPY) {
                     size_t nbytes = kcopy_put(ptl->ep->psmi_kassist_fd, sreq->buf,
                             pid, dest, msglen);
@@ -41,8 +41,6 @@
  * by the endpoint that allocates the index.  This narrows the window of two
  * jobs communicated with the same set of indexes from getting crosstalk.
  */
-/* Allocate new epaddrs in chunks of 128 */
-#define PTL_EPADDR_ALLOC_CHUNK  128
 
 psm_error_t
 ips_epstate_init(struct ips_epstate *eps, const psmi_context_t *context)
@@ -57,12 +55,73 @@ ips_epstate_init(struct ips_epstate *eps, const psmi_context_t *context)
 psm_error_t
 ips_epstate_fini(struct ips_epstate *eps)
 {
-    if (eps->eps_tab)
-	psmi_free(eps->eps_tab);
+    int i;
+
+    if (eps->eps_dir) {
+	for (i = 0; i < IPS_EPSTATE_DIR_SIZE && eps->eps_dir[i]; i++)
+	    psmi_free(eps->eps_dir[i]);
+	psmi_free(eps->eps_dir);
+    }
+    if (eps->eps_free)
+	psmi_free(eps->eps_free);
     memset(eps, 0, sizeof(*eps));
     return PSM_OK;
 }
 
+/*
+ * Add a page of entries to the table and queue its indexes as free.
+ * Called when the free ring is empty.
+ */
+static
+psm_error_t
+ips_epstate_grow(struct ips_epstate *eps)
+{
+    struct ips_epstate_entry *page;
+    ips_epstate_idx *newfree;
+    int i, pageno = eps->eps_tabsize >> IPS_EPSTATE_PAGE_SHIFT;
+
+    psmi_assert(eps->eps_free_cnt == 0);
+    if (pageno == IPS_EPSTATE_DIR_SIZE)
+	return psmi_handle_error(eps->context->ep, PSM_TOO_MANY_ENDPOINTS, 
+	    "Can't connect to more than %d non-local endpoints", 
+	    IPS_EPSTATE_COMMIDX_MAX);
+
+    if (eps->eps_dir == NULL) {
+	eps->eps_dir = (struct ips_epstate_entry **)
+	    psmi_calloc(eps->context->ep, PER_PEER_ENDPOINT,
+			IPS_EPSTATE_DIR_SIZE, sizeof(*eps->eps_dir));
+	if (eps->eps_dir == NULL)
+	    return PSM_NO_MEMORY;
+    }
+
+    page = (struct ips_epstate_entry *)
+	psmi_calloc(eps->context->ep, PER_PEER_ENDPOINT, 
+		    IPS_EPSTATE_PAGE_SIZE, sizeof(struct ips_epstate_entry));
+    if (page == NULL)
+	return PSM_NO_MEMORY;
+
+    /* The free ring can hold every index in the table; the old one is empty
+     * so there is nothing to copy */
+    newfree = (ips_epstate_idx *)
+	psmi_calloc(eps->context->ep, PER_PEER_ENDPOINT,
+		    eps->eps_tabsize + IPS_EPSTATE_PAGE_SIZE,
+		    sizeof(ips_epstate_idx));
+    if (newfree == NULL) {
+	psmi_free(page);
+	return PSM_NO_MEMORY;
+    }
+    if (eps->eps_free)
+	psmi_free(eps->eps_free);
+    eps->eps_free = newfree;
+
+    eps->eps_dir[pageno] = page;
+    eps->eps_free_head = 0;
+    for (i = 0; i < IPS_EPSTATE_PAGE_SIZE; i++)
+	eps->eps_free[eps->eps_free_cnt++] = eps->eps_tabsize + i;
+    eps->eps_tabsize += IPS_EPSTATE_PAGE_SIZE;
+    return PSM_OK;
+}
+
 /*
  * Add ipsaddr with epid to the epstate table, return new index to caller in
  * 'commidx'.
@@ -71,51 +130,31 @@ psm_error_t
 ips_epstate_add(struct ips_epstate *eps, struct ptl_epaddr *ipsaddr,
 		ips_epstate_idx *commidx_o)
 {
-    int i, j;
-    ips_epstate_idx commidx;
+    psm_error_t err;
+    ips_epstate_idx j, commidx;
+    struct ips_epstate_entry *entry;
     uint16_t lmc_mask = ~((1 << ipsaddr->proto->epinfo.ep_lmc) - 1);
     
-    if (++eps->eps_tabsizeused > eps->eps_tabsize) { /* realloc */
-	struct ips_epstate_entry *newtab;
-	eps->eps_tabsize += PTL_EPADDR_ALLOC_CHUNK;
-	newtab = (struct ips_epstate_entry *) 
-	    psmi_calloc(eps->context->ep, PER_PEER_ENDPOINT, eps->eps_tabsize, 
-			sizeof(struct ips_epstate_entry));
-	if (newtab == NULL) 
-	    return PSM_NO_MEMORY;
-	else if (eps->eps_tab) { /* NOT first alloc */
-	    for (i = 0; i < eps->eps_tabsize-PTL_EPADDR_ALLOC_CHUNK; i++)
-		newtab[i] = eps->eps_tab[i]; /* deep copy */
-	    psmi_free(eps->eps_tab);
-	}
-	eps->eps_tab = newtab;
-    }
-    /* Find the next free hole.  We can afford to do this since connect is not
-     * in the critical path */
-    for (i = 0, j = eps->eps_tab_nextidx; i < eps->eps_tabsize; i++, j++) {
-	if (j == eps->eps_tabsize)
-	    j = 0;
-	if (eps->eps_tab[j].epid == 0) {
-	    eps->eps_tab_nextidx = j + 1;
-	    if (eps->eps_tab_nextidx == eps->eps_tabsize)
-		eps->eps_tab_nextidx = 0;
-	    break;
-	}
-    }
-    psmi_assert_always(i != eps->eps_tabsize);
+    if (eps->eps_free_cnt == 0 && (err = ips_epstate_grow(eps)))
+	return err;
+
+    j = eps->eps_free[eps->eps_free_head];
+    if (++eps->eps_free_head == eps->eps_tabsize)
+	eps->eps_free_head = 0;
+    eps->eps_free_cnt--;
+    eps->eps_tabsizeused++;
+    entry = &eps->eps_dir[j >> IPS_EPSTATE_PAGE_SHIFT]
+			 [j & IPS_EPSTATE_PAGE_MASK];
+    psmi_assert(entry->epid == 0);
+
     commidx = (j - eps->eps_base_idx) & (IPS_EPSTATE_COMMIDX_MAX-1);
     _IPATH_VDBG("node %s gets commidx=%d (table idx %d)\n", 
 	    psmi_epaddr_get_name(ipsaddr->epaddr->epid), commidx, j);
-    eps->eps_tab[j].epid = 
+    entry->epid = 
       PSMI_EPID_PACK(ipsaddr->epr.epr_base_lid & lmc_mask,
 		     ipsaddr->epr.epr_context,
 		     ipsaddr->epr.epr_subcontext);
-    eps->eps_tab[j].ipsaddr = ipsaddr;
-    if (j >= IPS_EPSTATE_COMMIDX_MAX) {
-	return psmi_handle_error(eps->context->ep, PSM_TOO_MANY_ENDPOINTS, 
-	    "Can't connect to more than %d non-local endpoints", 
-	    IPS_EPSTATE_COMMIDX_MAX);
-    }
+    entry->ipsaddr = ipsaddr;
     *commidx_o = commidx;
     return PSM_OK;
 }
@@ -123,15 +162,24 @@ ips_epstate_add(struct ips_epstate *eps, struct ptl_epaddr *ipsaddr,
 psm_error_t
 ips_epstate_del(struct ips_epstate *eps, ips_epstate_idx commidx)
 {
+    struct ips_epstate_entry *entry;
     ips_epstate_idx idx;
+    int tail;
     /* actual table index */
     idx = (commidx + eps->eps_base_idx) & (IPS_EPSTATE_COMMIDX_MAX-1);
     psmi_assert_always(idx < eps->eps_tabsize);
     _IPATH_VDBG("commidx=%d, table_idx=%d\n", commidx, idx);
-    eps->eps_tab[idx].epid = 0;
-    eps->eps_tab[idx].ipsaddr = NULL;
-    /* We may eventually want to release memory, but probably not */
+    entry = &eps->eps_dir[idx >> IPS_EPSTATE_PAGE_SHIFT]
+			 [idx & IPS_EPSTATE_PAGE_MASK];
+    entry->epid = 0;
+    entry->ipsaddr = NULL;
+    /* Pages are never released, the index is reused once every other free
+     * index has been handed out */
+    tail = eps->eps_free_head + eps->eps_free_cnt;
+    if (tail >= eps->eps_tabsize)
+	tail -= eps->eps_tabsize;
+    eps->eps_free[tail] = idx;
+    eps->eps_free_cnt++;
     eps->eps_tabsizeused--;
     return PSM_OK;
 }
-
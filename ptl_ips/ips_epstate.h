@@ -46,19 +46,35 @@ typedef uint32_t ips_epstate_idx;
 
 struct ptl_epaddr;
 
+/*
+ * The table is two-level: a directory of pages of entries, directly indexed
+ * by table index.  Entries are 16 bytes with the epid checked on receive
+ * first, so a lookup touches a single cache line.
+ */
+#define IPS_EPSTATE_PAGE_SHIFT	9
+#define IPS_EPSTATE_PAGE_SIZE	(1<<IPS_EPSTATE_PAGE_SHIFT)
+#define IPS_EPSTATE_PAGE_MASK	(IPS_EPSTATE_PAGE_SIZE-1)
+#define IPS_EPSTATE_DIR_SIZE	(IPS_EPSTATE_COMMIDX_MAX>>IPS_EPSTATE_PAGE_SHIFT)
+
 struct ips_epstate_entry {
     uint64_t            epid;
     struct ptl_epaddr	*ipsaddr;
-};
+} __attribute__((aligned(16)));
 
 struct ips_epstate {
     const psmi_context_t	*context;
     ips_epstate_idx	eps_base_idx;
-    int			eps_tabsize;
+    int			eps_tabsize;	    /* entries in allocated pages */
     int			eps_tabsizeused;
-    int			eps_tab_nextidx;
 
-    struct ips_epstate_entry *eps_tab;
+    struct ips_epstate_entry **eps_dir;	    /* IPS_EPSTATE_DIR_SIZE pages */
+
+    /* FIFO ring of free table indexes (eps_tabsize slots).  A released index
+     * goes to the back so that late packets for a departed peer don't land
+     * on the next peer to connect. */
+    ips_epstate_idx	*eps_free;
+    int			eps_free_head;
+    int			eps_free_cnt;
 };
 
 psm_error_t ips_epstate_init(struct ips_epstate *eps, const psmi_context_t *contextj);
@@ -75,7 +91,8 @@ ips_epstate_lookup(const struct ips_epstate *eps, ips_epstate_idx idx))
 {
   idx = (idx + eps->eps_base_idx) & (IPS_EPSTATE_COMMIDX_MAX-1);
     if (idx < eps->eps_tabsize)
-	return &eps->eps_tab[idx];
+	return &eps->eps_dir[idx >> IPS_EPSTATE_PAGE_SHIFT]
+			    [idx & IPS_EPSTATE_PAGE_MASK];
     else
 	return NULL;
 }
@@ -56,6 +56,7 @@ struct ips_protoexp {
     mpool_t		   tid_desc_send_pool;
     mpool_t		   tid_desc_recv_pool;
     mpool_t		   tid_getreq_pool;
+    mpool_t		   tid_grant_pool;
     mpool_t		   tid_sreq_pool; /* backptr into proto->ep->mq */
     mpool_t		   tid_rreq_pool; /* backptr into proto->ep->mq */
     uint32_t		   tid_send_fragsize;
@@ -76,6 +77,18 @@ struct ips_protoexp {
 		ips_tid_get_request)	pend_getreqsq; /* pending tid reqs */
     struct psmi_timer			timer_getreqs;
 
+    /* Rendezvous window controller.  Grants are sized from free tids and
+     * tidflows shared across waiting getreqs, and rv_win moves between
+     * rv_win_min and rv_win_max following observed window completion time. */
+    uint32_t		   rv_win_adapt;
+    uint32_t		   rv_win;
+    uint32_t		   rv_win_min;
+    uint32_t		   rv_win_max;
+    uint32_t		   rv_getreqs;	    /* getreqs waiting for grants */
+    uint32_t		   rv_stalled;	    /* grants held back since last one */
+    uint32_t		   rv_win_halved;   /* a stall already shrank rv_win */
+    uint64_t		   rv_cyc_per_kb;   /* ewma of window completion */
+
     /* stats */
     uint64_t tid_grant_resends;
     uint64_t tid_release_resends;
@@ -199,7 +212,8 @@ struct ips_tid_recv_desc {
     uint16_t    pad;
 
     uint32_t ctrl_msg_queued; /* bitmap of queued control messages for */
-    struct ips_expected_recv_stats stats;				    
+    struct ips_expected_recv_stats stats;
+    uint64_t	t_grant;      /* cycles when the window was granted */				    
     			    
     struct ips_tid_get_request	*getreq;
     psmi_timer   timer_tidreq;
@@ -253,6 +267,16 @@ struct ips_tidinfo {
     struct ips_tid_recv_desc *tidrecvc;
 };
 
+/*
+ * Tid grant window of a send request in tid rendezvous, hung off the
+ * request's ptl_req_ptr for the duration of the transfer.
+ */
+#define IPS_TID_GRANT_SLOTS	128
+
+struct ips_tid_grant {
+    uint8_t slot[IPS_TID_GRANT_SLOTS];	/* don't change the size unless... */
+};
+
 /*
  * Descriptor limits, structure contents of struct psmi_rlimit_mpool for
  * normal, min and large configurations.
@@ -267,6 +267,10 @@ ips_opp_path_rec(struct ips_proto *proto,
   ipsaddr->epr.epr_num_paths[IPS_PATH_NORMAL_PRIORITY] =
   ipsaddr->epr.epr_num_paths[IPS_PATH_LOW_PRIORITY] = 0;
 
+  err = ips_epaddr_paths_alloc(proto, ipsaddr, num_path);
+  if (err != PSM_OK)
+    goto fail;
+
   /* For now there is always only one high priority path between nodes. */
   for (pidx = 0,cpath = 0; pidx < num_path && cpath == 0; pidx++) {
     path_slid = __cpu_to_be16(__be16_to_cpu(slid) + pidx);
@@ -323,7 +327,6 @@ ips_opp_path_rec(struct ips_proto *proto,
         
     /* Valid path. For now both normal and low priority paths are the same */
     ipsaddr->epr.epr_path[IPS_PATH_NORMAL_PRIORITY][cpath] = path;
-    ipsaddr->epr.epr_path[IPS_PATH_LOW_PRIORITY][cpath] = path;
     ipsaddr->epr.epr_num_paths[IPS_PATH_NORMAL_PRIORITY]++;
     ipsaddr->epr.epr_num_paths[IPS_PATH_LOW_PRIORITY]++;
     cpath++;
@@ -354,8 +357,10 @@ ips_opp_path_rec(struct ips_proto *proto,
     ipsaddr->epr.epr_hpp_index = 0;
   
  fail:
-  if (err != PSM_OK) 
+  if (err != PSM_OK) {
+    ips_epaddr_paths_free(ipsaddr);
     _IPATH_PRDBG("Unable to get path record for LID 0x%x <---> DLID 0x%x.\n", slid, dlid);
+  }
   return err;
 }
 
@@ -254,6 +254,39 @@ ips_none_get_path_rec(struct ips_proto *proto,
   return err;
 }
 
+/*
+ * Size the per-peer path table to the paths actually resolved for the peer:
+ * a single high priority path followed by num_path bulk paths.  Normal and
+ * low priority paths are resolved identically and share their slots.
+ */
+psm_error_t
+ips_epaddr_paths_alloc(struct ips_proto *proto, ips_epaddr_t *ipsaddr,
+		       int num_path)
+{
+  ips_path_rec_t **paths;
+
+  paths = (ips_path_rec_t **)
+    psmi_calloc(proto->ep, PER_PEER_ENDPOINT, 1 + num_path,
+		sizeof(ips_path_rec_t *));
+  if (paths == NULL)
+    return PSM_NO_MEMORY;
+
+  ipsaddr->epr.epr_path[IPS_PATH_HIGH_PRIORITY] = paths;
+  ipsaddr->epr.epr_path[IPS_PATH_NORMAL_PRIORITY] = paths + 1;
+  ipsaddr->epr.epr_path[IPS_PATH_LOW_PRIORITY] = paths + 1;
+  return PSM_OK;
+}
+
+void
+ips_epaddr_paths_free(ips_epaddr_t *ipsaddr)
+{
+  if (ipsaddr->epr.epr_path[IPS_PATH_HIGH_PRIORITY] != NULL)
+    psmi_free(ipsaddr->epr.epr_path[IPS_PATH_HIGH_PRIORITY]);
+  ipsaddr->epr.epr_path[IPS_PATH_HIGH_PRIORITY] = NULL;
+  ipsaddr->epr.epr_path[IPS_PATH_NORMAL_PRIORITY] = NULL;
+  ipsaddr->epr.epr_path[IPS_PATH_LOW_PRIORITY] = NULL;
+}
+
 static psm_error_t 
 ips_none_path_rec(struct ips_proto *proto,
 		  uint16_t slid, uint16_t dlid, uint16_t desthca_type,
@@ -288,6 +321,10 @@ ips_none_path_rec(struct ips_proto *proto,
     ipsaddr->epr.epr_num_paths[IPS_PATH_NORMAL_PRIORITY] = 1;
     ipsaddr->epr.epr_num_paths[IPS_PATH_LOW_PRIORITY] = 1;
   }
+
+  err = ips_epaddr_paths_alloc(proto, ipsaddr, num_path);
+  if (err != PSM_OK)
+    goto fail;
     
   /* For "none" path record we just setup 2^lmc paths. To get better load
    * balance
@@ -310,13 +347,11 @@ ips_none_path_rec(struct ips_proto *proto,
       }
       else {
 	ipsaddr->epr.epr_path[IPS_PATH_NORMAL_PRIORITY][pidx-1] = path;
-	ipsaddr->epr.epr_path[IPS_PATH_LOW_PRIORITY][pidx-1] = path;
       }
     }
     else {
       ipsaddr->epr.epr_path[IPS_PATH_HIGH_PRIORITY][0] = path;
       ipsaddr->epr.epr_path[IPS_PATH_NORMAL_PRIORITY][0] = path;
-      ipsaddr->epr.epr_path[IPS_PATH_LOW_PRIORITY][0] = path;
     }
   }
   
@@ -337,8 +372,10 @@ ips_none_path_rec(struct ips_proto *proto,
     ipsaddr->epr.epr_hpp_index = 0;
   
  fail:
-  if (err != PSM_OK) 
+  if (err != PSM_OK) {
+    ips_epaddr_paths_free(ipsaddr);
     _IPATH_PRDBG("Unable to get path record for LID %x <---> DLID %x.\n", slid, dlid);
+  }
   return err;
 }
 
@@ -206,6 +206,35 @@ ips_proto_init(const psmi_context_t *context, const ptl_t *ptl,
       if (env_coalesce_acks.e_uint) 
 	proto->flags |= IPS_PROTO_FLAG_COALESCE_ACKS;
     }
+
+    {
+      /* Disable header prediction? */
+      union psmi_envvar_val env_hdr_predict;
+      struct ips_message_header hp_hdr;
+
+      psmi_getenv("PSM_HDR_PREDICT",
+		  "Fast path in-order tiny and short eager packets (default is enabled i.e. 1)",
+		  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT_FLAGS,
+		  (union psmi_envvar_val) 1,  /* Enabled by default */
+		  &env_hdr_predict);
+
+      if (env_hdr_predict.e_uint)
+	proto->flags |= IPS_PROTO_FLAG_HDR_PREDICT;
+
+      /* The predicted word covers the opcode, flags, commidx and the source
+       * context bits; the piggybacked ack and ACK_REQ are allowed to vary,
+       * and so is the one opcode bit telling tiny (MQ_HDR) from short
+       * (MQ_CTRL) envelopes.  Build the mask through the header so it
+       * follows the bitfield layout. */
+      memset(&hp_hdr, 0, sizeof(hp_hdr));
+      hp_hdr.sub_opcode = (uint8_t) ~(OPCODE_SEQ_MQ_HDR ^ OPCODE_SEQ_MQ_CTRL);
+      hp_hdr.flags = (uint8_t) ~IPS_SEND_FLAG_ACK_REQ;
+      hp_hdr.commidx = 0xffff;
+      hp_hdr.src_context = 0xf;
+      hp_hdr.src_subcontext = 0x3;
+      hp_hdr.src_context_ext = 0x3;
+      proto->hp_mask = ips_proto_hp_word(&hp_hdr);
+    }
     
     {
       /* Number of credits per flow */
@@ -267,6 +296,18 @@ ips_proto_init(const psmi_context_t *context, const ptl_t *ptl,
 			       &proto->stats.scb_egr_unavail_cnt),
 	    PSMI_STATS_DECLU64("scb unavail exp count", 
 			       &proto->stats.scb_exp_unavail_cnt),
+	    PSMI_STATS_DECLU64("scb eager exhausted",
+			       &proto->scbc_egr.stats.exhausted),
+	    PSMI_STATS_DECLU64("scb eager fairness waits",
+			       &proto->scbc_egr.stats.deferred),
+	    PSMI_STATS_DECLU64("scb eager pool grows",
+			       &proto->scbc_egr.stats.grow),
+	    PSMI_STATS_DECLU64("scb eager pool shrinks",
+			       &proto->scbc_egr.stats.shrink),
+	    PSMI_STATS_DECLU64("scb eager pool max size",
+			       &proto->scbc_egr.stats.num_hiwat),
+	    PSMI_STATS_DECLU64("scb max held by a flow",
+			       &proto->scbc_egr.stats.flow_hiwat),
 	    PSMI_STATS_DECLU64("rcvhdr overflows", /* Normal egr/hdr ovflw */
 			       &proto->stats.hdr_overflow),
 	    PSMI_STATS_DECLU64("rcveager overflows", 
@@ -279,10 +320,88 @@ ips_proto_init(const psmi_context_t *context, const ptl_t *ptl,
 			       &proto->stats.stray_packets),
 	    PSMI_STATS_DECLU64("send dma misaligns (*)", 
 			       &proto->stats.send_dma_misaligns),
+	    PSMI_STATS_DECLU64("peer flows live",
+			       &proto->stats.flows_live),
+	    PSMI_STATS_DECLU64("peer flows materialized",
+			       &proto->stats.flows_materialized),
+	    PSMI_STATS_DECLU64("peer flows reclaimed",
+			       &proto->stats.flows_reclaimed),
+	    PSMI_STATS_DECLU64("header prediction hits",
+			       &proto->stats.hdr_predict_hits),
+	    PSMI_STATS_DECLU64("mq coalesced envelopes",
+			       &proto->stats.coalesced_envelopes),
+	    PSMI_STATS_DECLU64("mq coalesced packets",
+			       &proto->stats.coalesced_packets),
+	    PSMI_STATS_DECLU64("sdma batched writevs",
+			       &proto->stats.sdma_batch_flows),
+	    PSMI_STATS_DECLU64("sdma completion reads",
+			       &proto->stats.sdma_compl_reads),
+	    PSMI_STATS_DECLU64("sdma batch 1",
+			       &proto->stats.sdma_batch_hist[0]),
+	    PSMI_STATS_DECLU64("sdma batch 2-3",
+			       &proto->stats.sdma_batch_hist[1]),
+	    PSMI_STATS_DECLU64("sdma batch 4-7",
+			       &proto->stats.sdma_batch_hist[2]),
+	    PSMI_STATS_DECLU64("sdma batch 8-15",
+			       &proto->stats.sdma_batch_hist[3]),
+	    PSMI_STATS_DECLU64("sdma batch 16-31",
+			       &proto->stats.sdma_batch_hist[4]),
+	    PSMI_STATS_DECLU64("sdma batch 32+",
+			       &proto->stats.sdma_batch_hist[5]),
+	    PSMI_STATS_DECLU64("sdma ring inflight 0-3",
+			       &proto->stats.sdma_ring_hist[0]),
+	    PSMI_STATS_DECLU64("sdma ring inflight 4-15",
+			       &proto->stats.sdma_ring_hist[1]),
+	    PSMI_STATS_DECLU64("sdma ring inflight 16-63",
+			       &proto->stats.sdma_ring_hist[2]),
+	    PSMI_STATS_DECLU64("sdma ring inflight 64-255",
+			       &proto->stats.sdma_ring_hist[3]),
+	    PSMI_STATS_DECLU64("sdma ring inflight 256-1023",
+			       &proto->stats.sdma_ring_hist[4]),
+	    PSMI_STATS_DECLU64("sdma ring inflight 1024+",
+			       &proto->stats.sdma_ring_hist[5]),
+	    PSMI_STATS_DECLU64("ctrl msgs queued",
+			       &proto->stats.ctrlq_queued),
+	    PSMI_STATS_DECLU64("ctrl msgs coalesced",
+			       &proto->stats.ctrlq_coalesced),
+	    PSMI_STATS_DECLU64("ctrl queue max depth",
+			       &proto->stats.ctrlq_max_depth),
+	    PSMI_STATS_DECLU64("ctrl queue wait <10us",
+			       &proto->stats.ctrlq_wait_hist[0]),
+	    PSMI_STATS_DECLU64("ctrl queue wait 10-100us",
+			       &proto->stats.ctrlq_wait_hist[1]),
+	    PSMI_STATS_DECLU64("ctrl queue wait 100us-1ms",
+			       &proto->stats.ctrlq_wait_hist[2]),
+	    PSMI_STATS_DECLU64("ctrl queue wait 1ms+",
+			       &proto->stats.ctrlq_wait_hist[3]),
+	    PSMI_STATS_DECLU64("rndv grants stalled",
+			       &proto->stats.rv_win_stalls),
+	    PSMI_STATS_DECLU64("rndv window <16K",
+			       &proto->stats.rv_win_hist[0]),
+	    PSMI_STATS_DECLU64("rndv window 16K-32K",
+			       &proto->stats.rv_win_hist[1]),
+	    PSMI_STATS_DECLU64("rndv window 32K-64K",
+			       &proto->stats.rv_win_hist[2]),
+	    PSMI_STATS_DECLU64("rndv window 64K-128K",
+			       &proto->stats.rv_win_hist[3]),
+	    PSMI_STATS_DECLU64("rndv window 128K-256K",
+			       &proto->stats.rv_win_hist[4]),
+	    PSMI_STATS_DECLU64("rndv window 256K+",
+			       &proto->stats.rv_win_hist[5]),
+	    PSMI_STATS_DECLU64("eager credit rndv fallbacks",
+			       &proto->stats.egrcredit_rndv),
+	    PSMI_STATS_DECLU64("eager bufs lent",
+			       &proto->stats.egr_loans),
+	    PSMI_STATS_DECLU64("eager bufs recalled",
+			       &proto->stats.egr_loans_recalled),
+	    PSMI_STATS_DECLU64("eager sends buffered",
+			       &proto->stats.eager_buffered),
 	    PSMI_STATS_DECLU64("amreply no bufs (*)",
 			       &proto->proto_am.amreply_nobufs),
 	    PSMI_STATS_DECLU64("pio stalls (*)", /* shouldn't happen too often */ 
 			       &proto->spioc->spio_num_stall_total),
+	    PSMI_STATS_DECLU64("pio partition rebalances",
+			       &proto->spioc->spio_num_rebalance),
 	    PSMI_STATS_DECLU64("Invariant CRC error (*)",
 			       &proto->error_stats.num_icrc_err),
 	    PSMI_STATS_DECLU64("Variant CRC error (*)",
@@ -317,11 +436,119 @@ ips_proto_init(const psmi_context_t *context, const ptl_t *ptl,
      * Control Queue and messaging 
      */
     {
+      union psmi_envvar_val env_ctrlq;
       int idx;
+
+      /* Queued control messages are only dropped once this many are waiting
+       * across all flow types, losing them costs a protocol timeout. */
+      psmi_getenv("PSM_CTRLQ_MAX",
+		  "Max queued control messages (power of two)",
+		  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		  (union psmi_envvar_val) 65536, &env_ctrlq);
+      if (!PSMI_POWEROFTWO(env_ctrlq.e_uint) ||
+	  env_ctrlq.e_uint < CTRL_MSG_QEUEUE_SIZE)
+	env_ctrlq.e_uint = 65536;
+
+      proto->ctrlq_pool = 
+	psmi_mpool_create(sizeof(struct ips_ctrlq_elem), CTRL_MSG_QEUEUE_SIZE,
+			  env_ctrlq.e_uint, 0, DESCRIPTORS, NULL, NULL);
+      if (proto->ctrlq_pool == NULL) {
+	err = psmi_handle_error(proto->ep, PSM_NO_MEMORY,
+		"Couldn't allocate control message queue");
+	goto fail;
+      }
       
       for (idx = 0; idx < EP_FLOW_LAST; idx++)
 	ctrlq_init(&proto->ctrlq[idx], idx, proto);
     }
+
+    /*
+     * Peer flows are materialized on first use and given back once they
+     * have been idle for a while.
+     */
+    {
+	union psmi_envvar_val env_flow_idle;
+
+	psmi_getenv("PSM_FLOW_IDLE_TIMEOUT",
+		    "Seconds before an idle peer flow is reclaimed (0 never reclaims)",
+		    PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		    (union psmi_envvar_val) 30,
+		    &env_flow_idle);
+	proto->flows_idle_timeout = sec_2_cycles(env_flow_idle.e_uint);
+	TAILQ_INIT(&proto->flows_liveq);
+	psmi_timer_entry_init(&proto->flows_idle_timer,
+			      ips_proto_flows_idle_sweep, proto);
+    }
+
+    {
+      /* Coalesce small MQ sends to the same peer into one packet? */
+      union psmi_envvar_val env_coalesce, env_coalesce_sz, env_coalesce_us;
+
+      psmi_getenv("PSM_MQ_COALESCE",
+		  "Pack small sends issued close together into one packet (default is disabled i.e. 0)",
+		  PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT_FLAGS,
+		  (union psmi_envvar_val) 0,  /* Disabled by default */
+		  &env_coalesce);
+      psmi_getenv("PSM_MQ_COALESCE_SZ",
+		  "Largest message size coalesced with PSM_MQ_COALESCE",
+		  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		  (union psmi_envvar_val) 64,
+		  &env_coalesce_sz);
+      psmi_getenv("PSM_MQ_COALESCE_USEC",
+		  "Longest a coalesced send is held back, in usecs",
+		  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		  (union psmi_envvar_val) 5,
+		  &env_coalesce_us);
+
+      if (env_coalesce.e_uint)
+	proto->flags |= IPS_PROTO_FLAG_MQ_COALESCE;
+      proto->coalesce_thresh = env_coalesce_sz.e_uint;
+      proto->coalesce_window = us_2_cycles(env_coalesce_us.e_uint);
+      TAILQ_INIT(&proto->coalesceq);
+      psmi_timer_entry_init(&proto->coalesce_timer,
+			    ips_mq_coalesce_timer_callback, proto);
+    }
+
+    {
+      /* Complete pio eager isends as soon as they are copied to scbs? */
+      union psmi_envvar_val env_buffered;
+
+      psmi_getenv("PSM_MQ_EAGER_BUFFERED",
+		  "Max unacked bytes of eager isends completed once copied (default is disabled i.e. 0)",
+		  PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		  (union psmi_envvar_val) 0,  /* Disabled by default */
+		  &env_buffered);
+
+      if (env_buffered.e_uint)
+	proto->flags |= IPS_PROTO_FLAG_MQ_EAGER_BUFFERED;
+      proto->eager_buffered = 0;
+      proto->eager_buffered_max = env_buffered.e_uint;
+    }
+
+    {
+      /* Gather send dma flows held back by a busy ring into one writev? */
+      union psmi_envvar_val env_sdma_batch, env_sdma_batch_max;
+
+      psmi_getenv("PSM_SDMA_BATCH",
+		  "Gather send dma flows waiting on the ring into one writev (default is enabled i.e. 1)",
+		  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT_FLAGS,
+		  (union psmi_envvar_val) 1,  /* Enabled by default */
+		  &env_sdma_batch);
+      psmi_getenv("PSM_SDMA_BATCH_MAX",
+		  "Max packets in a batched send dma writev",
+		  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		  (union psmi_envvar_val) IPS_SDMA_BATCH_MAX_SCB,
+		  &env_sdma_batch_max);
+
+      if (env_sdma_batch.e_uint)
+	proto->flags |= IPS_PROTO_FLAG_SDMA_BATCH;
+      proto->sdma_batch_max = max(env_sdma_batch_max.e_uint, 1);
+      TAILQ_INIT(&proto->sdma_readyq);
+      proto->sdma_ready_cntr = 0;
+      proto->sdma_progress_next = 0;
+      proto->sdma_poll_epoch = 1;
+      proto->sdma_compl_epoch = 0;
+    }
 					     
     /*
      * Receive-side handling
@@ -338,6 +565,28 @@ ips_proto_init(const psmi_context_t *context, const ptl_t *ptl,
 		NULL, NULL, &proto->scbc_egr)))
 	goto fail;
 
+    /*
+     * Let the eager pool grow under bursts instead of stalling senders, and
+     * keep a few scbs per active flow so that bulk flows can't starve the
+     * others.
+     */
+    {
+	union psmi_envvar_val env_scb_max, env_scb_share;
+
+	psmi_getenv("PSM_SCB_MAX",
+		    "Max eager send descriptors when growing the pool",
+		    PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		    (union psmi_envvar_val) (4 * num_of_send_desc),
+		    &env_scb_max);
+	psmi_getenv("PSM_SCB_FLOW_SHARE",
+		    "Eager send descriptors reserved per active flow (0 disables)",
+		    PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		    (union psmi_envvar_val) 8,
+		    &env_scb_share);
+	ips_scbctrl_elastic(&proto->scbc_egr, env_scb_max.e_uint,
+			    env_scb_share.e_uint, proto->timerq);
+    }
+
     /*
      * Expected protocol handling.
      * If we enable tid-based expected rendezvous, the expected protocol code
@@ -561,7 +810,10 @@ ips_proto_fini(struct ips_proto *proto, int force, uint64_t timeout_in)
 
     t_grace_start = get_cycles();
 
-    while (psmi_cycles_left(t_grace_start, t_grace_time)) {
+    /* Nobody is left to need us once every peer disconnected from us, and
+     * at job exit nobody is expecting to. */
+    while (proto->num_connected_from > 0 && force != PSM_EP_CLOSE_JOBEXIT &&
+	   psmi_cycles_left(t_grace_start, t_grace_time)) {
         uint64_t t_grace_interval_start = get_cycles();
 	int num_disconnect_requests = proto->num_disconnect_requests;
         PSMI_BLOCKUNTIL(proto->ep, err, 
@@ -577,11 +829,15 @@ ips_proto_fini(struct ips_proto *proto, int force, uint64_t timeout_in)
 
     t_grace_finish = get_cycles();
 
-    _IPATH_PRDBG("Closing endpoint disconnect left to=%d,from=%d after %d millisec of grace (out of %d)\n",
+    _IPATH_PRDBG("Closing endpoint disconnect left to=%d,from=%d after %d millisec of disconnect and %d millisec of grace (out of %d)\n",
 	 	 proto->num_connected_to, proto->num_connected_from,
+		 (int) (cycles_to_nanosecs(t_grace_start - t_start) / MSEC_ULL),
 		 (int) (cycles_to_nanosecs(t_grace_finish - t_grace_start) / MSEC_ULL),
                  (int) (t_grace_time / MSEC_ULL));
     
+    psmi_timer_cancel(proto->timerq, &proto->flows_idle_timer);
+    psmi_timer_cancel(proto->timerq, &proto->coalesce_timer);
+
     if ((err = ips_ibta_fini(proto)))
       goto fail;
         
@@ -603,6 +859,7 @@ ips_proto_fini(struct ips_proto *proto, int force, uint64_t timeout_in)
     }
 
     psmi_mpool_destroy(proto->pend_sends_pool);
+    psmi_mpool_destroy(proto->ctrlq_pool);
 
 fail:
     proto->t_fini = proto->t_init = 0;
@@ -709,6 +966,8 @@ static
 void
 ctrlq_init(struct ips_ctrlq *ctrlq, int flowid, struct ips_proto *proto)
 {
+    int i;
+
     // clear the ctrl send queue
     memset(ctrlq, 0, sizeof(*ctrlq));
 
@@ -732,7 +991,9 @@ ctrlq_init(struct ips_ctrlq *ctrlq, int flowid, struct ips_proto *proto)
     proto->message_type_to_index[OPCODE_ERR_CHK_GEN] = CTRL_MSG_ERR_CHK_GEN_QUEUED;
     proto->message_type_to_index[OPCODE_FLOW_CCA_BECN] = CTRL_MSG_FLOW_CCA_BECN;
 
-    ctrlq->ctrlq_head = ctrlq->ctrlq_tail = 0;
+    for (i = 0; i < IPS_CTRLQ_PRIO_MAX; i++)
+	STAILQ_INIT(&ctrlq->ctrlq_prioq[i]);
+    ctrlq->ctrlq_depth = 0;
     ctrlq->ctrlq_overflow = 0;
     ctrlq->ctrlq_proto = proto;
     ctrlq->ctrlq_flowid = flowid;
@@ -801,12 +1062,16 @@ _build_ctrl_message(struct ips_proto *proto,
     p_hdr->dst_subcontext = epr->epr_subcontext;
     p_hdr->flags = 0;
     p_hdr->mqhdr = 0;
+    p_hdr->mqid = 0;
     p_hdr->flowid = flow->flowid;
 
     switch (message_type) {
     case OPCODE_ACK:
-      if_pt (flow->protocol != PSM_PROTOCOL_TIDFLOW) 
+      if_pt (flow->protocol != PSM_PROTOCOL_TIDFLOW) {
         p_hdr->ack_seq_num = flow->recv_seq_num.psn;
+	/* Piggyback the eager credits given back to the peer so far */
+	p_hdr->data[1].u32w0 = ipsaddr->epaddr->mctxt_master->egrcredit_freed;
+      }
       else {
 	ptl_arg_t *args = (ptl_arg_t*) payload;
 	uint32_t tid_recv_sessid;
@@ -842,6 +1107,7 @@ _build_ctrl_message(struct ips_proto *proto,
     case OPCODE_NAK:
       if_pf (flow->protocol != PSM_PROTOCOL_TIDFLOW) {
 	p_hdr->ack_seq_num = flow->recv_seq_num.psn;
+	p_hdr->data[1].u32w0 = ipsaddr->epaddr->mctxt_master->egrcredit_freed;
       }
       else {
 	ptl_arg_t *args = (ptl_arg_t*) payload;
@@ -1032,6 +1298,103 @@ _build_ctrl_message(struct ips_proto *proto,
 
 psm_error_t ips_proto_timer_ctrlq_callback(struct psmi_timer *, uint64_t);
 
+PSMI_ALWAYS_INLINE(
+int
+ctrlq_prio(uint8_t message_type))
+{
+    switch (message_type) {
+    case OPCODE_ACK:
+    case OPCODE_NAK:
+    case OPCODE_FLOW_CCA_BECN:
+	return IPS_CTRLQ_PRIO_ACK;
+    case OPCODE_CONNECT_REQUEST:
+    case OPCODE_CONNECT_REPLY:
+    case OPCODE_DISCONNECT_REQUEST:
+    case OPCODE_DISCONNECT_REPLY:
+    case OPCODE_CLOSE:
+    case OPCODE_CLOSE_ACK:
+    case OPCODE_ABORT:
+	return IPS_CTRLQ_PRIO_CONN;
+    default:
+	return IPS_CTRLQ_PRIO_TID;
+    }
+}
+
+/* Go-back-N acks and naks read the flow's receive sequence when they are
+ * built, so one queued ack or nak per flow covers every later one. */
+#define ctrlq_ack_per_flow(flow, message_type)				\
+	(((message_type) == OPCODE_ACK || (message_type) == OPCODE_NAK) &&  \
+	 (flow)->protocol != PSM_PROTOCOL_TIDFLOW)
+
+static __recvpath
+struct ips_ctrlq_elem *
+ctrlq_first(struct ips_ctrlq *ctrlq)
+{
+    int i;
+
+    for (i = 0; i < IPS_CTRLQ_PRIO_MAX; i++)
+	if (!STAILQ_EMPTY(&ctrlq->ctrlq_prioq[i]))
+	    return STAILQ_FIRST(&ctrlq->ctrlq_prioq[i]);
+    return NULL;
+}
+
+static __recvpath
+void
+ctrlq_dequeue(struct ips_ctrlq *ctrlq, struct ips_ctrlq_elem *cqe)
+{
+    struct ips_proto *proto = ctrlq->ctrlq_proto;
+    uint64_t ns = cycles_to_nanosecs(get_cycles() - cqe->t_queued);
+    int bucket;
+
+    psmi_assert(cqe == STAILQ_FIRST(
+		    &ctrlq->ctrlq_prioq[ctrlq_prio(cqe->message_type)]));
+    STAILQ_REMOVE_HEAD(&ctrlq->ctrlq_prioq[ctrlq_prio(cqe->message_type)],
+		       next);
+    ctrlq->ctrlq_depth--;
+
+    if (cqe->flow->ctrlq_ack == cqe)
+	cqe->flow->ctrlq_ack = NULL;
+    else
+	*cqe->msg_queue_mask &= ~message_type2index(proto, cqe->message_type);
+
+    if (ns < 10000)
+	bucket = 0;
+    else if (ns < 100000)
+	bucket = 1;
+    else if (ns < 1000000)
+	bucket = 2;
+    else
+	bucket = 3;
+    proto->stats.ctrlq_wait_hist[bucket]++;
+
+    psmi_mpool_put(cqe);
+}
+
+/* Drop whatever is still queued for a flow that is going away */
+void
+ips_proto_ctrlq_purge(struct ips_proto *proto, struct ips_flow *flow)
+{
+    struct ips_ctrlq *ctrlq = 
+	&proto->ctrlq[IPS_FLOWID2INDEX(flow->flowid)&0x3];
+    struct ips_ctrlq_elem *cqe, *next;
+    int i;
+
+    for (i = 0; i < IPS_CTRLQ_PRIO_MAX; i++) {
+	for (cqe = STAILQ_FIRST(&ctrlq->ctrlq_prioq[i]); cqe; cqe = next) {
+	    next = STAILQ_NEXT(cqe, next);
+	    if (cqe->flow != flow)
+		continue;
+	    if (cqe != flow->ctrlq_ack)
+		*cqe->msg_queue_mask &= 
+		    ~message_type2index(proto, cqe->message_type);
+	    STAILQ_REMOVE(&ctrlq->ctrlq_prioq[i], cqe, ips_ctrlq_elem, next);
+	    ctrlq->ctrlq_depth--;
+	    psmi_mpool_put(cqe);
+	}
+    }
+    flow->ctrlq_ack = NULL;
+}
+
 psm_error_t __recvpath
 ips_proto_send_ctrl_message(struct ips_flow *flow, uint8_t message_type, 
 			    uint32_t *msg_queue_mask, void *payload)
@@ -1042,16 +1405,16 @@ ips_proto_send_ctrl_message(struct ips_flow *flow, uint8_t message_type,
     ips_epaddr_t *ipsaddr = flow->ipsaddr;
     struct ips_proto *proto = ipsaddr->proto;
     struct ips_ctrlq *ctrlq = &proto->ctrlq[IPS_FLOWID2INDEX(flow->flowid)&0x3];
-    struct ips_ctrlq_elem *cqe = ctrlq->ctrlq_cqe;
+    struct ips_ctrlq_elem *cqe;
     uint32_t cksum = 0;
     int paylen;
     uint8_t discard_msg = 0;
     
     /* Drain queue if non-empty */
-    if (cqe[ctrlq->ctrlq_tail].ipsaddr)
+    if (ctrlq->ctrlq_depth)
       ips_proto_timer_ctrlq_callback(&ctrlq->ctrlq_timer, 0ULL);
     
-    if (!cqe[ctrlq->ctrlq_tail].ipsaddr) {
+    if (!ctrlq->ctrlq_depth) {
       paylen = _build_ctrl_message(proto, &msg, ipsaddr, message_type, 
 				   flow, payload, &discard_msg);
       
@@ -1108,25 +1471,43 @@ ips_proto_send_ctrl_message(struct ips_flow *flow, uint8_t message_type,
 
     if (!(proto->ctrl_msg_queue_never_enqueue & proto->message_type_to_index[message_type])) {
       
-      if ((*msg_queue_mask) & proto->message_type_to_index[message_type]) {
+      if (ctrlq_ack_per_flow(flow, message_type) && flow->ctrlq_ack) {
+	/* An ack or nak is already queued for this flow.  A nak supersedes
+	 * a queued ack, anything else is redundant. */
+	if (message_type == OPCODE_NAK)
+	  flow->ctrlq_ack->message_type = OPCODE_NAK;
+	proto->stats.ctrlq_coalesced++;
+	err = PSM_OK;
+      } else if (!ctrlq_ack_per_flow(flow, message_type) &&
+		 (*msg_queue_mask) & proto->message_type_to_index[message_type]) {
 	/* This type of control message is already queued, skip it */
+	proto->stats.ctrlq_coalesced++;
 	err = PSM_OK;
-      } else if (cqe[ctrlq->ctrlq_head].ipsaddr == NULL) {
-	// entry is free
-	*msg_queue_mask |= message_type2index(proto, message_type);
+      } else if ((cqe = (struct ips_ctrlq_elem *) 
+			psmi_mpool_get(proto->ctrlq_pool)) != NULL) {
+	if (ctrlq_ack_per_flow(flow, message_type))
+	  flow->ctrlq_ack = cqe;
+	else
+	  *msg_queue_mask |= message_type2index(proto, message_type);
 	
-	cqe[ctrlq->ctrlq_head].ipsaddr = ipsaddr;
-	cqe[ctrlq->ctrlq_head].message_type = message_type;
-	cqe[ctrlq->ctrlq_head].msg_queue_mask = msg_queue_mask;
-	cqe[ctrlq->ctrlq_head].flow = flow;
+	cqe->ipsaddr = ipsaddr;
+	cqe->message_type = message_type;
+	cqe->msg_queue_mask = msg_queue_mask;
+	cqe->flow = flow;
+	cqe->t_queued = get_cycles();
 	
 	if (args) {
-	  cqe[ctrlq->ctrlq_head].args[0].u64w0 = args[0].u64w0;
-	  cqe[ctrlq->ctrlq_head].args[1].u64w0 = args[1].u64w0;
-	  cqe[ctrlq->ctrlq_head].args[2].u64w0 = args[2].u64w0;
+	  cqe->args[0].u64w0 = args[0].u64w0;
+	  cqe->args[1].u64w0 = args[1].u64w0;
+	  cqe->args[2].u64w0 = args[2].u64w0;
 	}
 	
-	ctrlq->ctrlq_head = (ctrlq->ctrlq_head + 1) % CTRL_MSG_QEUEUE_SIZE;
+	STAILQ_INSERT_TAIL(&ctrlq->ctrlq_prioq[ctrlq_prio(message_type)],
+			   cqe, next);
+	ctrlq->ctrlq_depth++;
+	proto->stats.ctrlq_queued++;
+	if (ctrlq->ctrlq_depth > proto->stats.ctrlq_max_depth)
+	  proto->stats.ctrlq_max_depth = ctrlq->ctrlq_depth;
 	//_IPATH_INFO("requesting ctrlq timer for msgtype=%d!\n", message_type);
 	psmi_timer_request(proto->timerq, &ctrlq->ctrlq_timer, 
 			   PSMI_TIMER_PRIO_0);
@@ -1146,7 +1527,7 @@ ips_proto_timer_ctrlq_callback(struct psmi_timer *timer, uint64_t t_cyc_expire)
     struct ips_ctrlq *ctrlq = (struct ips_ctrlq *) timer->context;
     struct ips_proto *proto = ctrlq->ctrlq_proto;
     struct ips_proto_ctrl_message msg;
-    struct ips_ctrlq_elem *cqe = ctrlq->ctrlq_cqe;
+    struct ips_ctrlq_elem *cqe;
     struct ips_flow *flow;
     uint8_t msg_type;
     psm_error_t err;
@@ -1155,15 +1536,15 @@ ips_proto_timer_ctrlq_callback(struct psmi_timer *timer, uint64_t t_cyc_expire)
     int paylen;
     uint8_t discard_msg = 0;
     
-    // service ctrl send queue first
-    while (cqe[ctrlq->ctrlq_tail].ipsaddr) {
-	msg_type = cqe[ctrlq->ctrlq_tail].message_type;
-	ipsaddr = cqe[ctrlq->ctrlq_tail].ipsaddr;
-	flow = cqe[ctrlq->ctrlq_tail].flow;
+    // service ctrl send queue first, highest priority class first
+    while ((cqe = ctrlq_first(ctrlq)) != NULL) {
+	msg_type = cqe->message_type;
+	ipsaddr = cqe->ipsaddr;
+	flow = cqe->flow;
 	
         paylen = _build_ctrl_message(proto, &msg,
 				     ipsaddr, msg_type, flow,
-				     cqe[ctrlq->ctrlq_tail].args,
+				     cqe->args,
 				     &discard_msg);
 	
 	psmi_assert_always(paylen == 0);
@@ -1207,10 +1588,7 @@ ips_proto_timer_ctrlq_callback(struct psmi_timer *timer, uint64_t t_cyc_expire)
 
 	if (err == PSM_OK) {
 	  ips_epaddr_stats_send(ipsaddr, msg_type);
-	  *cqe[ctrlq->ctrlq_tail].msg_queue_mask &=
-	    ~message_type2index(proto, cqe[ctrlq->ctrlq_tail].message_type);
-	  cqe[ctrlq->ctrlq_tail].ipsaddr = NULL;
-	  ctrlq->ctrlq_tail = (ctrlq->ctrlq_tail + 1) % CTRL_MSG_QEUEUE_SIZE;
+	  ctrlq_dequeue(ctrlq, cqe);
         } else {
 	    psmi_assert(err == PSM_EP_NO_RESOURCES);
 
@@ -1243,6 +1621,13 @@ ips_proto_flow_enqueue(struct ips_flow *flow, ips_scb_t *scb)
     STAILQ_INSERT_TAIL(&flow->scb_unacked, scb, nextq);
     flow->scb_num_pending++;
     flow->scb_num_unacked++;
+    /* Only flows holding eager scbs get a share of the eager pool */
+    if (scb->scbc == &ipsaddr->proto->scbc_egr) {
+	if (flow->scb_num_egr++ == 0)
+	    ipsaddr->proto->scbc_egr.scb_flows_active++;
+	else if (flow->scb_num_egr > ipsaddr->proto->scbc_egr.stats.flow_hiwat)
+	    ipsaddr->proto->scbc_egr.stats.flow_hiwat = flow->scb_num_egr;
+    }
 
     /* Every ipsaddr has a pending head that points into the unacked queue.
      * If sends are already pending, process those first */
@@ -1317,8 +1702,16 @@ ips_proto_flow_flush_pio(struct ips_flow *flow, int *nflushed)
 /*
  * Flush all packets currently marked as pending
  */
-static psm_error_t scb_dma_send(struct ips_proto *proto, struct ips_flow *flow,
-				struct ips_scb_pendlist *slist, int num,
+struct ips_sdma_batch_ent {
+    struct ips_flow *flow;
+    struct ips_scb  *scb;	/* next scb to gather */
+    int		     num;	/* scbs to send from this flow */
+    int		     gathered;	/* scbs put in the iovec so far */
+    int		     sent;	/* scbs put in flight */
+};
+
+static psm_error_t scb_dma_send(struct ips_proto *proto,
+				struct ips_sdma_batch_ent *batch, int nent,
 				int *num_sent);
 
 #ifdef PSM_DEBUG
@@ -1350,67 +1743,86 @@ static psm_error_t scb_dma_send(struct ips_proto *proto, struct ips_flow *flow,
  *			  rxe/txe parity error.
  * PSM_EP_NO_NETWORK: No network, no lid, ...
  */
-psm_error_t __sendpath
-ips_proto_flow_flush_dma(struct ips_flow *flow, int *nflushed)
+/*
+ * Refresh our view of send dma completions, reading the counter at most once
+ * per progress poll.
+ */
+static void
+ips_proto_dma_completion_update(struct ips_proto *proto)
 {
-    struct ips_proto *proto = flow->ipsaddr->proto;
-    struct ips_scb_pendlist *scb_pend = &flow->scb_pend;
-    uint32_t cntr_init;
-    ips_scb_t *scb;
-    psm_error_t err = PSM_OK;
-    int howmany = 0;
-    int nsent = 0;
+    uint32_t cntr;
 
-    /* Out of credits - ACKs/NAKs reclaim recredit or congested flow */
-    if_pf ((!flow->credits) || (flow->flags & IPS_FLOW_FLAG_CONGESTED)) {
-      if (nflushed)
-	*nflushed = 0;
-      return PSM_EP_NO_RESOURCES;
+    if (proto->iovec_cntr_last_completed == proto->iovec_cntr_next_inflight ||
+	proto->sdma_compl_epoch == proto->sdma_poll_epoch)
+	return;
+
+    proto->sdma_compl_epoch = proto->sdma_poll_epoch;
+    proto->stats.sdma_compl_reads++;
+    if (ipath_sdma_complete(proto->ptl->context->ctrl, &cntr) > 0)
+	proto->iovec_cntr_last_completed = cntr;
+}
+
+void
+ips_proto_sdma_unready(struct ips_proto *proto, struct ips_flow *flow)
+{
+    if (flow->flags & IPS_FLOW_FLAG_SDMA_READY) {
+	TAILQ_REMOVE(&proto->sdma_readyq, flow, sdma_next);
+	flow->flags &= ~IPS_FLOW_FLAG_SDMA_READY;
     }
-    
-    if (SLIST_EMPTY(scb_pend))
-	goto success;
+}
 
-    /* 
-     * Count how many are to be sent and fire dma.
-     */
+PSMI_ALWAYS_INLINE(
+int
+ips_sdma_hist_bucket(uint32_t val, int shift))
+{
+    int bucket = 0;
+
+    while ((val >>= shift) && bucket < IPS_SDMA_HIST_BUCKETS - 1)
+	bucket++;
+    return bucket;
+}
+
+/*
+ * Number of packets a flow can hand to send dma right now.
+ */
+PSMI_ALWAYS_INLINE(
+int
+ips_sdma_flow_howmany(struct ips_proto *proto, struct ips_flow *flow))
+{
+    int howmany = 0;
+
+    if ((!flow->credits) || (flow->flags & IPS_FLOW_FLAG_CONGESTED))
+	return 0;
 #ifdef PSM_DEBUG
-    SLIST_FOREACH(scb, scb_pend, next)
-	howmany++;
-    psmi_assert_always(howmany == flow->scb_num_pending);
+    {
+	ips_scb_t *scb;
+	SLIST_FOREACH(scb, &flow->scb_pend, next)
+	    howmany++;
+	psmi_assert_always(howmany == flow->scb_num_pending);
+    }
 #else
     howmany = min(flow->scb_num_pending, flow->credits);
 #endif
-    
-    howmany = min(howmany, proto->scb_max_sdma);
-    
-    if (howmany == 0)
-      goto success;
-
-    PSM_DEBUG_CHECK_INFLIGHT_CNTR(proto); /* Pre-check */
-
-    cntr_init = proto->iovec_cntr_next_inflight;
-    err = scb_dma_send(proto, flow, scb_pend, howmany, &nsent);
-    if (err != PSM_OK && err != PSM_EP_NO_RESOURCES && 
-	err != PSM_OK_NO_PROGRESS)
-	goto fail;
+    return min(howmany, proto->scb_max_sdma);
+}
 
-    /* scb_dma_send shouldn't modify iovec_cntr_next_inflight */
-    psmi_assert_always(cntr_init == proto->iovec_cntr_next_inflight);
+/*
+ * Account for the packets of one flow that made it into flight and arm the
+ * flow's timers.  Called in the order flows were gathered so dma counters
+ * follow the order packets were queued to the ring.
+ */
+static psm_error_t __sendpath
+ips_sdma_flow_sent(struct ips_proto *proto, struct ips_sdma_batch_ent *ent,
+		   uint64_t t_cyc)
+{
+    struct ips_flow *flow = ent->flow;
+    struct ips_scb_pendlist *scb_pend = &flow->scb_pend;
+    ips_scb_t *scb;
+    int nsent = ent->sent;
 
     if (nsent > 0) {
-	uint64_t t_cyc = get_cycles();
-	uint32_t new_inflight = proto->iovec_cntr_next_inflight + nsent;
 	int i = 0;
 
-	/* We have to ensure that the inflight counter doesn't drift away too
-	 * far from the completion counter or else our wraparound arithmetic
-	 * in ips_proto_dma_wait_until will fail.
-	 */
-	if ((int) new_inflight - (int) proto->iovec_cntr_last_completed < 0)
-	    ips_proto_dma_wait_until(proto, 
-				     proto->iovec_cntr_last_completed + nsent);
-
 	flow->scb_num_pending -= nsent;
 	flow->credits = max((int) flow->credits - nsent, 0);
 	
@@ -1427,8 +1839,6 @@ ips_proto_flow_flush_dma(struct ips_flow *flow, int *nflushed)
 	SLIST_FIRST(scb_pend) = scb;
     }
 
-    PSM_DEBUG_CHECK_INFLIGHT_CNTR(proto); /* Post Check */
-
     if (SLIST_FIRST(scb_pend) != NULL) {
 	psmi_assert(flow->scb_num_pending > 0);
 
@@ -1471,22 +1881,159 @@ ips_proto_flow_flush_dma(struct ips_flow *flow, int *nflushed)
 	  }
 	  break;
 	}
+
+	/* Held back by the ring rather than by credits, let the next writev
+	 * or the progress poll pick the flow up */
+	if (flow->credits && (proto->flags & IPS_PROTO_FLAG_SDMA_BATCH) &&
+	    !(flow->flags & IPS_FLOW_FLAG_SDMA_READY)) {
+	    TAILQ_INSERT_TAIL(&proto->sdma_readyq, flow, sdma_next);
+	    flow->flags |= IPS_FLOW_FLAG_SDMA_READY;
+	    proto->sdma_ready_cntr = proto->iovec_cntr_last_completed;
+	}
+	else if (!flow->credits)
+	    ips_proto_sdma_unready(proto, flow);
     }
     else {
       /* Schedule ack timer */
       psmi_timer_cancel(proto->timerq, &flow->timer_send);
       psmi_timer_request(proto->timerq, &flow->timer_ack,
 			 get_cycles() + flow->path->epr_timeout_ack);
+      ips_proto_sdma_unready(proto, flow);
     }
     
     /* We overwrite error with its new meaning for flushing packets */
     if (nsent > 0)
-        if (nsent < howmany)
-	    err = PSM_OK_NO_PROGRESS; /* partial flush */
+        if (nsent < ent->num)
+	    return PSM_OK_NO_PROGRESS; /* partial flush */
 	else
-	    err = PSM_OK; /* complete flush */
+	    return PSM_OK; /* complete flush */
     else
-	err = PSM_EP_NO_RESOURCES; /* no flush at all */
+	return PSM_EP_NO_RESOURCES; /* no flush at all */
+}
+
+/*
+ * Flush all packets queued up on a flow via send DMA.
+ *
+ * Other send dma flows that were held back by a busy ring are gathered into
+ * the same writev, after the flow being flushed.  Return values only
+ * describe the flow being flushed.
+ *
+ * Recoverable errors:
+ * PSM_OK: Able to flush entire pending queue for DMA.
+ * PSM_OK_NO_PROGRESS: Flushed at least 1 but not all pending packets for DMA.
+ * PSM_EP_NO_RESOURCES: No scb's available to handle unaligned packets
+ *                      or writev returned a recoverable error (no mem for
+ *                      descriptors, dma interrupted or no space left in dma
+ *                      queue).
+ *
+ * Unrecoverable errors:
+ * PSM_EP_DEVICE_FAILURE: Unexpected error calling writev(), chip failure,
+ *			  rxe/txe parity error.
+ * PSM_EP_NO_NETWORK: No network, no lid, ...
+ */
+psm_error_t __sendpath
+ips_proto_flow_flush_dma(struct ips_flow *flow, int *nflushed)
+{
+    struct ips_proto *proto = flow->ipsaddr->proto;
+    struct ips_sdma_batch_ent batch[IPS_SDMA_BATCH_MAX_FLOWS];
+    struct ips_flow *bflow;
+    uint32_t cntr_init;
+    psm_error_t err = PSM_OK;
+    uint64_t t_cyc;
+    int howmany, total;
+    int nent = 0;
+    int nsent = 0;
+    int i;
+
+    /* Out of credits - ACKs/NAKs reclaim recredit or congested flow */
+    if_pf ((!flow->credits) || (flow->flags & IPS_FLOW_FLAG_CONGESTED)) {
+      if (nflushed)
+	*nflushed = 0;
+      return PSM_EP_NO_RESOURCES;
+    }
+    
+    if (SLIST_EMPTY(&flow->scb_pend))
+	goto success;
+
+    /* 
+     * Count how many are to be sent and fire dma.
+     */
+    howmany = ips_sdma_flow_howmany(proto, flow);
+    if (howmany == 0)
+      goto success;
+
+    batch[0].flow = flow;
+    batch[0].num = total = howmany;
+    nent = 1;
+
+    /* Gather flows waiting on the ring */
+    if (proto->flags & IPS_PROTO_FLAG_SDMA_BATCH) {
+	TAILQ_FOREACH(bflow, &proto->sdma_readyq, sdma_next) {
+	    if (nent == IPS_SDMA_BATCH_MAX_FLOWS || 
+		total >= proto->sdma_batch_max)
+		break;
+	    if (bflow == flow)
+		continue;
+	    howmany = min(ips_sdma_flow_howmany(proto, bflow),
+			  (int) proto->sdma_batch_max - total);
+	    if (howmany == 0)
+		continue;
+	    batch[nent].flow = bflow;
+	    batch[nent].num = howmany;
+	    total += howmany;
+	    nent++;
+	}
+    }
+
+    for (i = 0; i < nent; i++) {
+	batch[i].scb = SLIST_FIRST(&batch[i].flow->scb_pend);
+	batch[i].gathered = 0;
+	batch[i].sent = 0;
+    }
+
+    PSM_DEBUG_CHECK_INFLIGHT_CNTR(proto); /* Pre-check */
+
+    proto->stats.sdma_ring_hist[ips_sdma_hist_bucket(
+	proto->iovec_cntr_next_inflight - proto->iovec_cntr_last_completed,
+	2)]++;
+
+    cntr_init = proto->iovec_cntr_next_inflight;
+    err = scb_dma_send(proto, batch, nent, &nsent);
+    if (err != PSM_OK && err != PSM_EP_NO_RESOURCES && 
+	err != PSM_OK_NO_PROGRESS)
+	goto fail;
+
+    /* scb_dma_send shouldn't modify iovec_cntr_next_inflight */
+    psmi_assert_always(cntr_init == proto->iovec_cntr_next_inflight);
+
+    if (nsent > 0) {
+	uint32_t new_inflight = proto->iovec_cntr_next_inflight + nsent;
+
+	/* We have to ensure that the inflight counter doesn't drift away too
+	 * far from the completion counter or else our wraparound arithmetic
+	 * in ips_proto_dma_wait_until will fail.
+	 */
+	if ((int) new_inflight - (int) proto->iovec_cntr_last_completed < 0)
+	    ips_proto_dma_wait_until(proto, 
+				     proto->iovec_cntr_last_completed + nsent);
+
+	proto->stats.sdma_batch_hist[ips_sdma_hist_bucket(nsent, 1)]++;
+	if (nent > 1)
+	    proto->stats.sdma_batch_flows++;
+    }
+
+    /* Gathered flows still held back go to the back of the ready queue */
+    for (i = 1; i < nent; i++)
+	if (batch[i].sent < batch[i].num)
+	    ips_proto_sdma_unready(proto, batch[i].flow);
+
+    t_cyc = get_cycles();
+    err = ips_sdma_flow_sent(proto, &batch[0], t_cyc);
+    for (i = 1; i < nent; i++)
+	ips_sdma_flow_sent(proto, &batch[i], t_cyc);
+    nsent = batch[0].sent;
+
+    PSM_DEBUG_CHECK_INFLIGHT_CNTR(proto); /* Post Check */
 
 success:
 fail:
@@ -1496,6 +2043,37 @@ fail:
     return err;
 }
 
+/*
+ * Called from the progress poll while flows are held back by the ring.  The
+ * completion counter is read (at most once per poll) and the held back flows
+ * are retried as one writev when the ring has drained some.
+ */
+void __sendpath
+ips_proto_sdma_progress(struct ips_proto *proto, uint64_t t_cyc)
+{
+    struct ips_flow *flow;
+    uint32_t cntr;
+
+    proto->sdma_progress_next = t_cyc + proto->timeout_send;
+    if (TAILQ_EMPTY(&proto->sdma_readyq))
+	return;
+
+    cntr = proto->iovec_cntr_last_completed;
+    ips_proto_dma_completion_update(proto);
+    if (proto->iovec_cntr_last_completed == cntr &&
+	cntr == proto->sdma_ready_cntr)
+	return;
+
+    /* Flows that ran out of credits or got congested wait on their ack
+     * timer instead */
+    while ((flow = TAILQ_FIRST(&proto->sdma_readyq)) != NULL &&
+	   ips_sdma_flow_howmany(proto, flow) == 0)
+	ips_proto_sdma_unready(proto, flow);
+
+    if (flow != NULL)
+	ips_proto_flow_flush_dma(flow, NULL);
+}
+
 /* 
  * Fault injection in dma sends. Since DMA through writev() is all-or-nothing,
  * we don't inject faults on a packet-per-packet basis since the code gets
@@ -1503,20 +2081,21 @@ fail:
  * as an "event" and faults are generated according to the IPS_FAULTINJ_DMASEND
  * setting.
  *
- * The effect is as if the event was successful but dropped on the wire
- * somewhere.
+ * The effect of a drop is as if the event was successful but dropped on the
+ * wire somewhere.  A delay looks like a full ring, the send is retried.
  */
 PSMI_ALWAYS_INLINE(
 int
-dma_do_fault())
+dma_do_fault(struct ips_flow *flow))
 {
   
   if_pf (PSMI_FAULTINJ_ENABLED()) {
     PSMI_FAULTINJ_STATIC_DECL(fi, "dmalost", 1, IPS_FAULTINJ_DMALOST);
-    return psmi_faultinj_is_fault(fi);
+    return psmi_faultinj_event(fi, 
+	     ips_epaddr_faultinj_peer(flow->ipsaddr), flow->flowid);
   }
   else
-    return 0;
+    return PSMI_FAULTINJ_NONE;
 }
 
 /* ips_dma_transfer_frame is used only for control messages, and is
@@ -1539,8 +2118,18 @@ ips_dma_transfer_frame(struct ips_proto *proto, struct ips_flow *flow,
     psmi_assert(paylen < proto->epinfo.ep_mtu);
     
     /* See comments above for fault injection */
-    if_pf (dma_do_fault())
-	return PSM_OK;
+    if_pf (PSMI_FAULTINJ_ENABLED()) {
+	int fault = dma_do_fault(flow);
+	if (fault == PSMI_FAULTINJ_DROP)
+	    return PSM_OK;
+	else if (fault == PSMI_FAULTINJ_DELAY)
+	    return PSM_EP_NO_RESOURCES;
+    }
+
+    if_pf (PSMI_CAPTURE_ENABLED())
+	psmi_capture_packet(proto->ep, PSMI_CAPTURE_TX, PSMI_CAPTURE_DMA,
+			    &pbc_hdr_i->hdr, sizeof(struct ips_message_header),
+			    payload, paylen);
 
     ips_proto_pbc_update(proto, flow, PSMI_TRUE,  &pbc_hdr_i->pbc, 
 			 sizeof(struct ips_message_header), 
@@ -1647,26 +2236,39 @@ fail:
  */
 static
 psm_error_t  __sendpath
-scb_dma_send(struct ips_proto *proto, struct ips_flow *flow,
-	     struct ips_scb_pendlist *slist, int num, int *num_sent)
+scb_dma_send(struct ips_proto *proto, struct ips_sdma_batch_ent *batch,
+	     int nent, int *num_sent)
 {
     ssize_t ret;
-    struct ips_scb *scb = SLIST_FIRST(slist);
+    struct ips_flow *flow;
+    struct ips_scb *scb;
     unsigned int vec_idx = 0, scb_idx = 0, scb_sent = 0;
-    unsigned int max_elem;
+    unsigned int max_elem, scb_gathered = 0;
     struct iovec *iovec;
+    struct ips_scb **vec_scb = NULL; /* gathered scbs, in send order */
     psm_error_t err = PSM_OK;
     uint32_t cksum;
+    int num = 0, ent = 0, i;
+
+    for (i = 0; i < nent; i++)
+	num += batch[i].num;
 
     psmi_assert(num > 0);
-    psmi_assert(scb != NULL);
+    psmi_assert(batch[0].scb != NULL);
 
     /* See comments above for fault injection */
-    if_pf (dma_do_fault()) 
-      goto fail;
+    if_pf (PSMI_FAULTINJ_ENABLED()) {
+      int fault = dma_do_fault(batch[0].flow);
+      if (fault == PSMI_FAULTINJ_DELAY)
+	err = PSM_EP_NO_RESOURCES;
+      if (fault == PSMI_FAULTINJ_DROP || fault == PSMI_FAULTINJ_DELAY)
+	goto fail;
+    }
 
     max_elem = 3*num;
     iovec = alloca(sizeof(struct iovec) * max_elem);
+    if_pf (PSMI_CAPTURE_ENABLED())
+	vec_scb = alloca(sizeof(struct ips_scb *) * num);
 
     if_pf (iovec == NULL) {
 	err = psmi_handle_error(PSMI_EP_NORETURN, PSM_NO_MEMORY,
@@ -1677,11 +2279,16 @@ scb_dma_send(struct ips_proto *proto, struct ips_flow *flow,
 
 writev_again:
     vec_idx = 0;
+    scb_idx = 0;
 
-    SLIST_FOREACH(scb, slist, next) {
+    for (; ent < nent; ent++) {
+      flow = batch[ent].flow;
+      for (scb = batch[ent].scb; 
+	   scb != NULL && batch[ent].gathered < batch[ent].num;
+	   scb = batch[ent].scb = SLIST_NEXT(scb, next)) {
 	/* Can't exceed posix max writev count */
 	if (vec_idx + (int) !!(scb->payload_size > 0) >= UIO_MAXIOV)
-	    break;
+	    goto writev_now;
    	
 	psmi_assert(vec_idx < max_elem);
 	psmi_assert_always((scb->payload_size & 0x3) == 0);
@@ -1702,7 +2309,7 @@ writev_again:
 	iovec[vec_idx].iov_len  = sizeof(struct ips_message_header) + 
 			          sizeof(union ipath_pbc);
 	vec_idx++;
-	
+
 	if (scb->payload_size > 0) {
 	    /* 
 	     * Payloads must be 4-byte aligned.  If not, we need a bounce
@@ -1731,7 +2338,7 @@ writev_again:
 		    if (--vec_idx == 0) /* Remove header, nothing to send */
 		      goto fail;
 		    else    /* send what we have so far, but no more */
-		      break;
+		      goto writev_now;
 		  }
 		  
 		  /* Only need to copy if bounce buffer is used. */
@@ -1800,9 +2407,14 @@ writev_again:
 	}
 
 	/* Can bound the number to send by 'num' */
-	if (++scb_idx == num)
-	    break;
+	batch[ent].gathered++;
+	scb_idx++;
+	if_pf (vec_scb != NULL)
+	    vec_scb[scb_gathered++] = scb;
+      }
     }
+
+writev_now:
     psmi_assert(vec_idx > 0);
     ret = ipath_cmd_writev(proto->fd, iovec, vec_idx);
     
@@ -1813,7 +2425,7 @@ writev_again:
 	scb_sent += ret;
 	/* scbs are left if we didn't want to send less and didn't have
 	 * to break out of scbctrl_bufalloc */
-	if (scb != NULL && scb_idx < num && err == PSM_OK) 
+	if (ent < nent && scb_sent < num && err == PSM_OK) 
 	    goto writev_again;
     }
     else {
@@ -1847,7 +2459,7 @@ writev_again:
 	    }
 
 	    /* Re-write ret to actual inflight count */
-	    scb_sent += cntr_fini - proto->iovec_cntr_next_inflight;
+	    scb_sent = cntr_fini - proto->iovec_cntr_next_inflight;
 	}
 	else {
 	    /* No need for inflight system call, we can infer it's value from
@@ -1857,6 +2469,23 @@ writev_again:
     }
 
 fail:
+    /* Capture only what went out, scbs not taken by writev are gathered
+     * again on the next flush */
+    if_pf (vec_scb != NULL) {
+	for (i = 0; i < (int) min(scb_sent, scb_gathered); i++) {
+	    scb = vec_scb[i];
+	    psmi_capture_packet(proto->ep, PSMI_CAPTURE_TX, PSMI_CAPTURE_DMA,
+				&scb->ips_lrh, 
+				sizeof(struct ips_message_header),
+				scb->payload, scb->payload_size);
+	}
+    }
+
+    /* Packets went out in the order they were gathered */
+    for (i = 0, ret = scb_sent; i < nent; i++) {
+	batch[i].sent = min(batch[i].gathered, (int) ret);
+	ret -= batch[i].sent;
+    }
     *num_sent = scb_sent;
     psmi_assert(*num_sent <= num && *num_sent >= 0);
     return err;
@@ -1939,12 +2568,13 @@ ips_proto_timer_ack_callback(struct psmi_timer *current_timer, uint64_t current)
 	 * destination *after* we pio this err_chk. 
 	 */
 	if (flow->transfer == PSM_TRANSFER_DMA) {
-	  uint32_t dma_cntr;
 	  uint32_t scb_cntr = 
 	    STAILQ_LAST(&flow->scb_unacked, ips_scb, nextq)->dma_ctr;
+	  /* Shares one completion counter read with other flows whose ack
+	   * timers expire in this poll */
+	  ips_proto_dma_completion_update(proto);
 	  done_local = 
-	    (ipath_sdma_complete(proto->ptl->context->ctrl, &dma_cntr) > 0 &&
-	     ((int) dma_cntr - (int) scb_cntr >= 0));
+	    ((int) proto->iovec_cntr_last_completed - (int) scb_cntr >= 0);
 	  if (!done_local)
 	    proto->stats.writev_compl_eagain++;
 	}
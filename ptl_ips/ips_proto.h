@@ -101,7 +101,7 @@ struct ips_epinfo_remote {
   uint16_t      epr_max_lid;
   uint8_t       epr_num_paths[IPS_PATH_MAX_PRIORITY];
   uint8_t       epr_next_path[IPS_PATH_MAX_PRIORITY];
-  ips_path_rec_t *epr_path[IPS_PATH_MAX_PRIORITY][1 << IPS_MAX_PATH_LMC];
+  ips_path_rec_t **epr_path[IPS_PATH_MAX_PRIORITY]; /* ips_epaddr_paths_alloc */
 };
 
 /*
@@ -134,7 +134,18 @@ struct ips_pbc_header {
 /*
  * Control message structures
  */
-#define CTRL_MSG_QEUEUE_SIZE 32  /* power of two */
+#define CTRL_MSG_QEUEUE_SIZE 32  /* power of two, queue elements per chunk */
+
+/* Queued control messages drain by class: acks and naks first, then
+ * expected-receive (tid) and error check traffic, then connection
+ * management. */
+#define IPS_CTRLQ_PRIO_ACK	0
+#define IPS_CTRLQ_PRIO_TID	1
+#define IPS_CTRLQ_PRIO_CONN	2
+#define IPS_CTRLQ_PRIO_MAX	3
+
+/* Buckets in the time-in-queue histogram */
+#define IPS_CTRLQ_WAIT_BUCKETS	4
 
 struct ips_proto_ctrl_message {
     struct ips_pbc_header	pbc_hdr;
@@ -149,26 +160,30 @@ struct ips_flow;
 struct ips_tid_recv_desc;
 
 struct ips_ctrlq_elem {
+    STAILQ_ENTRY(ips_ctrlq_elem) next;
     struct ptl_epaddr *ipsaddr;
     uint8_t	       message_type;
     uint8_t	       flowid;
     uint16_t           pad;
     uint32_t          *msg_queue_mask;
     struct ips_flow   *flow;
+    uint64_t	       t_queued;
     ptl_arg_t	       args[3];
 };
 
+STAILQ_HEAD(ips_ctrlq_elemq, ips_ctrlq_elem);
+
 struct ips_ctrlq {
-    /* Queued control messages, queued when pio is busy */
+    /* Queued control messages, queued when pio is busy.  Elements come from
+     * the proto's ctrlq_pool so the queue grows with demand. */
     struct ips_proto *ctrlq_proto;
 
     int		ctrlq_flowid;
-    uint32_t	ctrlq_head;
-    uint32_t	ctrlq_tail;
+    uint32_t	ctrlq_depth;
     uint32_t	ctrlq_overflow;
     uint32_t	ctrlq_never_enqueue;
 
-    struct ips_ctrlq_elem   ctrlq_cqe[CTRL_MSG_QEUEUE_SIZE]  PSMI_CACHEALIGN;
+    struct ips_ctrlq_elemq  ctrlq_prioq[IPS_CTRLQ_PRIO_MAX];
     struct psmi_timer	    ctrlq_timer;    /* when in timerq */
 };
 
@@ -231,6 +246,26 @@ struct ips_proto_stats {
     uint64_t	unknown_packets;
     uint64_t	stray_packets;
     uint64_t	send_dma_misaligns;
+    uint64_t	flows_live;
+    uint64_t	flows_materialized;
+    uint64_t	flows_reclaimed;
+    uint64_t	hdr_predict_hits;
+    uint64_t	coalesced_envelopes;
+    uint64_t	coalesced_packets;
+    uint64_t	sdma_batch_flows;	/* writevs gathering several flows */
+    uint64_t	sdma_compl_reads;
+    uint64_t	sdma_batch_hist[IPS_SDMA_HIST_BUCKETS];
+    uint64_t	sdma_ring_hist[IPS_SDMA_HIST_BUCKETS];
+    uint64_t	ctrlq_queued;
+    uint64_t	ctrlq_coalesced;	/* redundant acks merged while queued */
+    uint64_t	ctrlq_max_depth;
+    uint64_t	ctrlq_wait_hist[IPS_CTRLQ_WAIT_BUCKETS];
+    uint64_t	rv_win_stalls;		/* grants held back on tids/tidflows */
+    uint64_t	rv_win_hist[IPS_RV_WIN_HIST_BUCKETS];
+    uint64_t	egrcredit_rndv;		/* eager sends pushed to rendezvous */
+    uint64_t	egr_loans;		/* unexpected payloads left in place */
+    uint64_t	egr_loans_recalled;	/* ... and copied out at the watermark */
+    uint64_t	eager_buffered;		/* isends completed before their ack */
 };
 
 struct ips_proto_error_stats {
@@ -305,6 +340,35 @@ struct ips_proto {
 
     struct ips_ctrlq	ctrlq[EP_FLOW_LAST];
 
+    /* Peer flows currently materialized, swept for idle ones to reclaim */
+    TAILQ_HEAD(ips_flow_liveq, ips_flow) flows_liveq;
+    struct psmi_timer	flows_idle_timer;
+    uint64_t		flows_idle_timeout;	/* 0 never reclaims */
+
+    /* Bits of ips_proto_hp_word() that must match a flow's prediction */
+    uint64_t		hp_mask;
+
+    /* Flows holding coalesced MQ envelopes, oldest first */
+    TAILQ_HEAD(ips_flow_coalesceq, ips_flow) coalesceq;
+    struct psmi_timer	coalesce_timer;
+    uint64_t		coalesce_window;  /* max cycles an envelope is held */
+    uint32_t		coalesce_thresh;  /* largest message coalesced */
+
+    /* Send dma flows with packets held back by a busy ring.  They are
+     * gathered into the next writev, and retried from the progress poll
+     * once the ring has completed more packets. */
+    TAILQ_HEAD(ips_flow_sdmaq, ips_flow) sdma_readyq;
+    uint32_t		sdma_batch_max;	  /* packets per batched writev */
+    uint32_t		sdma_ready_cntr;  /* completions when last refused */
+    uint64_t		sdma_progress_next;
+    /* Completion counter is read at most once per progress poll */
+    uint32_t		sdma_poll_epoch;
+    uint32_t		sdma_compl_epoch;
+
+    /* Eager isend bytes copied to scbs and completed, but not yet acked */
+    uint32_t		eager_buffered;
+    uint32_t		eager_buffered_max;  /* 0 never completes early */
+
     /* Handling tid errors */
     uint32_t	tiderr_cnt;
     uint32_t	tiderr_max;
@@ -373,6 +437,7 @@ struct ips_proto {
  */
     uint32_t ctrl_msg_queue_overflow;
     uint32_t ctrl_msg_queue_never_enqueue;
+    mpool_t  ctrlq_pool;
     uint32_t message_type_to_index[256];
 #define message_type2index(proto, msg_type) (proto->message_type_to_index[(msg_type)] & ~CTRL_MSG_QUEUE_ALWAYS)
 
@@ -506,6 +571,26 @@ struct ips_flow {
 
     uint32_t scb_num_pending;
     uint32_t scb_num_unacked;
+    uint32_t scb_num_egr;	/* unacked scbs drawn from scbc_egr */
+
+    uint64_t fi_t_xmit_lost;	/* fault injection: cycles at a lost send */
+    uint64_t fi_t_recv_lost;	/* ... and at a lost receive, 0 if none */
+    uint32_t fi_xmit_lost_psn;
+    uint32_t fi_recv_lost_psn;
+
+    uint64_t hp_pred;		/* predicted header word, 0 if none yet */
+    uint32_t touched;		/* used since the last idle sweep */
+    TAILQ_ENTRY(ips_flow) live_next;
+
+    /* Small envelopes being packed into one MQ_MSG_PACKED packet */
+    struct ips_scb *coalesce_scb;
+    uint32_t coalesce_cap;	/* payload room in coalesce_scb */
+    uint64_t coalesce_last;	/* cycles at the last small envelope */
+    uint64_t coalesce_deadline;	/* cycles by which coalesce_scb goes out */
+    TAILQ_ENTRY(ips_flow) coalesce_next;
+
+    TAILQ_ENTRY(ips_flow) sdma_next;	/* on proto's sdma_readyq */
+    struct ips_ctrlq_elem *ctrlq_ack;	/* queued ack or nak, if any */
 
     psmi_timer timer_send;   /* timer for frames that got a busy PIO */
     psmi_timer timer_ack;    /* timer for unacked frames */
@@ -514,6 +599,23 @@ struct ips_flow {
     SLIST_HEAD(ips_scb_pendlist, ips_scb)   scb_pend;
 };
 
+/*
+ * What is left of a go-back-n flow while it is not materialized.  Flows are
+ * allocated on first use and given back after being idle for a while, so
+ * peers that don't talk only cost their ptl_epaddr.
+ */
+struct ips_flow_saved {
+    psmi_seqnum_t xmit_seq_num;
+    psmi_seqnum_t xmit_ack_num;
+    psmi_seqnum_t recv_seq_num;
+    psmi_seqnum_t last_seq_num;
+    uint32_t frag_size;
+    uint16_t sl;
+    uint16_t msg_ooo_seqnum;
+};
+
+#define IPS_FLOW_SL_FROM_PATH	0xffff
+
 struct ptl_epaddr {
     struct ptl	      *ptl;	/* cached */
     psm_epaddr_t       epaddr;	/* back pointer to psm top-level epaddr */
@@ -522,8 +624,10 @@ struct ptl_epaddr {
 
     uint16_t			flags;	/* per-endpoint flags */
     struct ips_epinfo_remote	epr;	/* remote endpoint params */
-    struct ips_flow		flows[EP_FLOW_LAST]	    PSMI_CACHEALIGN;
-    struct ips_flow		tidgr_flow; /* tidflow */
+    struct ips_flow	       *flows[EP_FLOW_LAST]; /* see ips_epaddr_flow */
+    struct ips_flow_saved	flows_saved[EP_FLOW_LAST];
+    ips_path_rec_t	       *flows_path; /* path shared by PIO/DMA/AM_REQ */
+    struct ips_flow	       *tidgr_flow; /* tidflow, on first rendezvous */
 
     uint32_t ctrl_msg_queued; /* bitmap of queued control messages to be send */
     uint32_t delay_in_ms;   /* used in close */
@@ -559,6 +663,86 @@ void ips_scb_prepare_flow(ips_scb_t *scb, struct ips_epinfo *epinfo,
 
 void ips_proto_flow_enqueue(struct ips_flow *flow, ips_scb_t *scb);
 
+struct ips_flow *ips_epaddr_flow_materialize(ips_epaddr_t *ipsaddr,
+					     ptl_epaddr_flow_t flowid);
+void ips_epaddr_flow_set_sl(ips_epaddr_t *ipsaddr, uint16_t sl);
+void ips_epaddr_flows_free(ips_epaddr_t *ipsaddr);
+struct ips_flow *ips_epaddr_tidgr_flow_materialize(ips_epaddr_t *ipsaddr);
+psm_error_t ips_epaddr_paths_alloc(struct ips_proto *proto,
+				   ips_epaddr_t *ipsaddr, int num_path);
+void ips_epaddr_paths_free(ips_epaddr_t *ipsaddr);
+psm_error_t ips_proto_flows_idle_sweep(struct psmi_timer *, uint64_t);
+
+void ips_mq_coalesce_flush(struct ips_proto *proto, struct ips_flow *flow);
+void ips_mq_coalesce_discard(struct ips_proto *proto, struct ips_flow *flow);
+psm_error_t ips_mq_coalesce_timer_callback(struct psmi_timer *, uint64_t);
+
+/* 
+ * Return the go-back-n flow flowid of ipsaddr, materializing it if it is not
+ * in use yet (or was reclaimed while idle).
+ */
+PSMI_ALWAYS_INLINE(
+struct ips_flow *
+ips_epaddr_flow(ips_epaddr_t *ipsaddr, ptl_epaddr_flow_t flowid))
+{
+    struct ips_flow *flow = ipsaddr->flows[flowid];
+    if_pf (flow == NULL)
+	flow = ips_epaddr_flow_materialize(ipsaddr, flowid);
+    flow->touched = 1;
+    return flow;
+}
+
+/*
+ * Return the tidflow used for TID grant acks/naks to ipsaddr, materializing it
+ * on the first rendezvous with the peer.  It lives until the peer is freed.
+ */
+PSMI_ALWAYS_INLINE(
+struct ips_flow *
+ips_epaddr_tidgr_flow(ips_epaddr_t *ipsaddr))
+{
+    if_pf (ipsaddr->tidgr_flow == NULL)
+	return ips_epaddr_tidgr_flow_materialize(ipsaddr);
+    return ipsaddr->tidgr_flow;
+}
+
+/*
+ * Peer key used to match scripted faults (PSM_FI_SCRIPT peer=) against an
+ * endpoint: base lid, context and subcontext of the remote.
+ */
+PSMI_ALWAYS_INLINE(
+uint32_t
+ips_epaddr_faultinj_peer(ips_epaddr_t *ipsaddr))
+{
+    return ((uint32_t) __be16_to_cpu(ipsaddr->epr.epr_base_lid) << 16) |
+	   ((ipsaddr->epr.epr_context & 0xff) << 8) |
+	   (ipsaddr->epr.epr_subcontext & 0xff);
+}
+
+/*
+ * Fault injection recovery accounting on go-back-n flows.  A flow remembers
+ * its first injected send loss until that packet is acked.
+ */
+PSMI_ALWAYS_INLINE(
+void
+ips_flow_faultinj_xmit_lost(struct ips_flow *flow, 
+			    struct ips_message_header *p_hdr))
+{
+    if (flow->protocol == PSM_PROTOCOL_GO_BACK_N && flow->fi_t_xmit_lost == 0) {
+	flow->fi_t_xmit_lost = get_cycles();
+	flow->fi_xmit_lost_psn = __be32_to_cpu(p_hdr->bth[2]) & 0xffffff;
+    }
+}
+
+PSMI_ALWAYS_INLINE(
+void
+ips_flow_faultinj_xmit_acked(struct ips_flow *flow, ips_scb_t *scb))
+{
+    if_pf (flow->fi_t_xmit_lost && scb->seq_num.psn == flow->fi_xmit_lost_psn) {
+	psmi_faultinj_recovered(flow->fi_t_xmit_lost);
+	flow->fi_t_xmit_lost = 0;
+    }
+}
+
 psm_error_t ips_proto_flow_flush_pio(struct ips_flow *flow, int *nflushed);
 psm_error_t ips_proto_flow_flush_dma(struct ips_flow *flow, int *nflushed);
 
@@ -569,6 +753,9 @@ void	    ips_proto_scb_dma_enqueue(struct ips_proto *proto, ips_scb_t *scb);
 psm_error_t ips_proto_scb_dma_flush(struct ips_proto *proto, ips_epaddr_t *ipsaddr,
 				    int *nflushed);
 psm_error_t ips_proto_dma_wait_until(struct ips_proto *proto, uint32_t dma_ctr);
+void ips_proto_sdma_progress(struct ips_proto *proto, uint64_t t_cyc);
+void ips_proto_sdma_unready(struct ips_proto *proto, struct ips_flow *flow);
+void ips_proto_ctrlq_purge(struct ips_proto *proto, struct ips_flow *flow);
 psm_error_t ips_proto_dma_wait(struct ips_proto *proto, uint32_t dma_ctr,
 			       uint32_t *dma_ctr_out);
 
@@ -673,6 +860,7 @@ psm_error_t ips_proto_mq_push_eager_data(struct ips_proto *proto,
 					 psm_mq_req_t req);
 
 int ips_proto_mq_handle_cts(struct ips_proto *proto, ptl_arg_t *args);
+int ips_proto_mq_eager_buffered_acked(void *context, uint32_t nbytes);
 
 int ips_proto_mq_handle_rts_envelope(psm_mq_t mq, int mode, psm_epaddr_t epaddr, 
 			     uint64_t tag, uint32_t reqidx_peer, 
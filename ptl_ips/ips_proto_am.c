@@ -84,7 +84,7 @@ am_short_reqrep(struct ips_proto_am *proto_am, ips_scb_t *scb,
     ptl_epaddr_flow_t flowid = ((sub_opcode == OPCODE_AM_REQUEST) || 
 				(sub_opcode == OPCODE_AM_REQUEST_NOREPLY)) ?
       EP_FLOW_GO_BACK_N_AM_REQ : EP_FLOW_GO_BACK_N_AM_RSP;
-    struct ips_flow *flow = &ipsaddr->flows[flowid];
+    struct ips_flow *flow = ips_epaddr_flow(ipsaddr, flowid);
 
     _IPATH_VDBG("%s src=%p len=%d, nargs=%d\n", 
 		((sub_opcode == OPCODE_AM_REQUEST) ||
@@ -324,7 +324,7 @@ ips_proto_am(struct ips_recvhdrq_event *rcv_ev)
     struct ptl_epaddr *ipsaddr = rcv_ev->ipsaddr;
     struct ips_proto_am *proto_am = &rcv_ev->proto->proto_am;
     ptl_epaddr_flow_t flowid = ips_proto_flowid(p_hdr);
-    struct ips_flow *flow = &ipsaddr->flows[flowid];
+    struct ips_flow *flow = ips_epaddr_flow(ipsaddr, flowid);
     int ret = IPS_RECVHDRQ_CONTINUE;
     
 /*
@@ -54,16 +54,18 @@
 #define CSTATE_TO_WAITING	4
 #define CSTATE_TO_WAITING_DISC	5
 
-#define IPS_CONNECT_VERNO    0x0201 /* major,major,minor,minor */
+#define IPS_CONNECT_VERNO    0x0202 /* major,major,minor,minor */
+#define IPS_CONNECT_VERNO_EGRCREDIT 0x0202 /* first to carry eager credits */
 #define BIG_ENDIAN_TEST_WORD 0xA5A5
 
-/* We can use up to 16-bits of features, we only use 5 of them for now. */
+/* We can use up to 16-bits of features, we only use 6 of them for now. */
 #define EP_FEATURES_ENDIAN_BIG    0x0001
 #define EP_FEATURES_ENDIAN_LITTLE 0x0002
 #define EP_FEATURES_BITWIDTH_32   0x0004
 #define EP_FEATURES_BITWIDTH_64   0x0008
 #define EP_FEATURES_RCVTHREAD	  0x8000
 #define EP_FEATURES_MULTIFLOW     0x4000
+#define EP_FEATURES_MQ_PACKED     0x2000
 
 #define EP_FEATURES_NODETYPE	  0x0f
 
@@ -92,7 +94,9 @@ struct ips_connect_reqrep {
     uint32_t	commidx;	    /* ignore if 0xffffffff */
     uint32_t	runid_key;	    /* one-time stamp connect key */
     uint16_t	job_pkey;	    /* (future use) */
-    uint64_t	_unused1[4];
+    uint32_t	egrcredit_window;   /* eager bytes granted, 0 is unlimited */
+    uint32_t	_unused0;
+    uint64_t	_unused1[3];
 
     /* Per-node characteristics */
     uint32_t	features;	    /* be - endpoint desc (endian + bidwidth) */
@@ -225,6 +229,7 @@ psmi_ips_node_features(psm_ep_t ep)
     if (ep->context.runtime_flags & PSMI_RUNTIME_RCVTHREAD)
 	features |= EP_FEATURES_RCVTHREAD;
     features |= EP_FEATURES_MULTIFLOW;
+    features |= EP_FEATURES_MQ_PACKED;
 
     return features;
 }
@@ -259,6 +264,7 @@ ips_ipsaddr_set_req_params(struct ips_proto *proto,
 {
     psmi_assert_always(req->mtu > 0);
 
+    int i;
     uint32_t peer_mtu = min(req->mtu, proto->epinfo.ep_mtu);
     
     ipsaddr->epr.epr_piosize = min(peer_mtu, proto->epinfo.ep_piosize);
@@ -270,13 +276,22 @@ ips_ipsaddr_set_req_params(struct ips_proto *proto,
     /* 
      * DMA is bounded by the peer's mtu put also our local PIO send size
      */
-    ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO].frag_size = ipsaddr->epr.epr_piosize;
-    ipsaddr->flows[EP_FLOW_GO_BACK_N_DMA].frag_size = peer_mtu;
-    ipsaddr->flows[EP_FLOW_GO_BACK_N_AM_REQ].frag_size=ipsaddr->epr.epr_piosize;
-    ipsaddr->flows[EP_FLOW_GO_BACK_N_AM_RSP].frag_size=ipsaddr->epr.epr_piosize;
+    ipsaddr->flows_saved[EP_FLOW_GO_BACK_N_PIO].frag_size = ipsaddr->epr.epr_piosize;
+    ipsaddr->flows_saved[EP_FLOW_GO_BACK_N_DMA].frag_size = peer_mtu;
+    ipsaddr->flows_saved[EP_FLOW_GO_BACK_N_AM_REQ].frag_size=ipsaddr->epr.epr_piosize;
+    ipsaddr->flows_saved[EP_FLOW_GO_BACK_N_AM_RSP].frag_size=ipsaddr->epr.epr_piosize;
+    for (i = 0; i < EP_FLOW_LAST; i++)
+	if (ipsaddr->flows[i] != NULL)
+	    ipsaddr->flows[i]->frag_size = ipsaddr->flows_saved[i].frag_size;
 
     ipsaddr->epr.epr_commidx_to = req->commidx;
 
+    /* Peers before eager credits leave the field as garbage */
+    if (__be16_to_cpu(req->hdr.connect_verno) >= IPS_CONNECT_VERNO_EGRCREDIT)
+	ipsaddr->epaddr->egrcredit_window = req->egrcredit_window;
+    else
+	ipsaddr->epaddr->egrcredit_window = 0;
+
     /* 
      * For static routes i.e. "none" path resolution update all paths to
      * have the same profile (mtu, sl etc.).
@@ -303,9 +318,21 @@ ips_ipsaddr_set_req_params(struct ips_proto *proto,
 	count = paylen / (sizeof(uint64_t)+sizeof(psm_epid_t));
 	if (count > IPATH_MAX_UNIT) return PSM_INTERNAL_ERR;
 
-	memcpy(ipsaddr->epaddr->mctxt_gidhi, p, count*sizeof(uint64_t));
-	p += count*sizeof(uint64_t);
-	memcpy(ipsaddr->epaddr->mctxt_epid, p, count*sizeof(psm_epid_t));
+	if (count > 0 && ipsaddr->epaddr->mctxt_peer == NULL) {
+	    ipsaddr->epaddr->mctxt_peer = (struct psm_epaddr_mctxt *)
+		psmi_malloc(proto->ep, PER_PEER_ENDPOINT, 
+			    sizeof(struct psm_epaddr_mctxt));
+	    if (ipsaddr->epaddr->mctxt_peer == NULL)
+		return PSM_NO_MEMORY;
+	}
+
+	if (count > 0) {
+	    memcpy(ipsaddr->epaddr->mctxt_peer->gidhi, p, 
+		   count*sizeof(uint64_t));
+	    p += count*sizeof(uint64_t);
+	    memcpy(ipsaddr->epaddr->mctxt_peer->epid, p, 
+		   count*sizeof(psm_epid_t));
+	}
 	ipsaddr->epaddr->mctxt_epcount = count;
     }
 
@@ -313,27 +340,6 @@ ips_ipsaddr_set_req_params(struct ips_proto *proto,
 				       (char*) req->hostname, 0);
 }
 
-static psm_error_t __recvpath
-ips_proto_send_ctrl_message_request(struct ips_proto *proto,
-                                    struct ips_flow *flow, uint8_t message_type, 
-                                    uint32_t *msg_queue_mask, void *payload,
-				    uint64_t timeout)
-{
-    psm_error_t err = PSM_OK;
-
-    while (get_cycles() < timeout) {
-        err = ips_proto_send_ctrl_message(flow, message_type,
-                                          msg_queue_mask, payload);
-        if (err == PSM_OK) {
-	    break;
-        }
-        if ((err = psmi_err_only(psmi_poll_internal(proto->ep, 1)))) {
-	    break;
-	}
-    }
-    return err;
-}
-
 static psm_error_t __recvpath
 ips_proto_send_ctrl_message_reply(struct ips_flow *flow, uint8_t message_type, 
                                   uint32_t *msg_queue_mask, void *payload)
@@ -399,6 +405,8 @@ ips_proto_build_connect_message(struct ips_proto *proto,
 	    req->flags     = 0;
 	    req->commidx   = (uint32_t) ipsaddr->epr.epr_commidx_from;
 	    req->job_pkey  = ipsaddr->epr.epr_path[IPS_PATH_HIGH_PRIORITY][0]->epr_pkey;
+	    req->egrcredit_window = ipsaddr->epaddr->egrcredit_granted;
+	    req->_unused0  = 0;
 
 	    req->features      = 
 		    __cpu_to_be16(psmi_ips_node_features(proto->ep));
@@ -480,6 +488,9 @@ ips_flow_init(struct ips_flow *flow, ips_path_rec_t *path, ips_epaddr_t *ipsaddr
     flow->ack_interval = max((proto->flow_credits >> 2) - 1, 1);
     flow->scb_num_pending = 0;
     flow->scb_num_unacked = 0;
+    flow->scb_num_egr = 0;
+    flow->ctrlq_ack = NULL;
+    flow->fi_t_xmit_lost = flow->fi_t_recv_lost = 0;
 
     psmi_timer_entry_init(&(flow->timer_ack),
 			  ips_proto_timer_ack_callback, flow);
@@ -492,6 +503,222 @@ ips_flow_init(struct ips_flow *flow, ips_path_rec_t *path, ips_epaddr_t *ipsaddr
     return;
 }
 
+/*
+ * Go-back-n flows are allocated on first use.  Everything that must survive
+ * while a flow is not materialized lives in ipsaddr->flows_saved.
+ */
+struct ips_flow *
+ips_epaddr_flow_materialize(ips_epaddr_t *ipsaddr, ptl_epaddr_flow_t flowid)
+{
+    struct ips_proto *proto = ipsaddr->proto;
+    struct ips_flow_saved *saved = &ipsaddr->flows_saved[flowid];
+    struct ips_flow *flow;
+
+    psmi_assert(ipsaddr->flows[flowid] == NULL);
+    flow = (struct ips_flow *)
+	psmi_calloc(proto->ep, PER_PEER_ENDPOINT, 1, sizeof(struct ips_flow));
+    if (flow == NULL) {
+	psmi_handle_error(PSMI_EP_NORETURN, PSM_NO_MEMORY,
+		"Couldn't allocate memory for %s flow %d",
+		psmi_epaddr_get_name(ipsaddr->epaddr->epid), flowid);
+	return NULL;
+    }
+
+    switch (flowid) {
+    /* DMA flow uses the same path as PIO flow due to multi MTU sized
+     * eager messages. If we use separate paths we are more likely to have
+     * payload arrive out of order with respect to envelope leading to 
+     * un-necessary NAKs.
+     *
+     * AM Request messages also use the same path as the PIO flow as they
+     * also require order with respect to the MPI request messages.
+     */
+    case EP_FLOW_GO_BACK_N_DMA:
+	ips_flow_init(flow, ipsaddr->flows_path, ipsaddr, PSM_TRANSFER_DMA,
+		      PSM_PROTOCOL_GO_BACK_N, IPS_PATH_NORMAL_PRIORITY, flowid);
+	break;
+    case EP_FLOW_GO_BACK_N_PIO:
+    case EP_FLOW_GO_BACK_N_AM_REQ:
+	ips_flow_init(flow, ipsaddr->flows_path, ipsaddr, PSM_TRANSFER_PIO,
+		      PSM_PROTOCOL_GO_BACK_N, IPS_PATH_NORMAL_PRIORITY, flowid);
+	break;
+    default:
+	ips_flow_init(flow, NULL, ipsaddr, PSM_TRANSFER_PIO,
+		      PSM_PROTOCOL_GO_BACK_N, IPS_PATH_NORMAL_PRIORITY, flowid);
+	break;
+    }
+
+    flow->xmit_seq_num = saved->xmit_seq_num;
+    flow->xmit_ack_num = saved->xmit_ack_num;
+    flow->recv_seq_num = saved->recv_seq_num;
+    flow->last_seq_num = saved->last_seq_num;
+    flow->msg_ooo_seqnum = saved->msg_ooo_seqnum;
+    flow->frag_size = saved->frag_size;
+    if (saved->sl != IPS_FLOW_SL_FROM_PATH)
+	flow->sl = saved->sl;
+
+    ipsaddr->flows[flowid] = flow;
+    TAILQ_INSERT_TAIL(&proto->flows_liveq, flow, live_next);
+    proto->stats.flows_live++;
+    proto->stats.flows_materialized++;
+    if (proto->flows_idle_timeout) {
+	psmi_timer_request(proto->timerq, &proto->flows_idle_timer,
+			   get_cycles() + proto->flows_idle_timeout);
+    }
+    return flow;
+}
+
+static
+void
+ips_epaddr_flow_reclaim(ips_epaddr_t *ipsaddr, ptl_epaddr_flow_t flowid)
+{
+    struct ips_proto *proto = ipsaddr->proto;
+    struct ips_flow_saved *saved = &ipsaddr->flows_saved[flowid];
+    struct ips_flow *flow = ipsaddr->flows[flowid];
+    ips_scb_t *scb;
+
+    saved->xmit_seq_num = flow->xmit_seq_num;
+    saved->xmit_ack_num = flow->xmit_ack_num;
+    saved->recv_seq_num = flow->recv_seq_num;
+    saved->last_seq_num = flow->last_seq_num;
+    saved->msg_ooo_seqnum = flow->msg_ooo_seqnum;
+    saved->frag_size = flow->frag_size;
+
+    psmi_timer_cancel(proto->timerq, &flow->timer_ack);
+    psmi_timer_cancel(proto->timerq, &flow->timer_send);
+    ips_proto_sdma_unready(proto, flow);
+    ips_proto_ctrlq_purge(proto, flow);
+    ips_mq_coalesce_discard(proto, flow);
+
+    /* Idle flows have nothing unacked, only a departing peer can leave scbs
+     * behind.  Give them back and stop counting the flow as active.  Buffered
+     * isends already completed, they only hold on to their bounce bytes. */
+    if (!STAILQ_EMPTY(&flow->scb_unacked)) {
+	while ((scb = STAILQ_FIRST(&flow->scb_unacked)) != NULL) {
+	    STAILQ_REMOVE_HEAD(&flow->scb_unacked, nextq);
+	    if (scb->flags & IPS_SEND_FLAG_WAIT_SDMA)
+		ips_proto_dma_wait_until(proto, scb->dma_ctr);
+	    if (scb->callback == ips_proto_mq_eager_buffered_acked)
+		ips_proto_mq_eager_buffered_acked(scb->cb_param,
+				scb->payload_size - scb->extra_bytes);
+	    if (!(scb->flags & IPS_SEND_FLAG_PERSISTENT))
+		ips_scbctrl_free(scb);
+	}
+	SLIST_INIT(&flow->scb_pend);
+	flow->scb_num_unacked = flow->scb_num_pending = 0;
+	if (flow->scb_num_egr) {
+	    flow->scb_num_egr = 0;
+	    psmi_assert(proto->scbc_egr.scb_flows_active > 0);
+	    proto->scbc_egr.scb_flows_active--;
+	}
+    }
+
+    TAILQ_REMOVE(&proto->flows_liveq, flow, live_next);
+    proto->stats.flows_live--;
+    ipsaddr->flows[flowid] = NULL;
+    psmi_free(flow);
+}
+
+struct ips_flow *
+ips_epaddr_tidgr_flow_materialize(ips_epaddr_t *ipsaddr)
+{
+    struct ips_proto *proto = ipsaddr->proto;
+    struct ips_flow *flow;
+
+    flow = (struct ips_flow *)
+	psmi_calloc(proto->ep, PER_PEER_ENDPOINT, 1, sizeof(struct ips_flow));
+    if (flow == NULL) {
+	psmi_handle_error(PSMI_EP_NORETURN, PSM_NO_MEMORY,
+		"Couldn't allocate memory for %s tidflow",
+		psmi_epaddr_get_name(ipsaddr->epaddr->epid));
+	return NULL;
+    }
+    ips_flow_init(flow, NULL, ipsaddr, PSM_TRANSFER_DMA, PSM_PROTOCOL_TIDFLOW,
+		  IPS_PATH_LOW_PRIORITY, 0);
+    ipsaddr->tidgr_flow = flow;
+    return flow;
+}
+
+void
+ips_epaddr_flow_set_sl(ips_epaddr_t *ipsaddr, uint16_t sl)
+{
+    int i;
+
+    for (i = 0; i < EP_FLOW_LAST; i++) {
+	ipsaddr->flows_saved[i].sl = sl;
+	if (ipsaddr->flows[i] != NULL)
+	    ipsaddr->flows[i]->sl = sl;
+    }
+}
+
+void
+ips_epaddr_flows_free(ips_epaddr_t *ipsaddr)
+{
+    int i;
+
+    for (i = 0; i < EP_FLOW_LAST; i++)
+	if (ipsaddr->flows[i] != NULL)
+	    ips_epaddr_flow_reclaim(ipsaddr, i);
+
+    if (ipsaddr->tidgr_flow != NULL) {
+	ips_proto_ctrlq_purge(ipsaddr->proto, ipsaddr->tidgr_flow);
+	psmi_free(ipsaddr->tidgr_flow);
+	ipsaddr->tidgr_flow = NULL;
+    }
+}
+
+/*
+ * A flow can be reclaimed when it has nothing in flight or coalesced, no
+ * timers or control messages pending and no out-of-order message being
+ * tracked.
+ */
+PSMI_ALWAYS_INLINE(
+int
+ips_flow_is_idle(struct ips_flow *flow))
+{
+    return (STAILQ_EMPTY(&flow->scb_unacked) && 
+	    SLIST_EMPTY(&flow->scb_pend) &&
+	    flow->flags == 0 && flow->msg_ooo_toggle == 0 &&
+	    flow->coalesce_scb == NULL &&
+	    flow->ipsaddr->ctrl_msg_queued == 0 && flow->ctrlq_ack == NULL &&
+	    !(flow->timer_ack.flags & PSMI_TIMER_FLAG_PENDING) &&
+	    !(flow->timer_send.flags & PSMI_TIMER_FLAG_PENDING));
+}
+
+/*
+ * Second-chance sweep over the materialized flows: a flow not used since
+ * the previous sweep is reclaimed if it is idle.
+ */
+psm_error_t
+ips_proto_flows_idle_sweep(struct psmi_timer *timer, uint64_t current)
+{
+    struct ips_proto *proto = (struct ips_proto *) timer->context;
+    struct ips_flow *flow, *next;
+    int i;
+
+    for (flow = TAILQ_FIRST(&proto->flows_liveq); flow != NULL; flow = next) {
+	next = TAILQ_NEXT(flow, live_next);
+	if (flow->touched) {
+	    flow->touched = 0;
+	    continue;
+	}
+	if (!ips_flow_is_idle(flow))
+	    continue;
+	for (i = 0; i < EP_FLOW_LAST; i++) {
+	    if (flow->ipsaddr->flows[i] == flow) {
+		ips_epaddr_flow_reclaim(flow->ipsaddr, i);
+		proto->stats.flows_reclaimed++;
+		break;
+	    }
+	}
+    }
+
+    if (!TAILQ_EMPTY(&proto->flows_liveq))
+	psmi_timer_request(proto->timerq, &proto->flows_idle_timer,
+			   current + proto->flows_idle_timeout);
+    return PSM_OK;
+}
+
 static
 size_t
 epaddr_size()
@@ -570,6 +797,8 @@ ips_alloc_epaddr(struct ips_proto *proto, psm_epid_t epid,
     epaddr->mctxt_master = epaddr;
     epaddr->mctxt_current = epaddr;
     epaddr->mctxt_prev = epaddr->mctxt_next = epaddr;
+    /* Eager credits we grant this peer, advertised in every connect */
+    epaddr->egrcredit_granted = proto->mq->egrcredit_window;
     
     /* IPS-level epaddr */
     ipsaddr = (ips_epaddr_t *)(epaddr+1);
@@ -640,38 +869,23 @@ ips_alloc_epaddr(struct ips_proto *proto, psm_epid_t epid,
     ipsaddr->flags = 0;
     
     /* All flows are over BULK path. Only control messages use the high
-     * priority CONTROL path.
+     * priority CONTROL path.  The go-back-n flows themselves are only
+     * materialized on first use, see ips_epaddr_flow_materialize().
      */
-    ips_flow_init(&ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO], NULL,
-		  ipsaddr, PSM_TRANSFER_PIO, PSM_PROTOCOL_GO_BACK_N,
-		  IPS_PATH_NORMAL_PRIORITY, EP_FLOW_GO_BACK_N_PIO);
-    
-    /* DMA flow uses the same path as PIO flow due to multi MTU sized
-     * eager messages. If we use separate paths we are more likely to have
-     * payload arrive out of order with respect to envelope leading to 
-     * un-necessary NAKs.
-     */
-    ips_flow_init(&ipsaddr->flows[EP_FLOW_GO_BACK_N_DMA],
-		  ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO].path,
-		  ipsaddr, PSM_TRANSFER_DMA, PSM_PROTOCOL_GO_BACK_N,
-		  IPS_PATH_NORMAL_PRIORITY, EP_FLOW_GO_BACK_N_DMA);
-    
-    /* AM Request messages also use the same path as the PIO flow as they
-     * also require order with respect to the MPI request messages.
-     */
-    ips_flow_init(&ipsaddr->flows[EP_FLOW_GO_BACK_N_AM_REQ],
-		  ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO].path,
-		  ipsaddr, PSM_TRANSFER_PIO, PSM_PROTOCOL_GO_BACK_N,
-		  IPS_PATH_NORMAL_PRIORITY, EP_FLOW_GO_BACK_N_AM_REQ);
-    
-    ips_flow_init(&ipsaddr->flows[EP_FLOW_GO_BACK_N_AM_RSP], NULL,
-		  ipsaddr, PSM_TRANSFER_PIO, PSM_PROTOCOL_GO_BACK_N,
-		  IPS_PATH_NORMAL_PRIORITY, EP_FLOW_GO_BACK_N_AM_RSP);
+    ipsaddr->flows_path = 
+      ips_select_path(proto, IPS_PATH_NORMAL_PRIORITY, ipsaddr);
+    for (i = 0; i < EP_FLOW_LAST; i++) {
+	ipsaddr->flows[i] = NULL;
+	ipsaddr->flows_saved[i].xmit_seq_num.val = 0;
+	ipsaddr->flows_saved[i].xmit_ack_num.val = 0;
+	ipsaddr->flows_saved[i].xmit_ack_num.pkt--; /* last acked */
+	ipsaddr->flows_saved[i].recv_seq_num.val = 0;
+	ipsaddr->flows_saved[i].last_seq_num.val = 0;
+	ipsaddr->flows_saved[i].sl = IPS_FLOW_SL_FROM_PATH;
+    }
 
-    /* tidflow for tid get request */
-    ips_flow_init(&ipsaddr->tidgr_flow, NULL, ipsaddr,
-		  PSM_TRANSFER_DMA, PSM_PROTOCOL_TIDFLOW,
-		  IPS_PATH_LOW_PRIORITY, 0);
+    /* tidflow for tid get request, see ips_epaddr_tidgr_flow() */
+    ipsaddr->tidgr_flow = NULL;
 
     ipsaddr->cstate_to   = CSTATE_NONE;
     ipsaddr->cstate_from = CSTATE_NONE;
@@ -697,7 +911,11 @@ ips_free_epaddr(ips_epaddr_t *ipsaddr)
     _IPATH_VDBG("epaddr=%p,ipsaddr=%p,commidx_from=%d\n", epaddr, ipsaddr,
 	    ipsaddr->epr.epr_commidx_from);
     psmi_epid_remove(ipsaddr->proto->ep, epaddr->epid);
+    ips_epaddr_flows_free(ipsaddr);
+    ips_epaddr_paths_free(ipsaddr);
     ips_epstate_del(ipsaddr->proto->epstate, ipsaddr->epr.epr_commidx_from);
+    if (epaddr->mctxt_peer != NULL)
+	psmi_free(epaddr->mctxt_peer);
     psmi_free(epaddr);
     return;
 }
@@ -737,6 +955,7 @@ static psm_error_t ips_get_addr_from_epid(struct ips_proto *proto,
 		       context, subcontext, hca_type, 
 		       ipsaddr.epr.epr_path[IPS_PATH_HIGH_PRIORITY][0]->epr_sl);
   ep_address = psmi_epid_lookup(proto->ep, path_epid);
+  ips_epaddr_paths_free(&ipsaddr);
   
  fail:
   *epaddr = ep_address;
@@ -875,6 +1094,7 @@ ips_proto_process_connect(struct ips_proto *proto, psm_epid_t epid,
 	case OPCODE_DISCONNECT_REQUEST:
 	{
 	    ips_epaddr_t ipsaddr_f; /* fake a ptl addr */
+	    struct ips_flow flow_f;
 	    int ipsaddr_do_free = 0;
 	    psmi_assert_always(paylen >= IPS_DISCONNECT_REQREP_MINIMUM_SIZE);
 	    _IPATH_VDBG("Got a disconnect from %s\n", psmi_epaddr_get_name(epid));
@@ -911,6 +1131,7 @@ ips_proto_process_connect(struct ips_proto *proto, psm_epid_t epid,
 						     src_context, &ipsaddr_f);
 		if (err != PSM_OK) {
 	            _IPATH_ERROR("Disconnect: Warning! unknown HCA type %d.\n", hdr->hca_type);
+		    ips_epaddr_paths_free(&ipsaddr_f);
 		    goto fail;
 		}
 		
@@ -919,7 +1140,8 @@ ips_proto_process_connect(struct ips_proto *proto, psm_epid_t epid,
 		/* If the send fails because of pio_busy, don't let ips queue
 		 * the request on an invalid ipsaddr, just drop the reply */
 		ipsaddr_f.ctrl_msg_queued = ~0;
-		ips_flow_init(&ipsaddr_f.flows[EP_FLOW_GO_BACK_N_PIO], NULL,
+		ipsaddr_f.flows[EP_FLOW_GO_BACK_N_PIO] = &flow_f;
+		ips_flow_init(&flow_f, NULL,
 			      &ipsaddr_f, PSM_TRANSFER_PIO, 
 			      PSM_PROTOCOL_GO_BACK_N, IPS_PATH_LOW_PRIORITY,
 			      EP_FLOW_GO_BACK_N_PIO);
@@ -927,6 +1149,7 @@ ips_proto_process_connect(struct ips_proto *proto, psm_epid_t epid,
 	    }
 	    else if (ipsaddr->cstate_from != CSTATE_NONE) {
 		ipsaddr->cstate_from = CSTATE_NONE;
+		ipsaddr->flags |= SESS_FLAG_PEER_CLOSED;
 		proto->num_connected_from--;
 		if (ipsaddr->cstate_to == CSTATE_NONE) {
 		    ipsaddr_do_free = 1;
@@ -944,13 +1167,15 @@ ips_proto_process_connect(struct ips_proto *proto, psm_epid_t epid,
 	    }
 
 	    memset(buf, 0, sizeof buf);
-	    ips_proto_send_ctrl_message_reply(&ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO], 
+	    ips_proto_send_ctrl_message_reply(ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO), 
 					      OPCODE_DISCONNECT_REPLY,
 					      &ipsaddr->ctrl_msg_queued, buf);
 	    /* We can safely free the ipsaddr if required since disconnect
 	     * messages are never enqueued so no reference to ipsaddr is kept */
 	    if (ipsaddr_do_free)
 		ips_free_epaddr(ipsaddr);
+	    else if (ipsaddr == &ipsaddr_f)
+		ips_epaddr_paths_free(&ipsaddr_f);
 	}
 	break;
 
@@ -1112,13 +1337,15 @@ ptl_handle_connect_req(struct ips_proto *proto, psm_epid_t epid,
 		      SESS_FLAG_LOCK_SESS : 0;
     ipsaddr->flags |= features & EP_FEATURES_MULTIFLOW ?
 		      SESS_FLAG_HAS_FLOWID : 0;
+    ipsaddr->flags |= features & EP_FEATURES_MQ_PACKED ?
+		      SESS_FLAG_HAS_MQ_PACKED : 0;
 
     pthread_mutex_init(&ipsaddr->sesslock, NULL);
 
     proto->num_connected_from++;
 
 do_reply:
-    ips_proto_send_ctrl_message_reply(&ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO], 
+    ips_proto_send_ctrl_message_reply(ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO), 
 				      OPCODE_CONNECT_REPLY,
 				      &ipsaddr->ctrl_msg_queued, buf);
 no_reply:
@@ -1326,7 +1553,7 @@ ips_proto_connect(struct ips_proto *proto, int numep,
 				    __be16_to_cpu(ipsaddr->epr.epr_base_lid), 
 				    ipsaddr->epr.epr_context, 
 				    ipsaddr->epr.epr_subcontext);
-		        if (ips_proto_send_ctrl_message(&ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO],
+		        if (ips_proto_send_ctrl_message(ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO),
 							OPCODE_CONNECT_REQUEST,
 							&ipsaddr->ctrl_msg_queued,
 							buf) == PSM_OK) {
@@ -1406,6 +1633,34 @@ fail:
  *
  */
 
+/*
+ * A peer is presumed gone when it has already disconnected from us, or when
+ * retransmissions to it have backed off all the way without being acked.
+ * Nobody is left to reply to our disconnect request (or to ack what is still
+ * unacked), so waiting on it would only run the close into its timeout.
+ */
+static
+int
+ips_proto_peer_gone(ips_epaddr_t *ipsaddr)
+{
+    struct ips_flow *flow;
+    ips_scb_t *scb;
+    int flowid;
+
+    if (ipsaddr->flags & SESS_FLAG_PEER_CLOSED)
+	return 1;
+
+    for (flowid = 0; flowid < EP_FLOW_LAST; flowid++) {
+	flow = ipsaddr->flows[flowid];
+	if (flow == NULL || STAILQ_EMPTY(&flow->scb_unacked))
+	    continue;
+	scb = STAILQ_FIRST(&flow->scb_unacked);
+	if (scb->ack_timeout >= flow->path->epr_timeout_ack_max)
+	    return 1;
+    }
+    return 0;
+}
+
 psm_error_t
 ips_proto_disconnect(struct ips_proto *proto, int force, int numep, 
 	     const psm_epaddr_t array_of_epaddr[], 
@@ -1414,26 +1669,30 @@ ips_proto_disconnect(struct ips_proto *proto, int force, int numep,
 	     uint64_t timeout_in)
 {
     ips_epaddr_t *ipsaddr;
-    int numep_left, numep_todisc, i, n;
+    int numep_left, numep_todisc, numep_gone, i, n;
     int n_first;
     int cstate;
     int has_pending;
+    int send_busy;
+    int flowid;
     uint64_t timeout;
     psm_error_t err = PSM_OK;
     char buf[IPS_MAX_CONNECT_PAYLEN] PSMI_CACHEALIGN;
-    uint64_t reqs_sent = 0;
+    uint64_t reqs_sent = 0, reqs_busy = 0;
     union psmi_envvar_val credits_intval;
     int disconnect_credits;
-    uint64_t t_warning, t_start;
+    uint64_t t_warning, t_start, t_reqs_out;
     union psmi_envvar_val warn_intval;
     unsigned warning_secs;
 
     psmi_assert_always(numep > 0);
 
+    /* By default, requests go out as fast as the send engine takes them and
+     * there is no cap on how many are waiting for a reply. */
     psmi_getenv("PSM_DISCONNECT_CREDITS",
-                "End-point disconnect request credits.",
+                "End-point disconnect request credits (0 paces by send capacity).",
                 PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
-                (union psmi_envvar_val) 100,
+                (union psmi_envvar_val) 0,
                 &credits_intval);
 
     disconnect_credits = credits_intval.e_uint;
@@ -1477,13 +1736,28 @@ ips_proto_disconnect(struct ips_proto *proto, int force, int numep,
     else
 	timeout = get_cycles() + nanosecs_to_cycles(timeout_in);
 
-    t_start = get_cycles();
+    t_start = t_reqs_out = get_cycles();
     t_warning = t_start + nanosecs_to_cycles(warning_secs * SEC_ULL);
+    numep_gone = 0;
 
     n_first = ((uint32_t) get_cycles()) % numep;
-    if (!force) {
+    if (force == PSM_EP_CLOSE_JOBEXIT) {
+	/* The caller asserts that every peer is going away too, so there is
+	 * nobody to tell and nobody to wait for. */
+	for (i = 0; i < numep; i++) {
+	    if (!array_of_epaddr_mask[i] || array_of_errors[i] == PSM_OK)
+		continue;
+	    array_of_epaddr[i]->ptladdr->cstate_to = CSTATE_TO_DISCONNECTED;
+	    array_of_errors[i] = PSM_OK;
+	}
+        _IPATH_PRDBG("job exit close, skipped handshake with %d peers\n",
+		     numep_todisc);
+    } else if (!force) {
 	numep_left = numep_todisc;
 	do {
+	    /* Requests are sent without blocking.  Once the send engine is
+	     * busy, no more go out in this pass. */
+	    send_busy = 0;
 	    for (n = 0; n < numep; n++) {
 		i = (n_first + n) % numep;
 		if (!array_of_epaddr_mask[i] || array_of_errors[i] == PSM_OK)
@@ -1493,52 +1767,80 @@ ips_proto_disconnect(struct ips_proto *proto, int force, int numep,
 		    case CSTATE_TO_DISCONNECTED:
 			array_of_errors[i] = PSM_OK;
 			numep_left--;
-			disconnect_credits++;
+			if (ipsaddr->credit)
+			    disconnect_credits++;
 			ipsaddr->credit = 0;
 			continue;
 		    case CSTATE_TO_WAITING_DISC:
-			if (ipsaddr->s_timeout > get_cycles())
+			if (ipsaddr->s_timeout > get_cycles() || send_busy)
 			    continue;
+			if (ips_proto_send_ctrl_message(
+				ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO),
+				OPCODE_DISCONNECT_REQUEST,
+				&ipsaddr->ctrl_msg_queued, buf) != PSM_OK) {
+			    send_busy = 1;
+			    reqs_busy++;
+			    continue;
+			}
 			ipsaddr->delay_in_ms = 
 			    min(100, ipsaddr->delay_in_ms << 1);
 			ipsaddr->s_timeout = get_cycles() +
 			    nanosecs_to_cycles(ipsaddr->delay_in_ms*MSEC_ULL);
-			ips_proto_send_ctrl_message_request(proto, &ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO],
-						            OPCODE_DISCONNECT_REQUEST,
-						            &ipsaddr->ctrl_msg_queued, 
-						            buf, timeout);
 			reqs_sent++;
 			break;
 		    case CSTATE_ESTABLISHED:
 			/* Still pending acks, hold off for now */
 			ips_ptladdr_lock(ipsaddr);
-			has_pending = 
-			  !STAILQ_EMPTY(&ipsaddr->
-				        flows[EP_FLOW_GO_BACK_N_PIO].scb_unacked) ||
-			  !STAILQ_EMPTY(&ipsaddr->
-				        flows[EP_FLOW_GO_BACK_N_DMA].scb_unacked) ||
-			  !STAILQ_EMPTY(&ipsaddr->
-				        flows[EP_FLOW_GO_BACK_N_AM_REQ].scb_unacked) ||
-			  !STAILQ_EMPTY(&ipsaddr->
-				        flows[EP_FLOW_GO_BACK_N_AM_RSP].scb_unacked);
+			has_pending = 0;
+			for (flowid = 0; flowid < EP_FLOW_LAST; flowid++) {
+			    /* Flows never materialized have nothing unacked */
+			    if (ipsaddr->flows[flowid] == NULL)
+				continue;
+			    if (ipsaddr->flows[flowid]->coalesce_scb != NULL)
+				ips_mq_coalesce_flush(proto,
+						      ipsaddr->flows[flowid]);
+			    if (!STAILQ_EMPTY(&ipsaddr->flows[flowid]->scb_unacked))
+				has_pending = 1;
+			}
 			ips_ptladdr_unlock(ipsaddr);
-			if (has_pending)
+			if (has_pending && !ips_proto_peer_gone(ipsaddr))
+			    continue;
+			if (send_busy)
+			    continue;
+			if (credits_intval.e_uint) {
+			    if (!ipsaddr->credit && disconnect_credits) {
+				ipsaddr->credit = 1;
+				disconnect_credits--;
+			    }
+			    if (!ipsaddr->credit)
+				continue;
+			}
+			if (ips_proto_send_ctrl_message(
+				ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO),
+				OPCODE_DISCONNECT_REQUEST,
+				&ipsaddr->ctrl_msg_queued, buf) != PSM_OK) {
+			    send_busy = 1;
+			    reqs_busy++;
 			    continue;
-		        if (!ipsaddr->credit && disconnect_credits) {
-		            ipsaddr->credit = 1;
-			    disconnect_credits--;
-		        }
-		        if (!ipsaddr->credit)
+			}
+			reqs_sent++;
+			t_reqs_out = get_cycles();
+			if (ips_proto_peer_gone(ipsaddr)) {
+			    /* One request for the record, but no reply to
+			     * wait for */
+			    ipsaddr->cstate_to = CSTATE_TO_DISCONNECTED;
+			    array_of_errors[i] = PSM_OK;
+			    numep_left--;
+			    numep_gone++;
+			    if (ipsaddr->credit)
+				disconnect_credits++;
+			    ipsaddr->credit = 0;
 			    continue;
+			}
 			ipsaddr->delay_in_ms = 1;
 			ipsaddr->cstate_to = CSTATE_TO_WAITING_DISC;
 			ipsaddr->s_timeout = get_cycles() + 
 			  nanosecs_to_cycles(MSEC_ULL);			
-			ips_proto_send_ctrl_message_request(proto, &ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO],
-						            OPCODE_DISCONNECT_REQUEST,
-						            &ipsaddr->ctrl_msg_queued, 
-						            buf, timeout);
-			reqs_sent++;
 			break;
 		    default:
 			psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
@@ -1582,18 +1884,23 @@ ips_proto_disconnect(struct ips_proto *proto, int force, int numep,
 		    (unsigned long long) reqs_sent);
 	} 
 	else
-            _IPATH_PRDBG("graceful close complete from %d peers in %d millisecs, reqs_sent=%lld\n",
-		     numep_todisc,
+            _IPATH_PRDBG("graceful close complete from %d peers in %d millisecs "
+		    "(last request out at %d millisecs, %d peers presumed gone), "
+		    "reqs_sent=%lld, reqs_busy=%lld\n",
+		    numep_todisc,
 		    (int) (cycles_to_nanosecs(get_cycles() - t_start) / MSEC_ULL),
-                    (unsigned long long) reqs_sent);
+		    (int) (cycles_to_nanosecs(t_reqs_out - t_start) / MSEC_ULL),
+		    numep_gone,
+                    (unsigned long long) reqs_sent,
+		    (unsigned long long) reqs_busy);
     } else {
 	for (n = 0; n < numep; n++) {
 	    i = (n_first + n) % numep;
-	    if (!array_of_epaddr_mask[i])
+	    if (!array_of_epaddr_mask[i] || array_of_errors[i] == PSM_OK)
 		continue;
 	    ipsaddr = array_of_epaddr[i]->ptladdr;
 	    psmi_assert_always(ipsaddr->cstate_to == CSTATE_ESTABLISHED);
-	    ips_proto_send_ctrl_message(&ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO], 
+	    ips_proto_send_ctrl_message(ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO), 
 					OPCODE_DISCONNECT_REQUEST,
 					&ipsaddr->ctrl_msg_queued, 
 					buf);
@@ -320,6 +320,28 @@ ips_protoexp_init(const psmi_context_t *context,
 	}
     }
 
+    /* Tid grant windows, one per send request in tid rendezvous.  Can never
+     * be smaller than the max number of sreqs that can be allocated. */
+    {
+	uint32_t sreq_per_chunk, sreq_max;
+
+	psmi_assert_always(protoexp->proto->mq->sreq_pool != NULL);
+
+	psmi_mpool_get_obj_info(protoexp->proto->mq->sreq_pool,
+				&sreq_per_chunk,
+				&sreq_max);
+
+	protoexp->tid_grant_pool =
+	    psmi_mpool_create(sizeof(struct ips_tid_grant), 
+		    sreq_per_chunk, sreq_max, 0, DESCRIPTORS, NULL, NULL);
+
+	if (protoexp->tid_grant_pool == NULL) {
+	    err = psmi_handle_error(proto->ep, PSM_NO_MEMORY,
+		"Couldn't allocate tid grant memory pool");
+	    goto fail;
+	}
+    }
+
     /*
      * Parse the tid timeout settings from the environment.
      * <min_timeout>:<max_timeout>:<interrupt_iters>
@@ -367,40 +389,63 @@ ips_protoexp_init(const psmi_context_t *context,
      */
     {
 	uint32_t winsize = protoexp->proto->mq->ipath_window_rv;
+	uint32_t page_size = ips_tid_page_size(&protoexp->tidc);
+	int maxtids = 0;
+
+	/* Figure out maximum supportable value assuming we can send a
+	 * maxmium payload of 2048 bytes */
+	while (PSMI_ALIGNUP((sizeof(ips_tid_session_list) +
+	       ((maxtids+1) * sizeof(ips_tid_session_member))), 4) 
+		< IPS_PROTOEXP_MIN_MTU)
+	{
+	    maxtids++;
+	}
 
-	if (winsize < ips_tid_page_size(&protoexp->tidc)) {
+	/* Assume worse-case alignment when deriving the amount of tids,
+	 * need one tid for bad page-alignment and another for spillover
+	 * into last page */
+	protoexp->rv_win_max = (maxtids-2) * page_size;
+
+	if (winsize < page_size) {
 	    _IPATH_INFO("Overriding request for rndv window size %d "
 			"to minimum supported value %d bytes\n",
-			winsize, ips_tid_page_size(&protoexp->tidc));
-	    protoexp->proto->mq->ipath_window_rv = 
-		    ips_tid_page_size(&protoexp->tidc);
+			winsize, page_size);
+	    protoexp->proto->mq->ipath_window_rv = page_size;
 	}
-	else { /* Figure out maximum supportable value assuming we can
-		* send a maxmium payload of 2048 bytes */
-	    int maxtids = 0;
-
-	    while (PSMI_ALIGNUP((sizeof(ips_tid_session_list) +
-		   ((maxtids+1) * sizeof(ips_tid_session_member))), 4) 
-		    < IPS_PROTOEXP_MIN_MTU)
-	    {
-		maxtids++;
-	    }
-
-	    /* Assume worse-case alignment when deriving the amount of tids,
-	     * need one tid for bad page-alignment and another for spillover
-	     * into last page */
-	    winsize = (maxtids-2) * ips_tid_page_size(&protoexp->tidc);
-
-	    if (protoexp->proto->mq->ipath_window_rv > winsize) {
-		_IPATH_INFO("Overriding request for rndv window size %d "
-			    "to maximum supported value %d bytes\n",
-			    protoexp->proto->mq->ipath_window_rv,
-			    winsize);
-		protoexp->proto->mq->ipath_window_rv = winsize;
-	    }
+	else if (winsize > protoexp->rv_win_max) {
+	    _IPATH_INFO("Overriding request for rndv window size %d "
+			"to maximum supported value %d bytes\n",
+			winsize, protoexp->rv_win_max);
+	    protoexp->proto->mq->ipath_window_rv = protoexp->rv_win_max;
 	}
     }
 
+    /*
+     * Adaptive rendezvous windows.  The configured window is where the
+     * controller starts; it can grow up to the largest window a grant can
+     * describe and shrink down to a quarter of the configured size when
+     * tids get scarce.  When disabled, every window is exactly
+     * PSM_MQ_RNDV_IPATH_WINDOW as before.
+     */
+    {
+	union psmi_envvar_val env_adapt;
+
+	psmi_getenv("PSM_MQ_RNDV_IPATH_WINDOW_ADAPT",
+		    "Size rendezvous windows from tid availability (0 disables)",
+		    PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		    (union psmi_envvar_val) 1, &env_adapt);
+	protoexp->rv_win_adapt = !!env_adapt.e_uint;
+	protoexp->rv_win = protoexp->proto->mq->ipath_window_rv;
+	protoexp->rv_win_min = max(protoexp->rv_win / 4, 
+				   ips_tid_page_size(&protoexp->tidc));
+	if (!protoexp->rv_win_adapt)
+	    protoexp->rv_win_max = protoexp->rv_win;
+	protoexp->rv_getreqs = 0;
+	protoexp->rv_stalled = 0;
+	protoexp->rv_win_halved = 0;
+	protoexp->rv_cyc_per_kb = 0;
+    }
+
     /*
      * Allow setting of PSM_TID_MIN_EXPSEND, the minimum amount of expected
      * send packets we send before checking the receive queue.
@@ -444,6 +489,8 @@ ips_protoexp_init(const psmi_context_t *context,
     return err;
 
 fail:
+    if (protoexp != NULL && protoexp->tid_grant_pool != NULL)
+	psmi_mpool_destroy(protoexp->tid_grant_pool);
     if (protoexp != NULL && protoexp->tid_getreq_pool != NULL)
 	psmi_mpool_destroy(protoexp->tid_getreq_pool);
     if (protoexp != NULL && protoexp->tid_desc_recv_pool != NULL)
@@ -462,6 +509,7 @@ ips_protoexp_fini(struct ips_protoexp *protoexp)
 {
     psm_error_t err = PSM_OK;
 
+    psmi_mpool_destroy(protoexp->tid_grant_pool);
     psmi_mpool_destroy(protoexp->tid_getreq_pool);
     psmi_mpool_destroy(protoexp->tid_desc_recv_pool);
     psmi_mpool_destroy(protoexp->tid_desc_send_pool);
@@ -518,6 +566,87 @@ ips_tid_flowavail_callback(struct ips_tfctrl *tfctrl, void *context)
   return;
 }
 
+/*
+ * Size the next window granted to getreq.  The controller target rv_win is
+ * capped by an equal share of the free tids among the getreqs waiting for
+ * grants (or among the free tidflows, if there are fewer of those), so that
+ * a few large transfers get long windows while many concurrent ones split
+ * the tids instead of stalling on them.
+ */
+static __recvpath
+uint32_t
+ips_tid_rv_winsz(struct ips_protoexp *protoexp,
+		 const struct ips_tid_get_request *getreq, uint32_t nwaiting)
+{
+    uint32_t winsz, share;
+
+    if (!protoexp->rv_win_adapt)
+	return getreq->tidgr_rndv_winsz;
+
+    nwaiting = min(nwaiting, ips_tf_available(&protoexp->tfctrl));
+    share = ips_tid_num_available(&protoexp->tidc) / max(nwaiting, 1);
+    /* Leave room for a misaligned first and last page */
+    share = (share > 2 ? share - 2 : 1) * ips_tid_page_size(&protoexp->tidc);
+
+    winsz = min(protoexp->rv_win, share);
+    winsz = max(winsz, protoexp->rv_win_min);
+    return min(winsz, getreq->tidgr_rndv_winsz);
+}
+
+/*
+ * Window completed, compare its completion time per KB to the running
+ * average.  Windows that complete at least as fast as the average let the
+ * target grow, markedly slower ones shrink it.  The first completion after a
+ * stall is not compared since the stall already halved the target.  Short
+ * tail windows are too noisy to be of any use.
+ */
+static __fastpath
+void
+ips_tid_rv_win_update(struct ips_protoexp *protoexp,
+		      const struct ips_tid_recv_desc *tidrecvc)
+{
+    uint64_t cyc_per_kb;
+
+    if (!protoexp->rv_win_adapt || 
+	tidrecvc->recv_msglen < protoexp->rv_win_min)
+	return;
+
+    cyc_per_kb = ((get_cycles() - tidrecvc->t_grant) << 10) / 
+		 tidrecvc->recv_msglen;
+
+    if (protoexp->rv_cyc_per_kb == 0)
+	protoexp->rv_cyc_per_kb = cyc_per_kb;
+    else {
+	if (protoexp->rv_win_halved)
+	    ;
+	else if (cyc_per_kb <= protoexp->rv_cyc_per_kb)
+	    protoexp->rv_win = min(protoexp->rv_win + (protoexp->rv_win >> 2),
+				   protoexp->rv_win_max);
+	else if (cyc_per_kb > protoexp->rv_cyc_per_kb + 
+			      (protoexp->rv_cyc_per_kb >> 1))
+	    protoexp->rv_win = max(protoexp->rv_win - (protoexp->rv_win >> 2),
+				   protoexp->rv_win_min);
+
+	protoexp->rv_cyc_per_kb = 
+	    (protoexp->rv_cyc_per_kb * 7 + cyc_per_kb) >> 3;
+    }
+    protoexp->rv_win_halved = 0;
+}
+
+PSMI_ALWAYS_INLINE(
+int
+ips_tid_rv_win_bucket(uint32_t winsz))
+{
+    int bucket = 0;
+
+    winsz >>= 14; /* 16K */
+    while (winsz && bucket < IPS_RV_WIN_HIST_BUCKETS - 1) {
+	winsz >>= 1;
+	bucket++;
+    }
+    return bucket;
+}
+
 /*
  * The tid get request is always issued from within the receive progress loop,
  * which is why we always enqueue the request instead of issuing it directly.
@@ -566,12 +695,13 @@ ips_protoexp_tid_get_from_token(
     count = epaddr->mctxt_master->mctxt_nsconn;
     fragsize = (length+count)/(count+1);
     if (fragsize < 4096) fragsize = 4096;
-    getreq->tidgr_rndv_winsz= min(fragsize, epaddr->ep->mq->ipath_window_rv);
+    getreq->tidgr_rndv_winsz= min(fragsize, protoexp->rv_win_max);
 
     STAILQ_INSERT_TAIL(&protoexp->pend_getreqsq, getreq, tidgr_next);
+    protoexp->rv_getreqs++;
     if (ips_tid_num_available(&protoexp->tidc) >=
 	    ips_tid_num_required(&protoexp->tidc, (void *) NULL,
-		getreq->tidgr_rndv_winsz))
+		ips_tid_rv_winsz(protoexp, getreq, protoexp->rv_getreqs)))
 	ips_tid_pendtids_timer_callback(&protoexp->timer_getreqs, 0);
     else
 	psmi_timer_request(protoexp->timerq, &protoexp->timer_getreqs, 
@@ -641,6 +771,7 @@ ips_protoexp_tid_grant(const struct ips_recvhdrq_event *rcv_ev)
     psmi_seqnum_t flowgenseq;
     psm_error_t err = PSM_OK;
     psm_mq_req_t req;
+    struct ips_tid_grant *grant;
     ptl_arg_t args[3];
     uint8_t index, seqno;
 
@@ -652,10 +783,11 @@ ips_protoexp_tid_grant(const struct ips_recvhdrq_event *rcv_ev)
     
     /* Increment grant received stats for endpoint */
     ipsaddr->stats.tids_grant_recv++;
-    index = tid_list->tsess_seqno % sizeof(req->tid_grant);
-    seqno = tid_list->tsess_seqno / sizeof(req->tid_grant);
+    index = tid_list->tsess_seqno % IPS_TID_GRANT_SLOTS;
+    seqno = tid_list->tsess_seqno / IPS_TID_GRANT_SLOTS;
 
     req = psmi_mpool_find_obj_by_index(protoexp->tid_sreq_pool, reqidx);
+    grant = req ? (struct ips_tid_grant *) req->ptl_req_ptr : NULL;
 
     if (req) {
     _IPATH_VDBG("req=%p (%d) wait=%s req_seqno=%d pkt_len=%d, seqno=%d, msglen=%d\n", 
@@ -668,16 +800,19 @@ ips_protoexp_tid_grant(const struct ips_recvhdrq_event *rcv_ev)
     if (req == NULL) {
 	/* Not found, bogus req, ack it anyway */
     }
-    else if (seqno < req->tid_grant[index]) {
+    else if (grant == NULL) {
+	/* Send already completed (or req recycled), dupe, ack it */
+    }
+    else if (seqno < grant->slot[index]) {
 	/* dupe, ack it */
     }
-    else if (seqno > req->tid_grant[index]) {
+    else if (seqno > grant->slot[index]) {
 	/* lost tidreq, wait for rexmit */
 	/* XXX count this to see if it's worth handling instead of dropping */
 	goto no_ack;
     }
     else {
-	req->tid_grant[index]++;
+	grant->slot[index]++;
 	/* Safe to keep updating every time */
 	req->send_msglen = msglen;
 	if ((err = ips_tid_send_handle_tidreq(protoexp, req, msglen, 0, ipsaddr, flowgenseq, tid_list, paylen)) != PSM_OK)
@@ -693,7 +828,7 @@ ips_protoexp_tid_grant(const struct ips_recvhdrq_event *rcv_ev)
     /* At this point we can ack the request */
     args[0]	  = tid_list->tsess_descid;
 
-    ips_proto_send_ctrl_message(&ipsaddr->flows[protoexp->tid_ep_flow], 
+    ips_proto_send_ctrl_message(ips_epaddr_flow(ipsaddr, protoexp->tid_ep_flow), 
 				OPCODE_TIDS_GRANT_ACK,
 				&ipsaddr->ctrl_msg_queued, args);
 
@@ -806,7 +941,7 @@ process_ack:
   /* May require ACK for this packet. */
   if (p_hdr->flags & IPS_SEND_FLAG_ACK_REQ)
     ips_proto_send_ack((struct ips_recvhdrq *) rcv_ev->recvq,
-		&ipsaddr->flows[ips_proto_flowid(p_hdr)]);
+		ips_epaddr_flow(ipsaddr, ips_proto_flowid(p_hdr)));
 
   return;
 }
@@ -883,7 +1018,7 @@ ips_protoexp_data(struct ips_recvhdrq_event *rcv_ev)
     /* IBTA CCA handling for expected flow. */
     if (rcv_ev->is_congested & IPS_RECV_EVENT_FECN) {
       /* Mark flow to generate BECN in control packet */
-      tidrecvc->ipsaddr->tidgr_flow.flags |= IPS_FLOW_FLAG_GEN_BECN;
+      tidrecvc->ipsaddr->tidgr_flow->flags |= IPS_FLOW_FLAG_GEN_BECN;
       /* Update stats for congestion encountered */
       rcv_ev->ipsaddr->stats.congestion_pkts++;
       /* Clear FECN event */
@@ -959,13 +1094,13 @@ ips_protoexp_data(struct ips_recvhdrq_event *rcv_ev)
      * congestion. The ACK in this case will have the BECN bit set. 
      */
     if ((p_hdr->flags & IPS_SEND_FLAG_ACK_REQ) ||
-	(tidrecvc->ipsaddr->tidgr_flow.flags & IPS_FLOW_FLAG_GEN_BECN)) {
+	(tidrecvc->ipsaddr->tidgr_flow->flags & IPS_FLOW_FLAG_GEN_BECN)) {
       
       /* Ack sender with descriptor index */
       args[0] = send_descid;
       args[1] = tidrecvc->tid_list.tsess_descid;
       
-      ips_proto_send_ctrl_message(&tidrecvc->ipsaddr->tidgr_flow,
+      ips_proto_send_ctrl_message(tidrecvc->ipsaddr->tidgr_flow,
 				  OPCODE_ACK,
 				  &tidrecvc->ctrl_msg_queued, args);
     }
@@ -1042,8 +1177,8 @@ ips_tid_send_tid_release_msg(struct ips_tid_send_desc *tidsendc)
   desc_id[1] = tidsendc->descid;
   desc_id[2].u32w0 = tidsendc->release_cnt;
   
-  err = ips_proto_send_ctrl_message(&tidsendc->ipsaddr->
-				    flows[protoexp->tid_ep_flow],
+  err = ips_proto_send_ctrl_message(ips_epaddr_flow(tidsendc->ipsaddr,
+				    protoexp->tid_ep_flow),
 				    OPCODE_TIDS_RELEASE,
 				    &tidsendc->ctrl_msg_queued,
 				    desc_id);
@@ -1064,8 +1199,11 @@ ips_tid_send_tid_release_msg(struct ips_tid_send_desc *tidsendc)
 	      tidsendc->length, req->send_msgoff, req->send_msglen, req,
 	      req->send_msgoff == req->send_msglen ? " (complete)" : "");
   
-  if (req->send_msgoff == req->send_msglen) 
+  if (req->send_msgoff == req->send_msglen) {
+    psmi_mpool_put(req->ptl_req_ptr);
+    req->ptl_req_ptr = NULL;
     psmi_mq_handle_rts_complete(req);
+  }
 }
 
 static
@@ -1124,8 +1262,8 @@ ips_tid_release_timer_callback(struct psmi_timer *timer, uint64_t current)
     desc_id[1] = tidsendc->descid;
     desc_id[2].u32w0 = tidsendc->release_cnt;
 
-    err = ips_proto_send_ctrl_message(&tidsendc->ipsaddr->
-				      flows[protoexp->tid_ep_flow],
+    err = ips_proto_send_ctrl_message(ips_epaddr_flow(tidsendc->ipsaddr,
+				      protoexp->tid_ep_flow),
 				      OPCODE_TIDS_RELEASE,
 				      &tidsendc->ctrl_msg_queued,
 				      desc_id);
@@ -1159,7 +1297,7 @@ ips_tid_grant_timer_callback(struct psmi_timer *timer, uint64_t current)
     psm_error_t err;
     uint64_t t_cyc;
 
-    err = ips_proto_send_ctrl_message(&ipsaddr->flows[protoexp->tid_ep_flow], 
+    err = ips_proto_send_ctrl_message(ips_epaddr_flow(ipsaddr, protoexp->tid_ep_flow), 
 				      OPCODE_TIDS_GRANT,
 				      &tidrecvc->ctrl_msg_queued, 
 				      &tidrecvc->tid_list);
@@ -1309,6 +1447,7 @@ ips_protoexp_tid_release_ack(const struct ips_recvhdrq_event *rcv_ev)
 			      &tidsendc->tidflow.timer_send);
 	    psmi_timer_cancel(rcv_ev->proto->timerq,
 			      &tidsendc->tidflow.timer_ack);
+	    ips_proto_sdma_unready(rcv_ev->proto, &tidsendc->tidflow);
 	    psmi_mpool_put(tidsendc);
 	}
     }
@@ -1327,7 +1466,7 @@ ips_scb_send_unaligned_data(ips_scb_t *scb)
   uint8_t *unptr_beg = bufptr;
   uint8_t *unptr_end = bufptr + tidsendc->length - 
     tidsendc->tid_list.tsess_unaligned_end;
-  struct ips_flow *flow = &tidsendc->ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO];
+  struct ips_flow *flow = ips_epaddr_flow(tidsendc->ipsaddr, EP_FLOW_GO_BACK_N_PIO);
   
   psmi_assert(tidsendc->tid_idx == 0);
   
@@ -1782,6 +1921,7 @@ ips_tid_recv_alloc(struct ips_protoexp *protoexp, ips_epaddr_t *ipsaddr,
     tidrecvc->context = &protoexp->proto->ep->context;
     tidrecvc->protoexp = protoexp;
     tidrecvc->ipsaddr = ipsaddr;
+    ips_epaddr_tidgr_flow(ipsaddr); /* acks/naks for this rendezvous */
     tidrecvc->state = TIDRECVC_STATE_GRANT;
     tidrecvc->buffer = 
 	(void *)((uintptr_t) getreq->tidgr_lbuf + getreq->tidgr_offset);
@@ -1883,7 +2023,7 @@ ips_tid_pendtids_timer_callback(struct psmi_timer *timer, uint64_t current)
     struct ips_tid_get_pend *phead = &protoexp->pend_getreqsq;
     struct ips_tid_get_request *getreq;
     struct ips_tid_recv_desc *tidrecvc;
-    uint32_t nbytes_this, leftover;
+    uint32_t nbytes_this, leftover, winsz;
     uint64_t t_cyc;
     uintptr_t bufptr;
     psm_epaddr_t epaddr;
@@ -1897,8 +2037,9 @@ ips_tid_pendtids_timer_callback(struct psmi_timer *timer, uint64_t current)
 next_epaddr:
 	ipsaddr = epaddr->ptladdr;
 	protoexp = ipsaddr->proto->protoexp;
-	nbytes_this = min(getreq->tidgr_length - getreq->tidgr_offset,
-			  getreq->tidgr_rndv_winsz);
+	winsz = ips_tid_rv_winsz(protoexp, getreq, 
+				 getreq->tidgr_protoexp->rv_getreqs);
+	nbytes_this = min(getreq->tidgr_length - getreq->tidgr_offset, winsz);
 	/*
  	 * if the leftover is less than half window size,
  	 * we reduce nbytes_this by half, we want to avoid
@@ -1906,7 +2047,7 @@ next_epaddr:
  	 */
 	leftover = getreq->tidgr_length -
 			(getreq->tidgr_offset + nbytes_this);
-	if (leftover && leftover < getreq->tidgr_rndv_winsz/2) {
+	if (leftover && leftover < winsz/2) {
 		nbytes_this /= 2;
 	}
 
@@ -1915,13 +2056,24 @@ next_epaddr:
 	if ((ips_tid_num_required(&protoexp->tidc, (void *) bufptr, nbytes_this) > ips_tid_num_available(&protoexp->tidc)) ||
 	    !ips_tf_available(&protoexp->tfctrl)) {
 	  /* We're out of tids/tidflow, tid release will requeue the callback */
-	  ;
+	  if (!protoexp->rv_stalled++) {
+	    protoexp->proto->stats.rv_win_stalls++;
+	    if (protoexp->rv_win_adapt) {
+	      protoexp->rv_win = max(protoexp->rv_win >> 1, protoexp->rv_win_min);
+	      protoexp->rv_win_halved = 1;
+	    }
+	  }
 	}
 	else if ((tidrecvc = ips_tid_recv_alloc(protoexp, ipsaddr,
 				getreq, nbytes_this)) != NULL) {
 
-	    err = ips_proto_send_ctrl_message(&ipsaddr->
-					    flows[protoexp->tid_ep_flow],
+	    tidrecvc->t_grant = get_cycles();
+	    protoexp->rv_stalled = 0; /* next stall is a new one */
+	    protoexp->proto->stats.rv_win_hist[
+		ips_tid_rv_win_bucket(nbytes_this)]++;
+
+	    err = ips_proto_send_ctrl_message(ips_epaddr_flow(ipsaddr,
+					    protoexp->tid_ep_flow),
 					    OPCODE_TIDS_GRANT,
 					    &tidrecvc->ctrl_msg_queued, 
 					    &tidrecvc->tid_list);
@@ -1944,12 +2096,21 @@ next_epaddr:
 
 	    getreq->tidgr_desc_seqno++;
 	    if (getreq->tidgr_offset == getreq->tidgr_length) {
+		getreq->tidgr_protoexp->rv_getreqs--;
 		getreq->tidgr_protoexp = NULL;
 		getreq->tidgr_epaddr = NULL;
 		STAILQ_REMOVE_HEAD(phead, tidgr_next);
 		continue;
 	    }
 	    epaddr = epaddr->mctxt_next;
+	    /* Once every rail has been granted a window, give the next
+	     * waiting getreq its turn so one sender can't hold all the tids */
+	    if (epaddr == getreq->tidgr_epaddr && protoexp->rv_win_adapt &&
+		STAILQ_NEXT(getreq, tidgr_next) != NULL) {
+		STAILQ_REMOVE_HEAD(phead, tidgr_next);
+		STAILQ_INSERT_TAIL(phead, getreq, tidgr_next);
+		continue;
+	    }
 	    goto next_epaddr;
 	}
 	else {
@@ -1983,7 +2144,7 @@ ips_tid_recv_free(struct ips_tid_recv_desc *tidrecvc)
 					 0xffffffff);
       if (tidrecvc->cksum != cksum) {
 	psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
-			  "ErrPkt: Checksum mismatch. Expected: 0x%08x, Received: 0x%08x Source LID: %i. Rendezvous stats: nSeqErr: %d, nGenErr: %d, nReXmits: %d, nErrChkGen: %d. Aborting! \n", tidrecvc->cksum, cksum, __be16_to_cpu(tidrecvc->ipsaddr->tidgr_flow.path->epr_dlid), tidrecvc->stats.nSeqErr, tidrecvc->stats.nGenErr, tidrecvc->stats.nReXmit, tidrecvc->stats.nErrChkReceived);
+			  "ErrPkt: Checksum mismatch. Expected: 0x%08x, Received: 0x%08x Source LID: %i. Rendezvous stats: nSeqErr: %d, nGenErr: %d, nReXmits: %d, nErrChkGen: %d. Aborting! \n", tidrecvc->cksum, cksum, __be16_to_cpu(tidrecvc->ipsaddr->tidgr_flow->path->epr_dlid), tidrecvc->stats.nSeqErr, tidrecvc->stats.nGenErr, tidrecvc->stats.nReXmit, tidrecvc->stats.nErrChkReceived);
 	ips_proto_dump_data(tidrecvc->buffer, tidrecvc->recv_msglen);
 	
 	/* TODO: In order to recover from this we need to restart the rendezvous
@@ -2019,6 +2180,8 @@ ips_tid_recv_free(struct ips_tid_recv_desc *tidrecvc)
     }
     
     getreq->tidgr_bytesdone += tidrecvc->recv_msglen;
+    protoexp->rv_stalled = 0;
+    ips_tid_rv_win_update(protoexp, tidrecvc);
     
     _IPATH_EXP("req=%p bytes=%d/%d\n",
 		    getreq->tidgr_ucontext,
@@ -2097,7 +2260,7 @@ ips_protoexp_tid_release(const struct ips_recvhdrq_event *rcv_ev)
     /* Unconditionally echo back the confirmation.  If the release is a dupe
      * because a previous confirmation was lost, it still needs to be released
      * at the other end. */
-    ips_proto_send_ctrl_message(&rcv_ev->ipsaddr->flows[protoexp->tid_ep_flow], 
+    ips_proto_send_ctrl_message(ips_epaddr_flow(rcv_ev->ipsaddr, protoexp->tid_ep_flow), 
 				OPCODE_TIDS_RELEASE_CONFIRM,
 				&rcv_ev->ipsaddr->ctrl_msg_queued, 
 				args);
@@ -2413,7 +2576,7 @@ ips_protoexp_handle_tf_seqerr(const struct ips_recvhdrq_event *rcv_ev)
 	       (protoexp->proto->flags & IPS_PROTO_FLAG_CCA)) {
 	  _IPATH_CCADBG("Generating BECN. Number of swapped generations: %d.\n", tidrecvc->tidflow_nswap_gen);
 	  /* Mark flow to generate BECN in control packet */
-	  tidrecvc->ipsaddr->tidgr_flow.flags |= IPS_FLOW_FLAG_GEN_BECN;
+	  tidrecvc->ipsaddr->tidgr_flow->flags |= IPS_FLOW_FLAG_GEN_BECN;
 	  
 	  /* Update stats for congestion encountered */
 	  if (rcv_ev->ipsaddr)
@@ -2431,7 +2594,7 @@ ips_protoexp_handle_tf_seqerr(const struct ips_recvhdrq_event *rcv_ev)
 	args[1] = tidrecvc->tid_list.tsess_descid;
 	args[2].u16w0 = sequence_num.gen; /* Older Gen to NAK */
 
-	ips_proto_send_ctrl_message(&tidrecvc->ipsaddr->tidgr_flow, 
+	ips_proto_send_ctrl_message(tidrecvc->ipsaddr->tidgr_flow, 
 				    OPCODE_NAK,
 				    &tidrecvc->ctrl_msg_queued, args);
 
@@ -72,7 +72,8 @@ struct ips_message_header {
 
         union {
 	  struct {
-	    __u16 mqhdr : 14;    /* PSM matched queues */
+	    __u16 mqhdr : 8;     /* PSM matched queues */
+	    __u16 mqid : 6;      /* Matched queue of an envelope */
 	    __u16 dst_subcontext : 2; /* Destination subcontext */
 	  };
 	  struct {    /* for PSM Active Messages */
@@ -165,6 +166,21 @@ struct ips_message_header {
 /* Explicit CCA related messages */
 #define OPCODE_FLOW_CCA_BECN 0x80
 
+/*
+ * Payload of an MQ_MSG_PACKED packet: data[0].u32w0 envelopes, each one
+ * this record followed by the message padded to 8 bytes.  The packet
+ * carries the message sequence number of the first envelope, the others
+ * follow it in order.
+ */
+struct ips_mq_packed_env {
+	__u64 tag;
+	__u32 len;
+	__u32 reserved;
+};
+
+#define IPS_MQ_PACKED_ENV_SIZE(len)	\
+	(sizeof(struct ips_mq_packed_env) + (((len) + 7) & ~7))
+
 /*
  * like OPCODE_CLOSE, but no complaint if other side has already closed.
  * Used when doing abort(), MPI_Abort(), etc.
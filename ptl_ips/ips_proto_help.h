@@ -510,6 +510,29 @@ ips_proto_send_nak(struct ips_recvhdrq *recvq, struct ips_flow *flow))
   }
 }
 
+/*
+ * Header prediction.  The 64-bit word starting at sub_opcode holds the
+ * opcode, flags, commidx and the piggybacked ack with the source context
+ * bits.  Apart from the ack, ACK_REQ and the opcode bit that tells tiny from
+ * short envelopes, it is the same for every such envelope a peer sends on a
+ * flow, so it is learnt from the first one that goes through the full path.
+ */
+PSMI_ALWAYS_INLINE(
+uint64_t
+ips_proto_hp_word(const struct ips_message_header *p_hdr))
+{
+    return *((const uint64_t *) &p_hdr->sub_opcode);
+}
+
+PSMI_ALWAYS_INLINE(
+void
+ips_proto_hp_learn(struct ips_proto *proto, struct ips_flow *flow,
+		   const struct ips_message_header *p_hdr))
+{
+    if (p_hdr->mqhdr == MQ_MSG_TINY || p_hdr->mqhdr == MQ_MSG_SHORT)
+	flow->hp_pred = ips_proto_hp_word(p_hdr) & proto->hp_mask;
+}
+
 /* return 1 if packet is next expected in flow
  * return 0 if packet is not next expected in flow (and nak packet).
  */
@@ -520,7 +543,7 @@ ips_proto_is_expected_or_nak(struct ips_recvhdrq_event *rcv_ev))
     ips_epaddr_t *ipsaddr = rcv_ev->ipsaddr;
     struct ips_message_header *p_hdr = rcv_ev->p_hdr;
     ptl_epaddr_flow_t flowid = ips_proto_flowid(p_hdr);
-    struct ips_flow *flow = &ipsaddr->flows[flowid];
+    struct ips_flow *flow = ips_epaddr_flow(ipsaddr, flowid);
     psmi_seqnum_t sequence_num;
     
     psmi_assert((flowid == EP_FLOW_GO_BACK_N_PIO) ||
@@ -622,14 +645,16 @@ ips_proto_process_mq_tiny(const struct ips_recvhdrq_event *rcv_ev))
   psm_epaddr_t epaddr = ipsaddr->epaddr;
   struct ips_message_header *p_hdr = rcv_ev->p_hdr;
   ptl_epaddr_flow_t flowid = ips_proto_flowid(p_hdr);
-  struct ips_flow *flow = &ipsaddr->flows[flowid];
+  struct ips_flow *flow = ips_epaddr_flow(ipsaddr, flowid);
   int ret = IPS_RECVHDRQ_CONTINUE;
   
   if (ips_proto_is_expected_or_nak((struct ips_recvhdrq_event*) rcv_ev)) {
+    psm_mq_t mq;
     ret = ips_proto_check_msg_order(epaddr, flow, p_hdr);
     if (ret == 0) return IPS_RECVHDRQ_OOO;
+    mq = psmi_mq_demux(ipsaddr->proto->mq, p_hdr->mqid);
     if (ret == -1) {
-	psmi_mq_handle_envelope_outoforder(ipsaddr->proto->mq,
+	psmi_mq_handle_envelope_outoforder(mq,
 		(uint16_t) p_hdr->mqhdr,
 		epaddr, flow->msg_ooo_seqnum,
 		p_hdr->data[0].u64, /* tag */
@@ -640,10 +665,11 @@ ips_proto_process_mq_tiny(const struct ips_recvhdrq_event *rcv_ev))
 	ret = IPS_RECVHDRQ_BREAK;
     } else {
 	psmi_mq_handle_tiny_envelope(
-		ipsaddr->proto->mq,
+		mq,
 		epaddr, p_hdr->data[0].u64, /* tag */
 		(void *) &p_hdr->data[1], 
 		(uint32_t) p_hdr->hdr_dlen);
+	ips_proto_hp_learn(ipsaddr->proto, flow, p_hdr);
 	if (epaddr->mctxt_master->outoforder_c) {
 	    psmi_mq_handle_outoforder_queue(epaddr->mctxt_master);
 	}
@@ -659,6 +685,74 @@ ips_proto_process_mq_tiny(const struct ips_recvhdrq_event *rcv_ev))
 }
 #endif
 
+/*
+ * Fast path for the next in-order tiny or short envelope from a peer when
+ * nothing is out of order or pending on the flow: one masked compare
+ * against the flow's predicted header plus the usual psn and message order
+ * checks, then straight to MQ matching and ack coalescing.
+ *
+ * Returns -1 if the packet was not predicted and must take the full path.
+ */
+PSMI_ALWAYS_INLINE(
+int
+ips_proto_hp_process(struct ips_recvhdrq_event *rcv_ev))
+{
+    struct ips_message_header *p_hdr = rcv_ev->p_hdr;
+    ips_epaddr_t *ipsaddr = rcv_ev->ipsaddr;
+    struct ips_flow *flow = ipsaddr->flows[IPS_FLOWID_GET_INDEX(p_hdr->flowid)];
+    psm_epaddr_t epaddr = ipsaddr->epaddr;
+    psm_epaddr_t master = epaddr->mctxt_master;
+    psmi_egrid_t egrid;
+    psmi_seqnum_t sequence_num;
+    uint16_t mode = p_hdr->mqhdr;
+    uint32_t paylen;
+    psm_mq_t mq;
+
+    if_pf (flow == NULL || rcv_ev->ptype != RCVHQ_RCV_TYPE_EAGER ||
+	   rcv_ev->is_congested ||
+	   (ips_proto_hp_word(p_hdr) & rcv_ev->proto->hp_mask) != flow->hp_pred ||
+	   (mode != MQ_MSG_TINY && mode != MQ_MSG_SHORT))
+	return -1;
+
+    sequence_num.val = __be32_to_cpu(p_hdr->bth[2]);
+    if_pf (sequence_num.pkt != flow->recv_seq_num.pkt ||
+	   (flow->flags & ~IPS_FLOW_FLAG_PENDING_ACK) || flow->msg_ooo_toggle ||
+	   master->outoforder_c ||
+	   (uint16_t)(sequence_num.msg + ((p_hdr->ack_seq_num>>8)&0xff00)) !=
+	     master->mctxt_recv_seqnum)
+	return -1;
+
+    flow->last_seq_num = sequence_num;
+    flow->recv_seq_num.pkt += 1;
+    flow->cca_ooo_pkts = 0;
+    flow->touched = 1;
+    master->mctxt_recv_seqnum++;
+
+    mq = psmi_mq_demux(rcv_ev->proto->mq, p_hdr->mqid);
+    if (mode == MQ_MSG_TINY)
+	psmi_mq_handle_tiny_envelope(mq, epaddr,
+		p_hdr->data[0].u64, /* tag */
+		(void *) &p_hdr->data[1], (uint32_t) p_hdr->hdr_dlen);
+    else {
+	/* May have padded writes, account for it */
+	paylen = ips_recvhdrq_event_paylen(rcv_ev) - p_hdr->hdr_dlen;
+	egrid.egr_data = 0;
+	psmi_mq_handle_envelope(mq, mode, epaddr,
+		p_hdr->data[0].u64, /* tag */
+		egrid, paylen, ips_recvhdrq_event_payload(rcv_ev), paylen);
+    }
+    rcv_ev->proto->stats.hdr_predict_hits++;
+
+    if (p_hdr->flags & IPS_SEND_FLAG_ACK_REQ)
+	ips_proto_send_ack((struct ips_recvhdrq *) rcv_ev->recvq, flow);
+
+    /* Piggybacked ack, only if we have something outstanding to the peer */
+    if (!STAILQ_EMPTY(&flow->scb_unacked))
+	ips_proto_process_ack(rcv_ev);
+
+    return IPS_RECVHDRQ_CONTINUE;
+}
+
 PSMI_INLINE(
 int
 ips_proto_process_packet(const struct ips_recvhdrq_event *rcv_ev))
@@ -40,9 +40,25 @@
 #define MQ_NUM_MTUS(size,mtu)	(((size) + (mtu) - 1) / (mtu))
 #define MQ_EGRLONG_ENABLE_MULTIFLOW 0
 
+/* Flow used to send MQ message envelopes to ipsaddr */
+PSMI_ALWAYS_INLINE(
+struct ips_flow *
+ips_mq_envelope_flow(struct ips_proto *proto, ips_epaddr_t *ipsaddr))
+{
+    if_pf (proto->flags & IPS_PROTO_FLAG_MQ_ENVELOPE_SDMA)
+	return ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_DMA);
+    else
+	return ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO);
+}
+
+/*
+ * Eager scbs are allocated on behalf of the flow they will be sent on.  When
+ * the pool is under pressure, a flow already holding its share of scbs waits
+ * for its own acks so that other flows can still send.
+ */
 PSMI_NEVER_INLINE(
 ips_scb_t * __sendpath
-ips_poll_scb(struct ips_proto *proto,
+ips_poll_scb(struct ips_proto *proto, struct ips_flow *flow,
 	     int npkts, int len, uint32_t flags, int istiny))
 {
     ips_scb_t *scb = NULL;
@@ -52,7 +68,8 @@ ips_poll_scb(struct ips_proto *proto,
     proto->stats.scb_egr_unavail_cnt++;
 
     PSMI_BLOCKUNTIL(proto->ep,err,
-	((scb = istiny ? 
+	(ips_scbctrl_fair(&proto->scbc_egr, flow->scb_num_egr) &&
+	 (scb = istiny ? 
 	  ips_scbctrl_alloc_tiny(&proto->scbc_egr) :
 	  ips_scbctrl_alloc(&proto->scbc_egr, npkts, len, flags)) != NULL));
     psmi_assert(scb != NULL);
@@ -61,28 +78,35 @@ ips_poll_scb(struct ips_proto *proto,
 
 PSMI_ALWAYS_INLINE(
 ips_scb_t * 
-mq_alloc_tiny(struct ips_proto *proto))
+mq_alloc_tiny(struct ips_proto *proto, struct ips_flow *flow))
 {
-    ips_scb_t* scb = ips_scbctrl_alloc_tiny(&proto->scbc_egr);
+    ips_scb_t* scb;
     // common case should branch right through
-    if_pt (scb != NULL) 
-        return scb;
-    else 
-       return ips_poll_scb(proto, 1, 0, 0, 1);
+    if_pt (ips_scbctrl_fair(&proto->scbc_egr, flow->scb_num_egr)) {
+	scb = ips_scbctrl_alloc_tiny(&proto->scbc_egr);
+	if_pt (scb != NULL) 
+	    return scb;
+    }
+    else
+	proto->scbc_egr.stats.deferred++;
+    return ips_poll_scb(proto, flow, 1, 0, 0, 1);
 }
 
 PSMI_ALWAYS_INLINE(
 ips_scb_t * 
-mq_alloc_pkts(struct ips_proto *proto, int npkts, int len, uint32_t flags))
+mq_alloc_pkts(struct ips_proto *proto, struct ips_flow *flow,
+	      int npkts, int len, uint32_t flags))
 {
+    ips_scb_t* scb;
     psmi_assert(npkts > 0);
-    ips_scb_t* scb = ips_scbctrl_alloc(&proto->scbc_egr, npkts, len, flags);
-    if_pt (scb != NULL) {
-        return scb;
-    }
-    else {
-        return ips_poll_scb(proto, npkts, len, flags, 0 /* not tiny scb */);
+    if_pt (ips_scbctrl_fair(&proto->scbc_egr, flow->scb_num_egr)) {
+	scb = ips_scbctrl_alloc(&proto->scbc_egr, npkts, len, flags);
+	if_pt (scb != NULL)
+	    return scb;
     }
+    else
+	proto->scbc_egr.stats.deferred++;
+    return ips_poll_scb(proto, flow, npkts, len, flags, 0 /* not tiny scb */);
 }
 
 static
@@ -99,6 +123,17 @@ ips_proto_mq_eager_complete(void *reqp, uint32_t nbytes)
     return IPS_RECVHDRQ_CONTINUE;
 }
 
+/* Payload of a buffered isend was acked, its scb space can be reused */
+int __recvpath
+ips_proto_mq_eager_buffered_acked(void *context, uint32_t nbytes)
+{
+    struct ips_proto *proto = (struct ips_proto *) context;
+
+    psmi_assert(proto->eager_buffered >= nbytes);
+    proto->eager_buffered -= nbytes;
+    return IPS_RECVHDRQ_CONTINUE;
+}
+
 static
 int __recvpath
 ips_proto_mq_rv_complete(void *reqp)
@@ -145,11 +180,13 @@ ips_mq_send_envelope(struct ips_proto *proto, psm_epaddr_t mepaddr,
 		     ips_epaddr_t *ipsaddr, struct ips_scb *scb, int do_flush))
 {
     psm_error_t err = PSM_OK;
-    struct ips_flow *flow = &ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO];
+    struct ips_flow *flow = ips_mq_envelope_flow(proto, ipsaddr);
+
+    /* Coalesced envelopes hold earlier message sequence numbers */
+    if_pf (flow->coalesce_scb != NULL)
+	ips_mq_coalesce_flush(proto, flow);
     
     if_pf (proto->flags & IPS_PROTO_FLAG_MQ_ENVELOPE_SDMA) {
-      flow = &ipsaddr->flows[EP_FLOW_GO_BACK_N_DMA];
-      
       if_pt (ips_scb_length(scb)) /* For DMA envelope need local completion */
     	ips_scb_flags(scb) |= IPS_SEND_FLAG_WAIT_SDMA;
     }
@@ -176,6 +213,136 @@ ips_mq_send_envelope(struct ips_proto *proto, psm_epaddr_t mepaddr,
     return err;
 }
 
+/*
+ * Small envelope coalescing.
+ *
+ * When small sends to a peer come in faster than proto->coalesce_window, or
+ * while the flow still has packets waiting for PIO, they are packed into
+ * one MQ_MSG_PACKED packet instead of each going out with its own headers.
+ * The packet goes out when it is full, when any other envelope is sent on
+ * the flow, or Nagle-style once its first envelope has been held for
+ * coalesce_window.  Envelopes only take their message sequence numbers
+ * when the packet is sent, so ordering with other sends is preserved.
+ *
+ * Peers reached over several contexts are never coalesced since their
+ * sends alternate between the contexts anyway, nor are peers that didn't
+ * advertise EP_FEATURES_MQ_PACKED when connecting.
+ */
+void __sendpath
+ips_mq_coalesce_flush(struct ips_proto *proto, struct ips_flow *flow)
+{
+    ips_scb_t *scb = flow->coalesce_scb;
+    psm_epaddr_t mepaddr = flow->ipsaddr->epaddr->mctxt_master;
+
+    psmi_assert(scb != NULL);
+    flow->coalesce_scb = NULL;
+    TAILQ_REMOVE(&proto->coalesceq, flow, coalesce_next);
+
+    flow->xmit_seq_num.msg = mepaddr->mctxt_send_seqnum&0xff;
+    flow->recv_seq_num.msg = (mepaddr->mctxt_send_seqnum>>8)&0xff;
+    mepaddr->mctxt_send_seqnum += ips_scb_uwords(scb)[0].u32w0;
+    proto->stats.coalesced_packets++;
+
+    flow->fn.xfer.enqueue(flow, scb);
+    flow->fn.xfer.flush(flow, NULL);
+}
+
+/* Drop coalesced envelopes of a flow that is going away */
+void
+ips_mq_coalesce_discard(struct ips_proto *proto, struct ips_flow *flow)
+{
+    if (flow->coalesce_scb == NULL)
+	return;
+    TAILQ_REMOVE(&proto->coalesceq, flow, coalesce_next);
+    ips_scbctrl_free(flow->coalesce_scb);
+    flow->coalesce_scb = NULL;
+}
+
+psm_error_t __sendpath
+ips_mq_coalesce_timer_callback(struct psmi_timer *timer, uint64_t current)
+{
+    struct ips_proto *proto = (struct ips_proto *) timer->context;
+    struct ips_flow *flow;
+
+    while ((flow = TAILQ_FIRST(&proto->coalesceq)) != NULL &&
+	   flow->coalesce_deadline <= current)
+	ips_mq_coalesce_flush(proto, flow);
+
+    if (flow != NULL)
+	psmi_timer_request(proto->timerq, &proto->coalesce_timer,
+			   flow->coalesce_deadline);
+    return PSM_OK;
+}
+
+/* Returns 1 if the message was coalesced, 0 if it must be sent on its own */
+PSMI_ALWAYS_INLINE(
+int
+ips_mq_coalesce_envelope(struct ips_proto *proto, psm_mq_t mq,
+			 psm_epaddr_t epaddr, ips_epaddr_t *ipsaddr,
+			 uint64_t tag, const void *buf, uint32_t len))
+{
+    struct ips_flow *flow = ips_mq_envelope_flow(proto, ipsaddr);
+    struct ips_mq_packed_env *env;
+    ips_scb_t *scb = flow->coalesce_scb;
+    uint32_t envsz = IPS_MQ_PACKED_ENV_SIZE(len);
+    uint64_t now;
+
+    if (flow->transfer != PSM_TRANSFER_PIO || epaddr->mctxt_next != epaddr ||
+	!(ipsaddr->flags & SESS_FLAG_HAS_MQ_PACKED))
+	return 0;
+
+    now = get_cycles();
+    /* A packed packet holds envelopes for one MQ */
+    if (scb != NULL && (ips_scb_length(scb) + envsz > flow->coalesce_cap ||
+			ips_scb_mqid(scb) != mq->id)) {
+	ips_mq_coalesce_flush(proto, flow);
+	scb = NULL;
+    }
+
+    if (scb == NULL) {
+	/* An isolated send goes out right away, coalescing only starts with
+	 * the next one if it follows within the window */
+	if (SLIST_EMPTY(&flow->scb_pend) &&
+	    now - flow->coalesce_last >= proto->coalesce_window) {
+	    flow->coalesce_last = now;
+	    return 0;
+	}
+	scb = mq_alloc_pkts(proto, flow, 1, flow->frag_size,
+			    IPS_SCB_FLAG_ADD_BUFFER);
+	flow->coalesce_cap = min(ips_scb_length(scb), flow->frag_size);
+	if (envsz > flow->coalesce_cap) {
+	    ips_scbctrl_free(scb);
+	    return 0;
+	}
+	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
+	ips_scb_mqhdr(scb) = MQ_MSG_PACKED;
+	ips_scb_mqid(scb) = mq->id;
+	ips_scb_hdr_dlen(scb) = 0;
+	ips_scb_uwords(scb)[0].u64 = 0;
+	ips_scb_length(scb) = 0;
+
+	flow->coalesce_scb = scb;
+	flow->coalesce_deadline = now + proto->coalesce_window;
+	TAILQ_INSERT_TAIL(&proto->coalesceq, flow, coalesce_next);
+	if (!(proto->coalesce_timer.flags & PSMI_TIMER_FLAG_PENDING))
+	    psmi_timer_request(proto->timerq, &proto->coalesce_timer,
+			       flow->coalesce_deadline);
+    }
+
+    env = (struct ips_mq_packed_env *)
+	    ((uint8_t *) ips_scb_buffer(scb) + ips_scb_length(scb));
+    env->tag = tag;
+    env->len = len;
+    env->reserved = 0;
+    if (len)
+	psmi_mq_mtucpy(env + 1, buf, len);
+    ips_scb_length(scb) += envsz;
+    ips_scb_uwords(scb)[0].u32w0++;
+    flow->coalesce_last = now;
+    proto->stats.coalesced_envelopes++;
+    return 1;
+}
+
 /*
  * We don't use message striping for middle message protocol,
  * Tests on sandy-bridge two HCAs show lower bandwidth if
@@ -203,7 +370,7 @@ ips_mq_send_payload(psm_epaddr_t epaddr, psmi_egrid_t egrid,
     psmi_assert(len > 0);
     ipsaddr = epaddr->ptladdr;
     proto = ipsaddr->proto;
-    flow = &ipsaddr->flows[flowid];
+    flow = ips_epaddr_flow(ipsaddr, flowid);
     frag_size = flow->frag_size;
 
     if (!(flags & IPS_PROTO_FLAG_MQ_EAGER_SDMA)) goto spio;
@@ -216,7 +383,7 @@ ips_mq_send_payload(psm_epaddr_t epaddr, psmi_egrid_t egrid,
     if (pktlen > 131072) pktlen = 131072;
 
     do {
-	scb = mq_alloc_pkts(proto, 1, 0, 0);
+	scb = mq_alloc_pkts(proto, flow, 1, 0, 0);
 	psmi_assert(scb != NULL);
 
 #if 0
@@ -279,7 +446,8 @@ spio:
  * a proto deallocates the scb still in use by another proto.
  */
 	pktlen = min(frag_size, nbytes_left);
-	scb = mq_alloc_pkts(proto, 1, pktlen, is_blocking ? IPS_SCB_FLAG_ADD_BUFFER : 0);
+	scb = mq_alloc_pkts(proto, flow, 1, pktlen,
+			    is_blocking ? IPS_SCB_FLAG_ADD_BUFFER : 0);
 	psmi_assert(scb != NULL);
 
 	ips_scb_length(scb) = pktlen;
@@ -312,6 +480,13 @@ spio:
 	    }
 	}
 
+	if (flags & IPS_PROTO_FLAG_MQ_EAGER_BUFFERED) {
+	    /* The request already completed, only account for the copy */
+	    psmi_assert(is_blocking);
+	    ips_scb_cb(scb) = ips_proto_mq_eager_buffered_acked;
+	    ips_scb_cb_param(scb) = proto;
+	}
+
 	flow->fn.xfer.enqueue(flow, scb);
 
 	/* we need to flush the pending queue */
@@ -363,8 +538,19 @@ ips_ptl_mq_rndv(psm_mq_req_t req, psm_epaddr_t mepaddr, ips_epaddr_t *ipsaddr,
     req->send_msgoff = 0;
     req->recv_msgoff = 0;
     req->rts_peer = ipsaddr->epaddr;
+
+    /* The tid grant window is only needed while a tid rendezvous is in
+     * flight, keep it out of the request itself. */
+    if (proto->protoexp != NULL) {
+	struct ips_tid_grant *grant = 
+	    psmi_mpool_get(proto->protoexp->tid_grant_pool);
+	psmi_assert(grant != NULL);
+	if (grant == NULL) return PSM_NO_MEMORY;
+	memset(grant, 0, sizeof(*grant));
+	req->ptl_req_ptr = grant;
+    }
         
-    scb = mq_alloc_tiny(proto);
+    scb = mq_alloc_tiny(proto, ips_mq_envelope_flow(proto, ipsaddr));
 
     /* If the expected tid protocol is active, use it or else resort to
      * eager-based r-v. */
@@ -373,6 +559,7 @@ ips_ptl_mq_rndv(psm_mq_req_t req, psm_epaddr_t mepaddr, ips_epaddr_t *ipsaddr,
 			     MQ_MSG_RTS_WAIT : MQ_MSG_RTS;
     else
 	ips_scb_mqhdr(scb) = MQ_MSG_RTS_EGR;
+    ips_scb_mqid(scb) = req->mq->id;
 
     ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
     ips_scb_flags(scb) |= IPS_SEND_FLAG_ACK_REQ;
@@ -381,9 +568,13 @@ ips_ptl_mq_rndv(psm_mq_req_t req, psm_epaddr_t mepaddr, ips_epaddr_t *ipsaddr,
     ips_scb_uwords(scb)[1].u32w0 = psmi_mpool_get_obj_index(req);
     ips_scb_uwords(scb)[1].u32w1 = len;
 
-    memset(&req->tid_grant, 0, sizeof(req->tid_grant));
-    if ((err = ips_mq_send_envelope(proto, mepaddr, ipsaddr, scb, PSMI_TRUE)))
+    if ((err = ips_mq_send_envelope(proto, mepaddr, ipsaddr, scb, PSMI_TRUE))) {
+	if (req->ptl_req_ptr != NULL) {
+	    psmi_mpool_put(req->ptl_req_ptr);
+	    req->ptl_req_ptr = NULL;
+	}
 	goto fail;
+    }
 	    
     /* Assume that we already put a few rndv requests in flight.  This helps
      * for bibw microbenchmarks and doesn't hurt the 'blocking' case since
@@ -400,6 +591,32 @@ fail:
     return err; 
 }
 
+/*
+ * Charge an eager send against the credits the receiver granted us.  Returns
+ * 0 when the peer is out of credits and the message has to go rendezvous
+ * instead, so that a late receiver only ever buffers a bounded amount.
+ */
+PSMI_ALWAYS_INLINE(
+int
+ips_mq_egrcredit_ok(psm_mq_t mq, psm_epaddr_t mepaddr, ips_epaddr_t *ipsaddr,
+		    uint32_t flags, uint32_t len))
+{
+    struct ips_proto *proto = ipsaddr->proto;
+
+    if_pt (mepaddr->egrcredit_window == 0 || (flags & PSM_MQ_FLAG_SENDSYNC))
+	return 1;
+    /* Same cutoffs as the eager branches below */
+    if (len > MQ_IPATH_THRESH_TINY && len > ipsaddr->epr.epr_piosize &&
+	len > mq->ipath_thresh_rv &&
+	!((proto->flags & IPS_PROTO_FLAG_MQ_COALESCE) &&
+	  len <= proto->coalesce_thresh))
+	return 1;
+    if (mq_egrcredit_take(mepaddr, len))
+	return 1;
+    proto->stats.egrcredit_rndv++;
+    return 0;
+}
+
 psm_error_t __sendpath
 ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags, 
 	     uint64_t tag, const void *ubuf, uint32_t len, void *context,
@@ -422,11 +639,32 @@ ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
     req->tag = tag;
     req->context = context;
 
-    if (!flags && len <= MQ_IPATH_THRESH_TINY) {
-	scb = mq_alloc_tiny(proto);
+    if_pf (!ips_mq_egrcredit_ok(mq, mepaddr, ipsaddr, flags, len)) {
+	err = ips_ptl_mq_rndv(req, mepaddr, ipsaddr, ubuf, len);
+	*req_o = req;
+	return err;
+    }
+    else if_pf ((proto->flags & IPS_PROTO_FLAG_MQ_COALESCE) && !flags &&
+	   len <= proto->coalesce_thresh &&
+	   ips_mq_coalesce_envelope(proto, mq, epaddr, ipsaddr, tag, buf, len)) {
+	/* Data is copied into the packed scb, the op is complete */
+	req->state = MQ_STATE_COMPLETE;
+	mq_qq_append(&mq->completed_q, req);
+        _IPATH_VDBG("[ipack][%s->%s][b=%p][m=%d][t=%"PRIx64"][req=%p]\n", 
+	    psmi_epaddr_get_name(mq->ep->epid), 
+	    psmi_epaddr_get_name(epaddr->epid), buf, len, tag, req);
+	*req_o = req;
+	mq->stats.tx_num++;
+	mq->stats.tx_eager_num++;
+	mq->stats.tx_eager_bytes += len;
+	return err;
+    }
+    else if (!flags && len <= MQ_IPATH_THRESH_TINY) {
+	scb = mq_alloc_tiny(proto, ips_mq_envelope_flow(proto, ipsaddr));
 	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_HDR;
 	ips_scb_hdr_dlen(scb) = len;
 	ips_scb_mqhdr(scb) = MQ_MSG_TINY;
+	ips_scb_mqid(scb) = mq->id;
 	ips_scb_mqtag(scb) = tag;
 	mq_copy_tiny((uint32_t *)&ips_scb_mqparam(scb), (uint32_t *)buf, len);
 	err = ips_mq_send_envelope(proto, mepaddr, ipsaddr, scb, PSMI_TRUE);
@@ -458,12 +696,14 @@ ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	
         if_pf ((pad_write_bytes + len) > ipsaddr->epr.epr_piosize)
 	  pad_write_bytes = 0;
-	scb = mq_alloc_pkts(proto, 1, (len + pad_write_bytes),
+	scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr),
+			    1, (len + pad_write_bytes),
 			    IPS_SCB_FLAG_ADD_BUFFER);
 	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
 	ips_scb_hdr_dlen(scb) = pad_write_bytes;
 	ips_scb_length(scb) = len + pad_write_bytes;
 	ips_scb_mqhdr(scb) = MQ_MSG_SHORT;
+	ips_scb_mqid(scb) = mq->id;
 	ips_scb_mqtag(scb) = tag;
 	ips_shortcpy (ips_scb_buffer(scb), buf, len);
 	err = ips_mq_send_envelope(proto, mepaddr, ipsaddr, scb, PSMI_TRUE);
@@ -476,11 +716,9 @@ ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
     else if (len <= mq->ipath_thresh_rv) {
 	uint32_t proto_flags = proto->flags & IPS_PROTO_FLAG_MQ_MASK;
 	psmi_egrid_t egrid;
+	int buffered = 0;
 
-	scb = mq_alloc_pkts(proto, 1, 0, 0);
-	/* directly send from user's buffer */
-	ips_scb_buffer(scb) = buf;
-
+	proto_flags &= ~IPS_PROTO_FLAG_MQ_EAGER_BUFFERED;
 	if (len < proto->iovec_thresh_eager) {
 	    if (len <= 2 * ipsaddr->epr.epr_piosize) {
 		// split into 2 packets and round second down to dword multiple
@@ -491,14 +729,41 @@ ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	    }
 	    proto_flags &= ~IPS_PROTO_FLAG_MQ_EAGER_SDMA;
 
-	    /*
-	     * since following packets are sent on the same flow,
-	     * we only wait for completion for the last packet
-	     */
-	    req->send_msgoff = pktlen;
+	    /* Below the unacked cap, copy the message to scb bounce buffers
+	     * and complete it now rather than when the last packet is acked.
+	     * The scbs hold on to the copy in case of retransmission. */
+	    if ((proto->flags & IPS_PROTO_FLAG_MQ_EAGER_BUFFERED) &&
+		len <= proto->eager_buffered_max - proto->eager_buffered) {
+		buffered = 1;
+		proto_flags |= IPS_PROTO_FLAG_MQ_EAGER_BUFFERED;
+		proto->eager_buffered += len;
+
+		scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr),
+				    1, pktlen, IPS_SCB_FLAG_ADD_BUFFER);
+		ips_shortcpy (ips_scb_buffer(scb), buf, pktlen);
+		ips_scb_cb(scb) = ips_proto_mq_eager_buffered_acked;
+		ips_scb_cb_param(scb) = proto;
+	    }
+	    else {
+		scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr),
+				    1, 0, 0);
+		/* directly send from user's buffer */
+		ips_scb_buffer(scb) = buf;
+
+		/*
+		 * since following packets are sent on the same flow,
+		 * we only wait for completion for the last packet
+		 */
+		req->send_msgoff = pktlen;
+	    }
 	}
 	else {
 	    psmi_assert(proto_flags & IPS_PROTO_FLAG_MQ_EAGER_SDMA);
+	    scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr),
+				1, 0, 0);
+	    /* directly send from user's buffer */
+	    ips_scb_buffer(scb) = buf;
+
 	    /* send the unaligned bytes only, this is required by sdma. */
 	    pktlen = (uint32_t)((uintptr_t)buf & 0x3);
 	    if (pktlen) pktlen = 4 - pktlen;
@@ -516,6 +781,7 @@ ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	ips_scb_length(scb) = pktlen;
 	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
 	ips_scb_mqhdr(scb) = MQ_MSG_LONG;
+	ips_scb_mqid(scb) = mq->id;
 	ips_scb_mqtag(scb) = tag;
 	ips_scb_mqparam(scb).u32w1 = len;
 	
@@ -527,8 +793,13 @@ ips_proto_mq_isend(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	/* Send the envelope but don't flush if writev is enabled */
 	err = ips_mq_send_envelope(proto, mepaddr, ipsaddr, scb, PSMI_FALSE);
 	ips_mq_send_payload(epaddr, egrid, 
-			    buf+pktlen, len-pktlen, pktlen, req, 
-			    proto_flags);
+			    buf+pktlen, len-pktlen, pktlen,
+			    buffered ? NULL : req, proto_flags);
+	if (buffered) {
+	    req->state = MQ_STATE_COMPLETE;
+	    mq_qq_append(&mq->completed_q, req);
+	    proto->stats.eager_buffered++;
+	}
 
         _IPATH_VDBG("[ilong][%s->%s][b=%p][l=%d][m=%d][t=%"PRIx64"][req=%p]\n", 
 	    psmi_epaddr_get_name(mq->ep->epid), 
@@ -564,11 +835,25 @@ ips_proto_mq_send(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
     
     mepaddr->mctxt_current = epaddr->mctxt_next;
 
-    if (flags == 0 && len <= MQ_IPATH_THRESH_TINY) {
-	scb = mq_alloc_tiny(proto);
+    if_pf (!ips_mq_egrcredit_ok(mq, mepaddr, ipsaddr, flags, len))
+	goto do_rendezvous;
+    else if_pf ((proto->flags & IPS_PROTO_FLAG_MQ_COALESCE) && flags == 0 &&
+	   len <= proto->coalesce_thresh &&
+	   ips_mq_coalesce_envelope(proto, mq, epaddr, ipsaddr, tag, buf, len)) {
+	_IPATH_VDBG("[pack][%s->%s][b=%p][m=%d][t=%"PRIx64"]\n", 
+	    psmi_epaddr_get_name(mq->ep->epid), 
+	    psmi_epaddr_get_name(epaddr->epid), buf, len, tag);
+	mq->stats.tx_num++;
+	mq->stats.tx_eager_num++;
+	mq->stats.tx_eager_bytes += len;
+	return err;
+    }
+    else if (flags == 0 && len <= MQ_IPATH_THRESH_TINY) {
+	scb = mq_alloc_tiny(proto, ips_mq_envelope_flow(proto, ipsaddr));
 	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_HDR;
 	ips_scb_hdr_dlen(scb) = len;
 	ips_scb_mqhdr(scb) = MQ_MSG_TINY;
+	ips_scb_mqid(scb) = mq->id;
 	ips_scb_mqtag(scb) = tag;
 
 	mq_copy_tiny((uint32_t *)&ips_scb_mqparam(scb), (uint32_t *)buf, len);
@@ -595,12 +880,14 @@ ips_proto_mq_send(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
         if_pf ((pad_write_bytes + len) > ipsaddr->epr.epr_piosize)
 	  pad_write_bytes = 0;
 
-	scb = mq_alloc_pkts(proto, 1, (len + pad_write_bytes),
+	scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr),
+			    1, (len + pad_write_bytes),
 			    IPS_SCB_FLAG_ADD_BUFFER);
 	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
 	ips_scb_hdr_dlen(scb) = pad_write_bytes;
 	ips_scb_length(scb) = len + pad_write_bytes;
 	ips_scb_mqhdr(scb) = MQ_MSG_SHORT;
+	ips_scb_mqid(scb) = mq->id;
 	ips_scb_mqtag(scb) = tag;
 		
 	ips_shortcpy (ips_scb_buffer(scb), buf, len);
@@ -610,7 +897,8 @@ ips_proto_mq_send(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	    psmi_epaddr_get_name(epaddr->epid), buf, len, tag);
     }
     else if (len <= mq->ipath_thresh_rv) {
-	uint32_t proto_flags = proto->flags & IPS_PROTO_FLAG_MQ_MASK;
+	uint32_t proto_flags = proto->flags & IPS_PROTO_FLAG_MQ_MASK &
+			       ~IPS_PROTO_FLAG_MQ_EAGER_BUFFERED;
 	psmi_egrid_t egrid;
 	psm_mq_req_t req = NULL;
 
@@ -624,7 +912,8 @@ ips_proto_mq_send(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	    }
 	    proto_flags &= ~IPS_PROTO_FLAG_MQ_EAGER_SDMA;
 
-	    scb = mq_alloc_pkts(proto, 1, pktlen, IPS_SCB_FLAG_ADD_BUFFER);
+	    scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr),
+				1, pktlen, IPS_SCB_FLAG_ADD_BUFFER);
 	    /* In blocking mode, copy to scb bounce buffer */
 	    ips_shortcpy (ips_scb_buffer(scb), buf, pktlen);
 	}
@@ -641,7 +930,7 @@ ips_proto_mq_send(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
             req->send_msglen = len;
 	    req->tag = tag;
 
-	    scb = mq_alloc_pkts(proto, 1, 0, 0);
+	    scb = mq_alloc_pkts(proto, ips_mq_envelope_flow(proto, ipsaddr), 1, 0, 0);
 	    /* directly send from user's buffer */
 	    ips_scb_buffer(scb) = buf;
 
@@ -658,6 +947,7 @@ ips_proto_mq_send(psm_mq_t mq, psm_epaddr_t mepaddr, uint32_t flags,
 	ips_scb_length(scb) = pktlen;
 	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
 	ips_scb_mqhdr(scb) = MQ_MSG_LONG;
+	ips_scb_mqid(scb) = mq->id;
 	ips_scb_mqtag(scb) = tag;
 	ips_scb_mqparam(scb).u32w1 = len;
 
@@ -759,7 +1049,7 @@ ips_proto_mq_push_eager_req(struct ips_proto *proto, psm_mq_req_t req)
     req->egrid.egr_data = args[0].u32w1;
 
     ipsaddr = req->rts_peer->ptladdr;
-    flow = &ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO];
+    flow = ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO);
     ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
     ips_scb_mqhdr (scb) = MQ_MSG_CTS_EGR;
     
@@ -788,7 +1078,7 @@ ips_proto_mq_push_eager_data(struct ips_proto *proto, psm_mq_req_t req)
 
     if (!(proto->flags & IPS_PROTO_FLAG_MQ_EAGER_SDMA)) goto spio;
 
-    flow = &ipsaddr->flows[EP_FLOW_GO_BACK_N_DMA];
+    flow = ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_DMA);
     frag_size = flow->frag_size;
     nbytes_this = 131072/8;
     while (nbytes_left > 0) {
@@ -841,7 +1131,7 @@ ips_proto_mq_push_eager_data(struct ips_proto *proto, psm_mq_req_t req)
     return PSM_OK;
 
 spio:
-    flow = &ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO];
+    flow = ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO);
     frag_size = flow->frag_size;
     while (nbytes_left > 0) {
       scb = ips_scbctrl_alloc(proto->scbc_rv, 1, 0, 0);
@@ -895,6 +1185,13 @@ ips_proto_mq_handle_cts(struct ips_proto *proto, ptl_arg_t *args)
     psmi_assert(req != NULL);
     if (req == NULL) return IPS_RECVHDRQ_BREAK;
 
+    /* The receiver chose eager-based r-v (no tids on its side), so no tid
+     * grants will come for this send and its window can go back now. */
+    if (req->ptl_req_ptr != NULL) {
+	psmi_mpool_put(req->ptl_req_ptr);
+	req->ptl_req_ptr = NULL;
+    }
+
     if (msglen == 0) {
 	ips_proto_mq_rv_complete(req);
 	return IPS_RECVHDRQ_CONTINUE;
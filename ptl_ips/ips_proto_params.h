@@ -80,11 +80,14 @@
 #define IPS_FLOW_FLAG_GEN_BECN      0x08
 #define IPS_FLOW_FLAG_CONGESTED     0x10
 #define IPS_FLOW_FLAG_PENDING_NAK   0x20
+#define IPS_FLOW_FLAG_SDMA_READY    0x40 /* on proto's sdma_readyq */
 
 /* per-ipsaddr Flags (sess is ipsaddr) */
 #define SESS_FLAG_HAS_RCVTHREAD	    0x2
 #define SESS_FLAG_LOCK_SESS	    0x4
 #define SESS_FLAG_HAS_FLOWID	    0x8
+#define SESS_FLAG_PEER_CLOSED	    0x10    /* peer disconnected from us */
+#define SESS_FLAG_HAS_MQ_PACKED	    0x20    /* peer parses MQ_MSG_PACKED */
 
 /* tid session expected send flags  */
 #define EXP_SEND_FLAG_CLEAR_ALL 0x00
@@ -113,6 +116,7 @@
 #define IPS_PROTO_FLAG_MQ_ENVELOPE_SDMA	0x01
 #define IPS_PROTO_FLAG_MQ_EAGER_SDMA	0x02
 #define IPS_PROTO_FLAG_MQ_EXPECTED_SDMA	0x04
+#define IPS_PROTO_FLAG_MQ_EAGER_BUFFERED 0x08 /* complete isends once copied */
 #define IPS_PROTO_FLAG_MQ_MASK		0x0f /* contains all MQ proto flags */
 #define IPS_PROTO_FLAG_CTRL_SDMA	0x10
 
@@ -152,6 +156,15 @@
 /* IBTA CCA Protocol support */
 #define IPS_PROTO_FLAG_CCA 0x2000
 
+/* Header prediction for in-order tiny/short eager packets (On by default) */
+#define IPS_PROTO_FLAG_HDR_PREDICT 0x4000
+
+/* Coalesce small MQ envelopes into MQ_MSG_PACKED packets (Off by default) */
+#define IPS_PROTO_FLAG_MQ_COALESCE 0x8000
+
+/* Gather busy send dma flows into one writev (On by default) */
+#define IPS_PROTO_FLAG_SDMA_BATCH 0x10000
+
 /* By default, we use dma in eager (based on PSM_MQ_EAGER_SDMA_SZ) and
  * always use it in expected.
  */
@@ -177,6 +190,18 @@
  */
 #define IPS_SDMA_MAX_SCB		32
 
+/* Cross-flow send dma batching: flows with packets held back by a busy send
+ * dma ring are gathered with the flow being flushed into a single writev of
+ * at most BATCH_MAX_SCB packets from at most BATCH_MAX_FLOWS flows. */
+#define IPS_SDMA_BATCH_MAX_FLOWS	16
+#define IPS_SDMA_BATCH_MAX_SCB		128
+
+/* Buckets in the send dma batch size and ring occupancy histograms */
+#define IPS_SDMA_HIST_BUCKETS		6
+
+/* Buckets in the granted rendezvous window size histogram */
+#define IPS_RV_WIN_HIST_BUCKETS		6
+
 /* Fault injection, becomes parameters to psmi_faultinj_getspec so
  * a comma-delimited list of 
  *   "spec_name", num, denom
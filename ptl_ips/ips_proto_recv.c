@@ -179,6 +179,72 @@ ips_proto_timer_pendq_callback(struct psmi_timer *timer, uint64_t current)
     return err;
 }
 
+/*
+ * Unpack the envelopes of an MQ_MSG_PACKED packet.  The packet's message
+ * sequence number, already checked and consumed, is the first envelope's;
+ * each of the others takes the next one.  Envelopes are checked against the
+ * packet's payload before any is delivered: an in-order packet that overruns
+ * is dropped whole, still consuming the header's count of sequence numbers,
+ * and an out-of-order one is left to be received again once it is in order.
+ *
+ * Returns 0 if the packet must be received again.
+ */
+static
+int __recvpath
+_process_mq_packed(psm_mq_t mq, psm_epaddr_t epaddr, struct ips_flow *flow,
+		   struct ips_message_header *p_hdr, char *payload, 
+		   uint32_t paylen, int in_order)
+{
+    struct ips_mq_packed_env *env;
+    uint32_t i, nenv = p_hdr->data[0].u32w0;
+    uint32_t left = paylen;
+    char *p = payload;
+    psmi_egrid_t egrid;
+
+    for (i = 0; i < nenv; i++) {
+	env = (struct ips_mq_packed_env *) p;
+	if_pf (left < sizeof(struct ips_mq_packed_env) ||
+	       env->len > left - sizeof(struct ips_mq_packed_env))
+	    break;
+	p += IPS_MQ_PACKED_ENV_SIZE(env->len);
+	left -= min(left, IPS_MQ_PACKED_ENV_SIZE(env->len));
+    }
+    if_pf (i < nenv || nenv == 0) {
+	if (in_order != 1) {
+	    flow->recv_seq_num.pkt -= 1;
+	    return 0;
+	}
+	_IPATH_ERROR("ErrPkt: Packed envelope %d of %d from %s overruns "
+		     "its packet, dropping the packet\n", i, nenv,
+		     psmi_epaddr_get_name(epaddr->epid));
+	if (nenv > 1)
+	    epaddr->mctxt_master->mctxt_recv_seqnum += nenv - 1;
+	return 1;
+    }
+
+    egrid.egr_data = 0;
+    for (i = 0; i < nenv; i++) {
+	env = (struct ips_mq_packed_env *) payload;
+	payload += IPS_MQ_PACKED_ENV_SIZE(env->len);
+
+	if (in_order == 1) {
+	    if (i > 0)
+		epaddr->mctxt_master->mctxt_recv_seqnum++;
+	    if (env->len <= MQ_IPATH_THRESH_TINY)
+		psmi_mq_handle_tiny_envelope(mq, epaddr, env->tag,
+					     env + 1, env->len);
+	    else
+		psmi_mq_handle_envelope(mq, MQ_MSG_SHORT, epaddr, env->tag,
+					egrid, env->len, env + 1, env->len);
+	}
+	else
+	    psmi_mq_handle_envelope_outoforder(mq, MQ_MSG_SHORT, epaddr,
+		    (uint16_t)(flow->msg_ooo_seqnum + i), env->tag,
+		    egrid, env->len, env + 1, env->len);
+    }
+    return 1;
+}
+
 static 
 int __recvpath 
 _process_mq(struct ips_recvhdrq_event *rcv_ev)
@@ -195,7 +261,7 @@ _process_mq(struct ips_recvhdrq_event *rcv_ev)
     psm_mq_t mq = rcv_ev->proto->mq; 
     ptl_arg_t *args;
     ptl_epaddr_flow_t flowid = ips_proto_flowid(p_hdr);
-    struct ips_flow *flow = &ipsaddr->flows[flowid];
+    struct ips_flow *flow = ips_epaddr_flow(ipsaddr, flowid);
     int ret = IPS_RECVHDRQ_CONTINUE;
     
     if (!ips_proto_is_expected_or_nak((struct ips_recvhdrq_event*) rcv_ev))
@@ -206,11 +272,17 @@ _process_mq(struct ips_recvhdrq_event *rcv_ev)
 	paylen, p_hdr->mqhdr, 
 	(long long) p_hdr->data[0].u64, (long long) p_hdr->data[1].u64);
     
-    if (mode <= MQ_MSG_RTS_WAIT) {
+    if (mode <= MQ_MSG_RTS_WAIT || mode == MQ_MSG_PACKED) {
 	ret = ips_proto_check_msg_order(epaddr, flow, p_hdr);
 	if (ret == 0) return IPS_RECVHDRQ_OOO;
 
-	if (mode <= MQ_MSG_LONG) {
+	mq = psmi_mq_demux(mq, p_hdr->mqid);
+	if (mode == MQ_MSG_PACKED) {
+	    if (!_process_mq_packed(mq, epaddr, flow, p_hdr, payload, paylen,
+				    ret))
+		return IPS_RECVHDRQ_OOO;
+	}
+	else if (mode <= MQ_MSG_LONG) {
 	    egrid.egr_data = 0; 
 	    if (mode == MQ_MSG_SHORT) {
 		/* May have padded writes, account for it */
@@ -229,10 +301,12 @@ _process_mq(struct ips_recvhdrq_event *rcv_ev)
 		}
 	    }
 
-	    if (ret == 1)
+	    if (ret == 1) {
 		psmi_mq_handle_envelope(
 		    mq, mode, epaddr, p_hdr->data[0].u64, /* tag */
 		    egrid, msglen, (void *) payload, paylen);
+		ips_proto_hp_learn(rcv_ev->proto, flow, p_hdr);
+	    }
 	    else
 		psmi_mq_handle_envelope_outoforder(
 		    mq, mode, epaddr, flow->msg_ooo_seqnum,
@@ -475,7 +549,14 @@ ips_proto_process_ack(struct ips_recvhdrq_event *rcv_ev)
 
     switch(protocol){
     case PSM_PROTOCOL_GO_BACK_N:
-      flow = &ipsaddr->flows[flowid];
+      /* Credits are a running total, even a stale ack may carry news.
+       * Only explicit acks carry them, data[1] of a piggybacked ack is
+       * payload. */
+      if (p_hdr->sub_opcode == OPCODE_ACK)
+	mq_egrcredit_update(ipsaddr->epaddr, p_hdr->data[1].u32w0);
+      /* A flow that isn't materialized has nothing outstanding to ack */
+      if ((flow = ipsaddr->flows[flowid]) == NULL)
+	goto ret;
       ack_seq_num.pkt -= 1;
       if (!pio_dma_ack_valid(flow, ack_seq_num, proto->scb_max_inflight))
 	goto ret;
@@ -524,6 +605,7 @@ ips_proto_process_ack(struct ips_recvhdrq_event *rcv_ev)
 	    flow->scb_num_pending--;
 	    SLIST_REMOVE_HEAD(scb_pend, next);
 	}
+	ips_flow_faultinj_xmit_acked(flow, scb);
 
 	if (scb->flags & IPS_SEND_FLAG_WAIT_SDMA) 
 	    ips_proto_dma_wait_until(proto, scb->dma_ctr);
@@ -531,6 +613,11 @@ ips_proto_process_ack(struct ips_recvhdrq_event *rcv_ev)
         if (scb->callback)
             (*scb->callback) (scb->cb_param, scb->payload_size-scb->extra_bytes);
 
+	if (scb->scbc == &proto->scbc_egr && --flow->scb_num_egr == 0) {
+	    psmi_assert(proto->scbc_egr.scb_flows_active > 0);
+	    proto->scbc_egr.scb_flows_active--;
+	}
+
 	if (!(scb->flags & IPS_SEND_FLAG_PERSISTENT))
 	    ips_scbctrl_free(scb);
 
@@ -539,8 +626,10 @@ ips_proto_process_ack(struct ips_recvhdrq_event *rcv_ev)
 	if (STAILQ_EMPTY(unackedq)) {
             psmi_timer_cancel(proto->timerq, &flow->timer_ack);
 	    psmi_timer_cancel(proto->timerq, &flow->timer_send);
+	    ips_proto_sdma_unready(proto, flow);
 	    SLIST_FIRST(scb_pend) = NULL;
 	    psmi_assert(flow->scb_num_pending == 0);
+	    psmi_assert(flow->scb_num_egr == 0);
 	    /* Reset congestion window - all packets ACK'd */
 	    flow->credits = flow->cwin = proto->flow_credits;
 	    flow->ack_interval = max((flow->credits >> 2) - 1, 1);
@@ -614,7 +703,9 @@ _process_nak(struct ips_recvhdrq_event *rcv_ev)
     
     switch(protocol){
     case PSM_PROTOCOL_GO_BACK_N:
-      flow = &ipsaddr->flows[flowid];
+      mq_egrcredit_update(ipsaddr->epaddr, p_hdr->data[1].u32w0);
+      if ((flow = ipsaddr->flows[flowid]) == NULL)
+	goto ret;
       if (!pio_dma_ack_valid(flow, ack_seq_num, proto->scb_max_inflight)) 
 	goto ret;
       ack_seq_num.pkt--;
@@ -664,6 +755,7 @@ _process_nak(struct ips_recvhdrq_event *rcv_ev)
 	scb = STAILQ_FIRST(unackedq);
 	STAILQ_REMOVE_HEAD(unackedq, nextq);
 	flow->scb_num_unacked--;
+	ips_flow_faultinj_xmit_acked(flow, scb);
 	
 	if (scb->flags & IPS_SEND_FLAG_WAIT_SDMA) 
 	    ips_proto_dma_wait_until(proto, scb->dma_ctr);
@@ -671,6 +763,11 @@ _process_nak(struct ips_recvhdrq_event *rcv_ev)
         if (scb->callback)
             (*scb->callback) (scb->cb_param, scb->payload_size-scb->extra_bytes);
 
+	if (scb->scbc == &proto->scbc_egr && --flow->scb_num_egr == 0) {
+	    psmi_assert(proto->scbc_egr.scb_flows_active > 0);
+	    proto->scbc_egr.scb_flows_active--;
+	}
+
 	if (!(scb->flags & IPS_SEND_FLAG_PERSISTENT))
 	    ips_scbctrl_free(scb);
 
@@ -678,8 +775,10 @@ _process_nak(struct ips_recvhdrq_event *rcv_ev)
 	if (STAILQ_EMPTY(unackedq)) {
             psmi_timer_cancel(proto->timerq, &flow->timer_ack);
 	    psmi_timer_cancel(proto->timerq, &flow->timer_send);
+	    ips_proto_sdma_unready(proto, flow);
 	    SLIST_FIRST(scb_pend) = NULL;
 	    psmi_assert(flow->scb_num_pending == 0);
+	    psmi_assert(flow->scb_num_egr == 0);
 	    /* Reset congestion window if all packets acknowledged */
 	    flow->credits = flow->cwin = proto->flow_credits;
 	    flow->ack_interval = max((flow->credits >> 2) - 1, 1);
@@ -699,6 +798,13 @@ _process_nak(struct ips_recvhdrq_event *rcv_ev)
     /* What's now pending is all that was unacked */
     SLIST_FIRST(scb_pend) = STAILQ_FIRST(unackedq);
     flow->scb_num_pending = flow->scb_num_unacked;
+
+    if_pf (PSMI_FAULTINJ_ENABLED()) {
+	uint64_t nbytes = 0;
+	STAILQ_FOREACH(scb, unackedq, nextq)
+	    nbytes += scb->payload_size;
+	psmi_faultinj_retransmit(flow->scb_num_unacked, nbytes);
+    }
     
     /* If NAK with congestion bit set - delay re-transmitting and THEN adjust
      * CCA rate.
@@ -755,14 +861,14 @@ _process_err_chk(struct ips_recvhdrq *recvq, ips_epaddr_t *ipsaddr,
     psmi_seqnum_t seq_num;
     int16_t seq_off;
     ptl_epaddr_flow_t flowid = ips_proto_flowid(p_hdr);
-    struct ips_flow *flow = &ipsaddr->flows[flowid];
+    struct ips_flow *flow = ips_epaddr_flow(ipsaddr, flowid);
     
     INC_TIME_SPEND(TIME_SPEND_USER4);
 
     ipsaddr->stats.err_chk_recv++;
 
     seq_num.val = __be32_to_cpu(p_hdr->bth[2]);
-    seq_off = (int16_t)(ipsaddr->flows[flowid].recv_seq_num.pkt - seq_num.pkt);
+    seq_off = (int16_t)(flow->recv_seq_num.pkt - seq_num.pkt);
 
     if_pf (seq_off <= 0) {
       _IPATH_VDBG("naking for seq=%d, off=%d on flowid  %d\n",
@@ -866,13 +972,13 @@ _process_err_chk_gen(ips_epaddr_t *ipsaddr, struct ips_message_header *p_hdr)
 	 (protoexp->proto->flags & IPS_PROTO_FLAG_CCA)) {
     _IPATH_CCADBG("ERR_CHK_GEN: Generating BECN. Number of swapped generations: %d.\n", tidrecvc->tidflow_nswap_gen);
     /* Mark flow to generate BECN in control packet */
-    tidrecvc->ipsaddr->tidgr_flow.flags |= IPS_FLOW_FLAG_GEN_BECN;
+    tidrecvc->ipsaddr->tidgr_flow->flags |= IPS_FLOW_FLAG_GEN_BECN;
     
     /* Update stats for congestion encountered */
     ipsaddr->stats.congestion_pkts++;
   }
   
-  ips_proto_send_ctrl_message(&tidrecvc->ipsaddr->tidgr_flow, 
+  ips_proto_send_ctrl_message(tidrecvc->ipsaddr->tidgr_flow, 
 			      ack_type, &tidrecvc->ctrl_msg_queued, args);
 
   /* Update stats for expected window */
@@ -1125,6 +1231,7 @@ ips_proto_process_unknown(const struct ips_recvhdrq_event *rcv_ev)
 	if (ip != NULL && sepid->pid) {
 	    /* Make up a fake ipsaddr and reply */
 	    ips_epaddr_t ipsaddr_f;
+	    struct ips_flow flow_f;
 	    psm_error_t err;
 	    
 	    /* debugging sanity, and catch bugs */
@@ -1151,11 +1258,12 @@ ips_proto_process_unknown(const struct ips_recvhdrq_event *rcv_ev)
 	     * in this fake (stack-allocated) ptladdr */
 	    ipsaddr_f.ctrl_msg_queued = ~0;
 	    flowid = EP_FLOW_GO_BACK_N_PIO;
-	    ips_flow_init(&ipsaddr_f.flows[flowid], NULL,
+	    ipsaddr_f.flows[flowid] = &flow_f;
+	    ips_flow_init(&flow_f, NULL,
 			  &ipsaddr_f, PSM_TRANSFER_PIO,
 			  PSM_PROTOCOL_GO_BACK_N, IPS_PATH_LOW_PRIORITY, flowid);
 
-	    if (!ips_proto_send_ctrl_message(&ipsaddr_f.flows[flowid],
+	    if (!ips_proto_send_ctrl_message(&flow_f,
 					     OPCODE_ERR_CHK_BAD,
 					     &ipsaddr_f.ctrl_msg_queued,NULL)){
 		sepid->err_check_bad_sent++;
@@ -1163,6 +1271,7 @@ ips_proto_process_unknown(const struct ips_recvhdrq_event *rcv_ev)
 	    }
 	    else
 		_IPATH_VDBG("did *NOT* reply with ERR_CHK_BAD\n");
+	    ips_epaddr_paths_free(&ipsaddr_f);
 	    
 	fail:
 	    psmi_handle_error(ep_err, PSM_EPID_NETWORK_ERROR, 
@@ -1269,7 +1378,7 @@ ips_proto_process_packet_error(struct ips_recvhdrq_event *rcv_ev)
 	      return 0; /* Unknown packet - drop */
 	    
 	    rcv_ev->ipsaddr = epstaddr->ipsaddr;	    
-	    flow = &rcv_ev->ipsaddr->flows[flowid];
+	    flow = ips_epaddr_flow(rcv_ev->ipsaddr, flowid);
 	    sequence_num.val = __be32_to_cpu(p_hdr->bth[2]);
 	    diff = (int16_t) (sequence_num.pkt - flow->recv_seq_num.pkt);
 	    
@@ -1385,6 +1494,48 @@ ips_proto_process_packet_error(struct ips_recvhdrq_event *rcv_ev)
     return 0;
 }
 
+/*
+ * Fault injection recovery accounting on the receive side: a dropped
+ * sequenced packet that was next in order is recovered once its
+ * retransmission arrives in order.
+ */
+static void
+ips_proto_faultinj_recv(struct ips_recvhdrq_event *rcv_ev, int lost)
+{
+    struct ips_message_header *p_hdr = rcv_ev->p_hdr;
+    struct ips_flow *flow;
+    psmi_seqnum_t seq;
+
+    if (rcv_ev->ptype != RCVHQ_RCV_TYPE_EAGER ||
+	IPS_FLOWID_GET_PROTO(p_hdr->flowid) != PSM_PROTOCOL_GO_BACK_N)
+	return;
+    switch (p_hdr->sub_opcode) {
+    case OPCODE_SEQ_MQ_HDR:
+    case OPCODE_SEQ_MQ_CTRL:
+    case OPCODE_AM_REQUEST:
+    case OPCODE_AM_REQUEST_NOREPLY:
+    case OPCODE_AM_REPLY:
+	break;
+    default:
+	return;
+    }
+    flow = rcv_ev->ipsaddr->flows[IPS_FLOWID_GET_INDEX(p_hdr->flowid)];
+    seq.val = __be32_to_cpu(p_hdr->bth[2]);
+    if (flow == NULL || seq.pkt != flow->recv_seq_num.pkt)
+	return;
+
+    if (lost) {
+	if (flow->fi_t_recv_lost == 0) {
+	    flow->fi_t_recv_lost = get_cycles();
+	    flow->fi_recv_lost_psn = seq.psn;
+	}
+    }
+    else if (flow->fi_t_recv_lost && seq.psn == flow->fi_recv_lost_psn) {
+	psmi_faultinj_recovered(flow->fi_t_recv_lost);
+	flow->fi_t_recv_lost = 0;
+    }
+}
+
 /*
  * Only valid packets make it to this point.
  */
@@ -1412,8 +1563,38 @@ ips_proto_process_packet_inner(struct ips_recvhdrq_event *rcv_ev)
 
     if_pf (PSMI_FAULTINJ_ENABLED()) {
 	PSMI_FAULTINJ_STATIC_DECL(fi_recv, "recvlost", 1, IPS_FAULTINJ_RECVLOST);
-	if (psmi_faultinj_is_fault(fi_recv))
-	    return ret;
+	static int fi_in_dup = 0;
+
+	if (!fi_in_dup) {
+	    int fault = psmi_faultinj_event(fi_recv, 
+			ips_epaddr_faultinj_peer(ipsaddr), 
+			IPS_FLOWID_GET_INDEX(p_hdr->flowid));
+
+	    if (fault != PSMI_FAULTINJ_STALL && fault != PSMI_FAULTINJ_DELAY)
+		ips_proto_faultinj_recv(rcv_ev, fault == PSMI_FAULTINJ_DROP);
+	    switch (fault) {
+	    case PSMI_FAULTINJ_DROP:
+		return ret;
+	    case PSMI_FAULTINJ_STALL:
+	    case PSMI_FAULTINJ_DELAY:
+		/* Leave the packet in the header queue, it is revisited on
+		 * the next progress call */
+		return IPS_RECVHDRQ_OOO;
+	    case PSMI_FAULTINJ_DUP:
+		/* Only eager packets, go-back-n discards the second copy
+		 * by sequence number. */
+		if (rcv_ev->ptype == RCVHQ_RCV_TYPE_EAGER) {
+		    fi_in_dup = 1;
+		    ret = ips_proto_process_packet_inner(rcv_ev);
+		    fi_in_dup = 0;
+		    if (ret != IPS_RECVHDRQ_CONTINUE)
+			return ret;
+		}
+		break;
+	    default:
+		break;
+	    }
+	}
     }
 
     switch (rcv_ev->ptype) {
@@ -1454,7 +1635,7 @@ ips_proto_process_packet_inner(struct ips_recvhdrq_event *rcv_ev)
 		protocol = IPS_FLOWID_GET_PROTO(p_hdr->flowid);
 		flowid = IPS_FLOWID_GET_INDEX(p_hdr->flowid);
 		psmi_assert_always(protocol == PSM_PROTOCOL_GO_BACK_N);
-		flow = &ipsaddr->flows[flowid];
+		flow = ips_epaddr_flow(ipsaddr, flowid);
 		
 	        if ((flow->path->epr_ccti +
 		proto->cace[flow->path->epr_sl].ccti_increase) <=
@@ -127,6 +127,7 @@ ips_recvhdrq_init(const psmi_context_t *context,
 
     recvq->state->hdrq_head = 0;
     recvq->state->rcv_egr_index_head = NO_EAGER_UPDATE;
+    recvq->state->rcv_egr_index_held = NO_EAGER_UPDATE;
     recvq->state->num_hdrq_done = 0;
     recvq->state->hdr_countdown = 0;
     
@@ -143,14 +144,177 @@ ips_recvhdrq_init(const psmi_context_t *context,
             min(recvq->hdrq.elemcnt-1, recvq->egrq.elemcnt-1));
     }
 
+    {
+      union psmi_envvar_val env_batch;
+      psmi_getenv("PSM_RCVHDRQ_BATCH",
+                  "header queue entries decoded and prefetched ahead of dispatch (0 or 1 disables). Default is 8",
+                  PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+                  (union psmi_envvar_val) 8, &env_batch);
+
+      recvq->hdrq_batch = min(env_batch.e_uint, IPS_RECVHDRQ_BATCH_MAX);
+    }
+
 fail:
     return err;
 }
 
+static void
+_egr_loan_recall(struct ips_recvhdrq_loan *loan);
+
 psm_error_t
 ips_recvhdrq_fini(struct ips_recvhdrq *recvq)
 {
     ips_recvq_egrbuf_table_free(recvq->egrq_buftable);
+    if (recvq->egr_loan != NULL) {
+	/* Unexpected messages outlive the eager queue, copy them out */
+	_egr_loan_recall(recvq->egr_loan);
+	psmi_free(recvq->egr_loan);
+	recvq->egr_loan = NULL;
+    }
+    return PSM_OK;
+}
+
+/* Eager slots in use, counting the ones held back by loans */
+PSMI_ALWAYS_INLINE(
+uint32_t
+_egr_occupancy(const struct ips_recvhdrq *recvq, uint32_t head))
+{
+    const uint32_t egr_cnt = recvq->egrq.elemcnt;
+    return (ips_recvq_tail_get(&recvq->egrq) + egr_cnt - head) % egr_cnt;
+}
+
+/* Copy every lent payload out to a sysbuf and forget the loans */
+static
+void
+_egr_loan_recall(struct ips_recvhdrq_loan *loan)
+{
+    psm_mq_req_t req;
+    void *buf;
+
+    while ((req = STAILQ_FIRST(&loan->reqs)) != NULL) {
+	STAILQ_REMOVE_HEAD(&loan->reqs, nextq);
+	buf = psmi_mq_sysbuf_alloc(req->mq, req->send_msglen);
+	psmi_mq_mtucpy(buf, req->buf, req->send_msglen);
+	req->buf = buf;
+	req->type &= ~MQE_TYPE_EGRLENT;
+	loan->refcnt[req->egrid.egr_data] = 0;
+	loan->recvq->proto->stats.egr_loans_recalled++;
+    }
+    loan->nslots = 0;
+}
+
+static
+int __recvpath
+_egr_loan_hold(struct psmi_mq_lender *lender, psm_mq_req_t req,
+	       const void *payload)
+{
+    struct ips_recvhdrq_loan *loan = (struct ips_recvhdrq_loan *) lender;
+    struct ips_recvhdrq *recvq = loan->recvq;
+    uint32_t idx = loan->cur_index;
+    uintptr_t slot;
+
+    if (idx == NO_EAGER_UPDATE)
+	return 0;
+    /* Only payloads of the packet being dispatched */
+    slot = (uintptr_t) ips_recvq_egr_index_2_ptr(recvq->egrq_buftable, idx);
+    if ((uintptr_t) payload < slot ||
+	(uintptr_t) payload >= slot + recvq->egrq.elemsz)
+	return 0;
+    if (_egr_occupancy(recvq, ips_recvq_head_get(&recvq->egrq)) > 
+	loan->watermark)
+	return 0;
+
+    if (loan->refcnt[idx]++ == 0 && loan->nslots++ == 0)
+	loan->oldest = idx;
+    req->type |= MQE_TYPE_EGRLENT;
+    req->ptl_req_ptr = loan;
+    req->egrid.egr_data = idx;
+    STAILQ_INSERT_TAIL(&loan->reqs, req, nextq);
+    recvq->proto->stats.egr_loans++;
+    return 1;
+}
+
+static
+void __recvpath
+_egr_loan_release(psm_mq_req_t req)
+{
+    struct ips_recvhdrq_loan *loan = 
+	(struct ips_recvhdrq_loan *) req->ptl_req_ptr;
+    struct ips_recvhdrq *recvq = loan->recvq;
+    uint32_t idx = req->egrid.egr_data;
+    const uint32_t egr_cnt = recvq->egrq.elemcnt;
+    /* Without a progress lock the receive thread polls under the recvq lock,
+     * and psm_mq_irecv calls us holding neither (see ips_ptl_poll) */
+    const int do_lock = PSMI_PLOCK_DISABLED &&
+	(recvq->runtime_flags & PSMI_RUNTIME_RCVTHREAD);
+
+    if (do_lock)
+	ips_recvhdrq_lock(recvq);
+
+    /* Receives mostly match in arrival order, this is usually the head */
+    STAILQ_REMOVE(&loan->reqs, req, psm_mq_req, nextq);
+    if (--loan->refcnt[idx] > 0)
+	goto unlock;
+    if (--loan->nslots > 0) {
+	if (idx != loan->oldest)
+	    goto unlock;
+	while (loan->refcnt[loan->oldest] == 0)
+	    loan->oldest = (loan->oldest + 1) % egr_cnt;
+    }
+    /* The oldest slot is free, the next poll lets the eager head catch up.
+     * The hardware head is only written from the poll path. */
+    loan->head_retry = 1;
+
+unlock:
+    if (do_lock)
+	ips_recvhdrq_unlock(recvq);
+}
+
+/*
+ * callback_egr_lent for a hardware context lending its eager buffers to
+ * unexpected messages: the head can't pass the oldest lent slot, unless the
+ * queue is filling up in which case the loans are copied out.
+ */
+uint32_t
+ips_recvhdrq_loan_head(const struct ips_recvhdrq *recvq, uint32_t egr_head)
+{
+    struct ips_recvhdrq_loan *loan = recvq->egr_loan;
+
+    if (loan->nslots == 0)
+	return egr_head;
+    if (_egr_occupancy(recvq, loan->oldest) > loan->watermark) {
+	_egr_loan_recall(loan);
+	return egr_head;
+    }
+    return loan->oldest;
+}
+
+void
+ips_recvhdrq_loan_progress(struct ips_recvhdrq *recvq)
+{
+    recvq->egr_loan->head_retry = 0;
+    ips_recvhdrq_egr_head_retry(recvq);
+}
+
+psm_error_t
+ips_recvhdrq_loan_init(struct ips_recvhdrq *recvq, uint32_t watermark_pct)
+{
+    struct ips_recvhdrq_loan *loan;
+
+    loan = (struct ips_recvhdrq_loan *)
+	psmi_calloc(recvq->proto->ep, UNDEFINED, 1, sizeof(*loan) +
+		    recvq->egrq.elemcnt * sizeof(loan->refcnt[0]));
+    if (loan == NULL)
+	return psmi_handle_error(recvq->proto->ep, PSM_NO_MEMORY,
+		    "Couldn't allocate memory for eager buffer loans");
+
+    loan->lender.hold = _egr_loan_hold;
+    loan->lender.release = _egr_loan_release;
+    loan->recvq = recvq;
+    loan->cur_index = NO_EAGER_UPDATE;
+    loan->watermark = (recvq->egrq.elemcnt * min(watermark_pct, 100)) / 100;
+    STAILQ_INIT(&loan->reqs);
+    recvq->egr_loan = loan;
     return PSM_OK;
 }
 
@@ -389,6 +553,34 @@ do_pkt_cksum(struct ips_recvhdrq_event *rcv_ev)
   return 1;
 }
 
+/*
+ * Write the eager head, unless subcontexts still hold eager buffers lent to
+ * them by the zero-copy handoff.  In that case stop at the oldest lent buffer
+ * and remember the head we wanted so ips_recvhdrq_egr_head_retry can finish
+ * the update once the buffers are released.
+ */
+PSMI_ALWAYS_INLINE(
+void
+_update_egr_head(struct ips_recvhdrq *recvq, uint32_t egr_head))
+{
+    if_pf (recvq->recvq_callbacks.callback_egr_lent != NULL) {
+	uint32_t lent_head = 
+	    recvq->recvq_callbacks.callback_egr_lent(recvq, egr_head);
+	recvq->state->rcv_egr_index_held = 
+	    (lent_head == egr_head) ? NO_EAGER_UPDATE : egr_head;
+	egr_head = lent_head;
+    }
+    ips_recvq_head_update(&recvq->egrq, egr_head);
+}
+
+/* Called with the context lock held, after lent eager buffers are released */
+void
+ips_recvhdrq_egr_head_retry(struct ips_recvhdrq *recvq)
+{
+    if (recvq->state->rcv_egr_index_held != NO_EAGER_UPDATE)
+	_update_egr_head(recvq, recvq->state->rcv_egr_index_held);
+}
+
 PSMI_ALWAYS_INLINE(
 void
 process_pending_acks(struct ips_recvhdrq *recvq))
@@ -418,7 +610,140 @@ process_pending_acks(struct ips_recvhdrq *recvq))
   }
   
 }
-    
+
+/*
+ * One header queue entry as decoded by the first stage of a batch.  Only what
+ * the hardware wrote into the entry is kept, the dispatch stage still looks
+ * at state that earlier packets in the batch can change (lent buffers,
+ * eager loans, connections).
+ */
+struct ips_recvhdrq_decoded {
+    const uint32_t	      *rcv_hdr;
+    const __le32	      *rhf;
+    struct ips_message_header *p_hdr;
+    struct ips_epstate_entry  *epstaddr;    /* NULL if not for us or unknown */
+    psm_epid_t		       epid;
+    uint32_t		       error_flags;
+    uint32_t		       dest_subcontext;
+    uint16_t		       ptype;
+    uint8_t		       has_cksum;
+    uint8_t		       is_congested;
+};
+
+/*
+ * Batched receive, first stage.
+ *
+ * Decode up to 'max' ready entries starting at the current head into 'batch'
+ * and prefetch what the dispatch stage will touch: the header itself, the
+ * eager payload, the epstate entry and, in a second sweep once the epstate
+ * lines have arrived, the flow of the peer.  Nothing is consumed here, so the
+ * dispatch loop keeps its exact semantics for BREAK/OOO, subcontext routing
+ * and lazy head updates, entries left over when it stops are decoded again
+ * by the next call.  Returns the number of entries decoded.
+ */
+PSMI_ALWAYS_INLINE(
+uint32_t
+_decode_batch(struct ips_recvhdrq *recvq, const int has_no_rtail,
+	      const uint32_t hdrq_tail, const uint16_t lmc_mask,
+	      struct ips_recvhdrq_decoded *batch, const uint32_t max))
+{
+    const struct ips_recvhdrq_state *state = recvq->state;
+    const struct ips_proto *proto = recvq->proto;
+    uint32_t hdrq_head = state->hdrq_head;
+    uint32_t rhf_seq = state->hdrq_rhf_seq;
+    uint32_t i, num = 0;
+
+    while (num < max) {
+	struct ips_recvhdrq_decoded *d = &batch[num];
+	const uint32_t *rcv_hdr =
+	    (const uint32_t *) recvq->hdrq.base_addr + hdrq_head;
+	const __le32 *rhf = (const __le32 *) rcv_hdr + recvq->hdrq_rhf_off;
+	struct ips_message_header *p_hdr;
+
+	if (has_no_rtail ? (rhf_seq != _get_rhf_seq(recvq, rcv_hdr))
+			 : (hdrq_head == hdrq_tail))
+	    break;
+
+	p_hdr = recvq->hdrq_rhf_off ? _get_proto_hdr_from_rhf(rcv_hdr, rhf)
+				    : _get_proto_hdr(rcv_hdr);
+	__builtin_prefetch(p_hdr);
+
+	d->rcv_hdr = rcv_hdr;
+	d->rhf = rhf;
+	d->p_hdr = p_hdr;
+	d->error_flags = ipath_hdrget_err_flags(rhf);
+	d->ptype = ipath_hdrget_rcv_type(rhf);
+	d->epid = ips_epid_from_phdr(lmc_mask, p_hdr);
+	d->has_cksum = 
+	  ((proto->flags & IPS_PROTO_FLAG_CKSUM) &&
+	   (d->ptype == RCVHQ_RCV_TYPE_EAGER) &&
+	   (p_hdr->mqhdr != MQ_MSG_DATA_BLK) &&
+	   (p_hdr->mqhdr != MQ_MSG_DATA_REQ_BLK));
+
+	if_pt (proto->flags & IPS_PROTO_FLAG_CCA) {
+	  /* IBTA CCA handling:
+	   * If FECN bit set handle IBTA CCA protocol. For the flow that 
+	   * suffered congestion we flag it to generate a control packet with
+	   * the BECN bit set - This is currently an unsolicited ACK. 
+	   *
+	   * For all MQ packets the FECN processing/BECN generation is done
+	   * in the is_expected_or_nak function as each eager packet is
+	   * inspected there. 
+	   *
+	   * For TIDFLOW/Expected data transfers the FECN bit/BECN generation
+	   * is done in protoexp_data. Since header suppression can result
+	   * in even FECN packets being suppressed the expected protocol
+	   * generated addiional BECN packets if a "large" number of generations
+	   * are swapped without progress being made for receive. "Large" is
+	   * set empirically to 4.
+	   *
+	   * FECN packets are ignored for all control messages (except ACKs
+	   * and NAKs) since they indicate congestion on the control path which
+	   * is not rate controlled. The CCA specification allows FECN on
+	   * ACKs to be disregarded as well.
+	   */
+	  d->is_congested = 
+	    _is_cca_fecn_set(p_hdr) & IPS_RECV_EVENT_FECN;
+	  d->is_congested |= 
+	    (_is_cca_becn_set(p_hdr) << (IPS_RECV_EVENT_BECN - 1));
+	}
+	else
+	  d->is_congested = 0;
+
+	d->dest_subcontext = _get_proto_subcontext(p_hdr);
+	d->epstaddr = NULL;
+	if (!d->error_flags && d->dest_subcontext == recvq->subcontext) {
+	    d->epstaddr = ips_epstate_lookup(recvq->epstate, p_hdr->commidx +
+			    INFINIPATH_KPF_RESERVED_BITS(p_hdr->iph.pkt_flags));
+	    if (d->epstaddr != NULL)
+		__builtin_prefetch(d->epstaddr);
+	}
+
+	if (recvq->hdrq_rhf_off ? ipath_hdrget_use_egr_buf(rhf)
+	    : (d->ptype == RCVHQ_RCV_TYPE_EAGER))
+	    __builtin_prefetch(ips_recvq_egr_index_2_ptr(recvq->egrq_buftable,
+						ipath_hdrget_index(rhf)));
+
+	hdrq_head += recvq->hdrq.elemsz;
+	if (hdrq_head > recvq->hdrq_elemlast)
+	    hdrq_head = 0;
+	if (has_no_rtail && ++rhf_seq > LAST_RHF_SEQNO)
+	    rhf_seq = 1;
+	num++;
+    }
+
+    for (i = 0; i < num; i++) {
+	const struct ips_recvhdrq_decoded *d = &batch[i];
+	if (d->epstaddr != NULL && d->epstaddr->ipsaddr != NULL &&
+	    d->ptype == RCVHQ_RCV_TYPE_EAGER &&
+	    IPS_FLOWID2INDEX(d->p_hdr->flowid) < EP_FLOW_LAST)
+	    __builtin_prefetch(d->epstaddr->ipsaddr->
+				flows[IPS_FLOWID2INDEX(d->p_hdr->flowid)]);
+    }
+
+    return num;
+}
+
 /*
  * Core receive progress function
  *
@@ -429,6 +754,10 @@ process_pending_acks(struct ips_recvhdrq *recvq))
  * 'epstate' interface to classify packets from "known" and "unknown"
  * endpoints.  In order to support shared contexts, it can also handle packets
  * destined for other contexts (or "subcontexts").
+ *
+ * Entries are handled in batches of PSM_RCVHDRQ_BATCH (1 if it is 0): a
+ * first stage (_decode_batch) decodes the ready entries ahead and prefetches,
+ * and the loop below dispatches the decoded entries one at a time.
  */
 
 #if IPS_RCVHDRQ_THRU_FUNCTION_POINTER
@@ -444,13 +773,19 @@ ips_recvhdrq_progress(struct ips_recvhdrq *recvq)
     struct ips_recvhdrq_state *state = recvq->state;
     const __le32 *rhf;
     PSMI_CACHEALIGN struct ips_recvhdrq_event rcv_ev = { .proto = recvq->proto,
-							 .recvq = recvq };
+							 .recvq = recvq,
+				     .egrq_buftable = recvq->egrq_buftable };
+    struct ips_recvhdrq_lent *lent = recvq->egrq_lent;
+    int is_lent = 0;
+
+    struct ips_recvhdrq_decoded batch[IPS_RECVHDRQ_BATCH_MAX];
+    const struct ips_recvhdrq_decoded *d;
+    const uint32_t batch_max = max(recvq->hdrq_batch, 1);
+    uint32_t batch_idx = 0, batch_num = 0;
 
     uint32_t num_hdrq_done = 0;
     const int num_hdrq_todo = recvq->hdrq.elemcnt;
     const uint32_t hdrq_elemsz = recvq->hdrq.elemsz;
-    uint32_t dest_subcontext;
-
     int ret = IPS_RECVHDRQ_CONTINUE;
     int done = 0;
     int do_hdr_update = 0;
@@ -480,56 +815,55 @@ ips_recvhdrq_progress(struct ips_recvhdrq *recvq)
 
     while (!done)
     {
-      
-	rhf = (const __le32 *) rcv_hdr + recvq->hdrq_rhf_off;
-        rcv_ev.error_flags = ipath_hdrget_err_flags(rhf);
-        rcv_ev.ptype  = ipath_hdrget_rcv_type(rhf);
+	/* Decode the next batch once the previous one has been dispatched */
+	if (batch_idx == batch_num) {
+	    batch_num = _decode_batch(recvq, has_no_rtail, hdrq_tail, lmc_mask,
+				      batch, batch_max);
+	    batch_idx = 0;
+	    psmi_assert(batch_num > 0);
+	}
+	d = &batch[batch_idx++];
+	psmi_assert(d->rcv_hdr == rcv_hdr);
+
+	rhf = d->rhf;
+        rcv_ev.error_flags = d->error_flags;
+        rcv_ev.ptype  = d->ptype;
 	rcv_ev.rhf    = rhf;
 	rcv_ev.rcv_hdr= rcv_hdr;
-	rcv_ev.p_hdr  = recvq->hdrq_rhf_off ? _get_proto_hdr_from_rhf(rcv_hdr, rhf)
-				     : _get_proto_hdr(rcv_hdr); 
-	rcv_ev.epid   = ips_epid_from_phdr(lmc_mask, rcv_ev.p_hdr);
-	rcv_ev.has_cksum = 
-	  ((recvq->proto->flags & IPS_PROTO_FLAG_CKSUM) &&
-	   (rcv_ev.ptype == RCVHQ_RCV_TYPE_EAGER) &&
-	   (rcv_ev.p_hdr->mqhdr != MQ_MSG_DATA_BLK) &&
-	   (rcv_ev.p_hdr->mqhdr != MQ_MSG_DATA_REQ_BLK));
-	
-	if_pt (recvq->proto->flags & IPS_PROTO_FLAG_CCA) {
-	  /* IBTA CCA handling:
-	   * If FECN bit set handle IBTA CCA protocol. For the flow that 
-	   * suffered congestion we flag it to generate a control packet with
-	   * the BECN bit set - This is currently an unsolicited ACK. 
-	   *
-	   * For all MQ packets the FECN processing/BECN generation is done
-	   * in the is_expected_or_nak function as each eager packet is
-	   * inspected there. 
-	   *
-	   * For TIDFLOW/Expected data transfers the FECN bit/BECN generation
-	   * is done in protoexp_data. Since header suppression can result
-	   * in even FECN packets being suppressed the expected protocol
-	   * generated addiional BECN packets if a "large" number of generations
-	   * are swapped without progress being made for receive. "Large" is
-	   * set empirically to 4.
-	   *
-	   * FECN packets are ignored for all control messages (except ACKs
-	   * and NAKs) since they indicate congestion on the control path which
-	   * is not rate controlled. The CCA specification allows FECN on
-	   * ACKs to be disregarded as well.
-	   */
-	  rcv_ev.is_congested = 
-	  _is_cca_fecn_set(rcv_ev.p_hdr) & IPS_RECV_EVENT_FECN;
-	  rcv_ev.is_congested |= 
-	    (_is_cca_becn_set(rcv_ev.p_hdr) << (IPS_RECV_EVENT_BECN - 1));
+	rcv_ev.p_hdr  = d->p_hdr;
+	rcv_ev.epid   = d->epid;
+	rcv_ev.has_cksum = d->has_cksum;
+	rcv_ev.is_congested = d->is_congested;
+
+	/* Payload still sits in a hardware eager buffer lent to us */
+	if_pf (lent != NULL) {
+	    is_lent = (lent->lent_head != lent->lent_tail &&
+		       lent->lent[lent->lent_head & (IPS_RECVHDRQ_LENT_MAX-1)].
+			 hdrq_off == state->hdrq_head);
+	    rcv_ev.egrq_buftable = is_lent ? recvq->egrq_lent_buftable
+					   : recvq->egrq_buftable;
 	}
-	else
-	  rcv_ev.is_congested = 0;
 
-	dest_subcontext  = _get_proto_subcontext(rcv_ev.p_hdr);
+	/* Unexpected short messages may keep their payload in this slot */
+	if_pf (recvq->egr_loan != NULL &&
+	       rcv_ev.ptype == RCVHQ_RCV_TYPE_EAGER && !is_lent &&
+	       (!has_optional_eagerbuf || ipath_hdrget_use_egr_buf(rhf))) {
+	    recvq->egr_loan->cur_index = ipath_hdrget_index(rhf);
+	    recvq->proto->mq->egrlent = &recvq->egr_loan->lender;
+	}
 
 	if_pf (_check_headers(&rcv_ev))
 	  goto skip_packet;
 
+	/* Expected payloads are already placed, keep only eager ones */
+	if_pf (PSMI_CAPTURE_ENABLED())
+	  psmi_capture_packet(recvq->proto->ep, PSMI_CAPTURE_RX,
+			      PSMI_CAPTURE_RECV, rcv_ev.p_hdr,
+			      sizeof(struct ips_message_header),
+			      rcv_ev.ptype == RCVHQ_RCV_TYPE_EAGER ?
+				ips_recvhdrq_event_payload(&rcv_ev) : NULL,
+			      ips_recvhdrq_event_paylen(&rcv_ev));
+
         if_pf (rcv_ev.error_flags || 
 	       (_get_proto_ipath_opcode(rcv_ev.p_hdr) != IPATH_OPCODE_USER1)) 
 	{
@@ -541,7 +875,7 @@ ips_recvhdrq_progress(struct ips_recvhdrq *recvq)
 	      (rcv_ev.error_flags & INFINIPATH_RHF_H_TFGENERR)) {
 		/* Subcontexts need to see expected tid errors */
 		if (rcv_ev.ptype == RCVHQ_RCV_TYPE_EXPECTED &&
-		    dest_subcontext != recvq->subcontext)
+		    d->dest_subcontext != recvq->subcontext)
 			goto subcontext_packet;
 
 		recvq->recvq_callbacks.callback_error(&rcv_ev);
@@ -577,21 +911,31 @@ ips_recvhdrq_progress(struct ips_recvhdrq *recvq)
 	if_pf (rcv_ev.has_cksum && !do_pkt_cksum(&rcv_ev))
 	  goto skip_packet;
 	
-	if (dest_subcontext == recvq->subcontext) {
+	if (d->dest_subcontext == recvq->subcontext) {
 	    /* Classify packet from a known or unknown endpoint */
-	    struct ips_epstate_entry *epstaddr;
+	    struct ips_epstate_entry *epstaddr = d->epstaddr;
 
-      epstaddr =
-        ips_epstate_lookup(recvq->epstate, rcv_ev.p_hdr->commidx +
-            INFINIPATH_KPF_RESERVED_BITS(rcv_ev.p_hdr->iph.pkt_flags));
+	    /* The peer may have connected since the batch was decoded */
+	    if_pf (epstaddr == NULL || epstaddr->epid != rcv_ev.epid)
+		epstaddr = ips_epstate_lookup(recvq->epstate,
+		    rcv_ev.p_hdr->commidx +
+		    INFINIPATH_KPF_RESERVED_BITS(rcv_ev.p_hdr->iph.pkt_flags));
 	    if_pf (epstaddr == NULL || epstaddr->epid != rcv_ev.epid) {
 	        rcv_ev.ipsaddr = NULL;
 		recvq->recvq_callbacks.callback_packet_unknown(&rcv_ev);
 	    }
 	    else {   
 	        rcv_ev.ipsaddr = epstaddr->ipsaddr;
-		ret = ips_proto_process_packet(&rcv_ev);
-		if (ret == IPS_RECVHDRQ_OOO) return PSM_OK_NO_PROGRESS;
+		/* Header prediction first, the full path if it misses */
+		if_pf (!(recvq->proto->flags & IPS_PROTO_FLAG_HDR_PREDICT) ||
+		       PSMI_FAULTINJ_ENABLED() ||
+		       (ret = ips_proto_hp_process(&rcv_ev)) < 0)
+		    ret = ips_proto_process_packet(&rcv_ev);
+		if (ret == IPS_RECVHDRQ_OOO) {
+		    if_pf (recvq->egr_loan != NULL)
+			recvq->proto->mq->egrlent = NULL;
+		    return PSM_OK_NO_PROGRESS;
+		}
 	    }
 	}
 	else {
@@ -601,7 +945,7 @@ subcontext_packet:
 	    rcv_ev.ipsaddr = NULL;
 
 	    ret = recvq->recvq_callbacks.callback_subcontext(&rcv_ev,
-							     dest_subcontext);
+							     d->dest_subcontext);
 	}
 
 skip_packet:
@@ -611,15 +955,27 @@ skip_packet:
 	 * 2. Packet actually consumed an eagerbuf (post QLE72XX)
 	 * 3. Packet was *not* an eager header with RHF_H_TIDERR to mark
 	 *    an eager overflow
+	 * 4. Packet was not using an eager buffer lent by the hardware context
 	 */
-	if (has_optional_eagerbuf ? ipath_hdrget_use_egr_buf(rhf)
-			          : (rcv_ev.ptype == RCVHQ_RCV_TYPE_EAGER)) {
+	if (!is_lent && 
+	    (has_optional_eagerbuf ? ipath_hdrget_use_egr_buf(rhf)
+			           : (rcv_ev.ptype == RCVHQ_RCV_TYPE_EAGER))) {
 	    state->rcv_egr_index_head = ipath_hdrget_index(rhf);
 	    /* a header entry is using an eager entry, stop tracing. */
 	    state->hdr_countdown = 0;
 	}
 
 skip_packet_no_egr_update:
+	if_pf (recvq->egr_loan != NULL)
+	    recvq->proto->mq->egrlent = NULL;
+
+	/* Done with the payload, give the lent buffer back */
+	if_pf (is_lent) {
+	    ips_mb();
+	    lent->lent_head++;
+	    is_lent = 0;
+	}
+
         /* Note that state->hdrq_head is sampled speculatively by the code
          * in ips_ptl_shared_poll() when context sharing, so it is not safe
          * for this shared variable to temporarily exceed the last element. */
@@ -645,7 +1001,7 @@ skip_packet_no_egr_update:
 
 	    /* Lazy update of egrq */
 	    if (state->rcv_egr_index_head != NO_EAGER_UPDATE) {
-	      ips_recvq_head_update(&recvq->egrq, state->rcv_egr_index_head);
+	      _update_egr_head(recvq, state->rcv_egr_index_head);
 	      state->rcv_egr_index_head = NO_EAGER_UPDATE;
 	    }
 
@@ -667,7 +1023,7 @@ skip_packet_no_egr_update:
 
 		/* Checks eager-full again. This is a real false-egr-full */
 		if (head == ((tail+1)%egr_cnt)) {
-		    ips_recvq_head_update(&recvq->egrq, tail);
+		    _update_egr_head(recvq, tail);
 		    _IPATH_DBG("eager array full after overflow, flushing "
 				"(head %llx, tail %llx)\n",
 				(long long)head, (long long)tail);
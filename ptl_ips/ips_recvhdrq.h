@@ -37,6 +37,7 @@
 #include "ips_proto_header.h"
 #include "ips_proto_params.h"
 #include "ips_recvq.h"
+#include "psm_mq_internal.h"
 
 #ifndef _IPS_RECVHDRQ_H
 #define _IPS_RECVHDRQ_H
@@ -49,6 +50,8 @@ struct ips_epstate;
 #define IPS_RECVHDRQ_BREAK      1
 #define IPS_RECVHDRQ_OOO	2   /* out of order */
 #define IPS_RECVHDRQ_ELEMSZ_MAX 32  /* 128 bytes */
+#define IPS_RECVHDRQ_BATCH_MAX  16  /* max entries decoded ahead */
+#define IPS_RECVHDRQ_LENT_MAX   128 /* power of two */
 #define LAST_RHF_SEQNO 13
 
 /* CCA related receive events */
@@ -60,6 +63,7 @@ struct ips_recvhdrq_event {
     const struct ips_recvhdrq *recvq;	    /* where message received */
     const uint32_t	      *rcv_hdr;	    /* rcv_hdr ptr */
     const __le32              *rhf;	    /* receive header flags */
+    void		     **egrq_buftable; /* eager idx-to-ptr for payload */
     struct ips_message_header *p_hdr;	    /* protocol header in rcv_hdr */
     struct ptl_epaddr	      *ipsaddr;	    /* peer ipsaddr, if available */
     psm_epid_t                 epid;        /* peer epid */
@@ -73,6 +77,7 @@ struct ips_recvhdrq_callbacks {
     int (*callback_packet_unknown)(const struct ips_recvhdrq_event *);
     int (*callback_subcontext)(const struct ips_recvhdrq_event *, uint32_t subcontext);
     int (*callback_error)(struct ips_recvhdrq_event *);
+    uint32_t (*callback_egr_lent)(const struct ips_recvhdrq *, uint32_t egr_head);
 };
 
 psm_error_t 
@@ -93,6 +98,64 @@ ips_recvhdrq_progress(struct ips_recvhdrq *recvq);
 psm_error_t
 ips_recvhdrq_fini(struct ips_recvhdrq *recvq);
 
+void
+ips_recvhdrq_egr_head_retry(struct ips_recvhdrq *recvq);
+
+/*
+ * Eager buffers of a shared hardware context lent to a subcontext.
+ *
+ * With zero-copy subcontext handoff, the process that drains the hardware
+ * context only copies the header into the subcontext's header queue and the
+ * subcontext reads the payload straight out of the hardware eager buffer.
+ * Each lent buffer is recorded here (single producer under the context lock,
+ * single consumer being the subcontext) and the hardware eager head is not
+ * advanced past the oldest lent buffer until the subcontext releases it.
+ * This lives in the subcontext's shared ureg page.
+ */
+struct ips_recvhdrq_lent {
+    volatile uint32_t lent_head;	/* advanced by the subcontext */
+    volatile uint32_t lent_tail;	/* advanced by the context lock holder */
+    struct {
+	uint32_t hdrq_off;		/* subcontext hdrq entry using the buffer */
+	uint32_t egr_index;		/* hardware eager index */
+    } lent[IPS_RECVHDRQ_LENT_MAX];
+};
+
+/*
+ * Eager buffers of our own hardware context lent to unexpected MQ messages.
+ *
+ * An unexpected short message is normally copied out of its eager buffer
+ * into an MQ sysbuf so the eager head can move on, and copied again when a
+ * receive matches it.  While the eager queue is mostly empty we instead keep
+ * the payload where it is: each lent slot is refcounted (packed envelopes
+ * share a slot) and the eager head is not advanced past the oldest lent
+ * slot.  Once occupancy crosses the watermark all loans are copied out to
+ * sysbufs and the head catches up.  Receives give loans back outside the
+ * receive path, so they only mark the slot free and the head is moved by the
+ * next ips_recvhdrq_loan_progress().  Not used with shared contexts.
+ */
+struct ips_recvhdrq_loan {
+    struct psmi_mq_lender lender; /* first, req->ptl_req_ptr points here */
+    struct ips_recvhdrq *recvq;
+    uint32_t	cur_index;	/* slot being dispatched, or NO_EAGER_UPDATE */
+    uint32_t	watermark;	/* occupancy, in slots, above which we copy */
+    uint32_t	nslots;		/* slots with a non-zero refcount */
+    uint32_t	oldest;		/* oldest of those, valid if nslots > 0 */
+    int		head_retry;	/* oldest slot freed, eager head may move */
+    STAILQ_HEAD(, psm_mq_req) reqs; /* lent requests, oldest first */
+    uint16_t	refcnt[0];	/* per eager slot */
+};
+
+psm_error_t
+ips_recvhdrq_loan_init(struct ips_recvhdrq *recvq, uint32_t watermark_pct);
+
+uint32_t
+ips_recvhdrq_loan_head(const struct ips_recvhdrq *recvq, uint32_t egr_head);
+
+/* Called with the context lock held */
+void
+ips_recvhdrq_loan_progress(struct ips_recvhdrq *recvq);
+
 /*
  * Structure containing state for recvhdrq reading. This is logically
  * part of ips_recvhdrq but needs to be separated out for context
@@ -110,6 +173,7 @@ struct ips_recvhdrq_state
   uint32_t head_update_interval;        /* Header update interval */
   uint32_t num_hdrq_done;               /* Num header queue done */
   uint32_t hdr_countdown;		/* for false-egr-full tracing */
+  uint32_t rcv_egr_index_held;          /* eager head held back by lent bufs */
 };
 
 /*
@@ -132,12 +196,20 @@ struct ips_recvhdrq
     uint32_t		     hdrq_rhf_off;  /* QLE73XX/QLE72XX rhf offset */
     int			     hdrq_rhf_notail; /* rhf notail enabled */
     uint32_t		     hdrq_elemlast; /* last element precomputed */
+    uint32_t		     hdrq_batch;    /* entries decoded per batch */
     struct ips_recvq_params  hdrq;
 
     /* Eager queue handling */
     void		  **egrq_buftable;  /* table of eager idx-to-ptr */
     struct ips_recvq_params egrq;
 
+    /* Eager buffers lent by the hardware context (subcontexts only) */
+    struct ips_recvhdrq_lent *egrq_lent;
+    void		  **egrq_lent_buftable;
+
+    /* Eager buffers lent to unexpected messages (hardware context only) */
+    struct ips_recvhdrq_loan *egr_loan;
+
     /* Lookup endpoints epid -> ptladdr (rank)) */
     const struct ips_epstate	*epstate;
 
@@ -167,7 +239,7 @@ PSMI_INLINE(
 void *ips_recvhdrq_event_payload(const struct ips_recvhdrq_event *rcv_ev))
 {
     /* XXX return NULL if no eager buffer allocated */
-    return ips_recvq_egr_index_2_ptr(rcv_ev->recvq->egrq_buftable,
+    return ips_recvq_egr_index_2_ptr(rcv_ev->egrq_buftable,
 				     ipath_hdrget_index(rcv_ev->rhf));
 }
 
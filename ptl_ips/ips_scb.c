@@ -36,6 +36,156 @@
 #include "ips_proto.h"
 #include "ips_scb.h"
 
+/* An entirely free grown chunk is released only if it stayed free that long
+ * since the last time the pool had to grow */
+#define IPS_SCBCTRL_SHRINK_DELAY_MS	1000
+
+/* Allocate a chunk of numscb scbs (and their immediate buffers) and put them
+ * on the free list */
+static
+psm_error_t
+ips_scbctrl_chunk_alloc(struct ips_scbctrl *scbc, uint32_t numscb)
+{
+    struct ips_scbchunk *chunk = &scbc->scb_chunk[scbc->scb_chunk_cnt];
+    struct ips_scb *scb;
+    size_t scb_size;
+    size_t alloc_sz;
+    uintptr_t base, imm_base;
+    int i;
+
+    psmi_assert_always(scbc->scb_chunk_cnt < IPS_SCBCTRL_CHUNKS_MAX);
+
+    imm_base = 0;
+    if (scbc->scb_imm_size) {
+      alloc_sz = numscb * scbc->scb_imm_size + 64;
+      chunk->scb_imm_buf = 
+	psmi_calloc(scbc->ep, NETWORK_BUFFERS, 1, alloc_sz);
+      if (chunk->scb_imm_buf == NULL)
+	return PSM_NO_MEMORY;
+      imm_base = PSMI_ALIGNUP(chunk->scb_imm_buf, 64);
+    }
+    else
+      chunk->scb_imm_buf = NULL;
+    
+    scb_size = sizeof(struct ips_scb) + 2*PSM_VALGRIND_REDZONE_SZ;
+    scb_size = PSMI_ALIGNUP(scb_size, 64);
+    alloc_sz = numscb * scb_size + PSM_VALGRIND_REDZONE_SZ + 64;
+    chunk->scb_base = (void *)
+	psmi_calloc(scbc->ep, NETWORK_BUFFERS, 1, alloc_sz);
+    if (chunk->scb_base == NULL) {
+	if (chunk->scb_imm_buf)
+	    psmi_free(chunk->scb_imm_buf);
+	chunk->scb_imm_buf = NULL;
+	return PSM_NO_MEMORY;
+    }
+    base = (uintptr_t)chunk->scb_base;
+    base = PSMI_ALIGNUP(base + PSM_VALGRIND_REDZONE_SZ, 64);
+    for (i = 0; i < numscb; i++) {
+	scb = (struct ips_scb *)(base + i * scb_size);
+	scb->scbc = scbc;
+	scb->chunk = scbc->scb_chunk_cnt;
+	if (chunk->scb_imm_buf)
+	  scb->imm_payload = (void*)(imm_base + (i * scbc->scb_imm_size));
+	else
+	  scb->imm_payload = NULL;
+	
+	SLIST_INSERT_HEAD(&scbc->scb_free, scb, next);
+    }
+
+    chunk->num = chunk->num_free = numscb;
+    scbc->scb_chunk_cnt++;
+    scbc->scb_num += numscb;
+    scbc->scb_num_cur += numscb;
+    if (scbc->scb_num > scbc->stats.num_hiwat)
+	scbc->stats.num_hiwat = scbc->scb_num;
+    return PSM_OK;
+}
+
+static
+void
+ips_scbctrl_chunk_free(struct ips_scbctrl *scbc, struct ips_scbchunk *chunk)
+{
+    if (chunk->scb_base != NULL)
+	psmi_free(chunk->scb_base);
+    if (chunk->scb_imm_buf != NULL)
+	psmi_free(chunk->scb_imm_buf);
+    chunk->scb_base = chunk->scb_imm_buf = NULL;
+    chunk->num = chunk->num_free = 0;
+}
+
+/* Called when the free list is empty */
+static
+int
+ips_scbctrl_grow(struct ips_scbctrl *scbc)
+{
+    uint32_t num = min(scbc->scb_chunk_num, scbc->scb_num_max - scbc->scb_num);
+
+    if (num == 0 || scbc->scb_chunk_cnt == IPS_SCBCTRL_CHUNKS_MAX ||
+	ips_scbctrl_chunk_alloc(scbc, num) != PSM_OK) {
+	scbc->stats.exhausted++;
+	return 0;
+    }
+
+    scbc->stats.grow++;
+    scbc->scb_shrink_tnext = get_cycles() + 
+	nanosecs_to_cycles(IPS_SCBCTRL_SHRINK_DELAY_MS * 1000000ULL);
+    _IPATH_VDBG("grew scb pool by %d to %d scbs\n", num, scbc->scb_num);
+    return 1;
+}
+
+/* Called when the last grown chunk became entirely free, release it along
+ * with any other entirely free chunk it uncovers */
+static
+void
+ips_scbctrl_shrink(struct ips_scbctrl *scbc, uint64_t current)
+{
+    struct ips_scbchunk *chunk;
+    ips_scb_t **pscb;
+    uint32_t c;
+
+    /* Don't shrink right after growing, come back once the delay is over */
+    if (current < scbc->scb_shrink_tnext) {
+	if (scbc->scb_timerq != NULL)
+	    psmi_timer_request(scbc->scb_timerq, &scbc->scb_shrink_timer,
+			       scbc->scb_shrink_tnext);
+	return;
+    }
+
+    for (c = scbc->scb_chunk_cnt - 1; c > 0; c--) {
+	chunk = &scbc->scb_chunk[c];
+	/* Keep at least a chunk of slack */
+	if (chunk->num_free != chunk->num ||
+	    scbc->scb_num_cur - chunk->num < scbc->scb_chunk_num)
+	    break;
+
+	pscb = &SLIST_FIRST(&scbc->scb_free);
+	while (*pscb != NULL) {
+	    if ((*pscb)->chunk == c)
+		*pscb = SLIST_NEXT(*pscb, next);
+	    else
+		pscb = &SLIST_NEXT(*pscb, next);
+	}
+
+	scbc->scb_num -= chunk->num;
+	scbc->scb_num_cur -= chunk->num;
+	scbc->scb_chunk_cnt--;
+	ips_scbctrl_chunk_free(scbc, chunk);
+	scbc->stats.shrink++;
+	_IPATH_VDBG("shrunk scb pool to %d scbs\n", scbc->scb_num);
+    }
+}
+
+static
+psm_error_t
+ips_scbctrl_shrink_timer_callback(struct psmi_timer *timer, uint64_t current)
+{
+    struct ips_scbctrl *scbc = (struct ips_scbctrl *) timer->context;
+
+    if (scbc->scb_chunk_cnt > 1)
+	ips_scbctrl_shrink(scbc, current);
+    return PSM_OK;
+}
+
 psm_error_t 
 ips_scbctrl_init(const psmi_context_t *context,
 		 uint32_t numscb, uint32_t numbufs,
@@ -45,15 +195,14 @@ ips_scbctrl_init(const psmi_context_t *context,
 		 struct ips_scbctrl *scbc)
 {
     int i;
-    struct ips_scb *scb;
-    size_t scb_size;
     size_t alloc_sz;
-    uintptr_t base, imm_base;
+    uintptr_t base;
     psm_ep_t ep = context->ep;
-    //scbc->context = context;
     psm_error_t err = PSM_OK;
 
     psmi_assert_always(numscb > 0);
+    memset(&scbc->stats, 0, sizeof(scbc->stats));
+    scbc->ep = ep;
     scbc->sbuf_num = scbc->sbuf_num_cur = numbufs;
     SLIST_INIT(&scbc->sbuf_free);
     scbc->sbuf_buf_size  = bufsize;
@@ -106,45 +255,22 @@ ips_scbctrl_init(const psmi_context_t *context,
 			      PSM_VALGRIND_MEM_DEFINED);
     }
     
-    imm_base = 0;
-    scbc->scb_imm_size = imm_size;
-    if (scbc->scb_imm_size) {
-      scbc->scb_imm_size = PSMI_ALIGNUP(imm_size, 64);
-      alloc_sz = numscb * scbc->scb_imm_size + 64;
-      scbc->scb_imm_buf = 
-	psmi_calloc(ep, NETWORK_BUFFERS, 1, alloc_sz);
-      if (scbc->scb_imm_buf == NULL) {
-	err = PSM_NO_MEMORY;
-	goto fail;
-      }
-      imm_base = PSMI_ALIGNUP(scbc->scb_imm_buf, 64);
-    }
-    else
-      scbc->scb_imm_buf = NULL;
-    
-    scbc->scb_num = scbc->scb_num_cur = numscb;
+    scbc->scb_imm_size = PSMI_ALIGNUP(imm_size, 64);
+
+    /* Fixed-size pool until ips_scbctrl_elastic says otherwise */
+    scbc->scb_num = scbc->scb_num_cur = 0;
+    scbc->scb_num_max = scbc->scb_chunk_num = numscb;
+    scbc->scb_chunk_cnt = 0;
+    scbc->scb_shrink_tnext = 0;
+    scbc->scb_flow_share = 0;
+    scbc->scb_flows_active = 0;
+    scbc->scb_timerq = NULL;
+    psmi_timer_entry_init(&scbc->scb_shrink_timer,
+			  ips_scbctrl_shrink_timer_callback, scbc);
     SLIST_INIT(&scbc->scb_free);
-    scb_size = sizeof(struct ips_scb) + 2*PSM_VALGRIND_REDZONE_SZ;
-    scb_size = PSMI_ALIGNUP(scb_size, 64);
-    alloc_sz = numscb * scb_size + PSM_VALGRIND_REDZONE_SZ + 64;
-    scbc->scb_base = (void *)
-	psmi_calloc(ep, NETWORK_BUFFERS, 1, alloc_sz);
-    if (scbc->scb_base == NULL) {
-	err = PSM_NO_MEMORY;
+    if ((err = ips_scbctrl_chunk_alloc(scbc, numscb)))
 	goto fail;
-    }
-    base = (uintptr_t)scbc->scb_base;
-    base = PSMI_ALIGNUP(base + PSM_VALGRIND_REDZONE_SZ, 64);
-    for (i = 0; i < numscb; i++) {
-	scb = (struct ips_scb *)(base + i * scb_size);
-	scb->scbc = scbc;
-	if (scbc->scb_imm_buf)
-	  scb->imm_payload = (void*)(imm_base + (i * scbc->scb_imm_size));
-	else
-	  scb->imm_payload = NULL;
-	
-	SLIST_INSERT_HEAD(&scbc->scb_free, scb, next);
-    }
+
     scbc->scb_avail_callback = scb_avail_callback;
     scbc->scb_avail_context  = scb_avail_context;
 
@@ -161,8 +287,15 @@ fail:
 psm_error_t
 ips_scbctrl_fini(struct ips_scbctrl *scbc)
 {
-    if (scbc->scb_base != NULL) {
-	psmi_free(scbc->scb_base);
+    int i;
+
+    if (scbc->scb_timerq != NULL)
+	psmi_timer_cancel(scbc->scb_timerq, &scbc->scb_shrink_timer);
+
+    if (scbc->scb_chunk_cnt > 0) {
+	for (i = 0; i < scbc->scb_chunk_cnt; i++)
+	    ips_scbctrl_chunk_free(scbc, &scbc->scb_chunk[i]);
+	scbc->scb_chunk_cnt = 0;
 	VALGRIND_DESTROY_MEMPOOL(scbc);
     }
     if (scbc->sbuf_buf_alloc) {
@@ -172,6 +305,23 @@ ips_scbctrl_fini(struct ips_scbctrl *scbc)
     return PSM_OK;
 }
 
+/*
+ * Let the pool grow up to numscb_max scbs, in chunks the size of the initial
+ * allocation, and reserve flow_share scbs per active flow once the pool is
+ * under pressure (0 disables the reservation).  Shrinks that come too soon
+ * after a grow are retried from timerq.
+ */
+void
+ips_scbctrl_elastic(struct ips_scbctrl *scbc, uint32_t numscb_max,
+		    uint32_t flow_share, struct psmi_timer_ctrl *timerq)
+{
+    uint32_t chunk_max = scbc->scb_chunk_num * IPS_SCBCTRL_CHUNKS_MAX;
+
+    scbc->scb_num_max = max(scbc->scb_num, min(numscb_max, chunk_max));
+    scbc->scb_flow_share = flow_share;
+    scbc->scb_timerq = timerq;
+}
+
 int
 ips_scbctrl_bufalloc(ips_scb_t *scb)
 {
@@ -204,7 +354,8 @@ ips_scbctrl_bufalloc(ips_scb_t *scb)
 int
 ips_scbctrl_avail(struct ips_scbctrl *scbc)
 {
-    return (!SLIST_EMPTY(&scbc->scb_free) && scbc->sbuf_num_cur > 0);
+    return ((!SLIST_EMPTY(&scbc->scb_free) || 
+	     scbc->scb_num < scbc->scb_num_max) && scbc->sbuf_num_cur > 0);
 }
 
 ips_scb_t *
@@ -215,7 +366,7 @@ ips_scbctrl_alloc(struct ips_scbctrl *scbc, int scbnum, int len, uint32_t flags)
     psmi_assert(flags & IPS_SCB_FLAG_ADD_BUFFER ? (scbc->sbuf_num>0) : 1);
 
     while (scbnum--) {
-	if (SLIST_EMPTY(&scbc->scb_free))
+	if (SLIST_EMPTY(&scbc->scb_free) && !ips_scbctrl_grow(scbc))
 	    break;
 	scb = SLIST_FIRST(&scbc->scb_free);
 	scb->flags = 0; /* Need to set this here as bufalloc may request
@@ -243,11 +394,13 @@ ips_scbctrl_alloc(struct ips_scbctrl *scbc, int scbnum, int len, uint32_t flags)
 	scb->tidsendc = NULL;
 	scb->callback = NULL;
         scb->ips_lrh.mqhdr = 0;
+        scb->ips_lrh.mqid = 0;
         scb->offset = 0;
         scb->nfrag = 1;
 	scb->frag_size = 0;
 	
 	scbc->scb_num_cur--;
+	scbc->scb_chunk[scb->chunk].num_free--;
 	if (scbc->scb_num_cur < (scbc->scb_num >> 1))
 	  scb->flags |= IPS_SEND_FLAG_ACK_REQ;
 	
@@ -262,6 +415,7 @@ void
 ips_scbctrl_free(ips_scb_t *scb)
 {
     struct ips_scbctrl *scbc = scb->scbc;
+    struct ips_scbchunk *chunk = &scbc->scb_chunk[scb->chunk];
     if (scbc->sbuf_num && (scb->payload >= scbc->sbuf_buf_base) &&
 	(scb->payload <= scbc->sbuf_buf_last)) {
         scbc->sbuf_num_cur++;
@@ -282,6 +436,11 @@ ips_scbctrl_free(ips_scb_t *scb)
 	SLIST_INSERT_HEAD(&scbc->scb_free, scb, next);
 
     VALGRIND_MEMPOOL_FREE(scbc, scb);
+
+    /* Only the last grown chunk is ever released */
+    if (++chunk->num_free == chunk->num && chunk != &scbc->scb_chunk[0] &&
+	chunk == &scbc->scb_chunk[scbc->scb_chunk_cnt - 1])
+	ips_scbctrl_shrink(scbc, get_cycles());
     return;
 }
 
@@ -289,7 +448,7 @@ ips_scb_t *
 ips_scbctrl_alloc_tiny(struct ips_scbctrl *scbc)
 {
     ips_scb_t	*scb;
-    if (SLIST_EMPTY(&scbc->scb_free))
+    if (SLIST_EMPTY(&scbc->scb_free) && !ips_scbctrl_grow(scbc))
 	return NULL;
     scb = SLIST_FIRST(&scbc->scb_free);
     
@@ -303,10 +462,12 @@ ips_scbctrl_alloc_tiny(struct ips_scbctrl *scbc)
     scb->tid = IPATH_EAGER_TID_ID;
     scb->tidsendc = NULL;
     scb->callback = NULL;
+    scb->ips_lrh.mqid = 0;
     scb->nfrag = 1;
     scb->frag_size = 0;
     
     scbc->scb_num_cur--;
+    scbc->scb_chunk[scb->chunk].num_free--;
     if (scbc->scb_num_cur < (scbc->scb_num >> 1))
       scb->flags |= IPS_SEND_FLAG_ACK_REQ;
     return scb;
@@ -42,8 +42,13 @@
 #define IPS_SCB_FLAG_NONE	0x0
 #define IPS_SCB_FLAG_ADD_BUFFER 0x1
 
+/* Max number of scb chunks a controller can grow to, chunk 0 is the initial
+ * allocation and is never released */
+#define IPS_SCBCTRL_CHUNKS_MAX	16
+
 /* macros to update scb */
 #define ips_scb_mqhdr(scb)     scb->ips_lrh.mqhdr
+#define ips_scb_mqid(scb)      scb->ips_lrh.mqid
 #define ips_scb_mqtag(scb)     scb->ips_lrh.data[0].u64w0
 #define ips_scb_mqparam(scb)   scb->ips_lrh.data[1]
 #define ips_scb_uwords(scb)    scb->ips_lrh.data
@@ -68,20 +73,55 @@ typedef void (*ips_scbctrl_avail_callback_fn_t)(struct ips_scbctrl *,
 STAILQ_HEAD(ips_scb_stailq, ips_scb);
 SLIST_HEAD(ips_scb_slist, ips_scb);
 
+struct ips_scbchunk {
+    void	*scb_base;
+    void	*scb_imm_buf;
+    uint32_t	 num;
+    uint32_t	 num_free;
+};
+
 struct ips_scbctrl {
-    //const psmi_context_t *context;
+    psm_ep_t			     ep;
 
     /* Send control blocks for each send */
-    uint32_t			     scb_num;
-    uint32_t                         scb_num_cur;
+    uint32_t			     scb_num;	    /* current pool size */
+    uint32_t                         scb_num_cur;   /* free scbs */
     SLIST_HEAD(scb_free, ips_scb)    scb_free;
-    void			    *scb_base;
     ips_scbctrl_avail_callback_fn_t  scb_avail_callback;
     void			    *scb_avail_context;
 
+    /*
+     * Elastic pool: grows by scb_chunk_num up to scb_num_max when the free
+     * list runs dry, and gives back the last chunk once it has been
+     * entirely free for a while.
+     */
+    uint32_t			     scb_num_max;
+    uint32_t			     scb_chunk_num;
+    uint32_t			     scb_chunk_cnt;
+    uint64_t			     scb_shrink_tnext;
+    struct ips_scbchunk		     scb_chunk[IPS_SCBCTRL_CHUNKS_MAX];
+    /* Retries a shrink that was held back by the delay after a grow */
+    struct psmi_timer_ctrl	    *scb_timerq;
+    struct psmi_timer		     scb_shrink_timer;
+
+    /*
+     * Per-flow fairness: under pressure, the last scb_flow_share scbs for
+     * each active flow are kept for flows holding less than their share.
+     */
+    uint32_t			     scb_flow_share;
+    uint32_t			     scb_flows_active;
+
     /* Immediate data for send buffers */		    
     uint32_t                         scb_imm_size;
-    void                            *scb_imm_buf;
+
+    struct {
+	uint64_t		     exhausted;	 /* alloc failed at the cap */
+	uint64_t		     deferred;	 /* flow held back for fairness */
+	uint64_t		     grow;
+	uint64_t		     shrink;
+	uint64_t		     num_hiwat;	 /* largest pool size */
+	uint64_t		     flow_hiwat; /* most scbs held by one flow */
+    } stats;
 
     /*
      * Send buffers (or bounce buffers) to keep user data if we need to
@@ -127,6 +167,7 @@ struct ips_scb {
 	uint16_t offset;
 	uint16_t nfrag;
 	uint16_t frag_size;
+	uint16_t chunk;		/* index in scbc->scb_chunk */
   
 	struct ips_flow *flow;
 	struct ptl_epaddr *epaddr;
@@ -163,6 +204,28 @@ psm_error_t ips_scbctrl_init(const psmi_context_t *context,
 		 ips_scbctrl_avail_callback_fn_t, void *avail_context,
 		 struct ips_scbctrl *);
 psm_error_t ips_scbctrl_fini(struct ips_scbctrl *);
+void	    ips_scbctrl_elastic(struct ips_scbctrl *scbc, uint32_t numscb_max,
+				uint32_t flow_share,
+				struct psmi_timer_ctrl *timerq);
+
+/*
+ * Returns non-zero if a flow currently holding 'flow_held' scbs may allocate
+ * more from scbc without eating into the share reserved for other flows.
+ */
+PSMI_ALWAYS_INLINE(
+int
+ips_scbctrl_fair(struct ips_scbctrl *scbc, uint32_t flow_held))
+{
+    uint32_t reserve, avail;
+
+    if_pt (flow_held < scbc->scb_flow_share)
+	return 1;
+
+    reserve = min(scbc->scb_flow_share * scbc->scb_flows_active,
+		  scbc->scb_num_max >> 1);
+    avail = scbc->scb_num_cur + (scbc->scb_num_max - scbc->scb_num);
+    return (reserve == 0 || avail > reserve);
+}
 
 psm_error_t ips_scbctrl_writev(struct ips_scb_slist *slist, int fd);
 
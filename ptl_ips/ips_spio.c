@@ -56,13 +56,25 @@
 /* RESYNC_CONSECUTIVE_SEND_FAIL has to be a multiple of MAX_CONSECUTIVE */
 #define SPIO_RESYNC_CONSECUTIVE_SEND_FAIL (1<<4) /* 16 */
 
+/* Partition sizing: never shrink a partition below MIN_BUFS, move STEP
+ * buffers at a time and look at the busy counts every INTERVAL sends from the
+ * main path (power of 2). */
+#define SPIO_PART_MIN_BUFS	4
+#define SPIO_PART_STEP		4
+#define SPIO_PART_INTERVAL	1024
+#define SPIO_PART_BUSY_SLACK	16
+
 static void spio_report_stall(struct ips_spio *ctrl, 
+			      struct ips_spio_part *part,
 			      uint64_t t_cyc_now, 
 			      uint64_t send_failures);
 
 static void spio_handle_stall(struct ips_spio *ctrl,
+			      struct ips_spio_part *part,
 			      uint64_t send_failures);
 
+static void spio_part_init(struct ips_spio *ctrl);
+
 static inline
 uint64_t
 ips_spio_read_avail_index(struct ips_spio *ctrl, int index)
@@ -83,8 +95,9 @@ ips_spio_init(const struct psmi_context *context, const struct ptl *ptl,
     unsigned wc_unordered;
     char *order_str = "undefined";
     int i, last_shadow_index;
-    int num_shadow_index = sizeof(ctrl->spio_avail_shadow) / 
-			   sizeof(ctrl->spio_avail_shadow[0]);
+    struct ips_spio_part *part = &ctrl->spio_part[IPS_SPIO_PART_MAIN];
+    int num_shadow_index = sizeof(part->avail_shadow) / 
+			   sizeof(part->avail_shadow[0]);
 
     ctrl->ptl = ptl;
     ctrl->context = context;
@@ -101,14 +114,11 @@ ips_spio_init(const struct psmi_context *context, const struct ptl *ptl,
         (unsigned long *)(ptrdiff_t)base_info->spi_sendbuf_status;
 
     ctrl->spio_buffer_spacing = base_info->spi_pioalign >> 2;
-    ctrl->spio_first_buffer = ctrl->spio_current_buffer = 
-	base_info->spi_pioindex;
+    ctrl->spio_first_buffer = base_info->spi_pioindex;
     ctrl->spio_last_buffer = 
 	ctrl->spio_first_buffer + base_info->spi_piocnt - 1;
     ctrl->spio_num_of_buffer = base_info->spi_piocnt;
 
-    ctrl->spio_consecutive_failures = 0;
-    ctrl->spio_num_stall = 0ULL;
     ctrl->spio_next_stall_warning = 0ULL;
     ctrl->spio_last_stall_cyc = 0ULL;
     ctrl->spio_init_cyc = get_cycles();
@@ -121,8 +131,8 @@ ips_spio_init(const struct psmi_context *context, const struct ptl *ptl,
 		"Number of buffer avail registers is wrong; "
 		"have %u, expected %u (1st %u, piocnt %u, last %u)",
 		last_shadow_index, 
-		(uint32_t)(sizeof(ctrl->spio_avail_shadow) / 
-			   sizeof(ctrl->spio_avail_shadow[0])),
+		(uint32_t)(sizeof(part->avail_shadow) / 
+			   sizeof(part->avail_shadow[0])),
 		base_info->spi_pioindex, ctrl->spio_last_buffer,
 		base_info->spi_piocnt);
 	goto fail;
@@ -131,7 +141,9 @@ ips_spio_init(const struct psmi_context *context, const struct ptl *ptl,
     /* update the shadow copy with the current contents of hardware
      * available registers */
     for (i = 0; i < num_shadow_index; i++)
-	ctrl->spio_avail_shadow[i] = ips_spio_read_avail_index(ctrl, i);
+	part->avail_shadow[i] = ips_spio_read_avail_index(ctrl, i);
+
+    spio_part_init(ctrl);
 
     /* Figure out the type of ordering we require for pio writes.  Update the
      * routine we use for copies according to the type of pio write required */
@@ -172,23 +184,240 @@ fail:
 psm_error_t
 ips_spio_fini(struct ips_spio *ctrl)
 {
-    spio_report_stall(ctrl, get_cycles(), 0ULL);
+    int i;
+
+    for (i = 0; i < ctrl->spio_num_part; i++)
+	spio_report_stall(ctrl, &ctrl->spio_part[i], get_cycles(), 0ULL);
     return PSM_OK;
 }
 
+/*
+ * With the receive thread enabled, set aside the top of our PIO buffer range
+ * for it.  Without it, or if the user asks for no split, there is a single
+ * partition (shared under spio_lock when the receive thread is on).
+ */
+static void
+spio_part_init(struct ips_spio *ctrl)
+{
+    struct ips_spio_part *main_part = &ctrl->spio_part[IPS_SPIO_PART_MAIN];
+    struct ips_spio_part *rcv_part = &ctrl->spio_part[IPS_SPIO_PART_RCVTHREAD];
+    union psmi_envvar_val env_rcvbufs, env_adapt;
+    uint32_t num_rcv;
+
+    main_part->first = main_part->current = ctrl->spio_first_buffer;
+    main_part->last = ctrl->spio_last_buffer;
+    main_part->num = ctrl->spio_num_of_buffer;
+
+    ctrl->spio_num_part = 1;
+    ctrl->spio_rcvthread_claimed = 0;
+    ctrl->spio_shared_lock = 0;
+    ctrl->spio_split_gen = ctrl->spio_split_ack = 0;
+    ctrl->spio_split_adopt = 0;
+    ctrl->spio_num_rebalance = 0ULL;
+
+    if (!(ctrl->runtime_flags & PSMI_RUNTIME_RCVTHREAD))
+	return;
+
+    psmi_getenv("PSM_PIO_RCVTHREAD_BUFS",
+		"PIO buffers set aside for the receive thread (0 shares all)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) (ctrl->spio_num_of_buffer / 8),
+		&env_rcvbufs);
+    psmi_getenv("PSM_PIO_PART_ADAPT",
+		"Adapt the receive thread's PIO buffer share to its use "
+		"(default is enabled i.e. 1)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT_FLAGS,
+		(union psmi_envvar_val) 1,
+		&env_adapt);
+
+    num_rcv = env_rcvbufs.e_uint;
+    if (num_rcv == 0 || ctrl->spio_num_of_buffer < 2*SPIO_PART_MIN_BUFS) {
+	ctrl->spio_shared_lock = 1;
+	return;
+    }
+    num_rcv = max(num_rcv, SPIO_PART_MIN_BUFS);
+    num_rcv = min(num_rcv, ctrl->spio_num_of_buffer - SPIO_PART_MIN_BUFS);
+
+    rcv_part->last = ctrl->spio_last_buffer;
+    rcv_part->first = rcv_part->current = rcv_part->last - num_rcv + 1;
+    rcv_part->num = num_rcv;
+    memcpy(rcv_part->avail_shadow, main_part->avail_shadow,
+	   sizeof(rcv_part->avail_shadow));
+
+    main_part->last = rcv_part->first - 1;
+    main_part->num -= num_rcv;
+
+    ctrl->spio_split_req = rcv_part->first;
+    ctrl->spio_part_adapt = env_adapt.e_uint;
+    ctrl->spio_num_part = 2;
+
+    _IPATH_PRDBG("PIO bufs %u-%u for main path, %u-%u for receive thread\n",
+		 main_part->first, main_part->last,
+		 rcv_part->first, rcv_part->last);
+}
+
+/* Copy the 2-bit avail state of buffers first..last from one shadow to
+ * another */
+static void
+spio_shadow_copy(uint64_t *dst, const uint64_t *src,
+		 uint32_t first, uint32_t last)
+{
+    uint32_t i;
+
+    for (i = first; i <= last; i++) {
+	uint64_t mask = 3ULL << ((i % 32) * 2);
+	dst[i / 32] = (dst[i / 32] & ~mask) | (src[i / 32] & mask);
+    }
+}
+
+void
+ips_spio_part_claim(struct ips_spio *ctrl)
+{
+    ctrl->spio_rcvthread_id = pthread_self();
+    ips_wmb();
+    ctrl->spio_rcvthread_claimed = 1;
+}
+
+/*
+ * Receive thread is going away and won't send anymore.  The main path takes
+ * the buffers back from our shadow once it sees the release.
+ */
+void
+ips_spio_part_release(struct ips_spio *ctrl)
+{
+    ips_wmb();
+    ctrl->spio_rcvthread_claimed = -1;
+}
+
+/*
+ * Run from the main path.  Adopt buffers the receive thread has given up or
+ * move the partition boundary towards whichever side has been finding all of
+ * its buffers busy.  Only one boundary move is ever outstanding.
+ */
+static void
+spio_part_rebalance(struct ips_spio *ctrl, struct ips_spio_part *main_part)
+{
+    struct ips_spio_part *rcv_part = &ctrl->spio_part[IPS_SPIO_PART_RCVTHREAD];
+    uint64_t main_busy, rcv_busy;
+    uint32_t split;
+
+    if (ctrl->spio_rcvthread_claimed < 0) {
+	ips_rmb();
+	/* Buffers we handed over but that were never picked up are still in
+	 * the handoff shadow, the rest are in the receive thread's shadow */
+	spio_shadow_copy(main_part->avail_shadow, ctrl->spio_split_handoff,
+			 main_part->last + 1, rcv_part->first - 1);
+	spio_shadow_copy(main_part->avail_shadow, rcv_part->avail_shadow,
+			 rcv_part->first, rcv_part->last);
+	main_part->last = ctrl->spio_last_buffer;
+	main_part->num = main_part->last - main_part->first + 1;
+	ctrl->spio_num_part = 1;
+	return;
+    }
+
+    if (ctrl->spio_split_gen != ctrl->spio_split_ack)
+	return;
+    ips_rmb();
+
+    if (ctrl->spio_split_adopt) {
+	split = ctrl->spio_split_req;
+	spio_shadow_copy(main_part->avail_shadow, ctrl->spio_split_handoff,
+			 main_part->last + 1, split - 1);
+	main_part->last = split - 1;
+	main_part->num = main_part->last - main_part->first + 1;
+	ctrl->spio_split_adopt = 0;
+	ctrl->spio_num_rebalance++;
+	return;
+    }
+
+    if (!ctrl->spio_part_adapt)
+	return;
+
+    main_busy = main_part->busy - main_part->busy_last;
+    rcv_busy = rcv_part->busy - rcv_part->busy_last;
+    main_part->busy_last = main_part->busy;
+    rcv_part->busy_last = rcv_part->busy;
+    split = main_part->last + 1;
+
+    if (main_busy > 2*rcv_busy + SPIO_PART_BUSY_SLACK &&
+	rcv_part->num >= SPIO_PART_MIN_BUFS + SPIO_PART_STEP) 
+    {
+	/* Ask the receive thread for its bottom buffers, we adopt them once
+	 * it has acknowledged */
+	ctrl->spio_split_req = split + SPIO_PART_STEP;
+	ctrl->spio_split_adopt = 1;
+	ips_wmb();
+	ctrl->spio_split_gen++;
+    }
+    else if (rcv_busy > 2*main_busy + SPIO_PART_BUSY_SLACK &&
+	     main_part->num >= SPIO_PART_MIN_BUFS + SPIO_PART_STEP)
+    {
+	/* Stop using our top buffers right away and hand them over */
+	split -= SPIO_PART_STEP;
+	spio_shadow_copy(ctrl->spio_split_handoff, main_part->avail_shadow,
+			 split, main_part->last);
+	main_part->last = split - 1;
+	main_part->num -= SPIO_PART_STEP;
+	if (main_part->current > main_part->last)
+	    main_part->current = main_part->first;
+	ctrl->spio_split_req = split;
+	ctrl->spio_num_rebalance++;
+	ips_wmb();
+	ctrl->spio_split_gen++;
+    }
+}
+
+/*
+ * Run from the receive thread when the main path has posted a new boundary.
+ */
+static void
+spio_part_ack(struct ips_spio *ctrl, struct ips_spio_part *rcv_part)
+{
+    uint32_t split;
+
+    ips_rmb();
+    split = ctrl->spio_split_req;
+
+    if (split > rcv_part->first) {
+	spio_shadow_copy(ctrl->spio_split_handoff, rcv_part->avail_shadow,
+			 rcv_part->first, split - 1);
+	if (rcv_part->current < split)
+	    rcv_part->current = split;
+    }
+    else
+	spio_shadow_copy(rcv_part->avail_shadow, ctrl->spio_split_handoff,
+			 split, rcv_part->first - 1);
+    rcv_part->first = split;
+    rcv_part->num = rcv_part->last - split + 1;
+
+    ips_wmb();
+    ctrl->spio_split_ack = ctrl->spio_split_gen;
+}
+
+static inline
+struct ips_spio_part *
+spio_part_self(struct ips_spio *ctrl)
+{
+    if (ctrl->spio_num_part > 1 && ctrl->spio_rcvthread_claimed > 0 &&
+	pthread_equal(pthread_self(), ctrl->spio_rcvthread_id))
+	return &ctrl->spio_part[IPS_SPIO_PART_RCVTHREAD];
+    else
+	return &ctrl->spio_part[IPS_SPIO_PART_MAIN];
+}
+
 static
 void 
-spio_report_stall(struct ips_spio *ctrl, uint64_t t_cyc_now, 
-		  uint64_t send_failures)
+spio_report_stall(struct ips_spio *ctrl, struct ips_spio_part *part,
+		  uint64_t t_cyc_now, uint64_t send_failures)
 {
     int last, i;
     size_t off = 0;
     char buf[1024];
     
-    if (ctrl->spio_num_stall == 0)
+    if (part->num_stall == 0)
 	return;
 
-    last = ctrl->spio_last_buffer/32;
+    last = part->last/32;
 
     if (send_failures > 0) {
 	char bufctr[128];
@@ -198,8 +427,7 @@ spio_report_stall(struct ips_spio *ctrl, uint64_t t_cyc_now,
 	off = snprintf(buf, sizeof buf - 1, 
 	    "PIO Send Bufs context %d with %d bufs from %d to %d. PIO avail regs: ",
 	    (int) psm_epid_context(ctrl->context->epid),
-	    ctrl->spio_num_of_buffer, ctrl->spio_first_buffer, 
-	    ctrl->spio_last_buffer);
+	    part->num, part->first, part->last);
 
 	for (i = 0; i < 8; i++) {
 	    uint64_t avail = ips_spio_read_avail_index(ctrl, i);
@@ -207,9 +435,9 @@ spio_report_stall(struct ips_spio *ctrl, uint64_t t_cyc_now,
 		    i, (long long) avail);
 	}
 	off += snprintf(buf+off, sizeof buf - off - 1, ". PIO shadow regs: ");
-	for (i = ctrl->spio_first_buffer/32; i <= last; i++) {
+	for (i = part->first/32; i <= last; i++) {
 	    off += snprintf(buf+off, sizeof buf - off - 1, " <%d>=(%llx) ", 
-		    i, (long long)ctrl->spio_avail_shadow[i]);
+		    i, (long long)part->avail_shadow[i]);
 	}
 	buf[off] = '\0';
 
@@ -235,13 +463,13 @@ spio_report_stall(struct ips_spio *ctrl, uint64_t t_cyc_now,
 	    send_failures / 1e6,
 	    PSMI_CYCLES_TO_SECSF(t_cyc_now - ctrl->spio_init_cyc),
 	    PSMI_CYCLES_TO_SECSF(t_cyc_now - ctrl->spio_last_stall_cyc),
-	    (unsigned long long) ctrl->spio_num_stall,
+	    (unsigned long long) part->num_stall,
 	    bufctr[0] != '\0' ? bufctr : "", buf);
     }
     else {
 	_IPATH_DBG(
 	    "PIO Send Stall Summary: count=%llu, last=%.3fs, elapsed=%.3fs",
-	    (unsigned long long) ctrl->spio_num_stall,
+	    (unsigned long long) part->num_stall,
 	    PSMI_CYCLES_TO_SECSF(t_cyc_now - ctrl->spio_init_cyc),
 	    PSMI_CYCLES_TO_SECSF(t_cyc_now - ctrl->spio_last_stall_cyc));
     }
@@ -250,43 +478,48 @@ spio_report_stall(struct ips_spio *ctrl, uint64_t t_cyc_now,
 }
 
 static void 
-spio_handle_stall(struct ips_spio *ctrl,
+spio_handle_stall(struct ips_spio *ctrl, struct ips_spio_part *part,
 		  uint64_t send_failures)
 {
     uint64_t t_cyc_now = get_cycles();
     int i, last;
+    int do_lock = (ctrl->spio_num_part > 1);
     
     /* We handle the pio-stall every time but only report something every 20
      * seconds.  We print a summary at the end while closing the device */
-    ctrl->spio_num_stall++;
+    part->num_stall++;
+
+    if (do_lock)
+	pthread_spin_lock(&ctrl->spio_lock);
     ctrl->spio_num_stall_total++;
 
     if (ctrl->spio_next_stall_warning <= t_cyc_now) {
 	/* If context status is ok (i.e. no cables pulled or anything) */
 	if (psmi_context_check_status(ctrl->context) == PSM_OK)
-	    spio_report_stall(ctrl, t_cyc_now, send_failures);
+	    spio_report_stall(ctrl, part, t_cyc_now, send_failures);
 	ctrl->spio_next_stall_warning = 
 		get_cycles() + SPIO_STALL_WARNING_INTERVAL;
     }
+    ctrl->spio_last_stall_cyc = t_cyc_now;
+    if (do_lock)
+	pthread_spin_unlock(&ctrl->spio_lock);
 
     /* re-initialize our shadow from the real registers; by this time,
      * we know the hardware has to have done the update.
      * Also, kernel check may have changed things.
      */
-    last = ctrl->spio_last_buffer/32;
+    last = part->last/32;
     for (i = 0; i <= last; i++) {
         uint64_t mask, avail, shadow_avail;
       
         avail = ips_spio_read_avail_index(ctrl, i);
-	shadow_avail = ctrl->spio_avail_shadow[i];
+	shadow_avail = part->avail_shadow[i];
 	mask = (~(avail ^ shadow_avail) & SPIO_CHECK_MASK) << 1;
 	shadow_avail &= ~mask; /* clear all possible in-use bits */
 	shadow_avail |= (avail & mask);
-	ctrl->spio_avail_shadow[i] = shadow_avail;
+	part->avail_shadow[i] = shadow_avail;
     }
 
-    ctrl->spio_last_stall_cyc = t_cyc_now;
-
     return;
 }
 
@@ -294,16 +527,24 @@ spio_handle_stall(struct ips_spio *ctrl,
  * Update our shadow of the PIO available bitfield at index 'index'
  */
 static void __sendpath 
-spio_update_shadow(struct ips_spio *ctrl, int index)
+spio_update_shadow(struct ips_spio *ctrl, struct ips_spio_part *part,
+		   int index)
 {
     register uint64_t mask, avail, shadow_avail;
 
     if_pf (*ctrl->spio_sendbuf_status) {
       __u64 event_mask;
       struct ips_proto *proto = (struct ips_proto*) &ctrl->ptl->proto;
+      int do_lock = (ctrl->spio_num_part > 1);
+
+      /* Both partitions can see the events, only one of them acks */
+      if (do_lock)
+	pthread_spin_lock(&ctrl->spio_lock);
       
       /* Get event mask for PSM to process */
       event_mask = (uint64_t) *ctrl->spio_sendbuf_status;
+      if (event_mask == 0)
+	goto events_done;
       
       /* First ack the driver the receipt of the events */
       _IPATH_VDBG("Acking event(s) 0x%"PRIx64" to qib driver.\n", (uint64_t) event_mask);
@@ -346,33 +587,37 @@ spio_update_shadow(struct ips_spio *ctrl, int index)
 	_IPATH_INFO("SL2VL mapping changed for port.\n");
 	ips_ibta_init_sl2vl_table(proto);
       }
+
+events_done:
+      if (do_lock)
+	pthread_spin_unlock(&ctrl->spio_lock);
     }
 
-    index &= 0x7;	// max spio_avail_shadow[] index.
+    index &= 0x7;	// max avail_shadow[] index.
     avail = ips_spio_read_avail_index(ctrl, index);
  
     do {
-	shadow_avail = ctrl->spio_avail_shadow[index];
+	shadow_avail = part->avail_shadow[index];
 	mask = (~(avail ^ shadow_avail) & SPIO_CHECK_MASK) << 1;
 	shadow_avail &= ~mask; /* clear all possible in-use bits */
 	shadow_avail |= (avail & mask);
     }
 #ifndef PSMI_USE_THREADS
     while (0);
-    ctrl->spio_avail_shadow[index] = shadow_avail;
+    part->avail_shadow[index] = shadow_avail;
 #else
     while (ips_cswap(...));
 #endif
 }
 
 static void
-spio_handle_resync(struct ips_spio *ctrl,
+spio_handle_resync(struct ips_spio *ctrl, struct ips_spio_part *part,
 		   uint64_t consecutive_send_failed)
 {
   if (ctrl->runtime_flags & IPATH_RUNTIME_FORCE_PIOAVAIL)
     ipath_force_pio_avail_update(ctrl->context->ctrl);
   if (!(consecutive_send_failed & (SPIO_MAX_CONSECUTIVE_SEND_FAIL - 1)))
-    spio_handle_stall(ctrl, consecutive_send_failed);
+    spio_handle_stall(ctrl, part, consecutive_send_failed);
 }
 
 /* 
@@ -395,57 +640,78 @@ ips_spio_transfer_frame(struct ips_spio *ctrl, struct ips_flow *flow,
     const uint64_t toggle_bits = 3ULL;
     psm_error_t err = PSM_OK;
     int tries;
-    int do_lock = (ctrl->runtime_flags & PSMI_RUNTIME_RCVTHREAD);
+    int do_lock = ctrl->spio_shared_lock;
+    struct ips_spio_part *part = spio_part_self(ctrl);
     struct ipath_pio_params pio_params;
     struct ips_message_header *p_hdr = (struct ips_message_header*) header;
 
     if (do_lock)
 	pthread_spin_lock(&ctrl->spio_lock);
 
+    if_pf (ctrl->spio_num_part > 1) {
+	if (part == &ctrl->spio_part[IPS_SPIO_PART_MAIN]) {
+	    if (!(++part->attempts & (SPIO_PART_INTERVAL-1)) ||
+		ctrl->spio_rcvthread_claimed < 0)
+		spio_part_rebalance(ctrl, part);
+	}
+	else if (ctrl->spio_split_gen != ctrl->spio_split_ack)
+	    spio_part_ack(ctrl, part);
+    }
+
     if_pf (PSMI_FAULTINJ_ENABLED()) {
 	PSMI_FAULTINJ_STATIC_DECL(fi_lost, "piosend", 1, IPS_FAULTINJ_PIOLOST);
 	PSMI_FAULTINJ_STATIC_DECL(fi_busy, "piobusy", 1, IPS_FAULTINJ_PIOBUSY);
-	if (psmi_faultinj_is_fault(fi_lost)) {
+	uint32_t fi_peer = ips_epaddr_faultinj_peer(flow->ipsaddr);
+	int fault = psmi_faultinj_event(fi_lost, fi_peer, flow->flowid);
+
+	/* A delay holds the packet back like a busy pio buffer, duplicates
+	 * are left to the receive side */
+	if (fault == PSMI_FAULTINJ_DROP) {
+	    if (!isCtrlMsg)
+		ips_flow_faultinj_xmit_lost(flow, p_hdr);
 	    if (do_lock)
 		pthread_spin_unlock(&ctrl->spio_lock);
 	    return PSM_OK;
 	}
-	else if (psmi_faultinj_is_fault(fi_busy))
+	else if (fault == PSMI_FAULTINJ_STALL || fault == PSMI_FAULTINJ_DELAY ||
+		 psmi_faultinj_event(fi_busy, fi_peer, flow->flowid) != 
+		 PSMI_FAULTINJ_NONE)
 	    goto fi_busy;
 	/* else fall through normal processing path, i.e. no faults */
     }
 
-    if (ctrl->spio_avail_shadow[ctrl->spio_current_buffer / 32] & 
-        (1ULL<<(((ctrl->spio_current_buffer) % 32 * 2) + 1))) 
+    if (part->avail_shadow[part->current / 32] & 
+        (1ULL<<(((part->current) % 32 * 2) + 1))) 
     {
 	/* 
 	 * If the bit was already set, we couldn't get the pio buf. Update our
 	 * shadow copy.
 	 */
-        spio_update_shadow(ctrl, ctrl->spio_current_buffer / 32);
+        spio_update_shadow(ctrl, part, part->current / 32);
 
-        tries = ctrl->spio_num_of_buffer;
+        tries = part->num;
 
-	while (tries && (ctrl->spio_avail_shadow[ctrl->spio_current_buffer / 32] & 
-			    (1ULL<<(((ctrl->spio_current_buffer % 32) * 2) + 1)))) 
+	while (tries && (part->avail_shadow[part->current / 32] & 
+			    (1ULL<<(((part->current % 32) * 2) + 1)))) 
 	{
-            /* advance spio_current_buffer to next buffer */
-	    if (++ctrl->spio_current_buffer > ctrl->spio_last_buffer) {
-		ctrl->spio_current_buffer = ctrl->spio_first_buffer;
-                spio_update_shadow(ctrl, ctrl->spio_current_buffer / 32);
+            /* advance current buffer to next buffer */
+	    if (++part->current > part->last) {
+		part->current = part->first;
+                spio_update_shadow(ctrl, part, part->current / 32);
 	    }
-	    else if ( (ctrl->spio_current_buffer % 32) == 0 ) 
-                spio_update_shadow(ctrl, ctrl->spio_current_buffer / 32);
+	    else if ( (part->current % 32) == 0 ) 
+                spio_update_shadow(ctrl, part, part->current / 32);
             tries--;
         }
 
         if_pf ( !tries ) {
 	    /* Check unit status */
 fi_busy:
+	    part->busy++;
 	    if ((err = psmi_context_check_status(ctrl->context)) == PSM_OK) {
-		if (0 == (++ctrl->spio_consecutive_failures & 
+		if (0 == (++part->consecutive_failures & 
 			    (SPIO_RESYNC_CONSECUTIVE_SEND_FAIL-1)))
-		    spio_handle_resync(ctrl, ctrl->spio_consecutive_failures);
+		    spio_handle_resync(ctrl, part, part->consecutive_failures);
 		err = PSM_EP_NO_RESOURCES; 
 	    }
 	    /* If cable is pulled, we don't count it as a consecutive failure,
@@ -458,24 +724,24 @@ fi_busy:
             return err;
         }
     }
-    if (ctrl->spio_num_stall) // now able to send, so clear if set
-        ctrl->spio_num_stall = 0;
+    if (part->num_stall) // now able to send, so clear if set
+        part->num_stall = 0;
 
     /* toggle the Generation bit and set the busy bit.
      * If we detected a flip,        toggle busy but not GenBit (0x2)
      * If we didn't detect the flip, toggle busy but not the GenBit (0x3) */
-    ctrl->spio_avail_shadow[ctrl->spio_current_buffer / 32] ^= 
-	    (toggle_bits<<(((ctrl->spio_current_buffer % 32) * 2)));
+    part->avail_shadow[part->current / 32] ^= 
+	    (toggle_bits<<(((part->current % 32) * 2)));
 
     current_pio_buffer = (uint32_t *) ctrl->spio_buffer_base +
         (ctrl->spio_buffer_spacing * 
-	 (ctrl->spio_current_buffer - ctrl->spio_first_buffer));
+	 (part->current - ctrl->spio_first_buffer));
 
-    /* advance spio_current_buffer to next buffer */
-    if (++ctrl->spio_current_buffer > ctrl->spio_last_buffer)
-	ctrl->spio_current_buffer = ctrl->spio_first_buffer;
+    /* advance current buffer to next buffer */
+    if (++part->current > part->last)
+	part->current = part->first;
 
-    ctrl->spio_consecutive_failures = 0;
+    part->consecutive_failures = 0;
 
     if (do_lock)
 	pthread_spin_unlock(&ctrl->spio_lock);
@@ -499,6 +765,11 @@ fi_busy:
     /* Copy buffer using PIO */
     ctrl->spio_copy_fn(current_pio_buffer, &pio_params, header, payload);
 
+    if_pf (PSMI_CAPTURE_ENABLED())
+	psmi_capture_packet(ctrl->context->ep, PSMI_CAPTURE_TX, 
+			    PSMI_CAPTURE_PIO, header, 
+			    sizeof(struct ips_message_header), payload, length);
+
     return PSM_OK;
 } // ips_spio_transfer_frame()
 
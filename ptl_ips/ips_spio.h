@@ -48,6 +48,39 @@ psm_error_t ips_spio_transfer_frame(struct ips_spio *ctrl,struct ips_flow *flow,
 				    uint32_t cksum_valid, uint32_t cksum);
 psm_error_t ips_spio_fini(struct ips_spio *ctrl);
 
+/* Called by the receive thread to take ownership of (or give back) the send
+ * buffers set aside for it */
+void ips_spio_part_claim(struct ips_spio *ctrl);
+void ips_spio_part_release(struct ips_spio *ctrl);
+
+/*
+ * The context's PIO buffers can be split into two partitions, one used by the
+ * main progress path and one used by the receive thread.  Each partition has
+ * its own buffer cursor and shadow of the avail registers and only ever
+ * allocates buffers within its own range, so acks sent by the receive thread
+ * don't serialize against data sends on the main path.
+ */
+#define IPS_SPIO_PART_MAIN	0
+#define IPS_SPIO_PART_RCVTHREAD	1
+#define IPS_SPIO_PART_MAX	2
+
+struct ips_spio_part
+{
+    uint64_t avail_shadow[8] __attribute__((aligned(64)));
+
+    uint32_t first;
+    uint32_t last;
+    uint32_t current;
+    uint32_t num;
+
+    uint32_t consecutive_failures;
+    uint64_t num_stall;
+
+    uint64_t attempts;	/* sends attempted from this partition */
+    uint64_t busy;	/* sends that found no free buffer */
+    uint64_t busy_last;	/* busy count at last rebalance */
+} __attribute__((aligned(64)));
+
 struct ips_spio
 {
     const struct ptl       *ptl;
@@ -55,7 +88,10 @@ struct ips_spio
     uint32_t	            runtime_flags;
     int			    unit_id;
     uint16_t		    portnum;
+    /* Guards the whole send path when both threads share one partition,
+     * otherwise only driver events and stall bookkeeping */
     pthread_spinlock_t      spio_lock;
+    int			    spio_shared_lock;
 
     /* pio copy routine */
     void  (*spio_copy_fn)(volatile uint32_t *,
@@ -68,13 +104,26 @@ struct ips_spio
     uint32_t spio_buffer_spacing;
     uint32_t spio_first_buffer;
     uint32_t spio_last_buffer;
-    uint32_t spio_current_buffer;
     uint32_t spio_num_of_buffer;
 
-    uint64_t spio_avail_shadow[8] __attribute__((aligned(64)));
+    /* Partitions, only one unless the receive thread is enabled */
+    struct ips_spio_part spio_part[IPS_SPIO_PART_MAX];
+    volatile int	spio_num_part;
+    volatile int	spio_rcvthread_claimed;
+    pthread_t		spio_rcvthread_id;
+
+    /* Moving the boundary between partitions.  The main path posts a new
+     * boundary and bumps split_gen, the receive thread acknowledges it from
+     * its own send path.  Buffer state changes hands through split_handoff,
+     * always written by the partition giving buffers away. */
+    uint32_t		spio_part_adapt;
+    volatile uint32_t	spio_split_req;
+    volatile uint32_t	spio_split_gen;
+    volatile uint32_t	spio_split_ack;
+    uint32_t		spio_split_adopt;
+    uint64_t		spio_split_handoff[8];
+    uint64_t		spio_num_rebalance;
 
-    uint32_t spio_consecutive_failures;
-    uint64_t spio_num_stall;
     uint64_t spio_num_stall_total;
     uint64_t spio_next_stall_warning;
     uint64_t spio_last_stall_cyc;
@@ -46,6 +46,8 @@ ips_subcontext_ureg_get(ptl_t *ptl, const psmi_context_t *context,
     unsigned pagesize = getpagesize();
     int i;
     psmi_assert_always(all_subcontext_uregbase != NULL);
+    psmi_assert_always(_IPATH_UregMax*8*sizeof(uint64_t) +
+		       sizeof(struct ips_subcontext_ureg) <= pagesize);
     for (i = 0; i < INFINIPATH_MAX_SUBCONTEXT; i++) {
         struct ips_subcontext_ureg *subcontext_ureg = 
           (struct ips_subcontext_ureg *) &all_subcontext_uregbase[_IPATH_UregMax*8];
@@ -52,6 +52,7 @@ struct ips_writehdrq_state
 {
     uint32_t		     hdrq_rhf_seq;	/* last seq */
     uint32_t		     enabled;		/* enables writing */
+    struct ips_recvhdrq_lent egr_lent;		/* hardware eager bufs lent */
 };
 
 struct ips_writehdrq
@@ -65,6 +66,7 @@ struct ips_writehdrq
     struct ips_recvq_params  egrq;
     void	           **egrq_buftable; /* table of eager idx-to-ptr */
     uint32_t		     runtime_flags;
+    uint32_t		     egr_lend;		/* zero-copy eager handoff */
 };
 
 psm_error_t
@@ -152,7 +154,26 @@ ips_writehdrq_append(struct ips_writehdrq *writeq,
     rcv_paylen = ips_recvhdrq_event_paylen(rcv_ev);
     rcv_paylen += (rcv_ev->has_cksum ? PSM_CRC_SIZE_IN_BYTES : 0);
     
-    if (rcv_ev->ptype == RCVHQ_RCV_TYPE_EAGER && rcv_paylen > 0)
+    if (rcv_ev->ptype == RCVHQ_RCV_TYPE_EAGER && rcv_paylen > 0 &&
+	writeq->egr_lend &&
+	writeq->state->egr_lent.lent_tail - writeq->state->egr_lent.lent_head <
+	  IPS_RECVHDRQ_LENT_MAX)
+    {
+	/* Zero-copy handoff: lend the hardware eager buffer to the subcontext
+	 * and leave the rhf eager index pointing at it.  The entry is recorded
+	 * before the header becomes visible to the subcontext. */
+	struct ips_recvhdrq_lent *lent = &writeq->state->egr_lent;
+	uint32_t slot = lent->lent_tail & (IPS_RECVHDRQ_LENT_MAX-1);
+
+	lent->lent[slot].hdrq_off = write_hdr_tail;
+	lent->lent[slot].egr_index = ipath_hdrget_index(rcv_ev->rhf);
+	ips_wmb();
+	lent->lent_tail++;
+
+        /* Copy the header to the subcontext's header queue */
+        psmi_mq_mtucpy(write_hdr, rcv_hdr, writeq->hdrq_hdr_copysz);
+    }
+    else if (rcv_ev->ptype == RCVHQ_RCV_TYPE_EAGER && rcv_paylen > 0)
     {
 	uint32_t write_egr_tail = ips_recvq_tail_get(&writeq->egrq);
 	uint32_t next_write_egr_tail;
@@ -65,6 +65,41 @@ ips_subcontext_process(const struct ips_recvhdrq_event *rcv_ev, uint32_t subcont
     }
 }
 
+/*
+ * Eager buffers of the hardware context may still be lent to subcontexts
+ * (zero-copy handoff).  Return the eager head that can safely be written:
+ * 'egr_head' itself, or the oldest buffer still held by a subcontext.
+ */
+static
+uint32_t
+ips_subcontext_egr_lent(const struct ips_recvhdrq *recvq, uint32_t egr_head)
+{
+    struct ptl_shared *recvshc = recvq->proto->ptl->recvshc;
+    const uint32_t egr_cnt = recvq->egrq.elemcnt;
+    uint32_t oldest = egr_head, oldest_dist = 0;
+    int i;
+
+    for (i = 0; i < recvshc->subcontext_cnt; i++) {
+	struct ips_recvhdrq_lent *lent = 
+	    &recvshc->subcontext_ureg[i]->writeq_state.egr_lent;
+	uint32_t lent_head = lent->lent_head;
+
+	if (lent_head != lent->lent_tail) {
+	    /* Lent buffers are all older than the new head, keep the one
+	     * furthest behind it */
+	    uint32_t idx = 
+		lent->lent[lent_head & (IPS_RECVHDRQ_LENT_MAX-1)].egr_index;
+	    uint32_t dist = (egr_head + egr_cnt - idx) % egr_cnt;
+	    if (dist > oldest_dist) {
+		oldest_dist = dist;
+		oldest = idx;
+	    }
+	}
+    }
+
+    return oldest;
+}
+
 static
 void
 recvhdrq_hw_params(const psmi_context_t *context, 
@@ -305,15 +340,27 @@ ips_ptl_init(const psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
     if (!enable_shcontexts) {
         struct ips_recvhdrq_callbacks recvq_callbacks;
 	struct ips_recvq_params hdrq, egrq;
+	union psmi_envvar_val env_egr_lend;
+
+	psmi_getenv("PSM_EGR_LEND",
+		    "Leave unexpected eager payloads in the eager queue until it is this percent full (0 copies)",
+		    PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		    (union psmi_envvar_val) 0, &env_egr_lend);
+
 	recvhdrq_hw_params(context, &hdrq, &egrq, 0, 0);
 	recvq_callbacks.callback_packet_unknown = ips_proto_process_unknown;
 	recvq_callbacks.callback_subcontext = ips_subcontext_ignore;
 	recvq_callbacks.callback_error = ips_proto_process_packet_error;
+	recvq_callbacks.callback_egr_lent = 
+	    env_egr_lend.e_uint ? ips_recvhdrq_loan_head : NULL;
 	if ((err = ips_recvhdrq_init(context, &ptl->epstate, &ptl->proto,
 		      &hdrq, &egrq, &recvq_callbacks, 
 		      ptl->runtime_flags, 0,
 		      &ptl->recvq, &ptl->recvq_state)))
 	    goto fail;
+	if (env_egr_lend.e_uint &&
+	    (err = ips_recvhdrq_loan_init(&ptl->recvq, env_egr_lend.e_uint)))
+	    goto fail;
     }
 
     /*
@@ -401,7 +448,7 @@ ips_ptl_optctl(const void *core_obj, int optname,
       if (get) {
 	/* Get returns the SL for the PIO flow */
 	*((uint8_t *) optval) = 
-	  (uint8_t) ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO].sl;
+	  (uint8_t) ips_epaddr_flow(ipsaddr, EP_FLOW_GO_BACK_N_PIO)->sl;
       }
       else {
 	uint16_t new_sl;
@@ -415,10 +462,7 @@ ips_ptl_optctl(const void *core_obj, int optname,
 	}
 	
 	/* Set new SL for all flows */
-	ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO].sl = new_sl;
-	ipsaddr->flows[EP_FLOW_GO_BACK_N_DMA].sl = new_sl;
-	ipsaddr->flows[EP_FLOW_GO_BACK_N_AM_REQ].sl = new_sl;
-	ipsaddr->flows[EP_FLOW_GO_BACK_N_AM_RSP].sl = new_sl;
+	ips_epaddr_flow_set_sl(ipsaddr, new_sl);
       }
     }
     break;
@@ -493,6 +537,17 @@ ips_ptl_poll(ptl_t *ptl, int _ignored)
       (ptl->runtime_flags & PSMI_RUNTIME_RCVTHREAD);
     psm_error_t err = PSM_OK_NO_PROGRESS;
     psm_error_t err2;
+
+    ptl->poll_cnt++;
+    ptl->proto.sdma_poll_epoch++;
+
+    /* Receives gave back the oldest lent eager slot, move the head */
+    if_pf (ptl->recvq.egr_loan != NULL && ptl->recvq.egr_loan->head_retry &&
+	   (!do_lock || ips_recvhdrq_trylock(&ptl->recvq))) {
+	ips_recvhdrq_loan_progress(&ptl->recvq);
+	if (do_lock)
+	    ips_recvhdrq_unlock(&ptl->recvq);
+    }
     
     if (!ips_recvhdrq_isempty(&ptl->recvq)) {
       	if (do_lock && !ips_recvhdrq_trylock(&ptl->recvq))
@@ -524,6 +579,16 @@ ips_ptl_poll(ptl_t *ptl, int _ignored)
 	    ips_recvhdrq_unlock(&ptl->recvq);
     }
 
+    /* Retry send dma flows held back by a busy ring */
+    if_pf (!TAILQ_EMPTY(&ptl->proto.sdma_readyq) &&
+	   current_count >= ptl->proto.sdma_progress_next) {
+	if (do_lock)
+	    ips_recvhdrq_lock(&ptl->recvq);
+	ips_proto_sdma_progress(&ptl->proto, current_count);
+	if (do_lock)
+	    ips_recvhdrq_unlock(&ptl->recvq);
+    }
+
     return err;
 }
 
@@ -555,6 +620,7 @@ ips_ptl_shared_poll(ptl_t *ptl, int _ignored)
     psm_error_t err = PSM_OK_NO_PROGRESS;
     psm_error_t err2;
     struct ptl_shared *recvshc = ptl->recvshc;
+    uint32_t lent_head;
     psmi_assert(recvshc != NULL);
 
     /* The following header queue checks are speculative (but safe)
@@ -570,6 +636,10 @@ ips_ptl_shared_poll(ptl_t *ptl, int _ignored)
 	    if_pt (ips_recvhdrq_isempty(&recvshc->recvq)) {
                 err = ips_recvhdrq_progress(&ptl->recvq);
 	    }
+	    if (recvshc->egr_head_retry) {
+		recvshc->egr_head_retry = 0;
+		ips_recvhdrq_egr_head_retry(&ptl->recvq);
+	    }
             ips_unlock_shared_context(recvshc);
 	}
     }
@@ -578,12 +648,30 @@ ips_ptl_shared_poll(ptl_t *ptl, int _ignored)
 	return err;
 
     if (!ips_recvhdrq_isempty(&recvshc->recvq)) {
+	lent_head = recvshc->recvq.egrq_lent->lent_head;
 	err2 = ips_recvhdrq_progress(&recvshc->recvq);
         if (err2 != PSM_OK_NO_PROGRESS) {
 	    err = err2;
         }
+
+	if (lent_head != recvshc->recvq.egrq_lent->lent_head)
+	    recvshc->egr_head_retry = 1;
     }	
 
+    /* If we gave back lent eager buffers that were holding the hardware
+     * eager head, let the head move on now rather than on the next eager
+     * packet.  If the context is busy the retry stays pending for the next
+     * poll. */
+    if_pf (recvshc->egr_head_retry) {
+	if (ptl->recvq.state->rcv_egr_index_held == NO_EAGER_UPDATE)
+	    recvshc->egr_head_retry = 0;
+	else if (ips_try_lock_shared_context(recvshc) == 0) {
+	    recvshc->egr_head_retry = 0;
+	    ips_recvhdrq_egr_head_retry(&ptl->recvq);
+	    ips_unlock_shared_context(recvshc);
+	}
+    }
+
     if_pf (err > PSM_OK_NO_PROGRESS)
 	return err;
 
@@ -627,10 +715,16 @@ shrecvq_init(ptl_t *ptl, const psmi_context_t *context)
     struct ips_recvq_params hdrq, egrq;
     psm_error_t err = PSM_OK;
     struct ptl_shared *recvshc;
+    union psmi_envvar_val env_zerocopy;
     int i;
 
     psmi_assert_always(user_info->spu_subcontext_cnt > 0);
 
+    psmi_getenv("PSM_SUBCONTEXT_ZEROCOPY",
+		"Hand eager packets to other subcontexts without copying the payload, set alike in all subcontexts (0 copies)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT_FLAGS,
+		(union psmi_envvar_val) 0, &env_zerocopy);
+
     recvshc = (struct ptl_shared *)
 	    psmi_calloc(context->ep, UNDEFINED, 1, sizeof(struct ptl_shared));
     if (recvshc == NULL) {
@@ -661,6 +755,11 @@ shrecvq_init(ptl_t *ptl, const psmi_context_t *context)
     recvq_callbacks.callback_packet_unknown = ips_proto_process_unknown;
     recvq_callbacks.callback_subcontext = ips_subcontext_process;
     recvq_callbacks.callback_error = ips_proto_process_packet_error;
+    /* Only a context lending its eager buffers has to hold the eager head
+     * back.  PSM_SUBCONTEXT_ZEROCOPY must be the same in all subcontexts of
+     * a context, whichever of them drains it decides whether to lend. */
+    recvq_callbacks.callback_egr_lent = 
+	env_zerocopy.e_uint ? ips_subcontext_egr_lent : NULL;
     if ((err = ips_recvhdrq_init(context, &ptl->epstate, &ptl->proto,
 		      &hdrq, &egrq, &recvq_callbacks,
 		      ptl->runtime_flags, recvshc->subcontext,
@@ -673,6 +772,7 @@ shrecvq_init(ptl_t *ptl, const psmi_context_t *context)
     /* not require the rcvhdr copy feature. */
     recvhdrq_hw_params(context, &hdrq, &egrq, 1, recvshc->subcontext);
     recvq_callbacks.callback_subcontext = ips_subcontext_ignore;
+    recvq_callbacks.callback_egr_lent = NULL;
     if ((err = ips_recvhdrq_init(context, &ptl->epstate, &ptl->proto,
 		      &hdrq, &egrq, &recvq_callbacks,
 		      ptl->runtime_flags & ~IPATH_RUNTIME_RCVHDR_COPY,
@@ -681,6 +781,11 @@ shrecvq_init(ptl_t *ptl, const psmi_context_t *context)
 		      &recvshc->recvq_state))) {
 	goto fail;
     }
+    /* Packets may reference hardware eager buffers lent to us by whichever
+     * subcontext drains the hardware context */
+    recvshc->recvq.egrq_lent = 
+	&recvshc->subcontext_ureg[recvshc->subcontext]->writeq_state.egr_lent;
+    recvshc->recvq.egrq_lent_buftable = ptl->recvq.egrq_buftable;
 
     /* Initialize each recvshc->writeq for shared contexts */
     for (i = 0; i < recvshc->subcontext_cnt; i++) {
@@ -691,6 +796,7 @@ shrecvq_init(ptl_t *ptl, const psmi_context_t *context)
                           ptl->runtime_flags & ~IPATH_RUNTIME_RCVHDR_COPY))) {
 	    goto fail;
 	}
+	recvshc->writeq[i].egr_lend = !!env_zerocopy.e_uint;
     }
 
     if (err == PSM_OK)
@@ -708,9 +814,15 @@ shrecvq_fini(ptl_t *ptl)
     psm_error_t err = PSM_OK;
     int i;
 
-    /* disable my write header queue before deallocation */
+    /* disable my write header queue before deallocation, and give back
+     * any eager buffers still lent to us */
     i = ptl->recvshc->subcontext;
+    ips_lock_shared_context(ptl->recvshc);
     ptl->recvshc->subcontext_ureg[i]->writeq_state.enabled = 0;
+    ptl->recvshc->subcontext_ureg[i]->writeq_state.egr_lent.lent_head =
+	ptl->recvshc->subcontext_ureg[i]->writeq_state.egr_lent.lent_tail;
+    ips_recvhdrq_egr_head_retry(&ptl->recvq);
+    ips_unlock_shared_context(ptl->recvshc);
 
     if ((err = ips_recvhdrq_fini(&ptl->recvq)))
         goto fail;
@@ -774,12 +886,12 @@ ips_ptl_connect(ptl_t *ptl, int numep, const psm_epid_t *array_of_epid,
 	    if (array_of_epid_mask[i]
 	    && array_of_errors[i] == PSM_OK
 	    && count < array_of_epaddr[i]->mctxt_epcount) {
-		if (ep->gid_hi != array_of_epaddr[i]->mctxt_gidhi[count]) {
+		if (ep->gid_hi != array_of_epaddr[i]->mctxt_peer->gidhi[count]) {
 		    mask_array[i] = 0;
 		    _IPATH_INFO("Subnet ID mismatch, ignore...\n");
 		} else {
 		    mask_array[i] = 1;
-		    epid_array[i] = array_of_epaddr[i]->mctxt_epid[count];
+		    epid_array[i] = array_of_epaddr[i]->mctxt_peer->epid[count];
 		}
 	    } else {
 		mask_array[i] = 0;
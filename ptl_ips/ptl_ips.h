@@ -110,6 +110,9 @@ struct ptl {
 
     /* Rcv thread context */
     struct ptl_rcvthread    *rcvthread;
+
+    /* Progress polls, lets the receive thread see the main thread polling */
+    uint64_t		    poll_cnt;
 };
 
 /*
@@ -132,6 +135,7 @@ struct ptl_shared {
     struct ips_recvhdrq	recvq;	            /* subcontext receive queue */
     struct ips_recvhdrq_state recvq_state;  /* subcontext receive queue state */
     struct ips_writehdrq writeq[INFINIPATH_MAX_SUBCONTEXT]; /* peer subcontexts */
+    int egr_head_retry;	/* gave back lent eager bufs, head not retried yet */
 };
 
 /*
@@ -32,6 +32,7 @@
  */
 
 #include <sys/poll.h>
+#include <sched.h>
 
 #include "ptl_ips.h"
 #include "ips_proto.h"
@@ -42,12 +43,14 @@
 #define RCVTHREAD_TO_MIN_FREQ	    10	   /* min of 10 polls per sec */
 #define RCVTHREAD_TO_MAX_FREQ	    100    /* max of 100 polls per sec */
 #define RCVTHREAD_TO_SHIFT	    1
+#define RCVTHREAD_TO_BOOST	    1	   /* period with rendezvous pending */
 
 struct ptl_rcvthread;
 
 static void * ips_ptl_pollintr(void *recvthreadc);
 static psm_error_t rcvthread_initstats(ptl_t *ptl);
 static psm_error_t rcvthread_initsched(struct ptl_rcvthread *rcvc);
+static void rcvthread_initaffinity(struct ptl_rcvthread *rcvc);
 
 struct ptl_rcvthread {
     const psmi_context_t	*context;
@@ -63,14 +66,25 @@ struct ptl_rcvthread {
     uint64_t  pollcnt_to;
     uint64_t  pollcyc;
     uint64_t  pollok;
+    uint64_t  pollcnt_intr;	/* woken up by an urgent packet */
+    uint64_t  pollcnt_deferred;	/* skipped, main thread was polling */
+    uint64_t  pollcnt_boost;	/* timeouts shortened for rendezvous */
+    uint64_t  pollcyc_locked;	/* time spent holding the progress lock */
 
     /* For scheduling interrupt thread */
     int	      timeout_period_min;
     int	      timeout_period_max;
+    int	      timeout_period_boost;
     int	      timeout_shift;
     uint64_t  pollok_last;
     uint64_t  pollcnt_last;
     uint32_t  last_timeout;
+
+    /* Main thread progress, ptl's poll count less our own polls */
+    uint64_t  poll_self;
+    uint64_t  poll_main_last;
+
+    int	      cpu;		/* cpu to pin to, -1 if not pinned */
 };
 
 /* 
@@ -100,6 +114,7 @@ ips_ptl_rcvthread_init(ptl_t *ptl, struct ips_recvhdrq *recvq)
 
 	if ((err = rcvthread_initsched(rcvc)))
 	    goto fail;
+	rcvthread_initaffinity(rcvc);
 
 	/* Create a pipe so we can synchronously terminate the thread */
 	if (pipe(rcvc->pipefd) != 0) {
@@ -119,6 +134,19 @@ ips_ptl_rcvthread_init(ptl_t *ptl, struct ips_recvhdrq *recvq)
 	    goto fail;
 	}
 
+	if (rcvc->cpu >= 0) {
+	    cpu_set_t cpuset;
+	    CPU_ZERO(&cpuset);
+	    CPU_SET(rcvc->cpu, &cpuset);
+	    if (pthread_setaffinity_np(rcvc->hdrq_threadid, 
+				       sizeof cpuset, &cpuset))
+		_IPATH_PRDBG("Couldn't pin receive thread to processor %d\n",
+			     rcvc->cpu);
+	    else
+		_IPATH_PRDBG("Pinned receive thread to processor %d\n",
+			     rcvc->cpu);
+	}
+
     }
 
     if ((err = rcvthread_initstats(ptl)))
@@ -176,7 +204,7 @@ fail:
 psm_error_t
 rcvthread_initsched(struct ptl_rcvthread *rcvc)
 {
-    union psmi_envvar_val env_to;
+    union psmi_envvar_val env_to, env_boost;
     char buf[192];
     char *rcv_freq = buf;
     int no_timeout = 0;
@@ -221,8 +249,16 @@ rcvthread_initsched(struct ptl_rcvthread *rcvc)
 	}
     }
 
+    psmi_getenv("PSM_RCVTHREAD_BOOST",
+	"Thread timeout (ms) while rendezvous transfers are pending "
+	"(0 disables)",
+	PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+	(union psmi_envvar_val) RCVTHREAD_TO_BOOST, &env_boost);
+    rcvc->timeout_period_boost = env_boost.e_uint;
+
     if (no_timeout) {
 	rcvc->last_timeout = -1;
+	rcvc->timeout_period_boost = 0;
 	_IPATH_PRDBG("PSM_RCVTHREAD_FREQ set to only interrupt "
 		     "(no timeouts)\n");
     }
@@ -242,29 +278,133 @@ rcvthread_initsched(struct ptl_rcvthread *rcvc)
     return PSM_OK;
 }
 
+/*
+ * Pin the receive thread if asked to, either to a given processor or to the
+ * hyperthread sibling of the processor the main thread is running on so both
+ * share a core (and its caches) without competing for it.
+ */
+static
+void
+rcvthread_initaffinity(struct ptl_rcvthread *rcvc)
+{
+    union psmi_envvar_val env_aff;
+    char path[128], buf[128];
+    char *p, *end;
+    FILE *fp;
+    int cpu, lo, hi;
+
+    rcvc->cpu = -1;
+
+    psmi_getenv("PSM_RCVTHREAD_AFFINITY",
+	"Receive thread processor affinity <none|sibling|cpu number>",
+	PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_STR,
+	(union psmi_envvar_val) "none", &env_aff);
+
+    if (!strcasecmp(env_aff.e_str, "none"))
+	return;
+    if (strcasecmp(env_aff.e_str, "sibling")) {
+	cpu = (int) strtol(env_aff.e_str, &end, 0);
+	if (*end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE)
+	    _IPATH_INFO("Ignoring invalid PSM_RCVTHREAD_AFFINITY=%s\n",
+			env_aff.e_str);
+	else
+	    rcvc->cpu = cpu;
+	return;
+    }
+
+    if ((cpu = sched_getcpu()) < 0)
+	return;
+    snprintf(path, sizeof path, 
+	     "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if ((fp = fopen(path, "r")) == NULL)
+	return;
+    p = fgets(buf, sizeof buf, fp);
+    fclose(fp);
+    if (p == NULL)
+	return;
+
+    /* List of ranges, e.g. "2,18" or "2-3", pick the first that isn't us */
+    while (*p != '\0' && *p != '\n') {
+	lo = hi = (int) strtol(p, &end, 10);
+	if (end == p)
+	    break;
+	if (*end == '-') {
+	    p = end + 1;
+	    hi = (int) strtol(p, &end, 10);
+	}
+	for (; lo <= hi; lo++) {
+	    if (lo != cpu) {
+		rcvc->cpu = lo;
+		return;
+	    }
+	}
+	p = (*end == ',') ? end + 1 : end;
+    }
+
+    _IPATH_PRDBG("No hyperthread sibling for processor %d, receive thread "
+		 "left unpinned\n", cpu);
+}
+
+/*
+ * Rendezvous transfers in progress: expected receives holding tidflows or
+ * expected sends waiting to go out.  Read without the lock, it only steers
+ * the timeout.
+ */
+static
+int
+rcvthread_rv_pending(struct ptl_rcvthread *rcvc)
+{
+    const struct ips_protoexp *protoexp = rcvc->ptl->proto.protoexp;
+
+    return (protoexp != NULL &&
+	    (protoexp->tfctrl.tf_num_avail < protoexp->tfctrl.tf_num_max ||
+	     !STAILQ_EMPTY(&protoexp->pend_sendq)));
+}
+
+/*
+ * Timeout policy.  Back off when polls find nothing to do or when the main
+ * thread has polled since we last woke up (it is making progress itself),
+ * shorten the timeout when polls are useful, and cap it at the boost period
+ * while rendezvous transfers are pending so they keep moving while the
+ * application computes.
+ */
 static
 int
-rcvthread_next_timeout(struct ptl_rcvthread *rcvc)
+rcvthread_next_timeout(struct ptl_rcvthread *rcvc, int main_active)
 {
     uint64_t pollok_diff = rcvc->pollok - rcvc->pollok_last;
 
-    if (pollok_diff > 0) {
+    if (main_active) {
+	if (rcvc->last_timeout < rcvc->timeout_period_max)
+	    rcvc->last_timeout = min(rcvc->last_timeout << rcvc->timeout_shift,
+				     (uint32_t) rcvc->timeout_period_max);
+    }
+    else if (pollok_diff > 0) {
 	if (rcvc->last_timeout > rcvc->timeout_period_min)
 	/* By default, be less aggressive, but there's a more aggressive
 	 * alternative if need be */
 #if 1
-	    rcvc->last_timeout >>= rcvc->timeout_shift;
+	    rcvc->last_timeout = max(rcvc->last_timeout >> rcvc->timeout_shift,
+				     (uint32_t) rcvc->timeout_period_min);
 #else
 	    rcvc->last_timeout = rcvc->timeout_period_min;
 #endif
     }
     else { /* we had less progress */
 	if (rcvc->last_timeout < rcvc->timeout_period_max)
-	    rcvc->last_timeout <<= rcvc->timeout_shift;
+	    rcvc->last_timeout = min(rcvc->last_timeout << rcvc->timeout_shift,
+				     (uint32_t) rcvc->timeout_period_max);
     }
 
     rcvc->pollok_last = rcvc->pollok;
     rcvc->pollcnt_last = rcvc->pollcnt; 
+
+    if (rcvc->timeout_period_boost && 
+	(int) rcvc->last_timeout > rcvc->timeout_period_boost &&
+	rcvthread_rv_pending(rcvc)) {
+	rcvc->pollcnt_boost++;
+	return rcvc->timeout_period_boost;
+    }
     return (int) rcvc->last_timeout;
 }
 
@@ -287,6 +427,7 @@ ips_ptl_pollintr(void *rcvthreadc)
 {
     struct ptl_rcvthread *rcvc = (struct ptl_rcvthread *) rcvthreadc;
     struct ips_recvhdrq *recvq = rcvc->recvq;
+    struct ips_spio *spioc = (struct ips_spio *) &rcvc->ptl->spioc;
     psmi_context_t *context = (psmi_context_t *) rcvc->context;
     int fd_dev = context->fd;
     int fd_pipe = rcvc->pipefd[0];
@@ -294,18 +435,23 @@ ips_ptl_pollintr(void *rcvthreadc)
     struct pollfd pfd[2];
     int ret;
     int next_timeout = rcvc->last_timeout;
-    uint64_t t_cyc;
+    int main_active;
+    uint64_t t_cyc, poll_main;
     psm_error_t err;
 
     /* No reason to have many of these, keep this as a backup in case the
      * recvhdrq init function is misused */
     psmi_assert_always((recvq->runtime_flags & PSMI_RUNTIME_RCVTHREAD));
 
+    /* Acks we send go out through our own set of PIO buffers */
+    ips_spio_part_claim(spioc);
+
     /* Switch driver to a mode where it can interrupt on urgent packets */
     if (psmi_context_interrupt_set((psmi_context_t *)
 			        rcvc->context, 1) == PSM_EP_NO_RESOURCES) {
 	_IPATH_PRDBG("ipath_poll_type feature not present in driver, turning "
 		     "off internal progress thread\n");
+	ips_spio_part_release(spioc);
 	return NULL;
     }
 
@@ -338,6 +484,22 @@ ips_ptl_pollintr(void *rcvthreadc)
 	else {
 	    rcvc->pollcnt++;
 
+	    /* Has the main thread polled since we last woke up? */
+	    poll_main = rcvc->ptl->poll_cnt - rcvc->poll_self;
+	    main_active = (poll_main != rcvc->poll_main_last);
+	    rcvc->poll_main_last = poll_main;
+
+	    if (ret > 0 && pfd[0].revents & (POLLIN | POLLERR))
+		rcvc->pollcnt_intr++;
+	    else if (ret == 0 && main_active) {
+		/* Leave progress to the main thread on timeouts, urgent
+		 * packets are still serviced */
+		rcvc->pollcnt_deferred++;
+		rcvc->pollcnt_to++;
+		next_timeout = rcvthread_next_timeout(rcvc, main_active);
+		continue;
+	    }
+
 	    if (ret == 0 || pfd[0].revents & (POLLIN | POLLERR)) {
 		if (PSMI_PLOCK_DISABLED) {
 		    /* We do this check without acquiring the lock, no sense to
@@ -352,6 +514,7 @@ ips_ptl_pollintr(void *rcvthreadc)
 			rcvc->pollok++;
 		    else
 			rcvc->pollcyc += get_cycles() - t_cyc;
+		    rcvc->pollcyc_locked += get_cycles() - t_cyc;
 		    ips_recvhdrq_unlock(recvq);
 		}
 		else if (!PSMI_PLOCK_TRY()) { 
@@ -359,6 +522,7 @@ ips_ptl_pollintr(void *rcvthreadc)
 		     * assume to have received an ipath interrupt and service
 		     * only ipath.
 		     */
+		    rcvc->poll_self++;
 		    err = psmi_poll_internal(ep, 
 			    ret == 0 ? PSMI_TRUE : PSMI_FALSE);
 
@@ -371,13 +535,14 @@ ips_ptl_pollintr(void *rcvthreadc)
 		    }
 		    else
 			rcvc->pollcyc += get_cycles() - t_cyc;
+		    rcvc->pollcyc_locked += get_cycles() - t_cyc;
 		    PSMI_PUNLOCK();
 		}
 	    }
 
 	    if (ret == 0) { /* change timeout only on timed out poll */
 		rcvc->pollcnt_to++;
-		next_timeout = rcvthread_next_timeout(rcvc);
+		next_timeout = rcvthread_next_timeout(rcvc, main_active);
 	    }
 	}
     }
@@ -405,6 +570,15 @@ rcvthread_stats_pollcyc(void *context)
     return (uint64_t) ((double) cycles_to_nanosecs(rcvc->pollcyc) / 1.0e6);
 }
 
+static uint64_t
+rcvthread_stats_pollcyc_locked(void *context)
+{
+    struct ptl_rcvthread *rcvc = (struct ptl_rcvthread *) context;
+    /* log in milliseconds */
+    return (uint64_t) 
+	((double) cycles_to_nanosecs(rcvc->pollcyc_locked) / 1.0e6);
+}
+
 static psm_error_t   
 rcvthread_initstats(ptl_t *ptl)
 {
@@ -422,7 +596,20 @@ rcvthread_initstats(ptl_t *ptl)
 			NULL, &rcvc->pollcnt_to),
 	PSMI_STATS_DECL("intrthread wasted time (ms)",
 			MPSPAWN_STATS_REDUCTION_ALL,
-			rcvthread_stats_pollcyc, NULL)
+			rcvthread_stats_pollcyc, NULL),
+	PSMI_STATS_DECL("intrthread interrupt wakeups", 
+			MPSPAWN_STATS_REDUCTION_ALL | MPSPAWN_STATS_SKIP_IF_ZERO,
+			NULL, &rcvc->pollcnt_intr),
+	PSMI_STATS_DECL("intrthread deferred to main", 
+			MPSPAWN_STATS_REDUCTION_ALL | MPSPAWN_STATS_SKIP_IF_ZERO,
+			NULL, &rcvc->pollcnt_deferred),
+	PSMI_STATS_DECL("intrthread rendezvous boosts", 
+			MPSPAWN_STATS_REDUCTION_ALL | MPSPAWN_STATS_SKIP_IF_ZERO,
+			NULL, &rcvc->pollcnt_boost),
+	/* Time the main thread may have been kept from progressing */
+	PSMI_STATS_DECL("intrthread lock held (ms)",
+			MPSPAWN_STATS_REDUCTION_ALL,
+			rcvthread_stats_pollcyc_locked, NULL)
     };
 
     /* If we don't want a thread, make sure we still initialize the counters